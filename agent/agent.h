@@ -28,6 +28,7 @@
 #define map_assuan_err(a) \
         map_assuan_err_with_source (GPG_ERR_SOURCE_DEFAULT, (a))
 #include <errno.h>
+#include <time.h>
 
 #include <gcrypt.h>
 #include "../common/util.h"
@@ -113,6 +114,10 @@ struct
      for signing operations.  */
   int ignore_cache_for_signing;
 
+  /* If this global option is true, unprotected private keys are
+     cached as long as their passphrase is cached.  */
+  int cache_unlocked_keys;
+
   /* If this global option is true, the user is allowed to
      interactively mark certificate in trustlist.txt as trusted. */
   int allow_mark_trusted;
@@ -135,6 +140,9 @@ struct
      that we use a hack for cleanup handling in gpg-agent.c: If the
      value is less than 2 the name has not yet been malloced. */
   int extra_socket;
+
+  /* Number of threads kept for reuse by new connections.  */
+  unsigned int connection_threads;
 } opt;
 
 
@@ -317,6 +325,7 @@ gpg_error_t ssh_search_control_file (ssh_control_file_t cf,
                                      int *r_disabled,
                                      int *r_ttl, int *r_confirm);
 
+void initialize_module_command_ssh (void);
 void start_command_handler_ssh (ctrl_t, gnupg_fd_t);
 
 /*-- findkey.c --*/
@@ -339,6 +348,8 @@ gpg_error_t agent_public_key_from_file (ctrl_t ctrl,
 int agent_is_dsa_key (gcry_sexp_t s_key);
 int agent_is_eddsa_key (gcry_sexp_t s_key);
 int agent_key_available (const unsigned char *grip);
+void agent_flush_key_index (void);
+gpg_error_t agent_list_keygrips (unsigned char **r_grips, size_t *r_ngrips);
 gpg_error_t agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
                                       int *r_keytype,
                                       unsigned char **r_shadow_info);
@@ -369,13 +380,29 @@ void agent_popup_message_stop (ctrl_t ctrl);
 void initialize_module_cache (void);
 void deinitialize_module_cache (void);
 void agent_flush_cache (void);
+void agent_reconfigure_cache (void);
 int agent_put_cache (const char *key, cache_mode_t cache_mode,
                      const char *data, int ttl);
 char *agent_get_cache (const char *key, cache_mode_t cache_mode);
 void agent_store_cache_hit (const char *key);
+gpg_error_t agent_put_key_cache (const char *key, cache_mode_t cache_mode,
+                                 time_t mtime, unsigned long size,
+                                 const unsigned char *keybuf, size_t keylen);
+unsigned char *agent_get_key_cache (const char *key, cache_mode_t cache_mode,
+                                    time_t mtime, unsigned long size);
+void agent_key_cache_stats (unsigned long *r_hits, unsigned long *r_misses,
+                            unsigned int *r_entries);
 
 
 /*-- pksign.c --*/
+/* A hash to be signed by agent_pksign_multi.  */
+struct pksign_item_s
+{
+  int algo;
+  unsigned char value[MAX_DIGEST_LEN];
+  int valuelen;
+};
+
 int agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
                      const char *desc_text,
 		     gcry_sexp_t *signature_sexp,
@@ -384,6 +411,14 @@ int agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
 int agent_pksign (ctrl_t ctrl, const char *cache_nonce,
                   const char *desc_text,
                   membuf_t *outbuf, cache_mode_t cache_mode);
+gpg_error_t agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                                const char *desc_text, cache_mode_t cache_mode,
+                                const struct pksign_item_s *items,
+                                unsigned int nitems,
+                                gpg_error_t (*putsig)(void *opaque,
+                                                      const void *sig,
+                                                      size_t siglen),
+                                void *opaque);
 
 /*-- pkdecrypt.c --*/
 int agent_pkdecrypt (ctrl_t ctrl, const char *desc_text,
@@ -403,6 +438,7 @@ gpg_error_t agent_protect_and_store (ctrl_t ctrl, gcry_sexp_t s_skey,
 /*-- protect.c --*/
 unsigned long get_standard_s2k_count (void);
 unsigned char get_standard_s2k_count_rfc4880 (void);
+unsigned long get_s2k_rate (int hashalgo);
 int agent_protect (const unsigned char *plainkey, const char *passphrase,
                    unsigned char **result, size_t *resultlen,
 		   unsigned long s2k_count);
@@ -496,4 +532,26 @@ int agent_card_scd (ctrl_t ctrl, const char *cmdline,
 int agent_handle_learn (ctrl_t ctrl, int send, void *assuan_context);
 
 
+/*-- metrics.c --*/
+/* The operations for which latencies are recorded.  */
+typedef enum
+  {
+    METRIC_OP_PKSIGN,
+    METRIC_OP_PKDECRYPT,
+    METRIC_OP_GET_PASSPHRASE,
+    METRIC_OP_SSH_SIGN,
+    METRIC_OP_SCD,
+    METRIC_OP_LAST   /* Number of operations.  */
+  }
+metric_op_t;
+
+void agent_metrics_init (void);
+void agent_metrics_op_start (struct timespec *r_start);
+void agent_metrics_op_done (metric_op_t op, const struct timespec *start,
+                            gpg_error_t err);
+void agent_metrics_cache_lookup (int hit);
+void agent_metrics_connection (int opened);
+void agent_metrics_write (membuf_t *mb);
+
+
 #endif /*AGENT_H*/
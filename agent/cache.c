@@ -53,21 +53,44 @@ struct secret_data_s {
 
 typedef struct cache_item_s *ITEM;
 struct cache_item_s {
-  ITEM next;
+  ITEM next;      /* Next item in the same hash bucket.  */
+  int heapidx;    /* Index into the expiration heap or -1.  */
+  time_t expires; /* The time used to sort the heap.  */
   time_t created;
   time_t accessed;
   int ttl;  /* max. lifetime given in seconds, -1 one means infinite */
   struct secret_data_s *pw;
+  struct secret_data_s *keydata; /* The unprotected key or NULL.  It
+                                    is only valid as long as PW.  */
+  time_t keyfile_mtime;          /* Modification time and size of */
+  unsigned long keyfile_size;    /* the key file used for KEYDATA.  */
   cache_mode_t cache_mode;
   char key[1];
 };
 
-/* The cache himself.  */
-static ITEM thecache;
+/* The cache himself.  This is a hash table indexed by the cache key.
+   Note that items with the same key but a different cache mode are
+   in the same bucket; this is required because most cache modes
+   match all items with that key.  */
+static ITEM *thecache;
+static unsigned int thecache_size;  /* Number of buckets (power of 2).  */
+static unsigned int thecache_count; /* Number of items.  */
+
+/* A binary min-heap of all items which may expire, sorted by their
+   EXPIRES field.  Entries are updated lazily: The access time of an
+   item may be increased without updating the heap; this is fixed up
+   when the item reaches the top of the heap.  */
+static ITEM *expire_heap;
+static unsigned int expire_heap_len;
+static unsigned int expire_heap_size;
 
 /* NULL or the last cache key stored by agent_store_cache_hit.  */
 static char *last_stored_cache_key;
 
+/* Statistics for the unlocked key cache.  */
+static unsigned long key_cache_hits;
+static unsigned long key_cache_misses;
+
 
 /* This function must be called once to initialize this module. It
    has to be done before a second thread is spawned.  */
@@ -148,12 +171,23 @@ release_data (struct secret_data_s *data)
    xfree (data);
 }
 
+/* Release the passphrase and the key stored with item R.  */
+static void
+release_item_data (ITEM r)
+{
+  release_data (r->pw);
+  r->pw = NULL;
+  release_data (r->keydata);
+  r->keydata = NULL;
+}
+
+/* Encrypt LENGTH bytes of DATA and store them in a new object at
+   R_DATA.  */
 static gpg_error_t
-new_data (const char *string, struct secret_data_s **r_data)
+new_data (const void *data, size_t length, struct secret_data_s **r_data)
 {
   gpg_error_t err;
   struct secret_data_s *d, *d_enc;
-  size_t length;
   int total;
   int res;
 
@@ -163,8 +197,6 @@ new_data (const char *string, struct secret_data_s **r_data)
   if (err)
     return err;
 
-  length = strlen (string) + 1;
-
   /* We pad the data to 32 bytes so that it get more complicated
      finding something out by watching allocation patterns.  This is
      usally not possible but we better assume nothing about our secure
@@ -175,7 +207,8 @@ new_data (const char *string, struct secret_data_s **r_data)
   d = xtrymalloc_secure (sizeof *d + total - 1);
   if (!d)
     return gpg_error_from_syserror ();
-  memcpy (d->data, string, length);
+  memcpy (d->data, data, length);
+  memset (d->data + length, 0, total - length);
 
   d_enc = xtrymalloc (sizeof *d_enc + total - 1);
   if (!d_enc)
@@ -207,71 +240,320 @@ new_data (const char *string, struct secret_data_s **r_data)
 }
 
 
+/* Decrypt the object D and return the plaintext in a newly allocated
+   buffer in secure memory at R_VALUE.  */
+static gpg_error_t
+get_data (struct secret_data_s *d, char **r_value)
+{
+  gpg_error_t err;
+  char *value;
+  int res;
 
-/* Check whether there are items to expire.  */
-static void
-housekeeping (void)
+  *r_value = NULL;
+  if (d->totallen < 32)
+    return gpg_error (GPG_ERR_INV_LENGTH);
+  err = init_encryption ();
+  if (err)
+    return err;
+  value = xtrymalloc_secure (d->totallen - 8);
+  if (!value)
+    return gpg_error_from_syserror ();
+
+  res = npth_mutex_lock (&encryption_lock);
+  if (res)
+    log_fatal ("failed to acquire cache encryption mutex: %s\n",
+               strerror (res));
+  err = gcry_cipher_decrypt (encryption_handle,
+                             value, d->totallen - 8,
+                             d->data, d->totallen);
+  res = npth_mutex_unlock (&encryption_lock);
+  if (res)
+    log_fatal ("failed to release cache encryption mutex: %s\n",
+               strerror (res));
+  if (err)
+    {
+      xfree (value);
+      return err;
+    }
+  *r_value = value;
+  return 0;
+}
+
+
+
+/* Return the hash value for KEY.  */
+static unsigned int
+hash_key (const char *key)
 {
-  ITEM r, rprev;
-  time_t current = gnupg_get_time ();
+  unsigned int h = 5381;
+
+  for (; *key; key++)
+    h = (h * 33) ^ *(const unsigned char *)key;
+  return h;
+}
+
+
+/* Return the first item in the hash chain for KEY.  */
+static ITEM
+bucket_for_key (const char *key)
+{
+  if (!thecache)
+    return NULL;
+  return thecache[hash_key (key) & (thecache_size - 1)];
+}
+
 
-  /* First expire the actual data */
-  for (r=thecache; r; r = r->next)
+/* Insert the new item R into the hash table.  */
+static gpg_error_t
+hash_insert (ITEM r)
+{
+  unsigned int idx;
+
+  if (!thecache || thecache_count >= 2 * thecache_size)
     {
-      if (r->pw && r->ttl >= 0 && r->accessed + r->ttl < current)
+      ITEM *tbl, r2, rnext;
+      unsigned int i, newsize;
+
+      newsize = thecache? 2 * thecache_size : 64;
+      tbl = xtrycalloc (newsize, sizeof *tbl);
+      if (!tbl)
         {
-          if (DBG_CACHE)
-            log_debug ("  expired '%s' (%ds after last access)\n",
-                       r->key, r->ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
+          if (!thecache)
+            return gpg_error_from_syserror ();
+        }
+      else
+        {
+          /* Rehash while keeping the order within each chain.  */
+          for (i=0; i < thecache_size; i++)
+            {
+              ITEM *tails[2] = { NULL, NULL };
+
+              for (r2 = thecache[i]; r2; r2 = rnext)
+                {
+                  unsigned int n = hash_key (r2->key) & (newsize - 1);
+                  int k = (n != i);
+
+                  rnext = r2->next;
+                  r2->next = NULL;
+                  if (!tails[k])
+                    tbl[n] = r2;
+                  else
+                    *tails[k] = r2;
+                  tails[k] = &r2->next;
+                }
+            }
+          xfree (thecache);
+          thecache = tbl;
+          thecache_size = newsize;
         }
     }
 
-  /* Second, make sure that we also remove them based on the created stamp so
-     that the user has to enter it from time to time. */
-  for (r=thecache; r; r = r->next)
-    {
-      unsigned long maxttl;
+  idx = hash_key (r->key) & (thecache_size - 1);
+  r->next = thecache[idx];
+  thecache[idx] = r;
+  thecache_count++;
+  return 0;
+}
+
 
+/* Remove item R from the hash table.  */
+static void
+hash_remove (ITEM r)
+{
+  ITEM *rp;
+
+  for (rp = &thecache[hash_key (r->key) & (thecache_size - 1)];
+       *rp; rp = &(*rp)->next)
+    if (*rp == r)
+      {
+        *rp = r->next;
+        thecache_count--;
+        return;
+      }
+  BUG ();
+}
+
+
+/* Compute the time after which item R needs to be looked at by the
+   housekeeping.  Returns 0 if R never expires.  */
+static time_t
+compute_expiration (ITEM r)
+{
+  time_t expires;
+  unsigned long maxttl;
+
+  if (r->pw)
+    {
       switch (r->cache_mode)
         {
         case CACHE_MODE_SSH: maxttl = opt.max_cache_ttl_ssh; break;
         default: maxttl = opt.max_cache_ttl; break;
         }
-      if (r->pw && r->created + maxttl < current)
+      expires = r->created + maxttl;
+      if (r->ttl >= 0 && r->accessed + r->ttl < expires)
+        expires = r->accessed + r->ttl;
+    }
+  else if (r->ttl >= 0)
+    expires = r->accessed + 60*30;
+  else
+    expires = 0;
+  return expires;
+}
+
+
+static void
+heap_swap (unsigned int a, unsigned int b)
+{
+  ITEM tmp = expire_heap[a];
+
+  expire_heap[a] = expire_heap[b];
+  expire_heap[b] = tmp;
+  expire_heap[a]->heapidx = a;
+  expire_heap[b]->heapidx = b;
+}
+
+
+/* Restore the heap property for the entry at index I.  */
+static void
+heap_fixup (unsigned int i)
+{
+  unsigned int child;
+
+  while (i && expire_heap[i]->expires < expire_heap[(i-1)/2]->expires)
+    {
+      heap_swap (i, (i-1)/2);
+      i = (i-1)/2;
+    }
+  for (;;)
+    {
+      child = 2*i + 1;
+      if (child >= expire_heap_len)
+        break;
+      if (child + 1 < expire_heap_len
+          && expire_heap[child+1]->expires < expire_heap[child]->expires)
+        child++;
+      if (expire_heap[i]->expires <= expire_heap[child]->expires)
+        break;
+      heap_swap (i, child);
+      i = child;
+    }
+}
+
+
+static void
+heap_remove (ITEM r)
+{
+  unsigned int i = r->heapidx;
+
+  if (r->heapidx < 0)
+    return;
+  r->heapidx = -1;
+  expire_heap_len--;
+  if (i < expire_heap_len)
+    {
+      expire_heap[i] = expire_heap[expire_heap_len];
+      expire_heap[i]->heapidx = i;
+      heap_fixup (i);
+    }
+}
+
+
+/* Append item R to the end of the heap without restoring the heap
+   property.  Returns -1 if the heap could not be enlarged.  */
+static int
+heap_append (ITEM r)
+{
+  if (expire_heap_len == expire_heap_size)
+    {
+      ITEM *tmp;
+      unsigned int newsize = expire_heap_size? 2*expire_heap_size : 64;
+
+      tmp = xtryrealloc (expire_heap, newsize * sizeof *tmp);
+      if (!tmp)
         {
-          if (DBG_CACHE)
-            log_debug ("  expired '%s' (%lus after creation)\n",
-                       r->key, opt.max_cache_ttl);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = current;
+          /* Without memory we can't track the item; it will only be
+             released by agent_flush_cache.  */
+          log_error ("error growing the cache expiration heap: %s\n",
+                     gpg_strerror (gpg_error_from_syserror ()));
+          return -1;
         }
+      expire_heap = tmp;
+      expire_heap_size = newsize;
+    }
+  r->heapidx = expire_heap_len++;
+  expire_heap[r->heapidx] = r;
+  return 0;
+}
+
+
+/* Recompute the expiration time of R and update the heap.  This
+   needs to be called whenever the expiration time of R may have
+   decreased.  */
+static void
+update_expiration (ITEM r)
+{
+  r->expires = compute_expiration (r);
+  if (!r->expires)
+    {
+      heap_remove (r);
+      return;
     }
+  if (r->heapidx < 0 && heap_append (r))
+    return;
+  heap_fixup (r->heapidx);
+}
+
+
+/* Check whether there are items to expire.  Only items at the top of
+   the expiration heap need to be looked at.  */
+static void
+housekeeping (void)
+{
+  ITEM r;
+  time_t current = gnupg_get_time ();
+  time_t expires;
 
-  /* Third, make sure that we don't have too many items in the list.
-     Expire old and unused entries after 30 minutes */
-  for (rprev=NULL, r=thecache; r; )
+  while (expire_heap_len && expire_heap[0]->expires < current)
     {
-      if (!r->pw && r->ttl >= 0 && r->accessed + 60*30 < current)
+      r = expire_heap[0];
+
+      /* The access time may have been updated since the item was
+         put into the heap.  */
+      expires = compute_expiration (r);
+      if (expires && expires >= current)
         {
-          ITEM r2 = r->next;
+          r->expires = expires;
+          heap_fixup (0);
+          continue;
+        }
+
+      if (r->pw)
+        {
+          /* Expire the actual data.  */
           if (DBG_CACHE)
-            log_debug ("  removed '%s' (mode %d) (slot not used for 30m)\n",
-                       r->key, r->cache_mode);
-          xfree (r);
-          if (!rprev)
-            thecache = r2;
-          else
-            rprev->next = r2;
-          r = r2;
+            {
+              if (r->ttl >= 0 && r->accessed + r->ttl < current)
+                log_debug ("  expired '%s' (%ds after last access)\n",
+                           r->key, r->ttl);
+              else
+                log_debug ("  expired '%s' (%lus after creation)\n",
+                           r->key, opt.max_cache_ttl);
+            }
+          release_item_data (r);
+          r->accessed = current;
+          update_expiration (r);
         }
       else
         {
-          rprev = r;
-          r = r->next;
+          /* Make sure that we don't have too many items in the
+             table.  Expire old and unused entries after 30
+             minutes.  */
+          if (DBG_CACHE)
+            log_debug ("  removed '%s' (mode %d) (slot not used for 30m)\n",
+                       r->key, r->cache_mode);
+          heap_remove (r);
+          hash_remove (r);
+          xfree (r);
         }
     }
 }
@@ -281,25 +563,56 @@ void
 agent_flush_cache (void)
 {
   ITEM r;
+  unsigned int i;
 
   if (DBG_CACHE)
     log_debug ("agent_flush_cache\n");
 
-  for (r=thecache; r; r = r->next)
-    {
-      if (r->pw)
-        {
-          if (DBG_CACHE)
-            log_debug ("  flushing '%s'\n", r->key);
-          release_data (r->pw);
-          r->pw = NULL;
-          r->accessed = 0;
-        }
-    }
+  for (i=0; i < thecache_size; i++)
+    for (r=thecache[i]; r; r = r->next)
+      {
+        if (r->pw)
+          {
+            if (DBG_CACHE)
+              log_debug ("  flushing '%s'\n", r->key);
+            release_item_data (r);
+            r->accessed = 0;
+            update_expiration (r);
+          }
+      }
 }
 
 
 
+/* Recompute the expiration time of all items and rebuild the
+   expiration heap.  This needs to be called after the options have
+   been re-read because the expiration times depend on the maximum
+   TTLs.  */
+void
+agent_reconfigure_cache (void)
+{
+  ITEM r;
+  unsigned int i;
+
+  if (DBG_CACHE)
+    log_debug ("agent_reconfigure_cache\n");
+
+  for (i=0; i < expire_heap_len; i++)
+    expire_heap[i]->heapidx = -1;
+  expire_heap_len = 0;
+
+  for (i=0; i < thecache_size; i++)
+    for (r=thecache[i]; r; r = r->next)
+      {
+        r->expires = compute_expiration (r);
+        if (r->expires && !heap_append (r))
+          heap_fixup (r->heapidx);
+      }
+
+  housekeeping ();
+}
+
+
 /* Store the string DATA in the cache under KEY and mark it with a
    maximum lifetime of TTL seconds.  If there is already data under
    this key, it will be replaced.  Using a DATA of NULL deletes the
@@ -329,7 +642,7 @@ agent_put_cache (const char *key, cache_mode_t cache_mode,
   if ((!ttl && data) || cache_mode == CACHE_MODE_IGNORE)
     return 0;
 
-  for (r=thecache; r; r = r->next)
+  for (r=bucket_for_key (key); r; r = r->next)
     {
       if (((cache_mode != CACHE_MODE_USER
             && cache_mode != CACHE_MODE_NONCE)
@@ -339,20 +652,17 @@ agent_put_cache (const char *key, cache_mode_t cache_mode,
     }
   if (r) /* Replace.  */
     {
-      if (r->pw)
-        {
-          release_data (r->pw);
-          r->pw = NULL;
-        }
+      release_item_data (r);
       if (data)
         {
           r->created = r->accessed = gnupg_get_time ();
           r->ttl = ttl;
           r->cache_mode = cache_mode;
-          err = new_data (data, &r->pw);
+          err = new_data (data, strlen (data) + 1, &r->pw);
           if (err)
             log_error ("error replacing cache item: %s\n", gpg_strerror (err));
         }
+      update_expiration (r);
     }
   else if (data) /* Insert.  */
     {
@@ -362,17 +672,20 @@ agent_put_cache (const char *key, cache_mode_t cache_mode,
       else
         {
           strcpy (r->key, key);
+          r->heapidx = -1;
           r->created = r->accessed = gnupg_get_time ();
           r->ttl = ttl;
           r->cache_mode = cache_mode;
-          err = new_data (data, &r->pw);
+          err = new_data (data, strlen (data) + 1, &r->pw);
+          if (!err)
+            err = hash_insert (r);
           if (err)
-            xfree (r);
-          else
             {
-              r->next = thecache;
-              thecache = r;
+              release_item_data (r);
+              xfree (r);
             }
+          else
+            update_expiration (r);
         }
       if (err)
         log_error ("error inserting cache item: %s\n", gpg_strerror (err));
@@ -390,7 +703,6 @@ agent_get_cache (const char *key, cache_mode_t cache_mode)
   gpg_error_t err;
   ITEM r;
   char *value = NULL;
-  int res;
   int last_stored = 0;
 
   if (cache_mode == CACHE_MODE_IGNORE)
@@ -411,7 +723,7 @@ agent_get_cache (const char *key, cache_mode_t cache_mode)
                last_stored? " (stored cache key)":"");
   housekeeping ();
 
-  for (r=thecache; r; r = r->next)
+  for (r=bucket_for_key (key); r; r = r->next)
     {
       if (r->pw
           && ((cache_mode != CACHE_MODE_USER
@@ -423,30 +735,10 @@ agent_get_cache (const char *key, cache_mode_t cache_mode)
           r->accessed = gnupg_get_time ();
           if (DBG_CACHE)
             log_debug ("... hit\n");
-          if (r->pw->totallen < 32)
-            err = gpg_error (GPG_ERR_INV_LENGTH);
-          else if ((err = init_encryption ()))
-            ;
-          else if (!(value = xtrymalloc_secure (r->pw->totallen - 8)))
-            err = gpg_error_from_syserror ();
-          else
-            {
-              res = npth_mutex_lock (&encryption_lock);
-              if (res)
-                log_fatal ("failed to acquire cache encryption mutex: %s\n",
-			   strerror (res));
-              err = gcry_cipher_decrypt (encryption_handle,
-                                         value, r->pw->totallen - 8,
-                                         r->pw->data, r->pw->totallen);
-              res = npth_mutex_unlock (&encryption_lock);
-              if (res)
-                log_fatal ("failed to release cache encryption mutex: %s\n",
-			   strerror (res));
-            }
+          agent_metrics_cache_lookup (1);
+          err = get_data (r->pw, &value);
           if (err)
             {
-              xfree (value);
-              value = NULL;
               log_error ("retrieving cache entry '%s' failed: %s\n",
                          key, gpg_strerror (err));
             }
@@ -455,6 +747,7 @@ agent_get_cache (const char *key, cache_mode_t cache_mode)
     }
   if (DBG_CACHE)
     log_debug ("... miss\n");
+  agent_metrics_cache_lookup (0);
 
   return NULL;
 }
@@ -469,3 +762,132 @@ agent_store_cache_hit (const char *key)
   xfree (last_stored_cache_key);
   last_stored_cache_key = key? xtrystrdup (key) : NULL;
 }
+
+
+/* Find the item with a cached passphrase for KEY and CACHE_MODE.  */
+static ITEM
+find_pw_item (const char *key, cache_mode_t cache_mode)
+{
+  ITEM r;
+
+  for (r=bucket_for_key (key); r; r = r->next)
+    if (r->pw
+        && ((cache_mode != CACHE_MODE_USER
+             && cache_mode != CACHE_MODE_NONCE)
+            || r->cache_mode == cache_mode)
+        && !strcmp (r->key, key))
+      return r;
+  return NULL;
+}
+
+
+/* Store the unprotected key KEYBUF of length KEYLEN along with the
+   passphrase cached under KEY.  MTIME and SIZE describe the key file
+   the key was read from.  If no passphrase is cached for KEY nothing
+   is stored; thus the key expires together with its passphrase.
+   Using a KEYBUF of NULL removes the key for all cache modes.  */
+gpg_error_t
+agent_put_key_cache (const char *key, cache_mode_t cache_mode,
+                     time_t mtime, unsigned long size,
+                     const unsigned char *keybuf, size_t keylen)
+{
+  gpg_error_t err;
+  ITEM r;
+
+  if (!keybuf)
+    {
+      for (r=bucket_for_key (key); r; r = r->next)
+        if (r->keydata && !strcmp (r->key, key))
+          {
+            release_data (r->keydata);
+            r->keydata = NULL;
+          }
+      return 0;
+    }
+  if (cache_mode == CACHE_MODE_IGNORE)
+    return 0;
+
+  housekeeping ();
+  r = find_pw_item (key, cache_mode);
+  if (!r)
+    return 0;
+
+  release_data (r->keydata);
+  r->keydata = NULL;
+  err = new_data (keybuf, keylen, &r->keydata);
+  if (err)
+    log_error ("error caching unprotected key: %s\n", gpg_strerror (err));
+  else
+    {
+      r->keyfile_mtime = mtime;
+      r->keyfile_size = size;
+      if (DBG_CACHE)
+        log_debug ("agent_put_key_cache '%s' stored\n", key);
+    }
+  return err;
+}
+
+
+/* Return the unprotected key cached under KEY in secure memory or
+   NULL if there is none.  The key is only returned if the passphrase
+   for KEY is still cached and if the key file has not been changed
+   since; a hit counts as use of the cached passphrase.  The caller
+   must wipe and release the returned canonical S-expression.  */
+unsigned char *
+agent_get_key_cache (const char *key, cache_mode_t cache_mode,
+                     time_t mtime, unsigned long size)
+{
+  gpg_error_t err;
+  ITEM r;
+  char *value;
+
+  if (cache_mode == CACHE_MODE_IGNORE)
+    return NULL;
+
+  housekeeping ();
+  r = find_pw_item (key, cache_mode);
+  if (!r || !r->keydata)
+    {
+      key_cache_misses++;
+      return NULL;
+    }
+  if (r->keyfile_mtime != mtime || r->keyfile_size != size)
+    {
+      if (DBG_CACHE)
+        log_debug ("agent_get_key_cache '%s': key file changed\n", key);
+      release_data (r->keydata);
+      r->keydata = NULL;
+      key_cache_misses++;
+      return NULL;
+    }
+
+  r->accessed = gnupg_get_time ();
+  err = get_data (r->keydata, &value);
+  if (err)
+    {
+      log_error ("retrieving cached key '%s' failed: %s\n",
+                 key, gpg_strerror (err));
+      key_cache_misses++;
+      return NULL;
+    }
+  key_cache_hits++;
+  return (unsigned char *)value;
+}
+
+
+/* Return statistics about the unlocked key cache.  */
+void
+agent_key_cache_stats (unsigned long *r_hits, unsigned long *r_misses,
+                       unsigned int *r_entries)
+{
+  ITEM r;
+  unsigned int i, n = 0;
+
+  for (i=0; i < thecache_size; i++)
+    for (r=thecache[i]; r; r = r->next)
+      if (r->keydata)
+        n++;
+  *r_hits = key_cache_hits;
+  *r_misses = key_cache_misses;
+  *r_entries = n;
+}
@@ -63,6 +63,7 @@ struct scd_local_s
                            used with this connection. */
   int locked;           /* This flag is used to assert proper use of
                            start_scd and unlock_scd. */
+  struct timespec op_start; /* Time the current operation started.  */
 
 };
 
@@ -110,6 +111,23 @@ static assuan_context_t primary_scd_ctx;
    any connection. */
 static int primary_scd_ctx_reusable;
 
+/* Statistics about the use of the SCdaemon.  Each connection uses its
+   own session with the SCdaemon and thus card operations run
+   concurrently; only the setup of a session is serialized by
+   START_SCD_LOCK.  See agent_scd_dump_state.  */
+static struct
+{
+  unsigned long operations;    /* Number of card operations started.  */
+  unsigned int active;         /* Card operations in progress.  */
+  unsigned int max_active;     /* Highest value of ACTIVE.  */
+  unsigned int waiting;        /* Threads waiting for START_SCD_LOCK.  */
+  unsigned int max_waiting;    /* Highest value of WAITING.  */
+  unsigned long lock_waits;    /* Number of times START_SCD_LOCK was
+                                  acquired.  */
+  unsigned long total_wait_ms; /* Total time spent waiting for it.  */
+  unsigned long max_wait_ms;   /* Longest time spent waiting for it.  */
+} scd_stats;
+
 
 
 /* Local prototypes.  */
@@ -150,6 +168,45 @@ agent_scd_dump_state (void)
             primary_scd_ctx_reusable);
   if (socket_name)
     log_info ("agent_scd_dump_state: socket='%s'\n", socket_name);
+  log_info ("agent_scd_dump_state: operations=%lu active=%u (max %u)\n",
+            scd_stats.operations, scd_stats.active, scd_stats.max_active);
+  log_info ("agent_scd_dump_state: start_scd lock: queued=%u (max %u)"
+            " waits=%lu wait_ms=%lu (max %lu)\n",
+            scd_stats.waiting, scd_stats.max_waiting, scd_stats.lock_waits,
+            scd_stats.total_wait_ms, scd_stats.max_wait_ms);
+}
+
+
+/* Acquire START_SCD_LOCK and update the statistics.  If ABSTIME is
+   not NULL a timed lock is used.  Returns 0 on success or an errno
+   value.  */
+static int
+lock_start_scd (const struct timespec *abstime)
+{
+  struct timespec t0, t1;
+  unsigned long ms;
+  int rc;
+
+  npth_clock_gettime (&t0);
+  scd_stats.waiting++;
+  if (scd_stats.waiting > scd_stats.max_waiting)
+    scd_stats.max_waiting = scd_stats.waiting;
+  if (abstime)
+    rc = npth_mutex_timedlock (&start_scd_lock, abstime);
+  else
+    rc = npth_mutex_lock (&start_scd_lock);
+  scd_stats.waiting--;
+  if (rc)
+    return rc;
+
+  npth_clock_gettime (&t1);
+  ms = ((t1.tv_sec - t0.tv_sec) * 1000
+        + (t1.tv_nsec / 1000000) - (t0.tv_nsec / 1000000));
+  scd_stats.lock_waits++;
+  scd_stats.total_wait_ms += ms;
+  if (ms > scd_stats.max_wait_ms)
+    scd_stats.max_wait_ms = ms;
+  return 0;
 }
 
 
@@ -170,6 +227,12 @@ unlock_scd (ctrl_t ctrl, int rc)
       if (!rc)
         rc = gpg_error (GPG_ERR_INTERNAL);
     }
+  else
+    {
+      if (scd_stats.active)
+        scd_stats.active--;
+      agent_metrics_op_done (METRIC_OP_SCD, &ctrl->scd_local->op_start, rc);
+    }
   ctrl->scd_local->locked = 0;
   return rc;
 }
@@ -199,6 +262,7 @@ start_scd (ctrl_t ctrl)
   assuan_context_t ctx = NULL;
   const char *argv[3];
   assuan_fd_t no_close_list[3];
+  char *sockname = NULL;
   int i;
   int rc;
 
@@ -226,6 +290,11 @@ start_scd (ctrl_t ctrl)
       return gpg_error (GPG_ERR_INTERNAL);
     }
   ctrl->scd_local->locked++;
+  agent_metrics_op_start (&ctrl->scd_local->op_start);
+  scd_stats.operations++;
+  scd_stats.active++;
+  if (scd_stats.active > scd_stats.max_active)
+    scd_stats.max_active = scd_stats.active;
 
   if (ctrl->scd_local->ctx)
     return 0; /* Okay, the context is fine.  We used to test for an
@@ -236,12 +305,12 @@ start_scd (ctrl_t ctrl)
 
 
   /* We need to protect the following code. */
-  rc = npth_mutex_lock (&start_scd_lock);
+  rc = lock_start_scd (NULL);
   if (rc)
     {
       log_error ("failed to acquire the start_scd lock: %s\n",
                  strerror (rc));
-      return gpg_error (GPG_ERR_INTERNAL);
+      return unlock_scd (ctrl, gpg_error (GPG_ERR_INTERNAL));
     }
 
   /* Check whether the pipe server has already been started and in
@@ -266,18 +335,37 @@ start_scd (ctrl_t ctrl)
 
   if (socket_name)
     {
-      rc = assuan_socket_connect (ctx, socket_name, 0, 0);
+      /* Connecting to the socket does not need the lock; thus we
+         release it early so that other connections are not delayed
+         by the handshake.  */
+      sockname = xtrystrdup (socket_name);
+      if (!sockname)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      rc = npth_mutex_unlock (&start_scd_lock);
+      if (rc)
+        log_error ("failed to release the start_scd lock: %s\n",
+                   strerror (rc));
+
+      rc = assuan_socket_connect (ctx, sockname, 0, 0);
       if (rc)
         {
           log_error ("can't connect to socket '%s': %s\n",
-                     socket_name, gpg_strerror (rc));
+                     sockname, gpg_strerror (rc));
           err = gpg_error (GPG_ERR_NO_SCDAEMON);
-          goto leave;
+          unlock_scd (ctrl, err);
+          assuan_release (ctx);
         }
-
-      if (opt.verbose)
-        log_info ("new connection to SCdaemon established\n");
-      goto leave;
+      else
+        {
+          if (opt.verbose)
+            log_info ("new connection to SCdaemon established\n");
+          ctrl->scd_local->ctx = ctx;
+        }
+      xfree (sockname);
+      return err;
     }
 
   if (primary_scd_ctx)
@@ -441,7 +529,7 @@ agent_scd_check_aliveness (void)
      acquiring the lock.  */
   npth_clock_gettime (&abstime);
   abstime.tv_sec += 1;
-  err = npth_mutex_timedlock (&start_scd_lock, &abstime);
+  err = lock_start_scd (&abstime);
   if (err)
     {
       if (err == ETIMEDOUT)
@@ -40,6 +40,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "agent.h"
 
@@ -207,7 +208,38 @@ struct ssh_control_file_s
 };
 
 
+/* An entry of the ssh identity cache.  */
+struct ssh_identity_s
+{
+  struct ssh_identity_s *next;
+  time_t mtime;          /* Modification time of the key file.  */
+  off_t size;            /* Size of the key file or -1 if missing.  */
+  unsigned char *blob;   /* The public key and its comment in the
+                            format used for an identities answer.  NULL
+                            if the key file could not be used.  */
+  size_t bloblen;        /* The length of BLOB.  */
+  char hexgrip[40+1];    /* The keygrip as listed in sshcontrol.  */
+};
+typedef struct ssh_identity_s *ssh_identity_t;
+
+
+/* The identities listed in the sshcontrol file and their public keys
+   as converted for REQUEST_IDENTITIES.  The cache is checked against
+   the modification times of the sshcontrol file and the key files.
+   Reading the files may switch threads, thus the cache is protected
+   by IDENTITY_CACHE_LOCK.  */
+static npth_mutex_t identity_cache_lock;
+static struct
+{
+  int valid;             /* True if the cache may be used.  */
+  time_t cf_mtime;       /* Modification time of sshcontrol.  */
+  off_t cf_size;         /* Size of sshcontrol.  */
+  ssh_identity_t items;  /* The enabled keys in file order.  */
+} identity_cache;
+
+
 /* Prototypes.  */
+static void flush_identity_cache (void);
 static gpg_error_t ssh_handler_request_identities (ctrl_t ctrl,
 						   estream_t request,
 						   estream_t response);
@@ -1100,6 +1132,7 @@ add_control_entry (ctrl_t ctrl, ssh_key_type_spec_t *spec,
 
     }
   close_control_file (cf);
+  flush_identity_cache ();
   return 0;
 }
 
@@ -2573,21 +2606,288 @@ card_key_available (ctrl_t ctrl, gcry_sexp_t *r_pk, char **cardsn)
 */
 
 
+/* This function must be called once to initialize this module.  This
+   has to be done before a second thread is spawned.  */
+void
+initialize_module_command_ssh (void)
+{
+  static int initialized;
+  int err;
+
+  if (!initialized)
+    {
+      err = npth_mutex_init (&identity_cache_lock, NULL);
+      if (err)
+        log_fatal ("failed to init mutex in %s: %s\n",
+                   __FILE__, strerror (err));
+      initialized = 1;
+    }
+}
+
+
+static void
+lock_identity_cache (void)
+{
+  int err;
+
+  err = npth_mutex_lock (&identity_cache_lock);
+  if (err)
+    log_fatal ("failed to acquire mutex in %s: %s\n",
+               __FILE__, strerror (err));
+}
+
+
+static void
+unlock_identity_cache (void)
+{
+  int err;
+
+  err = npth_mutex_unlock (&identity_cache_lock);
+  if (err)
+    log_fatal ("failed to release mutex in %s: %s\n",
+               __FILE__, strerror (err));
+}
+
+
+/* Release all items of the ssh identity cache.  The caller must hold
+   the lock.  */
+static void
+release_identity_items (void)
+{
+  ssh_identity_t item;
+
+  while ((item = identity_cache.items))
+    {
+      identity_cache.items = item->next;
+      es_free (item->blob);
+      xfree (item);
+    }
+  identity_cache.valid = 0;
+}
+
+
+/* Release all items of the ssh identity cache.  */
+static void
+flush_identity_cache (void)
+{
+  lock_identity_cache ();
+  release_identity_items ();
+  unlock_identity_cache ();
+}
+
+
+/* Return true if the ssh identity cache matches the sshcontrol file
+   CFNAME and the key files.  KEY_FNAME is a buffer with the name of
+   the private keys directory and a slash; FNAMEPTR points right after
+   that slash.  Only stat calls are done.  */
+static int
+identity_cache_is_current (const char *cfname,
+                           char *key_fname, char *fnameptr)
+{
+  struct stat st;
+  ssh_identity_t item;
+
+  if (!identity_cache.valid)
+    return 0;
+  if (stat (cfname, &st)
+      || st.st_mtime != identity_cache.cf_mtime
+      || st.st_size != identity_cache.cf_size)
+    return 0;
+
+  for (item = identity_cache.items; item; item = item->next)
+    {
+      stpcpy (stpcpy (fnameptr, item->hexgrip), ".key");
+      if (stat (key_fname, &st))
+        {
+          if (item->size != -1)
+            return 0;
+        }
+      else if (st.st_mtime != item->mtime || st.st_size != item->size)
+        return 0;
+    }
+
+  return 1;
+}
+
+
+/* Convert the private key file content in (BUFFER,BUFFER_N) to the
+   public key in ssh format and store it at ITEM.  */
+static gpg_error_t
+load_identity_item (ssh_identity_t item,
+                    const unsigned char *buffer, size_t buffer_n)
+{
+  gpg_error_t err;
+  gcry_sexp_t key_secret = NULL;
+  ssh_key_type_spec_t spec;
+  estream_t stream = NULL;
+  void *blob;
+  size_t bloblen;
+
+  err = gcry_sexp_sscan (&key_secret, NULL, (const char*)buffer, buffer_n);
+  if (err)
+    goto leave;
+
+  {
+    char *key_type = NULL;
+
+    err = sexp_extract_identifier (key_secret, &key_type);
+    if (err)
+      goto leave;
+
+    err = ssh_key_type_lookup (NULL, key_type, &spec);
+    xfree (key_type);
+    if (err)
+      goto leave;
+  }
+
+  stream = es_fopenmem (0, "r+b");
+  if (!stream)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  err = ssh_send_key_public (stream, key_secret, NULL);
+  if (err)
+    goto leave;
+  if (es_fclose_snatch (stream, &blob, &bloblen))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  stream = NULL;
+  item->blob = blob;
+  item->bloblen = bloblen;
+
+ leave:
+  es_fclose (stream);
+  gcry_sexp_release (key_secret);
+  return err;
+}
+
+
+/* Make sure that the ssh identity cache is up to date.  If it is not
+   current the sshcontrol file and all listed key files are read
+   again.  KEY_FNAME and FNAMEPTR are as for
+   identity_cache_is_current.  The caller must hold the lock.  */
+static gpg_error_t
+update_identity_cache (char *key_fname, char *fnameptr)
+{
+  gpg_error_t err;
+  ssh_control_file_t cf = NULL;
+  ssh_identity_t item, *tailp;
+  struct stat st;
+  time_t now;
+  int racy = 0;
+
+  cf = NULL;
+  {
+    char *cfname;
+    int current;
+
+    cfname = make_filename_try (opt.homedir, SSH_CONTROL_FILE_NAME, NULL);
+    if (!cfname)
+      return gpg_error_from_syserror ();
+    current = identity_cache_is_current (cfname, key_fname, fnameptr);
+    xfree (cfname);
+    if (current)
+      return 0;
+  }
+
+  release_identity_items ();
+
+  err = open_control_file (&cf, 0);
+  if (err)
+    return err;
+
+  /* A file modified in the same second as we read it may change
+     again without a change of its mtime.  We use the data but do not
+     mark the cache as valid in this case.  */
+  now = time (NULL);
+  if (fstat (fileno (cf->fp), &st))
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  identity_cache.cf_mtime = st.st_mtime;
+  identity_cache.cf_size = st.st_size;
+  if (st.st_mtime >= now)
+    racy = 1;
+
+  tailp = &identity_cache.items;
+  while (!read_control_file_item (cf))
+    {
+      if (!cf->item.valid)
+        continue; /* Should not happen.  */
+      if (cf->item.disabled)
+        continue;
+      assert (strlen (cf->item.hexgrip) == 40);
+
+      item = xtrycalloc (1, sizeof *item);
+      if (!item)
+        {
+          err = gpg_error_from_syserror ();
+          goto leave;
+        }
+      strcpy (item->hexgrip, cf->item.hexgrip);
+      *tailp = item;
+      tailp = &item->next;
+
+      stpcpy (stpcpy (fnameptr, cf->item.hexgrip), ".key");
+      if (stat (key_fname, &st))
+        item->size = -1;
+      else
+        {
+          item->mtime = st.st_mtime;
+          item->size = st.st_size;
+          if (st.st_mtime >= now)
+            racy = 1;
+        }
+
+      /* Read file content.  */
+      {
+        unsigned char *buffer;
+        size_t buffer_n;
+
+        err = file_to_buffer (key_fname, &buffer, &buffer_n);
+        if (err)
+          {
+            log_error ("%s:%d: key '%s' skipped: %s\n",
+                       cf->fname, cf->lnr, cf->item.hexgrip,
+                       gpg_strerror (err));
+            continue;
+          }
+
+        err = load_identity_item (item, buffer, buffer_n);
+        xfree (buffer);
+        if (err)
+          goto leave;
+      }
+    }
+  err = 0;
+
+  identity_cache.valid = !racy;
+
+ leave:
+  if (err)
+    release_identity_items ();
+  close_control_file (cf);
+  return err;
+}
+
+
 /* Handler for the "request_identities" command.  */
 static gpg_error_t
 ssh_handler_request_identities (ctrl_t ctrl,
                                 estream_t request, estream_t response)
 {
-  ssh_key_type_spec_t spec;
   char *key_fname = NULL;
   char *fnameptr;
   u32 key_counter;
   estream_t key_blobs;
-  gcry_sexp_t key_secret;
   gcry_sexp_t key_public;
+  ssh_identity_t item;
   gpg_error_t err;
   int ret;
-  ssh_control_file_t cf = NULL;
   char *cardsn;
   gpg_error_t ret_err;
 
@@ -2595,7 +2895,6 @@ ssh_handler_request_identities (ctrl_t ctrl,
 
   /* Prepare buffer stream.  */
 
-  key_secret = NULL;
   key_public = NULL;
   key_counter = 0;
   err = 0;
@@ -2647,63 +2946,25 @@ ssh_handler_request_identities (ctrl_t ctrl,
     xfree (dname);
   }
 
-  /* Then look at all the registered and non-disabled keys. */
-  err = open_control_file (&cf, 0);
-  if (err)
-    goto out;
-
-  while (!read_control_file_item (cf))
+  /* Then look at all the registered and non-disabled keys.  They are
+     taken from the cache which is re-read only if sshcontrol or one
+     of the key files has been changed.  */
+  lock_identity_cache ();
+  err = update_identity_cache (key_fname, fnameptr);
+  for (item = err? NULL : identity_cache.items; item; item = item->next)
     {
-      if (!cf->item.valid)
-        continue; /* Should not happen.  */
-      if (cf->item.disabled)
-        continue;
-      assert (strlen (cf->item.hexgrip) == 40);
-
-      stpcpy (stpcpy (fnameptr, cf->item.hexgrip), ".key");
-
-      /* Read file content.  */
-      {
-        unsigned char *buffer;
-        size_t buffer_n;
-
-        err = file_to_buffer (key_fname, &buffer, &buffer_n);
-        if (err)
-          {
-            log_error ("%s:%d: key '%s' skipped: %s\n",
-                       cf->fname, cf->lnr, cf->item.hexgrip,
-                       gpg_strerror (err));
-            continue;
-          }
-
-        err = gcry_sexp_sscan (&key_secret, NULL, (char*)buffer, buffer_n);
-        xfree (buffer);
-        if (err)
-          goto out;
-      }
-
-      {
-        char *key_type = NULL;
-
-        err = sexp_extract_identifier (key_secret, &key_type);
-        if (err)
-          goto out;
-
-        err = ssh_key_type_lookup (NULL, key_type, &spec);
-        xfree (key_type);
-        if (err)
-          goto out;
-      }
-
-      err = ssh_send_key_public (key_blobs, key_secret, NULL);
-      if (err)
-        goto out;
-      gcry_sexp_release (key_secret);
-      key_secret = NULL;
-
+      if (!item->blob)
+        continue;  /* Key file was not available.  */
+      if (es_write (key_blobs, item->blob, item->bloblen, NULL))
+        {
+          err = gpg_error_from_syserror ();
+          break;
+        }
       key_counter++;
     }
-  err = 0;
+  unlock_identity_cache ();
+  if (err)
+    goto out;
 
   ret = es_fseek (key_blobs, 0, SEEK_SET);
   if (ret)
@@ -2715,7 +2976,6 @@ ssh_handler_request_identities (ctrl_t ctrl,
  out:
   /* Send response.  */
 
-  gcry_sexp_release (key_secret);
   gcry_sexp_release (key_public);
 
   if (!err)
@@ -2732,7 +2992,6 @@ ssh_handler_request_identities (ctrl_t ctrl,
     }
 
   es_fclose (key_blobs);
-  close_control_file (cf);
   xfree (key_fname);
 
   return ret_err;
@@ -2880,6 +3139,7 @@ ssh_handler_sign_request (ctrl_t ctrl, estream_t request, estream_t response)
   gpg_error_t err;
   gpg_error_t ret_err;
   int hash_algo;
+  struct timespec start;
 
   /* Receive key.  */
 
@@ -2938,10 +3198,12 @@ ssh_handler_sign_request (ctrl_t ctrl, estream_t request, estream_t response)
     }
 
   /* Sign data.  */
+  agent_metrics_op_start (&start);
   if ((spec.flags & SPEC_FLAG_IS_EdDSA))
     err = data_sign (ctrl, &spec, data, data_size, &sig, &sig_n);
   else
     err = data_sign (ctrl, &spec, NULL, 0, &sig, &sig_n);
+  agent_metrics_op_done (METRIC_OP_SSH_SIGN, &start, err);
 
  out:
   /* Done.  */
@@ -32,7 +32,6 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
 
 #include "agent.h"
 #include <assuan.h>
@@ -48,6 +47,8 @@
 #define MAXLEN_KEYPARAM 1024
 /* Maximum allowed size of key data as used in inquiries (bytes). */
 #define MAXLEN_KEYDATA 4096
+/* Maximum allowed size of the inquired list of hashes.  */
+#define MAXLEN_HASHLIST (256*1024)
 /* The size of the import/export KEK key (in bytes).  */
 #define KEYWRAP_KEYSIZE (128/8)
 
@@ -641,15 +642,61 @@ cmd_marktrusted (assuan_context_t ctx, char *line)
 
 static const char hlp_havekey[] =
   "HAVEKEY <hexstrings_with_keygrips>\n"
+  "HAVEKEY --list [<hexstrings_with_keygrips>]\n"
   "\n"
   "Return success if at least one of the secret keys with the given\n"
-  "keygrips is available.";
+  "keygrips is available.  With --list the keygrips of the available\n"
+  "keys are returned as binary data of 20 bytes each; if keygrips are\n"
+  "given only those of them which are available are returned.";
 static gpg_error_t
 cmd_havekey (assuan_context_t ctx, char *line)
 {
+  ctrl_t ctrl = assuan_get_pointer (ctx);
   gpg_error_t err;
   unsigned char buf[20];
 
+  if (has_option (line, "--list"))
+    {
+      unsigned char *grips;
+      size_t ngrips;
+
+      if (ctrl->restricted)
+        return leave_cmd (ctx, gpg_error (GPG_ERR_FORBIDDEN));
+
+      line = skip_options (line);
+      if (!*line)
+        {
+          err = agent_list_keygrips (&grips, &ngrips);
+          if (!err)
+            {
+              err = assuan_send_data (ctx, grips, ngrips * 20);
+              xfree (grips);
+            }
+          return leave_cmd (ctx, err);
+        }
+
+      do
+        {
+          err = parse_keygrip (ctx, line, buf);
+          if (err)
+            return err;
+
+          if (!agent_key_available (buf))
+            {
+              err = assuan_send_data (ctx, buf, 20);
+              if (err)
+                return leave_cmd (ctx, err);
+            }
+
+          while (*line && *line != ' ' && *line != '\t')
+            line++;
+          while (*line == ' ' || *line == '\t')
+            line++;
+        }
+      while (*line);
+      return 0;
+    }
+
   do
     {
       err = parse_keygrip (ctx, line, buf);
@@ -740,19 +787,17 @@ cmd_setkeydesc (assuan_context_t ctx, char *line)
 }
 
 
-static const char hlp_sethash[] =
-  "SETHASH (--hash=<name>)|(<algonumber>) <hexstring>\n"
-  "\n"
-  "The client can use this command to tell the server about the data\n"
-  "(which usually is a hash) to be signed.";
+/* Parse a hash specification as used by SETHASH from LINE.  On
+   success the algorithm is stored at R_ALGO and the hash value at
+   BUF which must provide space for MAX_DIGEST_LEN bytes; its length
+   is stored at R_BUFLEN.  */
 static gpg_error_t
-cmd_sethash (assuan_context_t ctx, char *line)
+parse_hash_spec (assuan_context_t ctx, char *line,
+                 int *r_algo, unsigned char *buf, int *r_buflen)
 {
   int rc;
   size_t n;
   char *p;
-  ctrl_t ctrl = assuan_get_pointer (ctx);
-  unsigned char *buf;
   char *endp;
   int algo;
 
@@ -793,8 +838,6 @@ cmd_sethash (assuan_context_t ctx, char *line)
       if (!algo || gcry_md_test_algo (algo))
         return set_error (GPG_ERR_UNSUPPORTED_ALGORITHM, NULL);
     }
-  ctrl->digest.algo = algo;
-  ctrl->digest.raw_value = 0;
 
   /* Parse the hash value. */
   n = 0;
@@ -811,16 +854,33 @@ cmd_sethash (assuan_context_t ctx, char *line)
   if (n > MAX_DIGEST_LEN)
     return set_error (GPG_ERR_ASS_PARAMETER, "hash value to long");
 
-  buf = ctrl->digest.value;
-  ctrl->digest.valuelen = n;
-  for (p=line, n=0; n < ctrl->digest.valuelen; p += 2, n++)
+  *r_algo = algo;
+  *r_buflen = n;
+  for (p=line, n=0; n < *r_buflen; p += 2, n++)
     buf[n] = xtoi_2 (p);
-  for (; n < ctrl->digest.valuelen; n++)
-    buf[n] = 0;
   return 0;
 }
 
 
+static const char hlp_sethash[] =
+  "SETHASH (--hash=<name>)|(<algonumber>) <hexstring>\n"
+  "\n"
+  "The client can use this command to tell the server about the data\n"
+  "(which usually is a hash) to be signed.";
+static gpg_error_t
+cmd_sethash (assuan_context_t ctx, char *line)
+{
+  int rc;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+
+  rc = parse_hash_spec (ctx, line, &ctrl->digest.algo,
+                        ctrl->digest.value, &ctrl->digest.valuelen);
+  if (!rc)
+    ctrl->digest.raw_value = 0;
+  return rc;
+}
+
+
 static const char hlp_pksign[] =
   "PKSIGN [<options>] [<cache_nonce>]\n"
   "\n"
@@ -835,6 +895,7 @@ cmd_pksign (assuan_context_t ctx, char *line)
   membuf_t outbuf;
   char *cache_nonce = NULL;
   char *p;
+  struct timespec start;
 
   line = skip_options (line);
 
@@ -852,8 +913,10 @@ cmd_pksign (assuan_context_t ctx, char *line)
 
   init_membuf (&outbuf, 512);
 
+  agent_metrics_op_start (&start);
   rc = agent_pksign (ctrl, cache_nonce, ctrl->server_local->keydesc,
                      &outbuf, cache_mode);
+  agent_metrics_op_done (METRIC_OP_PKSIGN, &start, rc);
   if (rc)
     clear_outbuf (&outbuf);
   else
@@ -866,6 +929,125 @@ cmd_pksign (assuan_context_t ctx, char *line)
 }
 
 
+/* Callback for agent_pksign_multi to send a signature back.  */
+static gpg_error_t
+pksign_multi_putsig (void *opaque, const void *sig, size_t siglen)
+{
+  assuan_context_t ctx = opaque;
+
+  return assuan_send_data (ctx, sig, siglen);
+}
+
+
+static const char hlp_pksign_multi[] =
+  "PKSIGN_MULTI [<options>] [<cache_nonce>]\n"
+  "\n"
+  "Sign several hashes with the key set by SIGKEY while unlocking the\n"
+  "key only once.  The hashes are inquired using the keyword HASHES;\n"
+  "each line of the returned data has the same format as the\n"
+  "arguments of SETHASH.  The signatures are returned as a sequence\n"
+  "of canonical encoded S-expressions in the order of the hashes.\n"
+  "Here is an example transaction:\n"
+  "\n"
+  "  C: PKSIGN_MULTI\n"
+  "  S: INQUIRE HASHES\n"
+  "  C: D 8 8C6976E5B5410415BDE908BD4DEE15DF...%0A8 2CF24DBA5FB0A30E...%0A\n"
+  "  C: END\n"
+  "  S: D (7:sig-val(3:rsa(1:s256:...)))(7:sig-val(3:rsa(1:s256:...)))\n"
+  "  S: OK";
+static gpg_error_t
+cmd_pksign_multi (assuan_context_t ctx, char *line)
+{
+  gpg_error_t err;
+  cache_mode_t cache_mode = CACHE_MODE_NORMAL;
+  ctrl_t ctrl = assuan_get_pointer (ctx);
+  char *cache_nonce = NULL;
+  unsigned char *value = NULL;
+  size_t valuelen;
+  struct pksign_item_s *items = NULL;
+  unsigned int nitems, idx;
+  char *p, *pend;
+
+  line = skip_options (line);
+
+  for (p=line; *p && *p != ' ' && *p != '\t'; p++)
+    ;
+  *p = '\0';
+  if (*line)
+    {
+      cache_nonce = xtrystrdup (line);
+      if (!cache_nonce)
+        {
+          err = out_of_core ();
+          goto leave;
+        }
+    }
+
+  err = print_assuan_status (ctx, "INQUIRE_MAXLEN", "%u", MAXLEN_HASHLIST);
+  if (!err)
+    err = assuan_inquire (ctx, "HASHES", &value, &valuelen, MAXLEN_HASHLIST);
+  if (err)
+    goto leave;
+
+  /* Count the lines to size the array.  The inquired data is not
+     nul terminated, thus we first turn it into a string.  */
+  p = xtryrealloc (value, valuelen + 1);
+  if (!p)
+    {
+      err = out_of_core ();
+      goto leave;
+    }
+  value = (unsigned char *)p;
+  value[valuelen] = 0;
+  for (nitems=1, p=(char*)value; (p = strchr (p, '\n')); p++)
+    nitems++;
+  items = xtrycalloc (nitems, sizeof *items);
+  if (!items)
+    {
+      err = out_of_core ();
+      goto leave;
+    }
+
+  for (idx=0, p=(char*)value; p; p = pend)
+    {
+      pend = strchr (p, '\n');
+      if (pend)
+        *pend++ = 0;
+      trim_spaces (p);
+      if (!*p)
+        continue;  /* Skip empty lines.  */
+      err = parse_hash_spec (ctx, p, &items[idx].algo,
+                             items[idx].value, &items[idx].valuelen);
+      if (err)
+        goto leave;
+      idx++;
+    }
+  nitems = idx;
+  if (!nitems)
+    {
+      err = set_error (GPG_ERR_NO_DATA, "no hashes given");
+      goto leave;
+    }
+
+  if (opt.ignore_cache_for_signing)
+    cache_mode = CACHE_MODE_IGNORE;
+  else if (!ctrl->server_local->use_cache_for_signing)
+    cache_mode = CACHE_MODE_IGNORE;
+
+  err = agent_pksign_multi (ctrl, cache_nonce, ctrl->server_local->keydesc,
+                            cache_mode, items, nitems,
+                            pksign_multi_putsig, ctx);
+
+ leave:
+  xfree (items);
+  xfree (value);
+  xfree (cache_nonce);
+  xfree (ctrl->server_local->keydesc);
+  ctrl->server_local->keydesc = NULL;
+  return leave_cmd (ctx, err);
+}
+
+
 static const char hlp_pkdecrypt[] =
   "PKDECRYPT [<options>]\n"
   "\n"
@@ -880,6 +1062,7 @@ cmd_pkdecrypt (assuan_context_t ctx, char *line)
   size_t valuelen;
   membuf_t outbuf;
   int padding;
+  struct timespec start;
 
   (void)line;
 
@@ -893,8 +1076,10 @@ cmd_pkdecrypt (assuan_context_t ctx, char *line)
 
   init_membuf (&outbuf, 512);
 
+  agent_metrics_op_start (&start);
   rc = agent_pkdecrypt (ctrl, ctrl->server_local->keydesc,
                         value, valuelen, &outbuf, &padding);
+  agent_metrics_op_done (METRIC_OP_PKDECRYPT, &start, rc);
   xfree (value);
   if (rc)
     clear_outbuf (&outbuf);
@@ -1213,7 +1398,8 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
   ctrl_t ctrl = assuan_get_pointer (ctx);
   int err;
   unsigned char grip[20];
-  DIR *dir = NULL;
+  unsigned char *grips = NULL;
+  size_t ngrips, n;
   int list_mode;
   int opt_data, opt_ssh_fpr, opt_with_ssh;
   ssh_control_file_t cf = NULL;
@@ -1254,34 +1440,16 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
     }
   else if (list_mode)
     {
-      char *dirname;
-      struct dirent *dir_entry;
-
-      dirname = make_filename_try (opt.homedir, GNUPG_PRIVATE_KEYS_DIR, NULL);
-      if (!dirname)
-        {
-          err = gpg_error_from_syserror ();
-          goto leave;
-        }
-      dir = opendir (dirname);
-      if (!dir)
-        {
-          err = gpg_error_from_syserror ();
-          xfree (dirname);
-          goto leave;
-        }
-      xfree (dirname);
+      /* The keygrips and the key types are taken from the key index
+         and thus there is no need to read the key files.  */
+      err = agent_list_keygrips (&grips, &ngrips);
+      if (err)
+        goto leave;
 
-      while ( (dir_entry = readdir (dir)) )
+      for (n=0; n < ngrips; n++)
         {
-          if (strlen (dir_entry->d_name) != 44
-              || strcmp (dir_entry->d_name + 40, ".key"))
-            continue;
-          strncpy (hexgrip, dir_entry->d_name, 40);
-          hexgrip[40] = 0;
-
-          if ( hex2bin (hexgrip, grip, 20) < 0 )
-            continue; /* Bad hex string.  */
+          memcpy (grip, grips + n * 20, 20);
+          bin2hex (grip, 20, hexgrip);
 
           disabled = ttl = confirm = is_ssh = 0;
           if (opt_with_ssh)
@@ -1323,8 +1491,7 @@ cmd_keyinfo (assuan_context_t ctx, char *line)
 
  leave:
   ssh_close_control_file (cf);
-  if (dir)
-    closedir (dir);
+  xfree (grips);
   if (err && gpg_err_code (err) != GPG_ERR_NOT_FOUND)
     leave_cmd (ctx, err);
   return err;
@@ -1399,6 +1566,7 @@ cmd_get_passphrase (assuan_context_t ctx, char *line)
   int opt_data, opt_check, opt_no_ask, opt_qualbar;
   int opt_repeat = 0;
   char *repeat_errtext = NULL;
+  struct timespec start;
 
   if (ctrl->restricted)
     return leave_cmd (ctx, gpg_error (GPG_ERR_FORBIDDEN));
@@ -1459,6 +1627,7 @@ cmd_get_passphrase (assuan_context_t ctx, char *line)
   if (!strcmp (desc, "X"))
     desc = NULL;
 
+  agent_metrics_op_start (&start);
   pw = cacheid ? agent_get_cache (cacheid, CACHE_MODE_NORMAL) : NULL;
   if (pw)
     {
@@ -1528,6 +1697,7 @@ cmd_get_passphrase (assuan_context_t ctx, char *line)
         }
     }
 
+  agent_metrics_op_done (METRIC_OP_GET_PASSPHRASE, &start, rc);
   return leave_cmd (ctx, rc);
 }
 
@@ -2755,6 +2925,11 @@ static const char hlp_getinfo[] =
   "  ssh_socket_name - Return the name of the ssh socket.\n"
   "  scd_running - Return OK if the SCdaemon is already running.\n"
   "  s2k_count   - Return the calibrated S2K count.\n"
+  "  s2k_bench   - Return the S2K count per second for each hash algo.\n"
+  "  key_cache_stats - Return the number of hits, misses and entries\n"
+  "                of the unlocked key cache.\n"
+  "  metrics     - Return counters and latency histograms; one\n"
+  "                \"<name> [<bucket>] <value>\" per line.\n"
   "  std_session_env - List the standard session environment.\n"
   "  std_startup_env - List the standard startup environment.\n"
   "  cmd_has_option\n"
@@ -2844,6 +3019,51 @@ cmd_getinfo (assuan_context_t ctx, char *line)
       else
         rc = gpg_error (GPG_ERR_NO_DATA);
     }
+  else if (!strcmp (line, "s2k_bench"))
+    {
+      static int algos[] = { GCRY_MD_SHA1, GCRY_MD_RMD160, GCRY_MD_SHA224,
+                             GCRY_MD_SHA256, GCRY_MD_SHA384, GCRY_MD_SHA512 };
+      char numbuf[100];
+      unsigned long rate;
+      int i;
+
+      for (i=0; !rc && i < DIM (algos); i++)
+        {
+          rate = get_s2k_rate (algos[i]);
+          if (!rate)
+            continue;
+          snprintf (numbuf, sizeof numbuf, "%s %lu\n",
+                    gcry_md_algo_name (algos[i]), rate);
+          rc = assuan_send_data (ctx, numbuf, strlen (numbuf));
+        }
+    }
+  else if (!strcmp (line, "key_cache_stats"))
+    {
+      char numbuf[100];
+      unsigned long hits, misses;
+      unsigned int entries;
+
+      agent_key_cache_stats (&hits, &misses, &entries);
+      snprintf (numbuf, sizeof numbuf, "%lu %lu %u", hits, misses, entries);
+      rc = assuan_send_data (ctx, numbuf, strlen (numbuf));
+    }
+  else if (!strcmp (line, "metrics"))
+    {
+      membuf_t mb;
+      char *buf;
+      size_t len;
+
+      init_membuf (&mb, 4096);
+      agent_metrics_write (&mb);
+      buf = get_membuf (&mb, &len);
+      if (!buf)
+        rc = gpg_error_from_syserror ();
+      else
+        {
+          rc = assuan_send_data (ctx, buf, len);
+          xfree (buf);
+        }
+    }
   else if (!strcmp (line, "scd_running"))
     {
       rc = agent_scd_check_running ()? 0 : gpg_error (GPG_ERR_GENERAL);
@@ -3060,6 +3280,7 @@ register_commands (assuan_context_t ctx)
     { "SETKEYDESC",     cmd_setkeydesc,hlp_setkeydesc },
     { "SETHASH",        cmd_sethash,   hlp_sethash },
     { "PKSIGN",         cmd_pksign,    hlp_pksign },
+    { "PKSIGN_MULTI",   cmd_pksign_multi, hlp_pksign_multi },
     { "PKDECRYPT",      cmd_pkdecrypt, hlp_pkdecrypt },
     { "GENKEY",         cmd_genkey,    hlp_genkey },
     { "READKEY",        cmd_readkey,   hlp_readkey },
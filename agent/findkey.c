@@ -29,6 +29,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <assert.h>
 #include <npth.h> /* (we use pth_sleep) */
 
@@ -40,6 +41,36 @@
 #define O_BINARY 0
 #endif
 
+/* An entry of the private key index.  */
+struct key_index_item_s
+{
+  unsigned char grip[20];
+  int keytype;                 /* The PRIVATE_KEY_ value or -1 if not
+                                  yet known.  */
+  unsigned char *shadow_info;  /* Malloced shadow info of a shadowed
+                                  key.  */
+};
+
+/* An index of the keys in the private key directory sorted by
+   keygrip.  The index is rebuilt if the modification time of the
+   directory changes; that is if a key file has been added or removed.
+   The type of a key is read from its file only on first use.  Changes
+   done by the agent itself flush the index.  A key file replaced in
+   place from outside does not change the modification time of the
+   directory; its cached type and shadow info are only refreshed by a
+   SIGHUP, which flushes the index.  Reading a key file may
+   switch threads; thus a pointer to an item may only be used after
+   that if GENERATION has not changed.  */
+static struct
+{
+  int valid;                       /* True if the index may be used.  */
+  unsigned int generation;         /* Incremented with each flush.  */
+  time_t mtime;                    /* Modification time of the dir.  */
+  size_t nitems;                   /* Number of used items.  */
+  struct key_index_item_s *items;  /* Malloced array of items.  */
+} key_index;
+
+
 /* Helper to pass data to the check callback of the unprotect function. */
 struct try_unprotect_arg_s
 {
@@ -105,6 +136,9 @@ agent_write_private_key (const unsigned char *grip,
     }
   bump_key_eventcounter ();
   xfree (fname);
+  hexgrip[40] = 0;
+  agent_put_key_cache (hexgrip, CACHE_MODE_IGNORE, 0, 0, NULL, 0);
+  agent_flush_key_index ();
   return 0;
 }
 
@@ -608,6 +642,59 @@ remove_key_file (const unsigned char *grip)
   if (gnupg_remove (fname))
     err = gpg_error_from_syserror ();
   xfree (fname);
+  hexgrip[40] = 0;
+  agent_put_key_cache (hexgrip, CACHE_MODE_IGNORE, 0, 0, NULL, 0);
+  agent_flush_key_index ();
+  return err;
+}
+
+
+/* Store the stat information of the key file for GRIP at ST.  */
+static gpg_error_t
+stat_key_file (const unsigned char *grip, struct stat *st)
+{
+  gpg_error_t err = 0;
+  char *fname;
+  char hexgrip[40+4+1];
+
+  bin2hex (grip, 20, hexgrip);
+  strcpy (hexgrip+40, ".key");
+  fname = make_filename (opt.homedir, GNUPG_PRIVATE_KEYS_DIR, hexgrip, NULL);
+  if (stat (fname, st))
+    err = gpg_error_from_syserror ();
+  xfree (fname);
+  return err;
+}
+
+
+/* Try to get the unprotected key for GRIP from the cache of unlocked
+   keys.  ST is the stat information of the key file.  On success
+   the key is stored at R_KEY.  */
+static gpg_error_t
+key_from_key_cache (const char *hexgrip, cache_mode_t cache_mode,
+                    struct stat *st, gcry_sexp_t *r_key)
+{
+  gpg_error_t err;
+  unsigned char *buf;
+  size_t buflen, erroff;
+
+  *r_key = NULL;
+  buf = agent_get_key_cache (hexgrip, cache_mode,
+                             st->st_mtime, (unsigned long)st->st_size);
+  if (!buf)
+    return gpg_error (GPG_ERR_NOT_FOUND);
+  buflen = gcry_sexp_canon_len (buf, 0, NULL, NULL);
+  if (!buflen)
+    err = gpg_error (GPG_ERR_INV_SEXP);
+  else
+    err = gcry_sexp_sscan (r_key, &erroff, (char*)buf, buflen);
+  wipememory (buf, buflen);
+  xfree (buf);
+  if (err)
+    log_error ("failed to build S-Exp from cached key: %s\n",
+               gpg_strerror (err));
+  else if (cache_mode == CACHE_MODE_NORMAL)
+    agent_store_cache_hit (hexgrip);
   return err;
 }
 
@@ -638,6 +725,9 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   unsigned char *buf;
   size_t len, buflen, erroff;
   gcry_sexp_t s_skey;
+  char hexgrip[40+1];
+  struct stat st;
+  int use_key_cache = 0;
 
   *result = NULL;
   if (shadow_info)
@@ -645,6 +735,18 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
   if (r_passphrase)
     *r_passphrase = NULL;
 
+  /* If enabled, try the cache of unlocked keys first.  A stat is
+     much cheaper than reading and unprotecting the key.  We can't
+     use the cache if the caller wants the passphrase.  */
+  if (opt.cache_unlocked_keys && cache_mode != CACHE_MODE_IGNORE
+      && !r_passphrase && !stat_key_file (grip, &st))
+    {
+      bin2hex (grip, 20, hexgrip);
+      if (!key_from_key_cache (hexgrip, cache_mode, &st, result))
+        return 0;
+      use_key_cache = 1;
+    }
+
   rc = read_key_file (grip, &s_skey);
   if (rc)
     {
@@ -694,6 +796,11 @@ agent_key_from_file (ctrl_t ctrl, const char *cache_nonce,
 	    if (rc)
 	      log_error ("failed to unprotect the secret key: %s\n",
 			 gpg_strerror (rc));
+            else if (use_key_cache)
+              agent_put_key_cache (hexgrip, cache_mode,
+                                   st.st_mtime, (unsigned long)st.st_size,
+                                   buf, gcry_sexp_canon_len (buf, 0,
+                                                             NULL, NULL));
 	  }
 
 	xfree (desc_text_final);
@@ -1129,6 +1236,173 @@ agent_public_key_from_file (ctrl_t ctrl,
 
 
 
+/* Release the private key index.  This needs to be called after a
+   key file has been changed.  */
+void
+agent_flush_key_index (void)
+{
+  size_t n;
+
+  for (n=0; n < key_index.nitems; n++)
+    xfree (key_index.items[n].shadow_info);
+  xfree (key_index.items);
+  key_index.items = NULL;
+  key_index.nitems = 0;
+  key_index.valid = 0;
+  key_index.generation++;
+}
+
+
+/* qsort compare function for the key index.  */
+static int
+compare_key_index_items (const void *arg_a, const void *arg_b)
+{
+  const struct key_index_item_s *a = arg_a;
+  const struct key_index_item_s *b = arg_b;
+
+  return memcmp (a->grip, b->grip, 20);
+}
+
+
+/* Make sure that the private key index matches the private key
+   directory.  This takes only a stat call if the directory has not
+   been changed.  */
+static gpg_error_t
+update_key_index (void)
+{
+  gpg_error_t err;
+  char *dname;
+  DIR *dir;
+  struct dirent *dir_entry;
+  struct stat st;
+  struct key_index_item_s *items = NULL;
+  size_t nitems = 0;
+  size_t size = 0;
+  time_t now;
+  char hexgrip[41];
+
+  dname = make_filename_try (opt.homedir, GNUPG_PRIVATE_KEYS_DIR, NULL);
+  if (!dname)
+    return gpg_error_from_syserror ();
+
+  if (stat (dname, &st))
+    {
+      err = gpg_error_from_syserror ();
+      agent_flush_key_index ();
+      xfree (dname);
+      return err;
+    }
+  if (key_index.valid && st.st_mtime == key_index.mtime)
+    {
+      xfree (dname);
+      return 0;
+    }
+
+  agent_flush_key_index ();
+  now = time (NULL);
+  dir = opendir (dname);
+  if (!dir)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (dname);
+      return err;
+    }
+  xfree (dname);
+
+  err = 0;
+  while ((dir_entry = readdir (dir)))
+    {
+      if (strlen (dir_entry->d_name) != 44
+          || strcmp (dir_entry->d_name + 40, ".key"))
+        continue;
+
+      if (nitems == size)
+        {
+          struct key_index_item_s *tmp;
+
+          size += 256;
+          tmp = xtryrealloc (items, size * sizeof *items);
+          if (!tmp)
+            {
+              err = gpg_error_from_syserror ();
+              break;
+            }
+          items = tmp;
+        }
+
+      memcpy (hexgrip, dir_entry->d_name, 40);
+      hexgrip[40] = 0;
+      if (hex2bin (hexgrip, items[nitems].grip, 20) < 0)
+        continue; /* Bad hex string.  */
+      items[nitems].keytype = -1;
+      items[nitems].shadow_info = NULL;
+      nitems++;
+    }
+  closedir (dir);
+  if (err)
+    {
+      xfree (items);
+      return err;
+    }
+
+  if (nitems)
+    qsort (items, nitems, sizeof *items, compare_key_index_items);
+  key_index.items = items;
+  key_index.nitems = nitems;
+  key_index.mtime = st.st_mtime;
+  /* If the directory has been modified in the same second we read it,
+     another change might not be visible in its mtime.  Use the index
+     for this call but read the directory again on the next one.  */
+  key_index.valid = (st.st_mtime < now);
+  return 0;
+}
+
+
+/* Return the index item for GRIP or NULL if there is no such key.
+   The caller must have called update_key_index.  */
+static struct key_index_item_s *
+find_key_index_item (const unsigned char *grip)
+{
+  struct key_index_item_s key;
+
+  if (!key_index.nitems)
+    return NULL;
+  memcpy (key.grip, grip, 20);
+  return bsearch (&key, key_index.items, key_index.nitems,
+                  sizeof *key_index.items, compare_key_index_items);
+}
+
+
+/* Return the keygrips of all private keys as an array of 20 byte
+   items sorted by keygrip.  On success the array is stored at R_GRIPS
+   and the number of keygrips at R_NGRIPS; the caller must xfree the
+   array.  */
+gpg_error_t
+agent_list_keygrips (unsigned char **r_grips, size_t *r_ngrips)
+{
+  gpg_error_t err;
+  unsigned char *grips;
+  size_t n;
+
+  *r_grips = NULL;
+  *r_ngrips = 0;
+
+  err = update_key_index ();
+  if (err)
+    return err;
+
+  grips = xtrymalloc ((key_index.nitems? key_index.nitems : 1) * 20);
+  if (!grips)
+    return gpg_error_from_syserror ();
+  for (n=0; n < key_index.nitems; n++)
+    memcpy (grips + n * 20, key_index.items[n].grip, 20);
+
+  *r_grips = grips;
+  *r_ngrips = key_index.nitems;
+  return 0;
+}
+
+
 /* Check whether the the secret key identified by GRIP is available.
    Returns 0 is the key is available.  */
 int
@@ -1138,6 +1412,10 @@ agent_key_available (const unsigned char *grip)
   char *fname;
   char hexgrip[40+4+1];
 
+  if (!update_key_index ())
+    return find_key_index_item (grip)? 0 : -1;
+
+  /* The index is not available; check the file directly.  */
   bin2hex (grip, 20, hexgrip);
   strcpy (hexgrip+40, ".key");
 
@@ -1159,8 +1437,12 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
 {
   gpg_error_t err;
   unsigned char *buf;
-  size_t len;
+  size_t len, n;
   int keytype;
+  struct key_index_item_s *item;
+  const unsigned char *s;
+  unsigned char *shadow_info = NULL;
+  unsigned int generation;
 
   (void)ctrl;
 
@@ -1169,6 +1451,31 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
   if (r_shadow_info)
     *r_shadow_info = NULL;
 
+  /* Try to take the information from the key index.  */
+  item = NULL;
+  generation = 0;
+  if (!update_key_index ())
+    {
+      generation = key_index.generation;
+      item = find_key_index_item (grip);
+      if (!item)
+        return gpg_error (GPG_ERR_NOT_FOUND);
+      if (item->keytype != -1)
+        {
+          if (r_shadow_info && item->shadow_info)
+            {
+              n = gcry_sexp_canon_len (item->shadow_info, 0, NULL, NULL);
+              *r_shadow_info = xtrymalloc (n);
+              if (!*r_shadow_info)
+                return gpg_error_from_syserror ();
+              memcpy (*r_shadow_info, item->shadow_info, n);
+            }
+          if (r_keytype)
+            *r_keytype = item->keytype;
+          return 0;
+        }
+    }
+
   {
     gcry_sexp_t sexp;
 
@@ -1196,22 +1503,24 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
          from such a key. */
       break;
     case PRIVATE_KEY_SHADOWED:
-      if (r_shadow_info)
+      err = agent_get_shadow_info (buf, &s);
+      if (!err)
         {
-          const unsigned char *s;
-          size_t n;
-
-          err = agent_get_shadow_info (buf, &s);
-          if (!err)
-            {
-              n = gcry_sexp_canon_len (s, 0, NULL, NULL);
-              assert (n);
-              *r_shadow_info = xtrymalloc (n);
-              if (!*r_shadow_info)
-                err = gpg_error_from_syserror ();
-              else
-                memcpy (*r_shadow_info, s, n);
-            }
+          n = gcry_sexp_canon_len (s, 0, NULL, NULL);
+          assert (n);
+          shadow_info = xtrymalloc (n);
+          if (!shadow_info)
+            err = gpg_error_from_syserror ();
+          else
+            memcpy (shadow_info, s, n);
+        }
+      if (!err && r_shadow_info)
+        {
+          *r_shadow_info = xtrymalloc (n);
+          if (!*r_shadow_info)
+            err = gpg_error_from_syserror ();
+          else
+            memcpy (*r_shadow_info, s, n);
         }
       break;
     default:
@@ -1222,6 +1531,18 @@ agent_key_info_from_file (ctrl_t ctrl, const unsigned char *grip,
   if (!err && r_keytype)
     *r_keytype = keytype;
 
+  /* Remember the information in the key index.  The index may have
+     been rebuilt while we were reading the file.  */
+  if (item && key_index.generation != generation)
+    item = find_key_index_item (grip);
+  if (!err && item && item->keytype == -1)
+    {
+      item->keytype = keytype;
+      item->shadow_info = shadow_info;
+      shadow_info = NULL;
+    }
+
+  xfree (shadow_info);
   xfree (buf);
   return err;
 }
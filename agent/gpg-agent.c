@@ -61,6 +61,7 @@
 #include "asshelp.h"
 #include "openpgpdefs.h"  /* for PUBKEY_ALGO_ECDSA, PUBKEY_ALGO_ECDH */
 #include "../common/init.h"
+#include "../common/conn-loop.h"
 
 
 enum cmd_and_opt_values
@@ -112,9 +113,11 @@ enum cmd_and_opt_values
   oUseStandardSocket,
   oNoUseStandardSocket,
   oExtraSocket,
+  oConnectionThreads,
   oFakedSystemTime,
 
   oIgnoreCacheForSigning,
+  oCacheUnlockedKeys,
   oAllowMarkTrusted,
   oNoAllowMarkTrusted,
   oAllowPresetPassphrase,
@@ -199,6 +202,7 @@ static ARGPARSE_OPTS opts[] = {
 
   ARGPARSE_s_n (oIgnoreCacheForSigning, "ignore-cache-for-signing",
                 /* */    N_("do not use the PIN cache when signing")),
+  ARGPARSE_s_n (oCacheUnlockedKeys, "cache-unlocked-keys", "@"),
   ARGPARSE_s_n (oNoAllowMarkTrusted, "no-allow-mark-trusted",
                 /* */    N_("disallow clients to mark keys as \"trusted\"")),
   ARGPARSE_s_n (oAllowMarkTrusted,   "allow-mark-trusted", "@"),
@@ -215,6 +219,7 @@ static ARGPARSE_OPTS opts[] = {
 #endif
                 ),
   ARGPARSE_s_s (oExtraSocket, "extra-socket", "@"),
+  ARGPARSE_s_u (oConnectionThreads, "connection-threads", "@"),
 
   /* Dummy options for backward compatibility.  */
   ARGPARSE_o_s (oWriteEnvFile, "write-env-file", "@"),
@@ -554,6 +559,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       opt.max_passphrase_days = MAX_PASSPHRASE_DAYS;
       opt.enable_passhrase_history = 0;
       opt.ignore_cache_for_signing = 0;
+      opt.cache_unlocked_keys = 0;
       opt.allow_mark_trusted = 1;
       opt.disable_scdaemon = 0;
       disable_check_own_socket = 0;
@@ -612,6 +618,7 @@ parse_rereadable_options (ARGPARSE_ARGS *pargs, int reread)
       break;
 
     case oIgnoreCacheForSigning: opt.ignore_cache_for_signing = 1; break;
+    case oCacheUnlockedKeys: opt.cache_unlocked_keys = 1; break;
 
     case oAllowMarkTrusted: opt.allow_mark_trusted = 1; break;
     case oNoAllowMarkTrusted: opt.allow_mark_trusted = 0; break;
@@ -902,6 +909,10 @@ main (int argc, char **argv )
           socket_name_extra = pargs.r.ret_str;
           break;
 
+        case oConnectionThreads:
+          opt.connection_threads = pargs.r.ret_ulong;
+          break;
+
         case oDebugQuickRandom:
           /* Only used by the first stage command line parser.  */
           break;
@@ -981,6 +992,8 @@ main (int argc, char **argv )
   initialize_module_call_pinentry ();
   initialize_module_call_scd ();
   initialize_module_trustlist ();
+  initialize_module_command_ssh ();
+  agent_metrics_init ();
 
   /* Try to create missing directories. */
   create_directories ();
@@ -1827,7 +1840,9 @@ agent_sighup_action (void)
             "re-reading configuration and flushing cache\n");
   agent_flush_cache ();
   reread_configuration ();
+  agent_reconfigure_cache ();
   agent_reload_trustlist ();
+  agent_flush_key_index ();
 }
 
 
@@ -2120,7 +2135,11 @@ start_connection_thread (ctrl_t ctrl)
     log_info (_("handler 0x%lx for fd %d started\n"),
               (unsigned long) npth_self(), FD2INT(ctrl->thread_startup.fd));
 
+  active_connections++;
+  agent_metrics_connection (1);
   start_command_handler (ctrl, GNUPG_INVALID_FD, ctrl->thread_startup.fd);
+  agent_metrics_connection (0);
+  active_connections--;
   if (opt.verbose)
     log_info (_("handler 0x%lx for fd %d terminated\n"),
               (unsigned long) npth_self(), FD2INT(ctrl->thread_startup.fd));
@@ -2166,7 +2185,11 @@ start_connection_thread_ssh (void *arg)
     log_info (_("ssh handler 0x%lx for fd %d started\n"),
               (unsigned long) npth_self(), FD2INT(ctrl->thread_startup.fd));
 
+  active_connections++;
+  agent_metrics_connection (1);
   start_command_handler_ssh (ctrl, ctrl->thread_startup.fd);
+  agent_metrics_connection (0);
+  active_connections--;
   if (opt.verbose)
     log_info (_("ssh handler 0x%lx for fd %d terminated\n"),
               (unsigned long) npth_self(), FD2INT(ctrl->thread_startup.fd));
@@ -2184,13 +2207,15 @@ handle_connections (gnupg_fd_t listen_fd,
                     gnupg_fd_t listen_fd_extra,
                     gnupg_fd_t listen_fd_ssh)
 {
+  gpg_error_t err;
   npth_attr_t tattr;
   struct sockaddr_un paddr;
   socklen_t plen;
-  fd_set fdset, read_fdset;
+  conn_watch_t watch;
+  conn_pool_t pool;
   int ret;
+  unsigned int i;
   gnupg_fd_t fd;
-  int nfd;
   int saved_errno;
   struct timespec abstime;
   struct timespec curtime;
@@ -2255,26 +2280,27 @@ handle_connections (gnupg_fd_t listen_fd,
      notifications.  */
   opt.sigusr2_enabled = 1;
 
-  FD_ZERO (&fdset);
-  FD_SET (FD2INT (listen_fd), &fdset);
-  nfd = FD2INT (listen_fd);
-  if (listen_fd_extra != GNUPG_INVALID_FD)
-    {
-      FD_SET ( FD2INT(listen_fd_extra), &fdset);
-      if (FD2INT (listen_fd_extra) > nfd)
-        nfd = FD2INT (listen_fd_extra);
-    }
-  if (listen_fd_ssh != GNUPG_INVALID_FD)
-    {
-      FD_SET ( FD2INT(listen_fd_ssh), &fdset);
-      if (FD2INT (listen_fd_ssh) > nfd)
-        nfd = FD2INT (listen_fd_ssh);
-    }
-
   listentbl[0].l_fd = listen_fd;
   listentbl[1].l_fd = listen_fd_extra;
   listentbl[2].l_fd = listen_fd_ssh;
 
+  err = conn_watch_new (&watch);
+  if (err)
+    log_fatal ("error creating the connection watcher: %s\n",
+               gpg_strerror (err));
+  for (i=0; i < DIM(listentbl); i++)
+    if (listentbl[i].l_fd != GNUPG_INVALID_FD)
+      {
+        err = conn_watch_add (watch, listentbl[i].l_fd);
+        if (err)
+          log_fatal ("error watching the %s socket: %s\n",
+                     listentbl[i].name, gpg_strerror (err));
+      }
+
+  err = conn_pool_new (&pool, opt.connection_threads);
+  if (err)
+    log_fatal ("error creating the thread pool: %s\n", gpg_strerror (err));
+
   npth_clock_gettime (&abstime);
   abstime.tv_sec += TIMERTICK_INTERVAL;
 
@@ -2288,13 +2314,9 @@ handle_connections (gnupg_fd_t listen_fd,
 
           /* Do not accept new connections but keep on running the
              loop to cope with the timer events.  */
-          FD_ZERO (&fdset);
+          conn_watch_clear (watch);
 	}
 
-      /* POSIX says that fd_set should be implemented as a structure,
-         thus a simple assignment is fine to copy the entire set.  */
-      read_fdset = fdset;
-
       npth_clock_gettime (&curtime);
       if (!(npth_timercmp (&curtime, &abstime, <)))
 	{
@@ -2306,8 +2328,7 @@ handle_connections (gnupg_fd_t listen_fd,
       npth_timersub (&abstime, &curtime, &timeout);
 
 #ifndef HAVE_W32_SYSTEM
-      ret = npth_pselect (nfd+1, &read_fdset, NULL, NULL, &timeout,
-                          npth_sigev_sigmask ());
+      ret = conn_watch_wait (watch, &timeout, npth_sigev_sigmask ());
       saved_errno = errno;
 
       {
@@ -2316,8 +2337,7 @@ handle_connections (gnupg_fd_t listen_fd,
           handle_signal (signo);
       }
 #else
-      ret = npth_eselect (nfd+1, &read_fdset, NULL, NULL, &timeout,
-                          events, &events_set);
+      ret = conn_watch_wait (watch, &timeout, events, &events_set);
       saved_errno = errno;
 
       /* This is valid even if npth_eselect returns an error.  */
@@ -2341,13 +2361,12 @@ handle_connections (gnupg_fd_t listen_fd,
         {
           int idx;
           ctrl_t ctrl;
-          npth_t thread;
 
           for (idx=0; idx < DIM(listentbl); idx++)
             {
               if (listentbl[idx].l_fd == GNUPG_INVALID_FD)
                 continue;
-              if (!FD_ISSET (FD2INT (listentbl[idx].l_fd), &read_fdset))
+              if (!conn_watch_ready (watch, listentbl[idx].l_fd))
                 continue;
 
               plen = sizeof paddr;
@@ -2374,12 +2393,12 @@ handle_connections (gnupg_fd_t listen_fd,
               else
                 {
                   ctrl->thread_startup.fd = fd;
-                  ret = npth_create (&thread, &tattr,
-                                     listentbl[idx].func, ctrl);
-                  if (ret)
+                  err = conn_pool_run (pool, listentbl[idx].func, ctrl, NULL);
+                  if (err)
                     {
                       log_error ("error spawning connection handler for %s:"
-                                 " %s\n", listentbl[idx].name, strerror (ret));
+                                 " %s\n", listentbl[idx].name,
+                                 gpg_strerror (err));
                       assuan_sock_close (fd);
                       xfree (ctrl);
                     }
@@ -2389,6 +2408,8 @@ handle_connections (gnupg_fd_t listen_fd,
         }
     }
 
+  conn_pool_release (pool);
+  conn_watch_release (watch);
   cleanup ();
   log_info (_("%s %s stopped\n"), strusage(11), strusage(13));
   npth_attr_destroy (&tattr);
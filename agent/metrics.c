@@ -0,0 +1,201 @@
+/* metrics.c - Operational statistics of the agent
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The counters are updated without any locking: nPth runs only one
+   thread at a time and none of the functions below let it switch
+   threads.  Thus a plain increment is atomic with respect to all
+   other threads of the agent and the hot paths do not need to take a
+   lock.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <npth.h>
+
+#include "agent.h"
+
+/* The upper bounds of the latency histogram buckets in milliseconds.
+   An implicit last bucket takes all larger values.  */
+static const unsigned long latency_bounds[] =
+  { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000 };
+#define N_LATENCY_BUCKETS (DIM (latency_bounds) + 1)
+
+/* The names of the operations as used in the output.  Must match the
+   order of metric_op_t.  */
+static const char *op_names[METRIC_OP_LAST] =
+  { "pksign", "pkdecrypt", "get_passphrase", "ssh_sign", "scd" };
+
+/* The statistics for one kind of operation.  */
+struct op_stats_s
+{
+  unsigned long count;      /* Number of finished operations.  */
+  unsigned long errors;     /* Number of operations which failed.  */
+  unsigned long sum_ms;     /* Total time of all operations.  */
+  unsigned long max_ms;     /* Longest time of an operation.  */
+  unsigned long buckets[N_LATENCY_BUCKETS];
+};
+
+static struct op_stats_s op_stats[METRIC_OP_LAST];
+
+/* Connection gauges and counters.  */
+static unsigned int connections_active;
+static unsigned int connections_max;
+static unsigned long connections_total;
+
+/* Passphrase cache lookups.  */
+static unsigned long cache_hits;
+static unsigned long cache_misses;
+
+/* The time the statistics were started.  */
+static time_t start_time;
+
+
+
+/* Return the milliseconds elapsed since START.  */
+static unsigned long
+elapsed_ms (const struct timespec *start)
+{
+  struct timespec now;
+  long ms;
+
+  npth_clock_gettime (&now);
+  ms = ((now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_nsec / 1000000) - (start->tv_nsec / 1000000));
+  return ms < 0? 0 : (unsigned long)ms;
+}
+
+
+/* Start the statistics.  This is called once at startup so that
+   the uptime covers the time before the first connection.  */
+void
+agent_metrics_init (void)
+{
+  start_time = gnupg_get_time ();
+}
+
+
+/* Store the start time of an operation at R_START.  */
+void
+agent_metrics_op_start (struct timespec *r_start)
+{
+  npth_clock_gettime (r_start);
+}
+
+
+/* Record the end of operation OP started at START.  ERR is the result
+   of the operation.  */
+void
+agent_metrics_op_done (metric_op_t op, const struct timespec *start,
+                       gpg_error_t err)
+{
+  struct op_stats_s *st;
+  unsigned long ms;
+  int i;
+
+  if (op < 0 || op >= METRIC_OP_LAST)
+    return;
+  st = op_stats + op;
+  ms = elapsed_ms (start);
+
+  st->count++;
+  if (err)
+    st->errors++;
+  st->sum_ms += ms;
+  if (ms > st->max_ms)
+    st->max_ms = ms;
+  for (i=0; i < DIM (latency_bounds) && ms > latency_bounds[i]; i++)
+    ;
+  st->buckets[i]++;
+}
+
+
+/* Record a lookup in the passphrase cache.  HIT is true if a
+   passphrase was found.  */
+void
+agent_metrics_cache_lookup (int hit)
+{
+  if (hit)
+    cache_hits++;
+  else
+    cache_misses++;
+}
+
+
+/* Record the start (OPENED is true) or the end of a connection.  */
+void
+agent_metrics_connection (int opened)
+{
+  if (opened)
+    {
+      connections_total++;
+      connections_active++;
+      if (connections_active > connections_max)
+        connections_max = connections_active;
+    }
+  else if (connections_active)
+    connections_active--;
+}
+
+
+/* Append the statistics to MB.  Each line has a name and a decimal
+   value separated by a space; histogram lines have the upper bound of
+   the bucket in milliseconds or "inf" as an additional field in
+   between.  The bucket counts are cumulative.  New lines may be added
+   in the future; thus a parser should ignore unknown names.  */
+void
+agent_metrics_write (membuf_t *mb)
+{
+  unsigned long hits, misses, cum;
+  unsigned int entries;
+  int op, i;
+
+  put_membuf_printf (mb, "uptime %lu\n",
+                     (unsigned long)(gnupg_get_time () - start_time));
+  put_membuf_printf (mb, "connections_active %u\n", connections_active);
+  put_membuf_printf (mb, "connections_max %u\n", connections_max);
+  put_membuf_printf (mb, "connections_total %lu\n", connections_total);
+  put_membuf_printf (mb, "cache_hits %lu\n", cache_hits);
+  put_membuf_printf (mb, "cache_misses %lu\n", cache_misses);
+  agent_key_cache_stats (&hits, &misses, &entries);
+  put_membuf_printf (mb, "key_cache_hits %lu\n", hits);
+  put_membuf_printf (mb, "key_cache_misses %lu\n", misses);
+  put_membuf_printf (mb, "key_cache_entries %u\n", entries);
+
+  for (op=0; op < METRIC_OP_LAST; op++)
+    {
+      const struct op_stats_s *st = op_stats + op;
+      const char *name = op_names[op];
+
+      put_membuf_printf (mb, "%s_count %lu\n", name, st->count);
+      put_membuf_printf (mb, "%s_errors %lu\n", name, st->errors);
+      put_membuf_printf (mb, "%s_ms_sum %lu\n", name, st->sum_ms);
+      put_membuf_printf (mb, "%s_ms_max %lu\n", name, st->max_ms);
+      for (cum=0, i=0; i < N_LATENCY_BUCKETS; i++)
+        {
+          cum += st->buckets[i];
+          if (i < DIM (latency_bounds))
+            put_membuf_printf (mb, "%s_ms_bucket %lu %lu\n",
+                               name, latency_bounds[i], cum);
+          else
+            put_membuf_printf (mb, "%s_ms_bucket inf %lu\n", name, cum);
+        }
+    }
+}
@@ -274,50 +274,19 @@ do_encode_raw_pkcs1 (const byte *md, size_t mdlen, unsigned int nbits,
 
 
 
-/* SIGN whatever information we have accumulated in CTRL and return
-   the signature S-expression.  LOOKUP is an optional function to
-   provide a way for lower layers to ask for the caching TTL.  If a
-   CACHE_NONCE is given that cache item is first tried to get a
-   passphrase.  If OVERRIDEDATA is not NULL, OVERRIDEDATALEN bytes
-   from this buffer are used instead of the data in CTRL.  The
-   override feature is required to allow the use of Ed25519 with ssh
-   because Ed25519 dies the hashing itself.  */
-int
-agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
-                 const char *desc_text,
-		 gcry_sexp_t *signature_sexp,
-                 cache_mode_t cache_mode, lookup_ttl_t lookup_ttl,
-                 const void *overridedata, size_t overridedatalen)
+/* Sign DATA of length DATALEN, which is a hash created with the
+   digest algorithm ALGO, using the secret key S_SKEY.  If SHADOW_INFO
+   is not NULL the operation is diverted to the smartcard.  RAW_VALUE
+   is passed to the PKCS#1 encoder.  On success the signature is
+   stored at R_SIG.  */
+static int
+sign_with_key (ctrl_t ctrl, gcry_sexp_t s_skey,
+               const unsigned char *shadow_info,
+               const unsigned char *data, int datalen,
+               int algo, int raw_value, gcry_sexp_t *r_sig)
 {
-  gcry_sexp_t s_skey = NULL, s_sig = NULL;
-  unsigned char *shadow_info = NULL;
-  unsigned int rc = 0;		/* FIXME: gpg-error? */
-  const unsigned char *data;
-  int datalen;
-
-  if (overridedata)
-    {
-      data = overridedata;
-      datalen = overridedatalen;
-    }
-  else
-    {
-      data = ctrl->digest.value;
-      datalen = ctrl->digest.valuelen;
-    }
-
-  if (!ctrl->have_keygrip)
-    return gpg_error (GPG_ERR_NO_SECKEY);
-
-  rc = agent_key_from_file (ctrl, cache_nonce, desc_text, ctrl->keygrip,
-                            &shadow_info, cache_mode, lookup_ttl,
-                            &s_skey, NULL);
-  if (rc)
-    {
-      if (gpg_err_code (rc) != GPG_ERR_NO_SECKEY)
-        log_error ("failed to read the secret key\n");
-      goto leave;
-    }
+  gcry_sexp_t s_sig = NULL;
+  int rc = 0;
 
   if (shadow_info)
     {
@@ -342,7 +311,7 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
 
       rc = divert_pksign (ctrl,
                           data, datalen,
-                          ctrl->digest.algo,
+                          algo,
                           shadow_info, &buf, &len);
       if (rc)
         {
@@ -437,7 +406,7 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
       if (agent_is_eddsa_key (s_skey))
         rc = do_encode_eddsa (data, datalen,
                               &s_hash);
-      else if (ctrl->digest.algo == MD_USER_TLS_MD5SHA1)
+      else if (algo == MD_USER_TLS_MD5SHA1)
         rc = do_encode_raw_pkcs1 (data, datalen,
                                   gcry_pk_get_nbits (s_skey),
                                   &s_hash);
@@ -447,9 +416,9 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
                             &s_hash);
       else
         rc = do_encode_md (data, datalen,
-                           ctrl->digest.algo,
+                           algo,
                            &s_hash,
-                           ctrl->digest.raw_value);
+                           raw_value);
       if (rc)
         goto leave;
 
@@ -472,6 +441,60 @@ agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
         gcry_log_debugsxp ("rslt", s_sig);
     }
 
+ leave:
+  *r_sig = s_sig;
+  return rc;
+}
+
+
+/* SIGN whatever information we have accumulated in CTRL and return
+   the signature S-expression.  LOOKUP is an optional function to
+   provide a way for lower layers to ask for the caching TTL.  If a
+   CACHE_NONCE is given that cache item is first tried to get a
+   passphrase.  If OVERRIDEDATA is not NULL, OVERRIDEDATALEN bytes
+   from this buffer are used instead of the data in CTRL.  The
+   override feature is required to allow the use of Ed25519 with ssh
+   because Ed25519 dies the hashing itself.  */
+int
+agent_pksign_do (ctrl_t ctrl, const char *cache_nonce,
+                 const char *desc_text,
+		 gcry_sexp_t *signature_sexp,
+                 cache_mode_t cache_mode, lookup_ttl_t lookup_ttl,
+                 const void *overridedata, size_t overridedatalen)
+{
+  gcry_sexp_t s_skey = NULL, s_sig = NULL;
+  unsigned char *shadow_info = NULL;
+  unsigned int rc = 0;		/* FIXME: gpg-error? */
+  const unsigned char *data;
+  int datalen;
+
+  if (overridedata)
+    {
+      data = overridedata;
+      datalen = overridedatalen;
+    }
+  else
+    {
+      data = ctrl->digest.value;
+      datalen = ctrl->digest.valuelen;
+    }
+
+  if (!ctrl->have_keygrip)
+    return gpg_error (GPG_ERR_NO_SECKEY);
+
+  rc = agent_key_from_file (ctrl, cache_nonce, desc_text, ctrl->keygrip,
+                            &shadow_info, cache_mode, lookup_ttl,
+                            &s_skey, NULL);
+  if (rc)
+    {
+      if (gpg_err_code (rc) != GPG_ERR_NO_SECKEY)
+        log_error ("failed to read the secret key\n");
+      goto leave;
+    }
+
+  rc = sign_with_key (ctrl, s_skey, shadow_info, data, datalen,
+                      ctrl->digest.algo, ctrl->digest.raw_value, &s_sig);
+
  leave:
 
   *signature_sexp = s_sig;
@@ -513,3 +536,83 @@ agent_pksign (ctrl_t ctrl, const char *cache_nonce, const char *desc_text,
 
   return rc;
 }
+
+
+/* Sign the NITEMS hashes from ITEMS with the key set in CTRL.  In
+   contrast to calling agent_pksign for each hash, the secret key is
+   read and unprotected only once.  For each hash PUTSIG is called
+   with OPAQUE and the canonical encoded signature; this is done in
+   the order of ITEMS.  Processing stops at the first error.  */
+gpg_error_t
+agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                    const char *desc_text, cache_mode_t cache_mode,
+                    const struct pksign_item_s *items, unsigned int nitems,
+                    gpg_error_t (*putsig)(void *opaque,
+                                          const void *sig, size_t siglen),
+                    void *opaque)
+{
+  gpg_error_t err;
+  gcry_sexp_t s_skey = NULL;
+  gcry_sexp_t s_sig;
+  unsigned char *shadow_info = NULL;
+  char *buf = NULL;
+  size_t bufsize = 0;
+  size_t len;
+  unsigned int idx;
+
+  if (!ctrl->have_keygrip)
+    return gpg_error (GPG_ERR_NO_SECKEY);
+
+  err = agent_key_from_file (ctrl, cache_nonce, desc_text, ctrl->keygrip,
+                             &shadow_info, cache_mode, NULL,
+                             &s_skey, NULL);
+  if (err)
+    {
+      if (gpg_err_code (err) != GPG_ERR_NO_SECKEY)
+        log_error ("failed to read the secret key\n");
+      return err;
+    }
+
+  for (idx=0; idx < nitems; idx++)
+    {
+      s_sig = NULL;
+      err = sign_with_key (ctrl, s_skey, shadow_info,
+                           items[idx].value, items[idx].valuelen,
+                           items[idx].algo, 0, &s_sig);
+      if (!err && !s_sig)
+        err = gpg_error (GPG_ERR_ENOMEM);
+      if (err)
+        {
+          gcry_sexp_release (s_sig);
+          break;
+        }
+
+      len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, NULL, 0);
+      assert (len);
+      if (len > bufsize)
+        {
+          xfree (buf);
+          buf = xtrymalloc (len);
+          if (!buf)
+            {
+              err = gpg_error_from_syserror ();
+              bufsize = 0;
+              gcry_sexp_release (s_sig);
+              break;
+            }
+          bufsize = len;
+        }
+      len = gcry_sexp_sprint (s_sig, GCRYSEXP_FMT_CANON, buf, bufsize);
+      assert (len);
+      gcry_sexp_release (s_sig);
+
+      err = putsig (opaque, buf, len);
+      if (err)
+        break;
+    }
+
+  xfree (buf);
+  gcry_sexp_release (s_skey);
+  xfree (shadow_info);
+  return err;
+}
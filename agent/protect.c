@@ -47,6 +47,14 @@
 #define PROT_CIPHER_STRING "aes"
 #define PROT_CIPHER_KEYLEN (128/8)
 
+/* The name of the file in the home directory to store the S2K
+   calibration results.  */
+#define S2K_CALIBRATION_FILE "s2k-calibration"
+
+/* The fraction of the calibrated S2K count used to check a stored
+   calibration result.  */
+#define S2K_REVALIDATE_DIVISOR 4
+
 /* Decode an rfc4880 encoded S2K count.  */
 #define S2K_DECODE_COUNT(_val) ((16ul + ((_val) & 15)) << (((_val) >> 4) + 6))
 
@@ -188,6 +196,223 @@ calibrate_s2k_count (void)
 
 
 
+/* Return a malloced string identifying the CPU model of this host or
+   NULL if that is not known.  */
+static char *
+get_cpu_model (void)
+{
+#ifdef HAVE_W32_SYSTEM
+  return NULL;
+#else
+  FILE *fp;
+  char line[256];
+  char *p, *result = NULL;
+  size_t n;
+
+  fp = fopen ("/proc/cpuinfo", "r");
+  if (!fp)
+    return NULL;
+  while (!result && fgets (line, sizeof line, fp))
+    {
+      if (strncmp (line, "model name", 10))
+        continue;
+      p = strchr (line, ':');
+      if (!p)
+        continue;
+      for (p++; spacep (p); p++)
+        ;
+      n = strlen (p);
+      while (n && isspace (((unsigned char *)p)[n-1]))
+        p[--n] = 0;
+      if (*p)
+        result = xtrystrdup (p);
+    }
+  fclose (fp);
+  return result;
+#endif
+}
+
+
+/* Return the key used to look up the calibration result of this host
+   in the S2K calibration file.  The key is made up of the Libgcrypt
+   version and the CPU model.  Returns NULL on error.  */
+static char *
+make_s2k_calibration_key (void)
+{
+  char *cpu, *key;
+
+  cpu = get_cpu_model ();
+  key = xtryasprintf ("%s %s", gcry_check_version (NULL), cpu? cpu : "-");
+  xfree (cpu);
+  return key;
+}
+
+
+/* Look up KEY in the S2K calibration file FNAME and return the stored
+   count or 0 if not found.  The file has lines of the form
+
+     <count> <libgcrypt-version> <cpu-model>
+
+   Empty lines and lines starting with a hash mark are ignored.  */
+static unsigned long
+read_s2k_calibration (const char *fname, const char *key)
+{
+  estream_t fp;
+  char line[512];
+  char *p;
+  unsigned long count = 0;
+  size_t n;
+
+  fp = es_fopen (fname, "r");
+  if (!fp)
+    return 0;
+  while (!count && es_fgets (line, sizeof line, fp))
+    {
+      n = strlen (line);
+      if (n && line[n-1] == '\n')
+        line[--n] = 0;
+      if (!*line || *line == '#')
+        continue;
+      p = strchr (line, ' ');
+      if (p && !strcmp (p+1, key))
+        count = strtoul (line, NULL, 10);
+    }
+  es_fclose (fp);
+  return count;
+}
+
+
+/* Store COUNT for KEY in the S2K calibration file FNAME.  Entries for
+   other keys are kept so that a home directory may be shared by
+   several hosts.  Errors are only logged; the calibration is merely
+   an optimization.  */
+static void
+write_s2k_calibration (const char *fname, const char *key,
+                       unsigned long count)
+{
+  estream_t fp, newfp;
+  char *tmpfname;
+  char line[512];
+  char *p;
+  size_t n;
+
+  tmpfname = xtryasprintf ("%s.tmp", fname);
+  if (!tmpfname)
+    return;
+  newfp = es_fopen (tmpfname, "w,mode=-rw");
+  if (!newfp)
+    {
+      log_error ("can't create '%s': %s\n",
+                 tmpfname, gpg_strerror (gpg_error_from_syserror ()));
+      xfree (tmpfname);
+      return;
+    }
+  es_fputs ("# S2K calibration results written by gpg-agent.\n"
+            "# This file may be removed at any time.\n", newfp);
+
+  fp = es_fopen (fname, "r");
+  if (fp)
+    {
+      while (es_fgets (line, sizeof line, fp))
+        {
+          n = strlen (line);
+          if (!n || line[n-1] != '\n')
+            continue;  /* Line too long or missing LF - skip.  */
+          line[--n] = 0;
+          if (!*line || *line == '#')
+            continue;
+          p = strchr (line, ' ');
+          if (!p || !strcmp (p+1, key))
+            continue;
+          es_fprintf (newfp, "%s\n", line);
+        }
+      es_fclose (fp);
+    }
+  es_fprintf (newfp, "%lu %s\n", count, key);
+
+  if (es_fclose (newfp))
+    {
+      log_error ("error writing '%s': %s\n",
+                 tmpfname, gpg_strerror (gpg_error_from_syserror ()));
+      gnupg_remove (tmpfname);
+    }
+  else
+    {
+#ifdef HAVE_DOSISH_SYSTEM
+      gnupg_remove (fname);
+#endif
+      if (rename (tmpfname, fname))
+        {
+          log_error ("renaming '%s' to '%s' failed: %s\n",
+                     tmpfname, fname,
+                     gpg_strerror (gpg_error_from_syserror ()));
+          gnupg_remove (tmpfname);
+        }
+    }
+  xfree (tmpfname);
+}
+
+
+/* Check that the stored calibration COUNT still matches the speed of
+   this box.  To keep this cheap we hash only a quarter of COUNT and
+   accept the value if the extrapolated time is in the range of 50 to
+   200ms.  */
+static int
+revalidate_s2k_count (unsigned long count)
+{
+  unsigned long ms;
+
+  if (count < 65536)
+    return 0;
+  ms = calibrate_s2k_count_one (count / S2K_REVALIDATE_DIVISOR);
+  ms *= S2K_REVALIDATE_DIVISOR;
+  if (opt.verbose > 1)
+    log_info ("S2K calibration: %lu -> %lums (cached)\n", count, ms);
+  return ms >= 50 && ms <= 200;
+}
+
+
+/* Return the S2K count for this box.  A count found in the
+   calibration file of the home directory is used after a quick check;
+   if there is none or it does not match anymore a full calibration is
+   done and the result stored in that file.  */
+static unsigned long
+load_or_calibrate_s2k_count (void)
+{
+  char *fname = NULL;
+  char *key = NULL;
+  unsigned long count = 0;
+
+  if (opt.homedir)
+    {
+      fname = make_filename (opt.homedir, S2K_CALIBRATION_FILE, NULL);
+      key = make_s2k_calibration_key ();
+    }
+
+  if (fname && key)
+    {
+      count = read_s2k_calibration (fname, key);
+      if (count && !revalidate_s2k_count (count))
+        {
+          if (opt.verbose)
+            log_info ("S2K calibration: cached count %lu is stale\n", count);
+          count = 0;
+        }
+    }
+
+  if (!count)
+    {
+      count = calibrate_s2k_count ();
+      if (fname && key)
+        write_s2k_calibration (fname, key, count);
+    }
+
+  xfree (key);
+  xfree (fname);
+  return count;
+}
+
+
 /* Return the standard S2K count.  */
 unsigned long
 get_standard_s2k_count (void)
@@ -195,13 +420,46 @@ get_standard_s2k_count (void)
   static unsigned long count;
 
   if (!count)
-    count = calibrate_s2k_count ();
+    count = load_or_calibrate_s2k_count ();
 
   /* Enforce a lower limit.  */
   return count < 65536 ? 65536 : count;
 }
 
 
+/* Return the number of octets per second the S2K function is able to
+   process using HASHALGO.  This is the S2K count which would require
+   one second of time.  Returns 0 if HASHALGO is not supported.  */
+unsigned long
+get_s2k_rate (int hashalgo)
+{
+  int rc;
+  char keybuf[PROT_CIPHER_KEYLEN];
+  struct calibrate_time_s starttime;
+  unsigned long count;
+  unsigned long ms = 0;
+
+  if (gcry_md_test_algo (hashalgo))
+    return 0;
+
+  for (count = 65536; count; count *= 2)
+    {
+      calibrate_get_time (&starttime);
+      rc = hash_passphrase ("123456789abcdef0", hashalgo,
+                            3, "saltsalt", count, keybuf, sizeof keybuf);
+      if (rc)
+        return 0;
+      ms = calibrate_elapsed_time (&starttime);
+      if (ms > 100)
+        break;
+    }
+  if (!count || !ms)
+    return 0;
+
+  return (unsigned long)(((double)count / ms) * 1000);
+}
+
+
 /* Same as get_standard_s2k_count but return the count in the encoding
    as described by rfc4880.  */
 unsigned char
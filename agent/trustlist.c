@@ -53,8 +53,11 @@ typedef struct trustitem_s trustitem_t;
 /* Malloced table and its allocated size with all trust items. */
 static trustitem_t *trusttable;
 static size_t trusttablesize;
-/* A mutex used to protect the table. */
-static npth_mutex_t trusttable_lock;
+/* Malloced array with pointers to all items of TRUSTTABLE sorted by
+   fingerprint.  Used for fast lookups.  */
+static trustitem_t **trustindex;
+/* A reader-writer lock used to protect the table. */
+static npth_rwlock_t trusttable_lock;
 
 
 static const char headerblurb[] =
@@ -85,9 +88,10 @@ initialize_module_trustlist (void)
 
   if (!initialized)
     {
-      err = npth_mutex_init (&trusttable_lock, NULL);
+      err = npth_rwlock_init (&trusttable_lock, NULL);
       if (err)
-        log_fatal ("failed to init mutex in %s: %s\n", __FILE__,strerror (err));
+        log_fatal ("failed to init rwlock in %s: %s\n",
+                   __FILE__, strerror (err));
       initialized = 1;
     }
 }
@@ -95,14 +99,30 @@ initialize_module_trustlist (void)
 
 
 
+/* Take an exclusive lock on the trusttable.  */
 static void
 lock_trusttable (void)
 {
   int err;
 
-  err = npth_mutex_lock (&trusttable_lock);
+  err = npth_rwlock_wrlock (&trusttable_lock);
   if (err)
-    log_fatal ("failed to acquire mutex in %s: %s\n", __FILE__, strerror (err));
+    log_fatal ("failed to acquire rwlock in %s: %s\n",
+               __FILE__, strerror (err));
+}
+
+
+/* Take a shared lock on the trusttable.  Only lookups are allowed
+   while holding this lock.  */
+static void
+lock_trusttable_shared (void)
+{
+  int err;
+
+  err = npth_rwlock_rdlock (&trusttable_lock);
+  if (err)
+    log_fatal ("failed to acquire rwlock in %s: %s\n",
+               __FILE__, strerror (err));
 }
 
 
@@ -111,20 +131,74 @@ unlock_trusttable (void)
 {
   int err;
 
-  err = npth_mutex_unlock (&trusttable_lock);
+  err = npth_rwlock_unlock (&trusttable_lock);
   if (err)
-    log_fatal ("failed to release mutex in %s: %s\n", __FILE__, strerror (err));
+    log_fatal ("failed to release rwlock in %s: %s\n",
+               __FILE__, strerror (err));
+}
+
+
+/* Replace the trusttable by TABLE with TABLESIZE items and the index
+   SORTED; all may be NULL to clear the table.  The caller needs to
+   make sure that the trusttable is locked exclusively.  */
+static void
+replace_trusttable (trustitem_t *table, size_t tablesize,
+                    trustitem_t **sorted)
+{
+  xfree (trustindex);
+  xfree (trusttable);
+  trusttable = table;
+  trusttablesize = tablesize;
+  trustindex = sorted;
 }
 
 
 /* Clear the trusttable.  The caller needs to make sure that the
-   trusttable is locked.  */
+   trusttable is locked exclusively.  */
 static inline void
 clear_trusttable (void)
 {
-  xfree (trusttable);
-  trusttable = NULL;
-  trusttablesize = 0;
+  replace_trusttable (NULL, 0, NULL);
+}
+
+
+/* qsort compare function for the trustindex.  Items with the same
+   fingerprint are kept in the order of the trustlist so that the
+   first one is found by a lookup.  */
+static int
+compare_trustitems (const void *arg_a, const void *arg_b)
+{
+  const trustitem_t *a = *(const trustitem_t **)arg_a;
+  const trustitem_t *b = *(const trustitem_t **)arg_b;
+  int cmp;
+
+  cmp = memcmp (a->fpr, b->fpr, 20);
+  if (!cmp)
+    cmp = a < b? -1 : a > b;
+  return cmp;
+}
+
+
+/* Return the first item of the trusttable with the binary fingerprint
+   FPR or NULL if there is none.  The trusttable must be locked.  */
+static trustitem_t *
+find_trustitem (const unsigned char *fpr)
+{
+  size_t lo, hi, mid;
+
+  lo = 0;
+  hi = trusttablesize;
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (memcmp (trustindex[mid]->fpr, fpr, 20) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo < trusttablesize && !memcmp (trustindex[lo]->fpr, fpr, 20))
+    return trustindex[lo];
+  return NULL;
 }
 
 
@@ -326,18 +400,26 @@ read_one_trustfile (const char *fname, int allow_include,
 }
 
 
-/* Read the trust files and update the global table on success.  The
-   trusttable is assumed to be locked. */
+/* Read the trust files and return a new table with its size and
+   sorted index at R_TABLE, R_TABLESIZE and R_SORTED.  If no trust
+   file exists NULL is stored at R_TABLE and R_SORTED.  The global
+   trusttable is not touched; thus there is no need to hold a lock.  */
 static gpg_error_t
-read_trustfiles (void)
+read_trustfiles (trustitem_t **r_table, size_t *r_tablesize,
+                 trustitem_t ***r_sorted)
 {
   gpg_error_t err;
   trustitem_t *table, *ti;
-  int tableidx;
+  trustitem_t **sorted;
+  int tableidx, i;
   size_t tablesize;
   char *fname;
   int allow_include = 1;
 
+  *r_table = NULL;
+  *r_tablesize = 0;
+  *r_sorted = NULL;
+
   tablesize = 20;
   table = xtrycalloc (tablesize, sizeof *table);
   if (!table)
@@ -368,13 +450,11 @@ read_trustfiles (void)
       if (gpg_err_code (err) == GPG_ERR_ENOENT)
         {
           /* Take a missing trustlist as an empty one.  */
-          clear_trusttable ();
           err = 0;
         }
       return err;
     }
 
-  /* Fixme: we should drop duplicates and sort the table. */
   ti = xtryrealloc (table, (tableidx?tableidx:1) * sizeof *table);
   if (!ti)
     {
@@ -382,15 +462,74 @@ read_trustfiles (void)
       xfree (table);
       return err;
     }
+  table = ti;
 
-  /* Replace the trusttable.  */
-  xfree (trusttable);
-  trusttable = ti;
-  trusttablesize = tableidx;
+  /* Build the index.  The table itself is kept in file order for
+     LISTTRUSTED.  */
+  sorted = xtrycalloc (tableidx?tableidx:1, sizeof *sorted);
+  if (!sorted)
+    {
+      err = gpg_error_from_syserror ();
+      xfree (table);
+      return err;
+    }
+  for (i=0; i < tableidx; i++)
+    sorted[i] = table + i;
+  qsort (sorted, tableidx, sizeof *sorted, compare_trustitems);
+
+  *r_table = table;
+  *r_tablesize = tableidx;
+  *r_sorted = sorted;
+  return 0;
+}
+
+
+/* Make sure that the trusttable has been read.  The trusttable must
+   be locked exclusively.  */
+static gpg_error_t
+load_trusttable (void)
+{
+  gpg_error_t err;
+  trustitem_t *table;
+  size_t tablesize;
+  trustitem_t **sorted;
+
+  if (trusttable)
+    return 0;
+
+  err = read_trustfiles (&table, &tablesize, &sorted);
+  if (err)
+    {
+      log_error (_("error reading list of trusted root certificates\n"));
+      return err;
+    }
+  replace_trusttable (table, tablesize, sorted);
   return 0;
 }
 
 
+/* Lock the trusttable for a lookup and make sure that it has been
+   read.  Usually only a shared lock is taken; only if the table needs
+   to be read an exclusive lock is used.  On success the caller needs
+   to release the lock using unlock_trusttable.  */
+static gpg_error_t
+lock_and_load_trusttable (void)
+{
+  gpg_error_t err;
+
+  lock_trusttable_shared ();
+  if (trusttable)
+    return 0;
+  unlock_trusttable ();
+
+  lock_trusttable ();
+  err = load_trusttable ();
+  if (err)
+    unlock_trusttable ();
+  return err;
+}
+
+
 /* Check whether the given fpr is in our trustdb.  We expect FPR to be
    an all uppercase hexstring of 40 characters.  If ALREADY_LOCKED is
    true the function assumes that the trusttable is already locked. */
@@ -401,7 +540,6 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
   gpg_error_t err;
   int locked = already_locked;
   trustitem_t *ti;
-  size_t len;
   unsigned char fprbin[20];
 
   if (r_disabled)
@@ -415,49 +553,46 @@ istrusted_internal (ctrl_t ctrl, const char *fpr, int *r_disabled,
 
   if (!already_locked)
     {
-      lock_trusttable ();
+      err = lock_and_load_trusttable ();
+      if (err)
+        goto leave;
       locked = 1;
     }
-
-  if (!trusttable)
+  else
     {
-      err = read_trustfiles ();
+      err = load_trusttable ();
       if (err)
-        {
-          log_error (_("error reading list of trusted root certificates\n"));
-          goto leave;
-        }
+        goto leave;
     }
 
-  if (trusttable)
+  ti = trusttable? find_trustitem (fprbin) : NULL;
+  if (ti)
     {
-      for (ti=trusttable, len = trusttablesize; len; ti++, len--)
-        if (!memcmp (ti->fpr, fprbin, 20))
-          {
-            if (ti->flags.disabled && r_disabled)
-              *r_disabled = 1;
-
-            /* Print status messages only if we have not been called
-               in a locked state.  */
-            if (already_locked)
-              ;
-            else if (ti->flags.relax)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
-              }
-            else if (ti->flags.cm)
-              {
-                unlock_trusttable ();
-                locked = 0;
-                err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
-              }
-
-            if (!err)
-              err = ti->flags.disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
-            goto leave;
-          }
+      int disabled = ti->flags.disabled;
+
+      if (disabled && r_disabled)
+        *r_disabled = 1;
+
+      /* Print status messages only if we have not been called in a
+         locked state.  */
+      if (already_locked)
+        ;
+      else if (ti->flags.relax)
+        {
+          unlock_trusttable ();
+          locked = 0;
+          err = agent_write_status (ctrl, "TRUSTLISTFLAG", "relax", NULL);
+        }
+      else if (ti->flags.cm)
+        {
+          unlock_trusttable ();
+          locked = 0;
+          err = agent_write_status (ctrl, "TRUSTLISTFLAG", "cm", NULL);
+        }
+
+      if (!err)
+        err = disabled? gpg_error (GPG_ERR_NOT_TRUSTED) : 0;
+      goto leave;
     }
   err = gpg_error (GPG_ERR_NOT_TRUSTED);
 
@@ -486,17 +621,9 @@ agent_listtrusted (void *assuan_context)
   gpg_error_t err;
   size_t len;
 
-  lock_trusttable ();
-  if (!trusttable)
-    {
-      err = read_trustfiles ();
-      if (err)
-        {
-          unlock_trusttable ();
-          log_error (_("error reading list of trusted root certificates\n"));
-          return err;
-        }
-    }
+  err = lock_and_load_trusttable ();
+  if (err)
+    return err;
 
   if (trusttable)
     {
@@ -798,10 +925,23 @@ agent_marktrusted (ctrl_t ctrl, const char *name, const char *fpr, int flag)
 void
 agent_reload_trustlist (void)
 {
-  /* All we need to do is to delete the trusttable.  At the next
-     access it will get re-read. */
+  gpg_error_t err;
+  trustitem_t *table;
+  size_t tablesize;
+  trustitem_t **sorted;
+
+  /* Read the new table without holding the lock so that lookups are
+     not blocked meanwhile and then switch to it in one step.  On
+     error we delete the trusttable so that the error shows up at the
+     next access.  */
+  err = read_trustfiles (&table, &tablesize, &sorted);
+  if (err)
+    log_error (_("error reading list of trusted root certificates\n"));
   lock_trusttable ();
-  clear_trusttable ();
+  if (err)
+    clear_trusttable ();
+  else
+    replace_trusttable (table, tablesize, sorted);
   unlock_trusttable ();
   bump_key_eventcounter ();
 }
@@ -123,6 +123,18 @@ b64dec_proc (struct b64state *state, void *buffer, size_t length,
 
   for (s=d=buffer; length && !state->stop_seen; length--, s++)
     {
+      if (ds == s_b64_0 && length >= 4)
+        {
+          /* Fast path: Decode all complete groups at once.  */
+          size_t used;
+
+          d += radix64_decode_block (d, s, length, &used);
+          s += used;
+          length -= used;
+          if (!length)
+            break;
+        }
+
       switch (ds)
         {
         case s_idle:
@@ -0,0 +1,459 @@
+/* conn-loop.c - Helpers for the connection loop of the daemons
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The daemons wait for new connections on up to three listening
+   sockets and run each connection in its own thread.  The watch
+   object hides whether epoll or select is used for waiting; epoll
+   does not impose the FD_SETSIZE limit and its cost does not depend
+   on the value of the descriptors.
+
+   The pool object keeps up to MAXTHREADS threads alive after their
+   connection has terminated, so that the next connection can be
+   handed to an idle thread instead of creating a new one.  If all
+   pool threads are busy a new thread is created for the connection
+   and terminated afterwards, as is done without a pool.  Connections
+   are thus never queued; this is important because a connection may
+   be blocked for a long time, for example while a pinentry is shown,
+   and another connection may be required to unblock it.  */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+# include <sys/epoll.h>
+# define USE_EPOLL 1
+#endif
+#include <npth.h>
+
+#include "util.h"
+#include "sysutils.h"
+#include "conn-loop.h"
+
+
+/* Maximum number of sockets which can be watched.  */
+#define MAX_WATCHED_FDS 8
+
+
+struct conn_watch_s
+{
+  int nfds;
+  struct {
+    gnupg_fd_t fd;
+    int ready;
+  } fds[MAX_WATCHED_FDS];
+#ifdef USE_EPOLL
+  int epfd;
+#else
+  fd_set fdset;
+  int maxfd;
+#endif
+};
+
+
+/* A thread of the pool.  */
+struct conn_pool_worker_s
+{
+  struct conn_pool_worker_s *next;  /* Next idle thread.  */
+  conn_pool_t pool;
+  npth_cond_t cond;                 /* Signaled when FUNC is set.  */
+  void *(*func) (void *arg);        /* The job or NULL.  */
+  void *arg;
+};
+typedef struct conn_pool_worker_s *conn_pool_worker_t;
+
+
+struct conn_pool_s
+{
+  npth_mutex_t lock;
+  npth_attr_t tattr;
+  unsigned int maxthreads;   /* Maximum number of pool threads.  */
+  unsigned int nthreads;     /* Current number of pool threads.  */
+  conn_pool_worker_t idle;   /* List of idle pool threads.  */
+  int stopping;              /* The pool is being released.  */
+};
+
+
+
+/* Create a new watch object and store it at R_WATCH.  */
+gpg_error_t
+conn_watch_new (conn_watch_t *r_watch)
+{
+  conn_watch_t watch;
+
+  *r_watch = NULL;
+  watch = xtrycalloc (1, sizeof *watch);
+  if (!watch)
+    return gpg_error_from_syserror ();
+#ifdef USE_EPOLL
+  watch->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (watch->epfd == -1)
+    {
+      gpg_error_t err = gpg_error_from_syserror ();
+      xfree (watch);
+      return err;
+    }
+#else
+  FD_ZERO (&watch->fdset);
+  watch->maxfd = -1;
+#endif
+  *r_watch = watch;
+  return 0;
+}
+
+
+/* Release the watch object WATCH.  The watched sockets are not
+   closed.  */
+void
+conn_watch_release (conn_watch_t watch)
+{
+  if (!watch)
+    return;
+#ifdef USE_EPOLL
+  close (watch->epfd);
+#endif
+  xfree (watch);
+}
+
+
+/* Add the listening socket FD to WATCH.  */
+gpg_error_t
+conn_watch_add (conn_watch_t watch, gnupg_fd_t fd)
+{
+#ifdef USE_EPOLL
+  struct epoll_event ev;
+#endif
+
+  if (watch->nfds >= MAX_WATCHED_FDS)
+    return gpg_error (GPG_ERR_TOO_MANY);
+
+#ifdef USE_EPOLL
+  memset (&ev, 0, sizeof ev);
+  ev.events = EPOLLIN;
+  ev.data.u32 = watch->nfds;
+  if (epoll_ctl (watch->epfd, EPOLL_CTL_ADD, FD2INT (fd), &ev))
+    return gpg_error_from_syserror ();
+#else
+# ifndef HAVE_W32_SYSTEM
+  if (FD2INT (fd) >= FD_SETSIZE)
+    return gpg_error (GPG_ERR_TOO_LARGE);
+# endif
+  FD_SET (FD2INT (fd), &watch->fdset);
+  if ((int)FD2INT (fd) > watch->maxfd)
+    watch->maxfd = FD2INT (fd);
+#endif
+
+  watch->fds[watch->nfds].fd = fd;
+  watch->fds[watch->nfds].ready = 0;
+  watch->nfds++;
+  return 0;
+}
+
+
+/* Remove all sockets from WATCH.  conn_watch_wait does then only
+   wait for the timeout and signals.  */
+void
+conn_watch_clear (conn_watch_t watch)
+{
+#ifdef USE_EPOLL
+  int i;
+
+  for (i=0; i < watch->nfds; i++)
+    epoll_ctl (watch->epfd, EPOLL_CTL_DEL, FD2INT (watch->fds[i].fd), NULL);
+#else
+  FD_ZERO (&watch->fdset);
+  watch->maxfd = -1;
+#endif
+  watch->nfds = 0;
+}
+
+
+/* Wait until one of the sockets in WATCH is readable or TIMEOUT has
+   expired.  While waiting the signal mask is replaced by SIGMASK.
+   Returns the number of ready sockets, 0 on timeout, or -1 with
+   ERRNO set on error.  Use conn_watch_ready to check which sockets
+   are ready.  On Windows EVENTS and EVENTS_SET are passed to
+   npth_eselect.  */
+#ifndef HAVE_W32_SYSTEM
+int
+conn_watch_wait (conn_watch_t watch, struct timespec *timeout,
+                 const sigset_t *sigmask)
+#else
+int
+conn_watch_wait (conn_watch_t watch, struct timespec *timeout,
+                 HANDLE *events, unsigned int *events_set)
+#endif
+{
+  int ret, i;
+#ifdef USE_EPOLL
+  struct epoll_event evs[MAX_WATCHED_FDS];
+  int msec, saved_errno;
+#else
+  fd_set read_fdset;
+#endif
+
+  for (i=0; i < watch->nfds; i++)
+    watch->fds[i].ready = 0;
+
+#ifdef USE_EPOLL
+  msec = timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+
+  /* Release the nPth lock while waiting; this is what npth_pselect
+     does as well.  */
+  npth_unprotect ();
+  ret = epoll_pwait (watch->epfd, evs, DIM (evs), msec, sigmask);
+  saved_errno = errno;
+  npth_protect ();
+
+  for (i=0; i < ret; i++)
+    if (evs[i].data.u32 < watch->nfds)
+      watch->fds[evs[i].data.u32].ready = 1;
+  gpg_err_set_errno (saved_errno);
+#else
+  /* POSIX says that fd_set should be implemented as a structure,
+     thus a simple assignment is fine to copy the entire set.  */
+  read_fdset = watch->fdset;
+# ifndef HAVE_W32_SYSTEM
+  ret = npth_pselect (watch->maxfd+1, &read_fdset, NULL, NULL,
+                      timeout, sigmask);
+# else
+  ret = npth_eselect (watch->maxfd+1, &read_fdset, NULL, NULL,
+                      timeout, events, events_set);
+# endif
+  if (ret > 0)
+    {
+      for (i=0; i < watch->nfds; i++)
+        if (FD_ISSET (FD2INT (watch->fds[i].fd), &read_fdset))
+          watch->fds[i].ready = 1;
+    }
+#endif
+
+  return ret;
+}
+
+
+/* Return true if FD has been reported as readable by the last call
+   to conn_watch_wait.  */
+int
+conn_watch_ready (conn_watch_t watch, gnupg_fd_t fd)
+{
+  int i;
+
+  for (i=0; i < watch->nfds; i++)
+    if (watch->fds[i].fd == fd)
+      return watch->fds[i].ready;
+  return 0;
+}
+
+
+
+/* Create a new thread pool which keeps up to MAXTHREADS threads.
+   With MAXTHREADS of 0 a new thread is created for each call of
+   conn_pool_run.  */
+gpg_error_t
+conn_pool_new (conn_pool_t *r_pool, unsigned int maxthreads)
+{
+  conn_pool_t pool;
+  int ret;
+
+  *r_pool = NULL;
+  pool = xtrycalloc (1, sizeof *pool);
+  if (!pool)
+    return gpg_error_from_syserror ();
+
+  ret = npth_mutex_init (&pool->lock, NULL);
+  if (ret)
+    {
+      xfree (pool);
+      return gpg_error_from_errno (ret);
+    }
+  ret = npth_attr_init (&pool->tattr);
+  if (ret)
+    {
+      npth_mutex_destroy (&pool->lock);
+      xfree (pool);
+      return gpg_error_from_errno (ret);
+    }
+  npth_attr_setdetachstate (&pool->tattr, NPTH_CREATE_DETACHED);
+  pool->maxthreads = maxthreads;
+
+  *r_pool = pool;
+  return 0;
+}
+
+
+static void
+destroy_pool (conn_pool_t pool)
+{
+  npth_attr_destroy (&pool->tattr);
+  npth_mutex_destroy (&pool->lock);
+  xfree (pool);
+}
+
+
+/* Release POOL.  Idle threads are terminated; busy threads terminate
+   after their current job.  */
+void
+conn_pool_release (conn_pool_t pool)
+{
+  conn_pool_worker_t w;
+
+  if (!pool)
+    return;
+
+  npth_mutex_lock (&pool->lock);
+  pool->stopping = 1;
+  for (w = pool->idle; w; w = w->next)
+    npth_cond_signal (&w->cond);
+  pool->idle = NULL;
+  if (!pool->nthreads)
+    {
+      npth_mutex_unlock (&pool->lock);
+      destroy_pool (pool);
+      return;
+    }
+  /* The last thread will destroy the pool.  */
+  npth_mutex_unlock (&pool->lock);
+}
+
+
+/* The main function of a pool thread.  */
+static void *
+pool_thread (void *arg)
+{
+  conn_pool_worker_t w = arg;
+  conn_pool_t pool = w->pool;
+  void *(*func) (void *arg);
+  void *funcarg;
+  int last;
+
+  npth_mutex_lock (&pool->lock);
+  for (;;)
+    {
+      while (!w->func && !pool->stopping)
+        npth_cond_wait (&w->cond, &pool->lock);
+      if (!w->func)
+        break;
+
+      func = w->func;
+      funcarg = w->arg;
+      w->func = NULL;
+      w->arg = NULL;
+      npth_mutex_unlock (&pool->lock);
+
+      func (funcarg);
+
+      npth_mutex_lock (&pool->lock);
+      if (pool->stopping)
+        break;
+      w->next = pool->idle;
+      pool->idle = w;
+    }
+
+  pool->nthreads--;
+  last = (pool->stopping && !pool->nthreads);
+  npth_mutex_unlock (&pool->lock);
+
+  npth_cond_destroy (&w->cond);
+  xfree (w);
+  if (last)
+    destroy_pool (pool);
+  return NULL;
+}
+
+
+/* Run FUNC with ARG in a separate thread.  An idle thread of POOL is
+   used if available.  NAME is used as the name of a newly created
+   thread.  */
+gpg_error_t
+conn_pool_run (conn_pool_t pool, void *(*func) (void *arg), void *arg,
+               const char *name)
+{
+  conn_pool_worker_t w;
+  npth_t thread;
+  int ret;
+
+  npth_mutex_lock (&pool->lock);
+  if (pool->idle)
+    {
+      w = pool->idle;
+      pool->idle = w->next;
+      w->next = NULL;
+      w->func = func;
+      w->arg = arg;
+      npth_cond_signal (&w->cond);
+      npth_mutex_unlock (&pool->lock);
+      return 0;
+    }
+
+  if (pool->nthreads < pool->maxthreads && !pool->stopping)
+    {
+      w = xtrycalloc (1, sizeof *w);
+      if (!w)
+        {
+          npth_mutex_unlock (&pool->lock);
+          return gpg_error_from_syserror ();
+        }
+      ret = npth_cond_init (&w->cond, NULL);
+      if (ret)
+        {
+          npth_mutex_unlock (&pool->lock);
+          xfree (w);
+          return gpg_error_from_errno (ret);
+        }
+      w->pool = pool;
+      w->func = func;
+      w->arg = arg;
+      ret = npth_create (&thread, &pool->tattr, pool_thread, w);
+      if (ret)
+        {
+          npth_mutex_unlock (&pool->lock);
+          npth_cond_destroy (&w->cond);
+          xfree (w);
+          return gpg_error_from_errno (ret);
+        }
+      pool->nthreads++;
+      npth_mutex_unlock (&pool->lock);
+      npth_setname_np (thread, "conn-pool");
+      return 0;
+    }
+  npth_mutex_unlock (&pool->lock);
+
+  /* All pool threads are busy; use a one-shot thread.  */
+  ret = npth_create (&thread, &pool->tattr, func, arg);
+  if (ret)
+    return gpg_error_from_errno (ret);
+  if (name)
+    npth_setname_np (thread, name);
+  return 0;
+}
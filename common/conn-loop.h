@@ -0,0 +1,64 @@
+/* conn-loop.h - Definitions for the connection loop helpers
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GNUPG_COMMON_CONN_LOOP_H
+#define GNUPG_COMMON_CONN_LOOP_H
+
+#include <npth.h>
+
+/* An object to wait for incoming connections on a set of listening
+   sockets.  Uses epoll if available and select otherwise.  */
+struct conn_watch_s;
+typedef struct conn_watch_s *conn_watch_t;
+
+gpg_error_t conn_watch_new (conn_watch_t *r_watch);
+void conn_watch_release (conn_watch_t watch);
+gpg_error_t conn_watch_add (conn_watch_t watch, gnupg_fd_t fd);
+void conn_watch_clear (conn_watch_t watch);
+#ifndef HAVE_W32_SYSTEM
+int conn_watch_wait (conn_watch_t watch, struct timespec *timeout,
+                     const sigset_t *sigmask);
+#else
+int conn_watch_wait (conn_watch_t watch, struct timespec *timeout,
+                     HANDLE *events, unsigned int *events_set);
+#endif
+int conn_watch_ready (conn_watch_t watch, gnupg_fd_t fd);
+
+
+/* A pool of threads to run connection handlers.  */
+struct conn_pool_s;
+typedef struct conn_pool_s *conn_pool_t;
+
+gpg_error_t conn_pool_new (conn_pool_t *r_pool, unsigned int maxthreads);
+void conn_pool_release (conn_pool_t pool);
+gpg_error_t conn_pool_run (conn_pool_t pool, void *(*func) (void *arg),
+                           void *arg, const char *name);
+
+
+#endif /*GNUPG_COMMON_CONN_LOOP_H*/
@@ -195,6 +195,12 @@ struct my_socket_s
 {
   int fd;       /* The actual socket - shall never be -1.  */
   int refcount; /* Number of references to this socket.  */
+#ifdef USE_TLS
+  /* The TLS session of this connection or NULL.  It is released
+     along with the socket so that a connection kept in the pool of
+     an http session keeps its TLS state.  */
+  tls_session_t tls_session;
+#endif /*USE_TLS*/
 };
 typedef struct my_socket_s *my_socket_t;
 
@@ -223,28 +229,59 @@ struct cookie_s
      the content length.  */
   longcounter_t content_length;
   unsigned int content_length_valid:1;
+
+  /* True if the connection may be put into the connection pool of
+     SESSION under POOL_KEY after the entire content has been read.  */
+  unsigned int keep_alive:1;
+  char *pool_key;
+
+  /* The number of bytes read from the socket.  */
+  longcounter_t nread;
 };
 typedef struct cookie_s *cookie_t;
 
+
+/* An idle connection kept in the pool of a session.  A TLS connection
+   has already been verified and is only reused for the same server
+   name.  */
+struct pool_item_s
+{
+  struct pool_item_s *next;
+  my_socket_t sock;  /* The socket object.  */
+  time_t since;      /* The time the connection became idle.  */
+  char key[1];       /* The server, port and flags of the connection.  */
+};
+typedef struct pool_item_s *pool_item_t;
+
 /* The session object. */
 struct http_session_s
 {
   int refcount;    /* Number of references to this object.  */
 #ifdef HTTP_USE_GNUTLS
   gnutls_certificate_credentials_t certcred;
+  gnutls_priority_t priority_cache;
 #endif /*HTTP_USE_GNUTLS*/
 #ifdef USE_TLS
+  /* The TLS session and the server name of the connection being
+     verified.  They are only valid while the verification callback
+     runs; the TLS sessions are owned by the sockets.  */
   tls_session_t tls_session;
+  char *servername; /* Malloced server name.  */
   struct {
     int done;      /* Verifciation has been done.  */
     int rc;        /* TLS verification return code.  */
     unsigned int status; /* Verification status.  */
   } verify;
-  char *servername; /* Malloced server name.  */
 #endif /*USE_TLS*/
   /* A callback function to log details of TLS certifciates.  */
   void (*cert_log_cb) (http_session_t, gpg_error_t, const char *,
                        const void **, size_t *);
+
+  /* The idle connections which may be reused.  Connections are only
+     kept if POOL_MAX_PER_HOST is not 0.  */
+  pool_item_t pool;
+  unsigned int pool_max_per_host;  /* Max. idle connections per host.  */
+  unsigned int pool_idle_timeout;  /* Seconds to keep a connection.  */
 };
 
 
@@ -265,6 +302,7 @@ struct http_context_s
   my_socket_t sock;
   unsigned int in_data:1;
   unsigned int is_http_0_9:1;
+  unsigned int reused:1;  /* SOCK has been taken from the pool.  */
   estream_t fp_read;
   estream_t fp_write;
   void *write_cookie;
@@ -276,6 +314,7 @@ struct http_context_s
   size_t buffer_size;
   unsigned int flags;
   header_t headers;      /* Received headers. */
+  char *pool_key;        /* NULL or the key for the connection pool. */
 };
 
 
@@ -351,6 +390,9 @@ _my_socket_new (int lnr, int fd)
     }
   so->fd = fd;
   so->refcount = 1;
+#ifdef USE_TLS
+  so->tls_session = NULL;
+#endif /*USE_TLS*/
   /* log_debug ("http.c:socket_new(%d): object %p for fd %d created\n", */
   /*            lnr, so, so->fd); */
   (void)lnr;
@@ -372,8 +414,8 @@ _my_socket_ref (int lnr, my_socket_t so)
 
 
 /* Bump down the reference counter for the socket object SO.  If SO
-   has no more references, close the socket and release the
-   object.  */
+   has no more references, call PRECLOSE, close the socket and release
+   the object along with its TLS session.  */
 static void
 _my_socket_unref (int lnr, my_socket_t so,
                   void (*preclose)(void*), void *preclosearg)
@@ -388,6 +430,12 @@ _my_socket_unref (int lnr, my_socket_t so,
         {
           if (preclose)
             preclose (preclosearg);
+#if HTTP_USE_NTBTLS
+          ntbtls_release (so->tls_session);
+#elif HTTP_USE_GNUTLS
+          if (so->tls_session)
+            gnutls_deinit (so->tls_session);
+#endif /*HTTP_USE_GNUTLS*/
           sock_close (so->fd);
           xfree (so);
         }
@@ -530,14 +578,18 @@ session_unref (int lnr, http_session_t sess)
   if (sess->refcount)
     return;
 
-#ifdef USE_TLS
-# ifdef HTTP_USE_GNUTLS
-  if (sess->tls_session)
+  while (sess->pool)
     {
-      my_socket_t sock = gnutls_transport_get_ptr (sess->tls_session);
-      my_socket_unref (sock, NULL, NULL);
-      gnutls_deinit (sess->tls_session);
+      pool_item_t tmp = sess->pool->next;
+      my_socket_unref (sess->pool->sock, NULL, NULL);
+      xfree (sess->pool);
+      sess->pool = tmp;
     }
+
+#ifdef USE_TLS
+# ifdef HTTP_USE_GNUTLS
+  if (sess->priority_cache)
+    gnutls_priority_deinit (sess->priority_cache);
   if (sess->certcred)
     gnutls_certificate_free_credentials (sess->certcred);
 # endif /*HTTP_USE_GNUTLS*/
@@ -555,8 +607,10 @@ http_session_release (http_session_t sess)
 }
 
 
-/* Create a new session object which is currently used to enable TLS
-   support.  It may eventually allow reusing existing connections.  */
+/* Create a new session object which is used to enable TLS support and
+   to reuse existing connections.  Each connection gets its own TLS
+   session; thus a session may be used by several requests at the
+   same time.  */
 gpg_error_t
 http_session_new (http_session_t *r_session, const char *tls_priority)
 {
@@ -573,13 +627,6 @@ http_session_new (http_session_t *r_session, const char *tls_priority)
 #if HTTP_USE_NTBTLS
   {
     (void)tls_priority;
-
-    err = ntbtls_new (&sess->tls_session, NTBTLS_CLIENT);
-    if (err)
-      {
-        log_error ("ntbtls_new failed: %s\n", gpg_strerror (err));
-        goto leave;
-      }
   }
 #elif HTTP_USE_GNUTLS
   {
@@ -606,36 +653,16 @@ http_session_new (http_session_t *r_session, const char *tls_priority)
                     sl->d, gnutls_strerror (rc));
       }
 
-    rc = gnutls_init (&sess->tls_session, GNUTLS_CLIENT);
+    rc = gnutls_priority_init (&sess->priority_cache,
+                               tls_priority? tls_priority : "NORMAL",
+                               &errpos);
     if (rc < 0)
       {
-        log_error ("gnutls_init failed: %s\n", gnutls_strerror (rc));
-        err = gpg_error (GPG_ERR_GENERAL);
-        goto leave;
-      }
-    /* A new session has the transport ptr set to (void*(-1), we need
-       it to be NULL.  */
-    gnutls_transport_set_ptr (sess->tls_session, NULL);
-
-    rc = gnutls_priority_set_direct (sess->tls_session,
-                                     tls_priority? tls_priority : "NORMAL",
-                                     &errpos);
-    if (rc < 0)
-      {
-        log_error ("gnutls_priority_set_direct failed at '%s': %s\n",
+        log_error ("gnutls_priority_init failed at '%s': %s\n",
                    errpos, gnutls_strerror (rc));
         err = gpg_error (GPG_ERR_GENERAL);
         goto leave;
       }
-
-    rc = gnutls_credentials_set (sess->tls_session,
-                                 GNUTLS_CRD_CERTIFICATE, sess->certcred);
-    if (rc < 0)
-      {
-        log_error ("gnutls_credentials_set failed: %s\n", gnutls_strerror (rc));
-        err = gpg_error (GPG_ERR_GENERAL);
-        goto leave;
-      }
   }
 #else /*!HTTP_USE_GNUTLS*/
   {
@@ -646,9 +673,9 @@ http_session_new (http_session_t *r_session, const char *tls_priority)
   /* log_debug ("http.c:session_new: sess %p created\n", sess); */
   err = 0;
 
-#if USE_TLS
+#if HTTP_USE_GNUTLS
  leave:
-#endif /*USE_TLS*/
+#endif /*HTTP_USE_GNUTLS*/
   if (err)
     http_session_unref (sess);
   else
@@ -683,6 +710,137 @@ http_session_set_log_cb (http_session_t sess,
 }
 
 
+/* Enable the reuse of connections for session SESS.  Up to
+   MAX_PER_HOST idle connections to the same server are kept for
+   IDLE_TIMEOUT seconds after a response has been read completely.  A
+   MAX_PER_HOST of 0 disables the reuse and closes all idle
+   connections.  */
+void
+http_session_set_keepalive (http_session_t sess, unsigned int max_per_host,
+                            unsigned int idle_timeout)
+{
+  sess->pool_max_per_host = max_per_host;
+  sess->pool_idle_timeout = idle_timeout;
+  if (!max_per_host)
+    {
+      while (sess->pool)
+        {
+          pool_item_t tmp = sess->pool->next;
+          my_socket_unref (sess->pool->sock, NULL, NULL);
+          xfree (sess->pool);
+          sess->pool = tmp;
+        }
+    }
+}
+
+
+/* Return true if the idle connection SOCK has not been closed by the
+   server and has no unexpected data pending.  */
+static int
+idle_socket_is_usable (my_socket_t sock)
+{
+  int fd = sock->fd;
+  fd_set rfds;
+  struct timeval tv;
+
+#ifdef HTTP_USE_GNUTLS
+  if (sock->tls_session && gnutls_record_check_pending (sock->tls_session))
+    return 0;
+#endif /*HTTP_USE_GNUTLS*/
+#ifndef HAVE_W32_SYSTEM
+  if (fd >= FD_SETSIZE)
+    return 0;
+#endif
+  FD_ZERO (&rfds);
+  FD_SET (fd, &rfds);
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  /* A readable socket indicates EOF or garbage.  Note that we do not
+     use npth_select because this never blocks.  */
+  return !select (fd + 1, &rfds, NULL, NULL, &tv);
+}
+
+
+/* Remove the expired connections from the pool of SESS.  If KEY is not
+   NULL return the first usable connection for KEY and remove it from
+   the pool.  */
+static my_socket_t
+session_pool_get (http_session_t sess, const char *key)
+{
+  pool_item_t item, prev, next;
+  my_socket_t sock = NULL;
+  time_t now = gnupg_get_time ();
+
+  for (prev=NULL, item=sess->pool; item; item=next)
+    {
+      next = item->next;
+      if (item->since + sess->pool_idle_timeout >= now
+          && (!key || sock || strcmp (item->key, key)))
+        {
+          prev = item;
+          continue;
+        }
+
+      /* Either expired or a candidate for KEY.  */
+      if (prev)
+        prev->next = next;
+      else
+        sess->pool = next;
+      if (item->since + sess->pool_idle_timeout >= now
+          && idle_socket_is_usable (item->sock))
+        sock = item->sock;
+      else
+        my_socket_unref (item->sock, NULL, NULL);
+      xfree (item);
+    }
+
+  return sock;
+}
+
+
+/* Close all connections in the pool of SESS which have been idle for
+   too long.  Without this they are only closed by the next request
+   using SESS.  */
+void
+http_session_expire_idle (http_session_t sess)
+{
+  if (sess && sess->pool)
+    session_pool_get (sess, NULL);
+}
+
+
+/* Put the connection SOCK for KEY into the pool of SESS.  This takes
+   over the reference to SOCK.  */
+static void
+session_pool_put (http_session_t sess, const char *key, my_socket_t sock)
+{
+  pool_item_t item;
+  unsigned int count;
+
+  session_pool_get (sess, NULL);
+  for (count=0, item=sess->pool; item; item = item->next)
+    if (!strcmp (item->key, key))
+      count++;
+  if (count >= sess->pool_max_per_host)
+    {
+      my_socket_unref (sock, NULL, NULL);
+      return;
+    }
+
+  item = xtrymalloc (sizeof *item + strlen (key));
+  if (!item)
+    {
+      my_socket_unref (sock, NULL, NULL);
+      return;
+    }
+  strcpy (item->key, key);
+  item->sock = sock;
+  item->since = gnupg_get_time ();
+  item->next = sess->pool;
+  sess->pool = item;
+}
+
+
 
 
 /* Start a HTTP retrieval and on success store at R_HD a context
@@ -723,6 +881,7 @@ http_open (http_t *r_hd, http_req_t reqtype, const char *url,
       if (hd->fp_write)
         es_fclose (hd->fp_write);
       http_session_unref (hd->session);
+      xfree (hd->pool_key);
       xfree (hd);
     }
   else
@@ -953,10 +1112,28 @@ http_close (http_t hd, int keep_read_stream)
       hd->headers = tmp;
     }
   xfree (hd->buffer);
+  xfree (hd->pool_key);
   xfree (hd);
 }
 
 
+/* Return true if the connection of HD has been taken from the pool of
+   idle connections and nothing has yet been received from the server.
+   If the request failed in this state, the server has most likely
+   closed the idle connection and the request may be sent again using
+   HTTP_FLAG_NO_REUSE.  */
+int
+http_may_retry (http_t hd)
+{
+  cookie_t cookie;
+
+  if (!hd || !hd->reused)
+    return 0;
+  cookie = hd->read_cookie;
+  return !cookie || !cookie->nread;
+}
+
+
 estream_t
 http_get_read_ptr (http_t hd)
 {
@@ -1392,6 +1569,184 @@ parse_tuple (char *string)
 }
 
 
+/* Set HD->SOCK to a connection to SERVER at PORT.  If the session of
+   HD keeps connections alive an idle connection to the same server is
+   reused unless HTTP_FLAG_NO_REUSE is set; HD->POOL_KEY is then set
+   to the key for the pool.  HTTPHOST is the name used to verify a TLS
+   connection or NULL.  */
+static gpg_error_t
+connect_or_reuse (http_t hd, const char *server, unsigned short port,
+                  const char *srvtag, const char *httphost)
+{
+  int sock;
+  int hnf;
+
+  if (hd->session && hd->session->pool_max_per_host
+      && !(hd->flags & HTTP_FLAG_SHUTDOWN))
+    {
+      /* A TLS connection has been set up for the host of the URL and
+         verified for HTTPHOST; it may only be reused for the same
+         names.  */
+      hd->pool_key = xtryasprintf ("%s:%hu:%s:%u:%s:%s", server, port,
+                                   srvtag? srvtag : "",
+                                   (hd->flags & (HTTP_FLAG_IGNORE_IPv4
+                                                 | HTTP_FLAG_IGNORE_IPv6)),
+                                   hd->uri->use_tls? hd->uri->host : "",
+                                   hd->uri->use_tls && httphost? httphost:"");
+      if (!hd->pool_key)
+        return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+      if (!(hd->flags & HTTP_FLAG_NO_REUSE))
+        {
+          hd->sock = session_pool_get (hd->session, hd->pool_key);
+          if (hd->sock)
+            {
+              hd->reused = 1;
+              return 0;
+            }
+        }
+    }
+
+  sock = connect_server (server, port, hd->flags, srvtag, &hnf);
+  if (sock == -1)
+    return gpg_err_make (default_errsource,
+                         (hnf? GPG_ERR_UNKNOWN_HOST
+                             : gpg_err_code_from_syserror ()));
+  hd->sock = my_socket_new (sock);
+  if (!hd->sock)
+    return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+  return 0;
+}
+
+
+#ifdef USE_TLS
+/* Set up a TLS session on the new connection HD->SOCK to SERVER and
+   verify the server's certificate for HTTPHOST or, if that is NULL,
+   for SERVER.  The TLS session is owned by the socket object.  */
+static gpg_error_t
+start_tls (http_t hd, const char *server, const char *httphost)
+{
+  http_session_t sess = hd->session;
+  my_socket_t sock = hd->sock;
+  gpg_error_t err;
+
+# if HTTP_USE_NTBTLS
+  err = ntbtls_new (&sock->tls_session, NTBTLS_CLIENT);
+  if (err)
+    {
+      log_error ("ntbtls_new failed: %s\n", gpg_strerror (err));
+      sock->tls_session = NULL;
+      return err;
+    }
+
+  err = ntbtls_set_hostname (sock->tls_session, server);
+  if (err)
+    {
+      log_info ("ntbtls_set_hostname failed: %s\n", gpg_strerror (err));
+      return err;
+    }
+
+  while ((err = ntbtls_handshake (sock->tls_session)))
+    {
+      switch (err)
+        {
+        default:
+          log_info ("TLS handshake failed: %s <%s>\n",
+                    gpg_strerror (err), gpg_strsource (err));
+          return err;
+        }
+    }
+# elif HTTP_USE_GNUTLS
+  int rc;
+
+  rc = gnutls_init (&sock->tls_session, GNUTLS_CLIENT);
+  if (rc < 0)
+    {
+      log_error ("gnutls_init failed: %s\n", gnutls_strerror (rc));
+      sock->tls_session = NULL;
+      return gpg_err_make (default_errsource, GPG_ERR_GENERAL);
+    }
+
+  rc = gnutls_priority_set (sock->tls_session, sess->priority_cache);
+  if (rc < 0)
+    {
+      log_error ("gnutls_priority_set failed: %s\n", gnutls_strerror (rc));
+      return gpg_err_make (default_errsource, GPG_ERR_GENERAL);
+    }
+
+  rc = gnutls_credentials_set (sock->tls_session,
+                               GNUTLS_CRD_CERTIFICATE, sess->certcred);
+  if (rc < 0)
+    {
+      log_error ("gnutls_credentials_set failed: %s\n", gnutls_strerror (rc));
+      return gpg_err_make (default_errsource, GPG_ERR_GENERAL);
+    }
+
+  /* Try to use SNI.  */
+  rc = gnutls_server_name_set (sock->tls_session, GNUTLS_NAME_DNS,
+                               server, strlen (server));
+  if (rc < 0)
+    log_info ("gnutls_server_name_set failed: %s\n", gnutls_strerror (rc));
+
+  /* The socket object owns the TLS session; thus the transport
+     pointer does not take a reference.  */
+  gnutls_transport_set_ptr (sock->tls_session, sock);
+#ifdef USE_NPTH
+  gnutls_transport_set_pull_function (sock->tls_session, my_npth_read);
+  gnutls_transport_set_push_function (sock->tls_session, my_npth_write);
+#endif
+
+  do
+    {
+      rc = gnutls_handshake (sock->tls_session);
+    }
+  while (rc == GNUTLS_E_INTERRUPTED || rc == GNUTLS_E_AGAIN);
+  if (rc < 0)
+    {
+      if (rc == GNUTLS_E_WARNING_ALERT_RECEIVED
+          || rc == GNUTLS_E_FATAL_ALERT_RECEIVED)
+        {
+          gnutls_alert_description_t alertno;
+          const char *alertstr;
+
+          alertno = gnutls_alert_get (sock->tls_session);
+          alertstr = gnutls_alert_get_name (alertno);
+          log_info ("TLS handshake failed: %s (alert %d)\n",
+                    alertstr, (int)alertno);
+          if (alertno == GNUTLS_A_UNRECOGNIZED_NAME && server)
+            log_info ("  (sent server name '%s')\n", server);
+        }
+      else
+        log_info ("TLS handshake failed: %s\n", gnutls_strerror (rc));
+      return gpg_err_make (default_errsource, GPG_ERR_NETWORK);
+    }
+# endif /*HTTP_USE_GNUTLS*/
+
+  /* SESS may be used by other connections at the same time.  Its TLS
+     session and server name are thus only set for the verification,
+     which does not switch threads.  */
+  xfree (sess->servername);
+  sess->servername = xtrystrdup (httphost? httphost : server);
+  if (!sess->servername)
+    return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+  sess->tls_session = sock->tls_session;
+  sess->verify.done = 0;
+  if (tls_callback)
+    err = tls_callback (hd, sess, 0);
+  else
+    err = http_verify_server_credentials (sess);
+  sess->tls_session = NULL;
+  if (err)
+    {
+      log_info ("TLS connection authentication failed: %s <%s>\n",
+                gpg_strerror (err), gpg_strsource (err));
+      return err;
+    }
+
+  return 0;
+}
+#endif /*USE_TLS*/
+
+
 /*
  * Send a HTTP request to the server
  * Returns 0 if the request was successful
@@ -1407,65 +1762,22 @@ send_request (http_t hd, const char *httphost, const char *auth,
   const char *http_proxy = NULL;
   char *proxy_authstr = NULL;
   char *authstr = NULL;
-  int sock;
-  int hnf;
 
   if (hd->uri->use_tls && !hd->session)
     {
       log_error ("TLS requested but no session object provided\n");
       return gpg_err_make (default_errsource, GPG_ERR_INTERNAL);
     }
-#ifdef USE_TLS
-  if (hd->uri->use_tls && !hd->session->tls_session)
-    {
-      log_error ("TLS requested but no GNUTLS context available\n");
-      return gpg_err_make (default_errsource, GPG_ERR_INTERNAL);
-    }
-#endif /*USE_TLS*/
 
   server = *hd->uri->host ? hd->uri->host : "localhost";
   port = hd->uri->port ? hd->uri->port : 80;
 
-  /* Try to use SNI.  */
-#ifdef USE_TLS
-  if (hd->uri->use_tls)
-    {
-# if HTTP_USE_GNUTLS
-      int rc;
-# endif
-
-      xfree (hd->session->servername);
-      hd->session->servername = xtrystrdup (httphost? httphost : server);
-      if (!hd->session->servername)
-        {
-          err = gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
-          return err;
-        }
-
-# if HTTP_USE_NTBTLS
-      err = ntbtls_set_hostname (hd->session->tls_session, server);
-      if (err)
-        {
-          log_info ("ntbtls_set_hostname failed: %s\n", gpg_strerror (err));
-          return err;
-        }
-# elif HTTP_USE_GNUTLS
-      rc = gnutls_server_name_set (hd->session->tls_session,
-                                   GNUTLS_NAME_DNS,
-                                   server, strlen (server));
-      if (rc < 0)
-        log_info ("gnutls_server_name_set failed: %s\n", gnutls_strerror (rc));
-# endif /*HTTP_USE_GNUTLS*/
-    }
-#endif /*USE_TLS*/
-
   if ( (proxy && *proxy)
        || ( (hd->flags & HTTP_FLAG_TRY_PROXY)
             && (http_proxy = getenv (HTTP_PROXY_ENV))
             && *http_proxy ))
     {
       parsed_uri_t uri;
-      int save_errno;
 
       if (proxy)
 	http_proxy = proxy;
@@ -1494,119 +1806,35 @@ send_request (http_t hd, const char *httphost, const char *auth,
             }
         }
 
-      sock = connect_server (*uri->host ? uri->host : "localhost",
-                             uri->port ? uri->port : 80,
-                             hd->flags, srvtag, &hnf);
-      save_errno = errno;
+      err = connect_or_reuse (hd, *uri->host ? uri->host : "localhost",
+                              uri->port ? uri->port : 80, srvtag, httphost);
       http_release_parsed_uri (uri);
-      if (sock == -1)
-        gpg_err_set_errno (save_errno);
     }
   else
     {
-      sock = connect_server (server, port, hd->flags, srvtag, &hnf);
+      err = connect_or_reuse (hd, server, port, srvtag, httphost);
     }
 
-  if (sock == -1)
-    {
-      xfree (proxy_authstr);
-      return gpg_err_make (default_errsource,
-                           (hnf? GPG_ERR_UNKNOWN_HOST
-                               : gpg_err_code_from_syserror ()));
-    }
-  hd->sock = my_socket_new (sock);
-  if (!hd->sock)
+  if (err)
     {
       xfree (proxy_authstr);
-      return gpg_err_make (default_errsource, gpg_err_code_from_syserror ());
+      return err;
     }
 
 
 
-#if HTTP_USE_NTBTLS
-  if (hd->uri->use_tls)
-    {
-      my_socket_ref (hd->sock);
-
-      while ((err = ntbtls_handshake (hd->session->tls_session)))
-        {
-          switch (err)
-            {
-            default:
-              log_info ("TLS handshake failed: %s <%s>\n",
-                        gpg_strerror (err), gpg_strsource (err));
-              xfree (proxy_authstr);
-              return err;
-            }
-        }
-
-      hd->session->verify.done = 0;
-      if (tls_callback)
-        err = tls_callback (hd, hd->session, 0);
-      else
-        err = http_verify_server_credentials (hd->session);
-      if (err)
-        {
-          log_info ("TLS connection authentication failed: %s <%s>\n",
-                    gpg_strerror (err), gpg_strsource (err));
-          xfree (proxy_authstr);
-          return err;
-        }
-    }
-#elif HTTP_USE_GNUTLS
-  if (hd->uri->use_tls)
+#ifdef USE_TLS
+  /* A connection taken from the pool has already been verified.  */
+  if (hd->uri->use_tls && !hd->reused)
     {
-      int rc;
-
-      my_socket_ref (hd->sock);
-      gnutls_transport_set_ptr (hd->session->tls_session, hd->sock);
-#ifdef USE_NPTH
-      gnutls_transport_set_pull_function (hd->session->tls_session,
-                                          my_npth_read);
-      gnutls_transport_set_push_function (hd->session->tls_session,
-                                          my_npth_write);
-#endif
-
-      do
-        {
-          rc = gnutls_handshake (hd->session->tls_session);
-        }
-      while (rc == GNUTLS_E_INTERRUPTED || rc == GNUTLS_E_AGAIN);
-      if (rc < 0)
-        {
-          if (rc == GNUTLS_E_WARNING_ALERT_RECEIVED
-              || rc == GNUTLS_E_FATAL_ALERT_RECEIVED)
-            {
-              gnutls_alert_description_t alertno;
-              const char *alertstr;
-
-              alertno = gnutls_alert_get (hd->session->tls_session);
-              alertstr = gnutls_alert_get_name (alertno);
-              log_info ("TLS handshake failed: %s (alert %d)\n",
-                        alertstr, (int)alertno);
-              if (alertno == GNUTLS_A_UNRECOGNIZED_NAME && server)
-                log_info ("  (sent server name '%s')\n", server);
-            }
-          else
-            log_info ("TLS handshake failed: %s\n", gnutls_strerror (rc));
-          xfree (proxy_authstr);
-          return gpg_err_make (default_errsource, GPG_ERR_NETWORK);
-        }
-
-      hd->session->verify.done = 0;
-      if (tls_callback)
-        err = tls_callback (hd, hd->session, 0);
-      else
-        err = http_verify_server_credentials (hd->session);
+      err = start_tls (hd, server, httphost);
       if (err)
         {
-          log_info ("TLS connection authentication failed: %s\n",
-                    gpg_strerror (err));
           xfree (proxy_authstr);
           return err;
         }
     }
-#endif /*HTTP_USE_GNUTLS*/
+#endif /*USE_TLS*/
 
   if (auth || hd->uri->auth)
     {
@@ -1648,7 +1876,7 @@ send_request (http_t hd, const char *httphost, const char *auth,
   if (http_proxy && *http_proxy)
     {
       request = es_bsprintf
-        ("%s %s://%s:%hu%s%s HTTP/1.0\r\n%s%s",
+        ("%s %s://%s:%hu%s%s HTTP/1.0\r\n%s%s%s",
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" : "OOPS",
@@ -1656,7 +1884,8 @@ send_request (http_t hd, const char *httphost, const char *auth,
          httphost? httphost : server,
          port, *p == '/' ? "" : "/", p,
          authstr ? authstr : "",
-         proxy_authstr ? proxy_authstr : "");
+         proxy_authstr ? proxy_authstr : "",
+         hd->pool_key? "Proxy-Connection: keep-alive\r\n" : "");
     }
   else
     {
@@ -1668,14 +1897,15 @@ send_request (http_t hd, const char *httphost, const char *auth,
         snprintf (portstr, sizeof portstr, ":%u", port);
 
       request = es_bsprintf
-        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s",
+        ("%s %s%s HTTP/1.0\r\nHost: %s%s\r\n%s%s",
          hd->req_type == HTTP_REQ_GET ? "GET" :
          hd->req_type == HTTP_REQ_HEAD ? "HEAD" :
          hd->req_type == HTTP_REQ_POST ? "POST" : "OOPS",
          *p == '/' ? "" : "/", p,
          httphost? httphost : server,
          portstr,
-         authstr? authstr:"");
+         authstr? authstr:"",
+         hd->pool_key? "Connection: keep-alive\r\n" : "");
     }
   xfree (p);
   if (!request)
@@ -1948,6 +2178,9 @@ parse_response (http_t hd)
   size_t maxlen, len;
   cookie_t cookie = hd->read_cookie;
   const char *s;
+  longcounter_t hdrlen = 0;
+  int truncated = 0;
+  int http_1_1 = 0;
 
   /* Delete old header lines.  */
   while (hd->headers)
@@ -1970,6 +2203,7 @@ parse_response (http_t hd)
 	return GPG_ERR_TRUNCATED; /* Line has been truncated. */
       if (!len)
 	return GPG_ERR_EOF;
+      hdrlen += len;
 
       if ((hd->flags & HTTP_FLAG_LOG_RESP))
         log_info ("RESP: '%.*s'\n",
@@ -1989,6 +2223,7 @@ parse_response (http_t hd)
     }
   if (!p2)
     return 0; /* Also assume http 0.9. */
+  http_1_1 = !strcmp (p, "1.1");
   p = p2;
   /* TODO: Add HTTP version number check. */
   if ((p2 = strpbrk (p, " \t")))
@@ -2014,6 +2249,9 @@ parse_response (http_t hd)
       /* Note, that we can silently ignore truncated lines. */
       if (!len)
 	return GPG_ERR_EOF;
+      if (!maxlen)
+        truncated = 1;
+      hdrlen += len;
       /* Trim line endings of empty lines. */
       if ((*line == '\r' && line[1] == '\n') || *line == '\n')
 	*line = 0;
@@ -2040,6 +2278,36 @@ parse_response (http_t hd)
         }
     }
 
+  /* If we asked for a persistent connection we need to take care of
+     the content already buffered by estream; the server won't close
+     the connection to indicate the end of the content.  */
+  if (hd->pool_key && cookie->content_length_valid)
+    {
+      longcounter_t buffered = cookie->nread - hdrlen;
+
+      if (truncated)
+        cookie->content_length_valid = 0;  /* Can't tell.  */
+      else if (buffered > cookie->content_length)
+        cookie->content_length = 0;
+      else
+        {
+          cookie->content_length -= buffered;
+          s = http_get_header (hd, "Connection");
+          if (http_1_1)
+            cookie->keep_alive = !(s && !ascii_strcasecmp (s, "close"));
+          else
+            cookie->keep_alive = (s && !ascii_strcasecmp (s, "keep-alive"));
+          if (http_get_header (hd, "Transfer-Encoding"))
+            cookie->keep_alive = 0;
+          if (cookie->keep_alive)
+            {
+              cookie->pool_key = xtrystrdup (hd->pool_key);
+              if (!cookie->pool_key)
+                cookie->keep_alive = 0;
+            }
+        }
+    }
+
   return 0;
 }
 
@@ -2404,10 +2672,10 @@ cookie_read (void *cookie, void *buffer, size_t size)
     }
 
 #ifdef HTTP_USE_GNUTLS
-  if (c->use_tls && c->session && c->session->tls_session)
+  if (c->use_tls && c->sock->tls_session)
     {
     again:
-      nread = gnutls_record_recv (c->session->tls_session, buffer, size);
+      nread = gnutls_record_recv (c->sock->tls_session, buffer, size);
       if (nread < 0)
         {
           if (nread == GNUTLS_E_INTERRUPTED)
@@ -2456,6 +2724,9 @@ cookie_read (void *cookie, void *buffer, size_t size)
       while (nread == -1 && errno == EINTR);
     }
 
+  if (nread > 0)
+    c->nread += nread;
+
   if (c->content_length_valid && nread > 0)
     {
       if (nread < c->content_length)
@@ -2476,12 +2747,12 @@ cookie_write (void *cookie, const void *buffer_arg, size_t size)
   int nwritten = 0;
 
 #ifdef HTTP_USE_GNUTLS
-  if (c->use_tls && c->session && c->session->tls_session)
+  if (c->use_tls && c->sock->tls_session)
     {
       int nleft = size;
       while (nleft > 0)
         {
-          nwritten = gnutls_record_send (c->session->tls_session,
+          nwritten = gnutls_record_send (c->sock->tls_session,
                                          buffer, nleft);
           if (nwritten <= 0)
             {
@@ -2554,14 +2825,21 @@ cookie_close (void *cookie)
   if (!c)
     return 0;
 
+  /* Keep the connection if the entire content has been read.  */
+  if (c->keep_alive && c->sock && c->session
+      && c->content_length_valid && !c->content_length)
+    session_pool_put (c->session, c->pool_key, c->sock);
+  else
 #ifdef HTTP_USE_GNUTLS
-  if (c->use_tls && c->session && c->session->tls_session)
-    my_socket_unref (c->sock, send_gnutls_bye, c->session->tls_session);
+  if (c->use_tls && c->sock && c->sock->tls_session)
+    my_socket_unref (c->sock, send_gnutls_bye, c->sock->tls_session);
   else
 #endif /*HTTP_USE_GNUTLS*/
     if (c->sock)
       my_socket_unref (c->sock, NULL, NULL);
 
+  xfree (c->pool_key);
+
   if (c->session)
     http_session_unref (c->session);
   xfree (c);
@@ -79,7 +79,8 @@ enum
     HTTP_FLAG_FORCE_TLS = 16,    /* Force the use opf TLS.  */
     HTTP_FLAG_IGNORE_CL = 32,    /* Ignore content-length.  */
     HTTP_FLAG_IGNORE_IPv4 = 64,  /* Do not use IPv4.  */
-    HTTP_FLAG_IGNORE_IPv6 = 128  /* Do not use IPv6.  */
+    HTTP_FLAG_IGNORE_IPv6 = 128, /* Do not use IPv6.  */
+    HTTP_FLAG_NO_REUSE = 256     /* Do not use an idle connection.  */
   };
 
 
@@ -101,6 +102,10 @@ void http_session_set_log_cb (http_session_t sess,
                               void (*cb)(http_session_t, gpg_error_t,
                                          const char *,
                                          const void **, size_t *));
+void http_session_set_keepalive (http_session_t sess,
+                                 unsigned int max_per_host,
+                                 unsigned int idle_timeout);
+void http_session_expire_idle (http_session_t sess);
 
 
 gpg_error_t http_parse_uri (parsed_uri_t *ret_uri, const char *uri,
@@ -128,6 +133,8 @@ gpg_error_t http_wait_response (http_t hd);
 
 void http_close (http_t hd, int keep_read_stream);
 
+int http_may_retry (http_t hd);
+
 gpg_error_t http_open_document (http_t *r_hd,
                                 const char *document,
                                 const char *auth,
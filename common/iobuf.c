@@ -63,6 +63,11 @@
    test "armored_key_8192" in armor.test! */
 #define IOBUF_BUFFER_SIZE  8192
 
+/* The limits for buffer sizes set with
+   iobuf_set_default_buffer_size.  */
+#define IOBUF_MIN_BUFFER_SIZE  1024
+#define IOBUF_MAX_BUFFER_SIZE  (1024*1024)
+
 /* To avoid a potential DoS with compression packets we better limit
    the number of filters in a chain.  */
 #define MAX_NESTING_FILTER 64
@@ -70,6 +75,10 @@
 /*-- End configurable part.  --*/
 
 
+/* The buffer size used for newly opened file and fd iobufs.  */
+static size_t default_buffer_size = IOBUF_BUFFER_SIZE;
+
+
 #ifdef HAVE_W32_SYSTEM
 # ifdef HAVE_W32CE_SYSTEM
 #  define FD_FOR_STDIN  (es_fileno (es_stdin))
@@ -1315,7 +1324,7 @@ iobuf_open (const char *fname)
     return iobuf_fdopen (translate_file_handle (fd, 0), "rb");
   else if ((fp = fd_cache_open (fname, "rb")) == GNUPG_INVALID_FD)
     return NULL;
-  a = iobuf_alloc (1, IOBUF_BUFFER_SIZE);
+  a = iobuf_alloc (1, default_buffer_size);
   fcx = xmalloc (sizeof *fcx + strlen (fname));
   fcx->fp = fp;
   fcx->print_only_name = print_only;
@@ -1344,7 +1353,7 @@ do_iobuf_fdopen (int fd, const char *mode, int keep_open)
 
   fp = INT2FD (fd);
 
-  a = iobuf_alloc (strchr (mode, 'w') ? 2 : 1, IOBUF_BUFFER_SIZE);
+  a = iobuf_alloc (strchr (mode, 'w') ? 2 : 1, default_buffer_size);
   fcx = xmalloc (sizeof *fcx + 20);
   fcx->fp = fp;
   fcx->print_only_name = 1;
@@ -1384,7 +1393,7 @@ iobuf_esopen (estream_t estream, const char *mode, int keep_open)
   file_es_filter_ctx_t *fcx;
   size_t len;
 
-  a = iobuf_alloc (strchr (mode, 'w') ? 2 : 1, IOBUF_BUFFER_SIZE);
+  a = iobuf_alloc (strchr (mode, 'w') ? 2 : 1, default_buffer_size);
   fcx = xtrymalloc (sizeof *fcx + 30);
   fcx->fp = estream;
   fcx->print_only_name = 1;
@@ -1409,7 +1418,7 @@ iobuf_sockopen (int fd, const char *mode)
   sock_filter_ctx_t *scx;
   size_t len;
 
-  a = iobuf_alloc (strchr (mode, 'w') ? 2 : 1, IOBUF_BUFFER_SIZE);
+  a = iobuf_alloc (strchr (mode, 'w') ? 2 : 1, default_buffer_size);
   scx = xmalloc (sizeof *scx + 25);
   scx->sock = fd;
   scx->print_only_name = 1;
@@ -1451,7 +1460,7 @@ iobuf_create (const char *fname, int mode700)
     return iobuf_fdopen (translate_file_handle (fd, 1), "wb");
   else if ((fp = direct_open (fname, "wb", mode700)) == GNUPG_INVALID_FD)
     return NULL;
-  a = iobuf_alloc (2, IOBUF_BUFFER_SIZE);
+  a = iobuf_alloc (2, default_buffer_size);
   fcx = xmalloc (sizeof *fcx + strlen (fname));
   fcx->fp = fp;
   fcx->print_only_name = print_only;
@@ -1482,7 +1491,7 @@ iobuf_openrw (const char *fname)
     return NULL;
   else if ((fp = direct_open (fname, "r+b", 0)) == GNUPG_INVALID_FD)
     return NULL;
-  a = iobuf_alloc (2, IOBUF_BUFFER_SIZE);
+  a = iobuf_alloc (2, default_buffer_size);
   fcx = xmalloc (sizeof *fcx + strlen (fname));
   fcx->fp = fp;
   strcpy (fcx->fname, fname);
@@ -1962,21 +1971,42 @@ iobuf_read (iobuf_t a, void *buffer, unsigned int buflen)
 
   if (a->nlimit)
     {
-      /* Handle special cases. */
-      for (n = 0; n < buflen; n++)
+      /* Handle special cases.  This is the same as calling
+         iobuf_readbyte in a loop but copies as much of the buffer as
+         the limit allows at once.  Note that the limit is checked
+         again after each underflow because that may have popped a
+         filter and thus changed the limit.  */
+      for (n = 0; n < buflen; )
 	{
-	  if ((c = iobuf_readbyte (a)) == -1)
+	  if (a->nlimit && a->nbytes >= a->nlimit)
+	    break;		/* forced EOF */
+	  if (a->d.start < a->d.len)
 	    {
-	      if (!n)
-		return -1;	/* eof */
-	      break;
+	      size_t size = a->d.len - a->d.start;
+	      if (size > buflen - n)
+		size = buflen - n;
+	      if (a->nlimit && size > a->nlimit - a->nbytes)
+		size = a->nlimit - a->nbytes;
+	      if (buf)
+		{
+		  memcpy (buf, a->d.buf + a->d.start, size);
+		  buf += size;
+		}
+	      a->d.start += size;
+	      a->nbytes += size;
+	      n += size;
+	    }
+	  else if ((c = underflow (a)) == -1)
+	    break;		/* EOF */
+	  else
+	    {
+	      if (buf)
+		*buf++ = c;
+	      a->nbytes++;
+	      n++;
 	    }
-	  else if (buf)
-	    *buf = c;
-	  if (buf)
-	    buf++;
 	}
-      return n;
+      return n ? n : -1 /*EOF*/;
     }
 
   n = 0;
@@ -2040,6 +2070,53 @@ iobuf_peek (iobuf_t a, byte * buf, unsigned buflen)
 }
 
 
+/* Borrow the data currently buffered in A without copying it.  On
+   success a pointer to the data is stored at R_BUF and its length at
+   R_LEN; the buffer is refilled first if it is empty.  The returned
+   window honors a limit set with iobuf_set_limit.  Returns -1 on EOF
+   and 0 on success.  The data stays valid until the next operation
+   on A; the caller marks the bytes it used as read by calling
+   iobuf_consume.  */
+int
+iobuf_borrow (iobuf_t a, const byte **r_buf, size_t *r_len)
+{
+  size_t len;
+
+  *r_buf = NULL;
+  *r_len = 0;
+
+  if (a->nlimit && a->nbytes >= a->nlimit)
+    return -1;			/* forced EOF */
+
+  if (!(a->d.start < a->d.len))
+    {
+      if (underflow (a) == -1)
+	return -1;
+      /* And unget this character. */
+      assert (a->d.start == 1);
+      a->d.start = 0;
+    }
+
+  len = a->d.len - a->d.start;
+  if (a->nlimit && len > a->nlimit - a->nbytes)
+    len = a->nlimit - a->nbytes;
+  *r_buf = a->d.buf + a->d.start;
+  *r_len = len;
+  return 0;
+}
+
+
+/* Mark N bytes of the window returned by the last iobuf_borrow as
+   read.  */
+void
+iobuf_consume (iobuf_t a, size_t n)
+{
+  assert (n <= a->d.len - a->d.start);
+  a->d.start += n;
+  a->nbytes += n;
+}
+
+
 
 
 int
@@ -2163,6 +2240,26 @@ iobuf_set_limit (iobuf_t a, off_t nlimit)
 }
 
 
+/* Set the buffer size used for file and fd iobufs opened from now
+   on.  Returns the previous size.  A SIZE of 0 only queries the
+   current value; out of range values are clamped.  */
+size_t
+iobuf_set_default_buffer_size (size_t size)
+{
+  size_t old = default_buffer_size;
+
+  if (size)
+    {
+      if (size < IOBUF_MIN_BUFFER_SIZE)
+        size = IOBUF_MIN_BUFFER_SIZE;
+      else if (size > IOBUF_MAX_BUFFER_SIZE)
+        size = IOBUF_MAX_BUFFER_SIZE;
+      default_buffer_size = size;
+    }
+  return old;
+}
+
+
 
 /* Return the length of an open file A.  IF OVERFLOW is not NULL it
    will be set to true if the file is larger than what off_t can cope
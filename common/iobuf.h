@@ -134,6 +134,7 @@ void iobuf_clear_eof (iobuf_t a);
 #define iobuf_error(a)	      ((a)->error)
 
 void iobuf_set_limit (iobuf_t a, off_t nlimit);
+size_t iobuf_set_default_buffer_size (size_t size);
 
 off_t iobuf_tell (iobuf_t a);
 int iobuf_seek (iobuf_t a, off_t newpos);
@@ -144,6 +145,8 @@ void iobuf_unread (iobuf_t a, const unsigned char *buf, unsigned int buflen);
 unsigned iobuf_read_line (iobuf_t a, byte ** addr_of_buffer,
 			  unsigned *length_of_buffer, unsigned *max_length);
 int iobuf_peek (iobuf_t a, byte * buf, unsigned buflen);
+int iobuf_borrow (iobuf_t a, const byte **r_buf, size_t *r_len);
+void iobuf_consume (iobuf_t a, size_t n);
 int iobuf_writebyte (iobuf_t a, unsigned c);
 int iobuf_write (iobuf_t a, const void *buf, unsigned buflen);
 int iobuf_writestr (iobuf_t a, const char *buf);
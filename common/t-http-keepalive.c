@@ -0,0 +1,622 @@
+/* t-http-keepalive.c - Module tests for the connection pool of http.c
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The tests run a tiny HTTP server in a child process which counts
+   the connections it accepted.  The server understands these paths:
+
+     /count  Return the number of accepted connections.
+     /open   Return the number of open connections.
+     /hangup Close the connection without a response.
+     /close  Return a short body and close the connection.
+     /drop   Return a short body announcing keep-alive but close the
+             connection anyway.
+     /big    Return a body larger than the stream buffers.
+     /quit   Terminate the server.
+
+   All other paths return a short body.  The connection is kept open
+   if the client asked for it.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+#include "membuf.h"
+#include "http.h"
+
+#define pass()  do { ; } while(0)
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                     errcount++;                                 \
+                   } while(0)
+
+#define BIG_BODY_SIZE 50000
+#define MAX_CLIENTS   16
+
+static int errcount;
+static unsigned short server_port;
+static pid_t server_pid;
+
+
+
+/* Send the response to REQUEST over FD.  Returns true if the
+   connection shall be closed.  */
+static int
+server_respond (int fd, const char *request, unsigned int nconn,
+                unsigned int nopen)
+{
+  char path[64];
+  char body[64];
+  char head[256];
+  const char *data = body;
+  size_t datalen;
+  int close_it = 0;
+  char *big = NULL;
+
+  if (sscanf (request, "%*s %63s", path) != 1)
+    strcpy (path, "/");
+
+  if (!strcmp (path, "/quit"))
+    exit (0);
+  if (!strcmp (path, "/hangup"))
+    return 1;
+
+  if (!strcmp (path, "/count"))
+    snprintf (body, sizeof body, "%u", nconn);
+  else if (!strcmp (path, "/open"))
+    snprintf (body, sizeof body, "%u", nopen);
+  else if (!strcmp (path, "/big"))
+    {
+      big = malloc (BIG_BODY_SIZE);
+      if (!big)
+        exit (1);
+      memset (big, 'x', BIG_BODY_SIZE);
+      data = big;
+    }
+  else
+    snprintf (body, sizeof body, "hello %s", path);
+  datalen = big? BIG_BODY_SIZE : strlen (body);
+
+  /* As an HTTP/1.0 server we keep the connection only on request.  */
+  if (!strcmp (path, "/close") || !strstr (request, "keep-alive\r\n"))
+    close_it = 1;
+
+  snprintf (head, sizeof head,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %u\r\n"
+            "Connection: %s\r\n"
+            "\r\n",
+            (unsigned int)datalen, close_it? "close":"keep-alive");
+
+  if (write (fd, head, strlen (head)) < 0)
+    {
+      free (big);
+      return 1;
+    }
+  while (datalen)
+    {
+      ssize_t n = write (fd, data, datalen);
+      if (n < 0)
+        {
+          close_it = 1;
+          break;
+        }
+      else
+        {
+          data += n;
+          datalen -= n;
+        }
+    }
+  free (big);
+
+  return close_it || !strcmp (path, "/drop");
+}
+
+
+/* The main loop of the server.  */
+static void
+server_loop (int lfd)
+{
+  struct {
+    int fd;
+    size_t len;
+    char buf[1024];
+  } clients[MAX_CLIENTS];
+  unsigned int nconn = 0;
+  unsigned int nopen = 0;
+  fd_set rfds;
+  int i, n, maxfd;
+  char *p;
+
+  for (i=0; i < MAX_CLIENTS; i++)
+    clients[i].fd = -1;
+
+  for (;;)
+    {
+      FD_ZERO (&rfds);
+      FD_SET (lfd, &rfds);
+      maxfd = lfd;
+      for (i=0; i < MAX_CLIENTS; i++)
+        if (clients[i].fd != -1)
+          {
+            FD_SET (clients[i].fd, &rfds);
+            if (clients[i].fd > maxfd)
+              maxfd = clients[i].fd;
+          }
+
+      if (select (maxfd+1, &rfds, NULL, NULL, NULL) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          exit (1);
+        }
+
+      if (FD_ISSET (lfd, &rfds))
+        {
+          int fd = accept (lfd, NULL, NULL);
+          if (fd != -1)
+            {
+              for (i=0; i < MAX_CLIENTS && clients[i].fd != -1; i++)
+                ;
+              if (i == MAX_CLIENTS)
+                close (fd);
+              else
+                {
+                  nconn++;
+                  nopen++;
+                  clients[i].fd = fd;
+                  clients[i].len = 0;
+                }
+            }
+        }
+
+      for (i=0; i < MAX_CLIENTS; i++)
+        {
+          if (clients[i].fd == -1 || !FD_ISSET (clients[i].fd, &rfds))
+            continue;
+          n = read (clients[i].fd, clients[i].buf + clients[i].len,
+                    sizeof clients[i].buf - clients[i].len - 1);
+          if (n <= 0)
+            {
+              close (clients[i].fd);
+              clients[i].fd = -1;
+              nopen--;
+              continue;
+            }
+          clients[i].len += n;
+          clients[i].buf[clients[i].len] = 0;
+
+          /* We only handle requests without a body.  */
+          while ((p = strstr (clients[i].buf, "\r\n\r\n")))
+            {
+              p += 4;
+              if (server_respond (clients[i].fd, clients[i].buf,
+                                  nconn, nopen))
+                {
+                  close (clients[i].fd);
+                  clients[i].fd = -1;
+                  nopen--;
+                  break;
+                }
+              clients[i].len -= p - clients[i].buf;
+              memmove (clients[i].buf, p, clients[i].len + 1);
+            }
+          if (clients[i].fd != -1 && clients[i].len >= sizeof clients[i].buf - 1)
+            {
+              close (clients[i].fd);
+              clients[i].fd = -1;
+              nopen--;
+            }
+        }
+    }
+}
+
+
+/* Start the server and set SERVER_PORT.  */
+static void
+start_server (void)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen;
+  int lfd;
+
+  lfd = socket (AF_INET, SOCK_STREAM, 0);
+  if (lfd == -1)
+    {
+      perror ("socket");
+      exit (77);
+    }
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  addrlen = sizeof addr;
+  if (bind (lfd, (struct sockaddr *)&addr, sizeof addr)
+      || listen (lfd, 5)
+      || getsockname (lfd, (struct sockaddr *)&addr, &addrlen))
+    {
+      perror ("bind");
+      close (lfd);
+      exit (77);
+    }
+  server_port = ntohs (addr.sin_port);
+
+  server_pid = fork ();
+  if (server_pid == (pid_t)(-1))
+    {
+      perror ("fork");
+      exit (1);
+    }
+  if (!server_pid)
+    {
+      server_loop (lfd);
+      exit (0);
+    }
+  close (lfd);
+}
+
+
+
+/* Get PATH from the server using SESSION.  If EXPECTED is not NULL
+   the body must match it.  If MAXREAD is not 0 only this many bytes
+   are read.  If KEEP_STREAM is set the read stream is closed only
+   after the HTTP context.  Returns the body as a malloced string or
+   NULL on error.  */
+static char *
+get (http_session_t session, const char *path, const char *expected,
+     size_t maxread, int keep_stream)
+{
+  gpg_error_t err;
+  http_t hd;
+  estream_t fp;
+  char url[100];
+  membuf_t mb;
+  char buffer[512];
+  size_t nread, total;
+  char *result;
+
+  snprintf (url, sizeof url, "http://127.0.0.1:%hu%s", server_port, path);
+  err = http_open_document (&hd, url, NULL, 0, NULL, session, NULL, NULL);
+  if (err)
+    {
+      fprintf (stderr, "GET %s failed: %s\n", path, gpg_strerror (err));
+      return NULL;
+    }
+  if (http_get_status_code (hd) != 200)
+    {
+      fprintf (stderr, "GET %s: status %u\n", path, http_get_status_code (hd));
+      http_close (hd, 0);
+      return NULL;
+    }
+
+  fp = http_get_read_ptr (hd);
+  if (keep_stream)
+    http_close (hd, 1);
+
+  init_membuf (&mb, 512);
+  total = 0;
+  while (!es_read (fp, buffer, sizeof buffer, &nread) && nread)
+    {
+      put_membuf (&mb, buffer, nread);
+      total += nread;
+      if (maxread && total >= maxread)
+        break;
+    }
+  put_membuf (&mb, "", 1);
+
+  if (keep_stream)
+    es_fclose (fp);
+  else
+    http_close (hd, 0);
+
+  result = get_membuf (&mb, NULL);
+  if (result && expected && strcmp (result, expected))
+    {
+      fprintf (stderr, "GET %s: unexpected body '%s'\n", path, result);
+      xfree (result);
+      result = NULL;
+    }
+  return result;
+}
+
+
+/* Return the number of connections accepted by the server or with
+   OPEN set the number of connections currently open.  */
+static int
+get_number (http_session_t session, int open)
+{
+  char *s;
+  int n;
+
+  s = get (session, open? "/open" : "/count", NULL, 0, 0);
+  if (!s)
+    return -1;
+  n = atoi (s);
+  xfree (s);
+  return n;
+}
+
+#define get_count(a)  get_number ((a), 0)
+#define get_open(a)   get_number ((a), 1)
+
+
+/* Do a GET which is expected to return "hello PATH".  */
+static int
+get_hello (http_session_t session, const char *path, int keep_stream)
+{
+  char expected[64];
+  char *s;
+
+  snprintf (expected, sizeof expected, "hello %s", path);
+  s = get (session, path, expected, 0, keep_stream);
+  xfree (s);
+  return !!s;
+}
+
+
+
+static void
+test_keepalive (void)
+{
+  http_session_t session;
+  int base, i;
+  char *s;
+
+  if (http_session_new (&session, NULL))
+    {
+      fail (0);
+      return;
+    }
+  http_session_set_keepalive (session, 2, 30);
+
+  /* All requests shall use the same connection.  */
+  base = get_count (session);
+  if (base < 1)
+    fail (1);
+  for (i=0; i < 5; i++)
+    if (!get_hello (session, "/a", 0))
+      fail (2);
+  if (get_count (session) != base)
+    fail (3);
+
+  /* Same for requests where the stream is closed after the HTTP
+     context.  */
+  for (i=0; i < 3; i++)
+    if (!get_hello (session, "/b", 1))
+      fail (4);
+  if (get_count (session) != base)
+    fail (5);
+
+  /* A body which does not fit into one read.  */
+  s = get (session, "/big", NULL, 0, 0);
+  if (!s || strlen (s) != BIG_BODY_SIZE)
+    fail (6);
+  xfree (s);
+  if (get_count (session) != base)
+    fail (7);
+
+  /* A connection closed by the server is not reused.  */
+  if (!get_hello (session, "/close", 0))
+    fail (8);
+  if (get_count (session) != base + 1)
+    fail (9);
+
+  /* A connection which the server closed while it was idle is
+     detected and not reused.  */
+  if (!get_hello (session, "/drop", 0))
+    fail (10);
+  if (get_count (session) != base + 2)
+    fail (11);
+
+  /* A connection with unread data is not reused.  */
+  s = get (session, "/big", NULL, 100, 0);
+  if (!s)
+    fail (12);
+  xfree (s);
+  if (get_count (session) != base + 3)
+    fail (13);
+
+  /* Disabling the pool closes the idle connections.  */
+  http_session_set_keepalive (session, 0, 0);
+  if (get_count (session) != base + 4)
+    fail (14);
+  if (get_count (session) != base + 5)
+    fail (15);
+
+  http_session_release (session);
+}
+
+
+static void
+test_idle_timeout (void)
+{
+  http_session_t session;
+  int base;
+
+  if (http_session_new (&session, NULL))
+    {
+      fail (0);
+      return;
+    }
+  http_session_set_keepalive (session, 2, 1);
+
+  base = get_count (session);
+  if (get_count (session) != base)
+    fail (1);
+  sleep (3);
+  if (get_count (session) != base + 1)
+    fail (2);
+
+  /* Expiring the idle connections closes them without a request.  */
+  if (get_open (session) != 1)
+    fail (3);
+  sleep (3);
+  http_session_expire_idle (session);
+  http_session_set_keepalive (session, 0, 0);
+  if (get_open (session) != 1)
+    fail (4);
+
+  http_session_release (session);
+}
+
+
+/* Send a request for PATH using SESSION and FLAGS.  Store at
+   R_MAY_RETRY whether the request may be retried.  */
+static gpg_error_t
+send_get (http_session_t session, const char *path, unsigned int flags,
+          int *r_may_retry)
+{
+  gpg_error_t err;
+  http_t hd;
+  char url[100];
+
+  *r_may_retry = 0;
+  snprintf (url, sizeof url, "http://127.0.0.1:%hu%s", server_port, path);
+  err = http_open (&hd, HTTP_REQ_GET, url, NULL, NULL, flags, NULL,
+                   session, NULL, NULL);
+  if (err)
+    return err;
+  err = http_wait_response (hd);
+  *r_may_retry = http_may_retry (hd);
+  http_close (hd, 0);
+  return err;
+}
+
+
+static void
+test_retry (void)
+{
+  http_session_t session;
+  int base, may_retry;
+
+  if (http_session_new (&session, NULL))
+    {
+      fail (0);
+      return;
+    }
+  http_session_set_keepalive (session, 2, 30);
+
+  /* A reused connection which fails before the response may be
+     retried.  */
+  base = get_count (session);
+  if (!send_get (session, "/hangup", 0, &may_retry) || !may_retry)
+    fail (1);
+
+  /* A new connection which fails may not be retried.  */
+  if (!send_get (session, "/hangup", 0, &may_retry) || may_retry)
+    fail (2);
+
+  /* Nor may a reused connection which received a response.  */
+  if (get_count (session) != base + 2)
+    fail (3);
+  if (send_get (session, "/a", 0, &may_retry) || may_retry)
+    fail (4);
+
+  /* HTTP_FLAG_NO_REUSE opens a new connection.  */
+  if (send_get (session, "/a", HTTP_FLAG_NO_REUSE, &may_retry))
+    fail (5);
+  if (get_count (session) != base + 3)
+    fail (6);
+
+  http_session_release (session);
+}
+
+
+static void
+test_no_keepalive (void)
+{
+  http_session_t session;
+  int base;
+
+  if (http_session_new (&session, NULL))
+    {
+      fail (0);
+      return;
+    }
+
+  base = get_count (session);
+  if (!get_hello (session, "/a", 0))
+    fail (1);
+  if (!get_hello (session, "/a", 1))
+    fail (2);
+  if (get_count (session) != base + 3)
+    fail (3);
+
+  http_session_release (session);
+}
+
+
+static void
+stop_server (void)
+{
+  http_session_t session;
+  char url[100];
+  http_t hd;
+
+  if (!http_session_new (&session, NULL))
+    {
+      snprintf (url, sizeof url, "http://127.0.0.1:%hu/quit", server_port);
+      if (!http_open_document (&hd, url, NULL, 0, NULL, session, NULL, NULL))
+        http_close (hd, 0);
+      http_session_release (session);
+    }
+  if (waitpid (server_pid, NULL, 0) == (pid_t)(-1))
+    kill (server_pid, SIGTERM);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  (void)argc;
+  (void)argv;
+
+  signal (SIGPIPE, SIG_IGN);
+  start_server ();
+
+  test_keepalive ();
+  test_idle_timeout ();
+  test_retry ();
+  test_no_keepalive ();
+
+  stop_server ();
+
+  return !!errcount;
+}
@@ -0,0 +1,201 @@
+/* t-iobuf.c - Module tests for iobuf.c
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "iobuf.h"
+
+#define pass()  do { ; } while(0)
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                     errcount++;                                 \
+                   } while(0)
+
+static int errcount;
+
+#define DATALEN 50000
+
+
+/* A filter which returns the bytes from DATA in odd sized chunks.  */
+struct chunk_filter_s
+{
+  const unsigned char *data;
+  size_t length;
+  size_t off;
+};
+
+static int
+chunk_filter (void *opaque, int control, iobuf_t chain,
+              byte *buf, size_t *ret_len)
+{
+  struct chunk_filter_s *cf = opaque;
+  size_t n;
+
+  (void)chain;
+
+  if (control == IOBUFCTRL_UNDERFLOW)
+    {
+      n = *ret_len;
+      if (n > 777)
+        n = 777;
+      if (n > cf->length - cf->off)
+        n = cf->length - cf->off;
+      memcpy (buf, cf->data + cf->off, n);
+      cf->off += n;
+      *ret_len = n;
+      return n? 0 : -1;
+    }
+  else if (control == IOBUFCTRL_DESC)
+    *(char**)buf = "chunk_filter";
+  return 0;
+}
+
+
+/* Read with a limit set and compare against iobuf_readbyte.  */
+static void
+test_read_limit (const unsigned char *data)
+{
+  iobuf_t a;
+  unsigned char buffer[1000];
+  size_t limits[] = { 1, 13, 999, 1000, 1001, 8192, 9000, DATALEN };
+  int i, n, c;
+  size_t off;
+
+  for (i=0; i < DIM (limits); i++)
+    {
+      a = iobuf_temp_with_content ((const char *)data, DATALEN);
+      iobuf_set_limit (a, limits[i]);
+      off = 0;
+      while ((n = iobuf_read (a, buffer, sizeof buffer)) != -1)
+        {
+          if (off + n > limits[i] || memcmp (buffer, data + off, n))
+            fail (i);
+          off += n;
+        }
+      if (off != limits[i])
+        fail (i);
+      /* Lifting the limit gives us the rest of the data.  */
+      iobuf_set_limit (a, 0);
+      if (limits[i] < DATALEN)
+        {
+          c = iobuf_readbyte (a);
+          if (c != data[off])
+            fail (i);
+        }
+      iobuf_close (a);
+    }
+}
+
+
+/* Read through a filter using iobuf_borrow.  */
+static void
+test_borrow (const unsigned char *data)
+{
+  struct chunk_filter_s cf;
+  iobuf_t a;
+  const byte *p;
+  size_t n, off;
+  int count;
+
+  memset (&cf, 0, sizeof cf);
+  cf.data = data;
+  cf.length = DATALEN;
+  a = iobuf_alloc (1, 8192);
+  iobuf_push_filter (a, chunk_filter, &cf);
+
+  off = 0;
+  count = 0;
+  while (!iobuf_borrow (a, &p, &n))
+    {
+      if (!n || n > 777 || off + n > DATALEN || memcmp (p, data + off, n))
+        fail (1);
+      /* Consume only parts of the window every other time.  */
+      if ((count++ & 1) && n > 1)
+        n /= 2;
+      iobuf_consume (a, n);
+      off += n;
+    }
+  if (off != DATALEN)
+    fail (2);
+  iobuf_close (a);
+
+  /* The window must not extend beyond the limit.  */
+  a = iobuf_temp_with_content ((const char *)data, DATALEN);
+  iobuf_set_limit (a, 100);
+  if (iobuf_borrow (a, &p, &n) || n != 100 || memcmp (p, data, 100))
+    fail (3);
+  iobuf_consume (a, 100);
+  if (iobuf_borrow (a, &p, &n) != -1)
+    fail (4);
+  if (iobuf_read (a, &count, 1) != -1)
+    fail (5);
+  iobuf_close (a);
+}
+
+
+/* The default size can be queried and is clamped to the limits.  */
+static void
+test_default_buffer_size (void)
+{
+  size_t old;
+
+  old = iobuf_set_default_buffer_size (0);
+  if (old != 8192)
+    fail (1);
+  iobuf_set_default_buffer_size (10);
+  if (iobuf_set_default_buffer_size (0) != 1024)
+    fail (2);
+  iobuf_set_default_buffer_size (old);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  unsigned char *data;
+  size_t i;
+
+  (void)argc;
+  (void)argv;
+
+  data = xmalloc (DATALEN);
+  for (i=0; i < DATALEN; i++)
+    data[i] = i ^ (i >> 8) ^ (i >> 13);
+
+  test_read_limit (data);
+  test_borrow (data);
+  test_default_buffer_size ();
+
+  xfree (data);
+  return !!errcount;
+}
@@ -0,0 +1,235 @@
+/* t-radix64.c - Module tests for radix64.c
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define pass()  do { ; } while(0)
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                     errcount++;                                 \
+                   } while(0)
+
+static int errcount;
+
+
+/* Fill BUFFER with LENGTH bytes of predictable data.  */
+static void
+fill_buffer (unsigned char *buffer, size_t length, unsigned int seed)
+{
+  for (; length; length--)
+    {
+      seed = seed * 1103515245 + 12345;
+      *buffer++ = seed >> 16;
+    }
+}
+
+
+/* Bit-wise reference implementation of the OpenPGP CRC-24.  */
+static u32
+crc24_reference (u32 crc, const unsigned char *buffer, size_t length)
+{
+  int i;
+
+  for (; length; buffer++, length--)
+    {
+      crc ^= (u32)*buffer << 16;
+      for (i=0; i < 8; i++)
+        {
+          crc <<= 1;
+          if ((crc & 0x1000000))
+            crc ^= 0x1864cfb;
+        }
+    }
+  return crc & 0x00ffffff;
+}
+
+
+static void
+test_crc24 (void)
+{
+  unsigned char buffer[200];
+  size_t len, off;
+  u32 crc;
+
+  /* The check value of CRC-24/OpenPGP.  */
+  if (radix64_crc24 (RADIX64_CRCINIT, "123456789", 9) != 0x21cf02)
+    fail (0);
+
+  fill_buffer (buffer, sizeof buffer, 42);
+  for (len=0; len <= sizeof buffer; len++)
+    if (radix64_crc24 (RADIX64_CRCINIT, buffer, len)
+        != crc24_reference (RADIX64_CRCINIT, buffer, len))
+      fail (1);
+
+  /* Chunked processing must give the same result.  */
+  for (off=0; off < 8; off++)
+    {
+      crc = radix64_crc24 (RADIX64_CRCINIT, buffer, off);
+      crc = radix64_crc24 (crc, buffer + off, sizeof buffer - off);
+      if (crc != crc24_reference (RADIX64_CRCINIT, buffer, sizeof buffer))
+        fail (2);
+    }
+}
+
+
+static void
+test_encode_decode (void)
+{
+  static struct {
+    const char *data;
+    const char *expected;
+  } tests[] = {
+    { "", "" },
+    { "foo", "Zm9v" },
+    { "foobar", "Zm9vYmFy" },
+    { "\xff\xfe\xfd\x00\x01\x02", "//79AAEC" }
+  };
+  unsigned char buffer[150], result[150];
+  char text[200], inplace[200];
+  size_t n, len, used;
+  int tidx;
+
+  for (tidx = 0; tidx < DIM(tests); tidx++)
+    {
+      len = strlen (tests[tidx].expected);
+      n = radix64_encode_block (text, tests[tidx].data, len / 4 * 3);
+      if (n != len || memcmp (text, tests[tidx].expected, len))
+        fail (tidx);
+      n = radix64_decode_block (result, tests[tidx].expected, len, &used);
+      if (used != len || n != len / 4 * 3
+          || memcmp (result, tests[tidx].data, n))
+        fail (tidx);
+    }
+
+  fill_buffer (buffer, sizeof buffer, 4711);
+  n = radix64_encode_block (text, buffer, sizeof buffer);
+  if (n != sizeof buffer / 3 * 4)
+    fail (10);
+
+  /* A trailing incomplete group is not decoded.  */
+  n = radix64_decode_block (result, text, 4 * 10 + 3, &used);
+  if (n != 30 || used != 40 || memcmp (result, buffer, n))
+    fail (11);
+
+  /* Decoding stops at the first group with a non-alphabet char.  */
+  memcpy (inplace, text, 200);
+  inplace[45] = '\n';
+  n = radix64_decode_block (inplace, inplace, 200, &used);
+  if (n != 33 || used != 44 || memcmp (inplace, buffer, n))
+    fail (12);
+  memcpy (text + 60, "==", 2);
+  n = radix64_decode_block (result, text, 200, &used);
+  if (n != 45 || used != 60 || memcmp (result, buffer, n))
+    fail (13);
+  text[21] = '\x80' | 'A';
+  n = radix64_decode_block (result, text, 200, &used);
+  if (n != 15 || used != 20)
+    fail (14);
+}
+
+
+/* Check that the fast path in b64dec_proc yields the same result as
+   the per character decoding.  */
+static void
+test_b64dec (void)
+{
+  unsigned char data[500];
+  char armor[1000], *p;
+  size_t n, len, off, nbytes, total;
+  struct b64state state;
+  int i;
+
+  fill_buffer (data, sizeof data, 1);
+  p = armor;
+  p += sprintf (p, "junk\n-----BEGIN TEST-----\n");
+  for (off=0; off + 48 <= sizeof data; off += 48)
+    {
+      p += radix64_encode_block (p, data + off, 48);
+      *p++ = '\n';
+    }
+  n = sizeof data - off;
+  p += radix64_encode_block (p, data + off, n / 3 * 3);
+  if (n % 3)
+    {
+      /* 500 % 48 is 20, thus 2 bytes are left.  */
+      p += radix64_encode_block (p, "\0\0\0", 3);
+      p[-4] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+        "0123456789+/"[data[sizeof data - 2] >> 2];
+      p[-3] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+        "0123456789+/"[((data[sizeof data - 2] << 4) & 060)
+                       | (data[sizeof data - 1] >> 4)];
+      p[-2] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+        "0123456789+/"[(data[sizeof data - 1] << 2) & 074];
+      p[-1] = '=';
+    }
+  p += sprintf (p, "\n-----END TEST-----\n");
+  len = p - armor;
+
+  /* Feed the armor in chunks of various sizes.  */
+  for (i=1; i < 70; i += 7)
+    {
+      char buffer[1000];
+
+      if (b64dec_start (&state, ""))
+        fail (i);
+      memcpy (buffer, armor, len);
+      total = 0;
+      for (off=0; off < len; off += n)
+        {
+          n = len - off < i? len - off : i;
+          if (b64dec_proc (&state, buffer + off, n, &nbytes))
+            fail (i);
+          memmove (buffer + total, buffer + off, nbytes);
+          total += nbytes;
+        }
+      if (b64dec_finish (&state))
+        fail (i);
+      if (total != sizeof data || memcmp (buffer, data, total))
+        fail (i);
+    }
+}
+
+
+int
+main (int argc, char **argv)
+{
+  (void)argc;
+  (void)argv;
+
+  test_crc24 ();
+  test_encode_decode ();
+  test_b64dec ();
+
+  return !!errcount;
+}
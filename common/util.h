@@ -166,6 +166,13 @@ gpg_error_t b64dec_proc (struct b64state *state, void *buffer, size_t length,
                          size_t *r_nbytes);
 gpg_error_t b64dec_finish (struct b64state *state);
 
+/*-- radix64.c --*/
+#define RADIX64_CRCINIT 0xB704CE
+u32 radix64_crc24 (u32 crc, const void *buffer, size_t length);
+size_t radix64_encode_block (char *dst, const void *src, size_t srclen);
+size_t radix64_decode_block (void *dst, const char *src, size_t srclen,
+                             size_t *r_used);
+
 
 /*-- zb32.c --*/
 char *zb32_encode (const void *data, unsigned int databits);
@@ -35,6 +35,10 @@
 
 #define MAX_EXTRA_CACHED_CERTS 1000
 
+/* The number of slots of the hash tables used as secondary indexes.
+   Must be a power of 2.  */
+#define CERT_INDEX_SIZE 4096
+
 /* Constants used to classify search patterns.  */
 enum pattern_class
   {
@@ -56,20 +60,27 @@ enum pattern_class
 /* A certificate cache item.  This consists of a the KSBA cert object
    and some meta data for easier lookup.  We use a hash table to keep
    track of all items and use the (randomly distributed) first byte of
-   the fingerprint directly as the hash which makes it pretty easy. */
+   the fingerprint directly as the hash which makes it pretty easy.
+   Valid items are also linked into hash tables indexed by the issuer
+   DN and serial number, the subject DN and the subject key id. */
 struct cert_item_s
 {
   struct cert_item_s *next; /* Next item with the same hash value. */
+  struct cert_item_s *next_sn;      /* Next item in SN_INDEX.  */
+  struct cert_item_s *next_subject; /* Next item in SUBJECT_INDEX.  */
+  struct cert_item_s *next_ski;     /* Next item in SKI_INDEX.  */
   ksba_cert_t cert;         /* The KSBA cert object or NULL is this is
                                not a valid item.  */
   unsigned char fpr[20];    /* The fingerprint of this object. */
   char *issuer_dn;          /* The malloced issuer DN.  */
   ksba_sexp_t sn;           /* The malloced serial number  */
   char *subject_dn;         /* The malloced subject DN - maybe NULL.  */
+  ksba_sexp_t ski;          /* The malloced subject key id - maybe NULL.  */
   struct
   {
     unsigned int loaded:1;  /* It has been explicitly loaded.  */
     unsigned int trusted:1; /* This is a trusted root certificate.  */
+    unsigned int indexed:1; /* The item is linked into the indexes.  */
   } flags;
 };
 typedef struct cert_item_s *cert_item_t;
@@ -78,6 +89,11 @@ typedef struct cert_item_s *cert_item_t;
    the first byte of the fingerprint.  */
 static cert_item_t cert_cache[256];
 
+/* The secondary indexes of the cert cache.  */
+static cert_item_t sn_index[CERT_INDEX_SIZE];
+static cert_item_t subject_index[CERT_INDEX_SIZE];
+static cert_item_t ski_index[CERT_INDEX_SIZE];
+
 /* This is the global cache_lock variable. In general looking is not
    needed but it would take extra efforts to make sure that no
    indirect use of npth functions is done, so we simply lock it
@@ -205,6 +221,125 @@ cert_compute_fpr (ksba_cert_t cert, unsigned char *digest)
 }
 
 
+/* Return the FNV-1a hash of the LENGTH bytes at BUFFER continuing
+   the hash value HASH.  Use 2166136261 for the first call.  */
+static unsigned int
+hash_buffer (unsigned int hash, const void *buffer, size_t length)
+{
+  const unsigned char *p = buffer;
+
+  for (; length; length--, p++)
+    hash = ((hash ^ *p) * 16777619) & 0xffffffff;
+  return hash;
+}
+
+
+/* Return the hash of the canonical S-expression SEXP continuing the
+   hash value HASH.  */
+static unsigned int
+hash_sexp (unsigned int hash, ksba_const_sexp_t sexp)
+{
+  return hash_buffer (hash, sexp,
+                      gcry_sexp_canon_len ((const void*)sexp, 0, NULL, NULL));
+}
+
+
+/* Return the slot in SN_INDEX for ISSUER_DN and SN.  */
+static unsigned int
+sn_index_slot (const char *issuer_dn, ksba_const_sexp_t sn)
+{
+  unsigned int hash;
+
+  hash = hash_buffer (2166136261U, issuer_dn, strlen (issuer_dn));
+  hash = hash_sexp (hash, sn);
+  return hash & (CERT_INDEX_SIZE - 1);
+}
+
+
+/* Return the slot in SUBJECT_INDEX for SUBJECT_DN.  */
+static unsigned int
+subject_index_slot (const char *subject_dn)
+{
+  return (hash_buffer (2166136261U, subject_dn, strlen (subject_dn))
+          & (CERT_INDEX_SIZE - 1));
+}
+
+
+/* Return the slot in SKI_INDEX for the subject key id SKI.  */
+static unsigned int
+ski_index_slot (ksba_const_sexp_t ski)
+{
+  return hash_sexp (2166136261U, ski) & (CERT_INDEX_SIZE - 1);
+}
+
+
+/* Link the valid cache item CI into the indexes.  */
+static void
+index_cert (cert_item_t ci)
+{
+  unsigned int slot;
+
+  slot = sn_index_slot (ci->issuer_dn, ci->sn);
+  ci->next_sn = sn_index[slot];
+  sn_index[slot] = ci;
+
+  if (ci->subject_dn)
+    {
+      slot = subject_index_slot (ci->subject_dn);
+      ci->next_subject = subject_index[slot];
+      subject_index[slot] = ci;
+    }
+
+  if (ci->ski)
+    {
+      slot = ski_index_slot (ci->ski);
+      ci->next_ski = ski_index[slot];
+      ski_index[slot] = ci;
+    }
+
+  ci->flags.indexed = 1;
+}
+
+
+/* Remove the cache item CI from the indexes.  */
+static void
+unindex_cert (cert_item_t ci)
+{
+  cert_item_t *p;
+
+  if (!ci->flags.indexed)
+    return;
+
+  for (p = &sn_index[sn_index_slot (ci->issuer_dn, ci->sn)];
+       *p; p = &(*p)->next_sn)
+    if (*p == ci)
+      {
+        *p = ci->next_sn;
+        break;
+      }
+
+  if (ci->subject_dn)
+    for (p = &subject_index[subject_index_slot (ci->subject_dn)];
+         *p; p = &(*p)->next_subject)
+      if (*p == ci)
+        {
+          *p = ci->next_subject;
+          break;
+        }
+
+  if (ci->ski)
+    for (p = &ski_index[ski_index_slot (ci->ski)]; *p; p = &(*p)->next_ski)
+      if (*p == ci)
+        {
+          *p = ci->next_ski;
+          break;
+        }
+
+  ci->next_sn = ci->next_subject = ci->next_ski = NULL;
+  ci->flags.indexed = 0;
+}
+
+
 /* Cleanup one slot.  This releases all resourses but keeps the actual
    slot in the cache marked for reuse. */
 static void
@@ -215,12 +350,15 @@ clean_cache_slot (cert_item_t ci)
   if (!ci->cert)
     return; /* Already cleaned.  */
 
+  unindex_cert (ci);
   ksba_free (ci->sn);
   ci->sn = NULL;
   ksba_free (ci->issuer_dn);
   ci->issuer_dn = NULL;
   ksba_free (ci->subject_dn);
   ci->subject_dn = NULL;
+  ksba_free (ci->ski);
+  ci->ski = NULL;
   cert = ci->cert;
   ci->cert = NULL;
 
@@ -316,8 +454,11 @@ put_cert (ksba_cert_t cert, int is_loaded, int is_trusted, void *fpr_buffer)
       return gpg_error (GPG_ERR_INV_CERT_OBJ);
     }
   ci->subject_dn = ksba_cert_get_subject (cert, 0);
+  if (ksba_cert_get_subj_key_id (cert, NULL, &ci->ski))
+    ci->ski = NULL;
   ci->flags.loaded  = !!is_loaded;
   ci->flags.trusted = !!is_trusted;
+  index_cert (ci);
 
   if (is_loaded)
     total_loaded_certificates++;
@@ -606,22 +747,17 @@ get_cert_byhexfpr (const char *string)
 ksba_cert_t
 get_cert_bysn (const char *issuer_dn, ksba_sexp_t serialno)
 {
-  /* Simple and inefficient implementation.   fixme! */
   cert_item_t ci;
-  int i;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && !strcmp (ci->issuer_dn, issuer_dn)
-            && !compare_serialno (ci->sn, serialno))
-          {
-            ksba_cert_ref (ci->cert);
-            release_cache_lock ();
-            return ci->cert;
-          }
-    }
+  for (ci = sn_index[sn_index_slot (issuer_dn, serialno)]; ci; ci = ci->next_sn)
+    if (!strcmp (ci->issuer_dn, issuer_dn)
+        && !compare_serialno (ci->sn, serialno))
+      {
+        ksba_cert_ref (ci->cert);
+        release_cache_lock ();
+        return ci->cert;
+      }
 
   release_cache_lock ();
   return NULL;
@@ -660,26 +796,46 @@ get_cert_byissuer (const char *issuer_dn, unsigned int seq)
 ksba_cert_t
 get_cert_bysubject (const char *subject_dn, unsigned int seq)
 {
-  /* Simple and very inefficient implementation and API.  fixme! */
   cert_item_t ci;
-  int i;
 
   if (!subject_dn)
     return NULL;
 
   acquire_cache_read_lock ();
-  for (i=0; i < 256; i++)
-    {
-      for (ci=cert_cache[i]; ci; ci = ci->next)
-        if (ci->cert && ci->subject_dn
-            && !strcmp (ci->subject_dn, subject_dn))
-          if (!seq--)
-            {
-              ksba_cert_ref (ci->cert);
-              release_cache_lock ();
-              return ci->cert;
-            }
-    }
+  for (ci = subject_index[subject_index_slot (subject_dn)];
+       ci; ci = ci->next_subject)
+    if (!strcmp (ci->subject_dn, subject_dn))
+      if (!seq--)
+        {
+          ksba_cert_ref (ci->cert);
+          release_cache_lock ();
+          return ci->cert;
+        }
+
+  release_cache_lock ();
+  return NULL;
+}
+
+
+/* Return the certificate matching SUBJECT_DN and the subject key id
+   KEYID.  */
+ksba_cert_t
+get_cert_byski (const char *subject_dn, ksba_sexp_t keyid)
+{
+  cert_item_t ci;
+
+  if (!subject_dn)
+    return NULL;
+
+  acquire_cache_read_lock ();
+  for (ci = ski_index[ski_index_slot (keyid)]; ci; ci = ci->next_ski)
+    if (!cmp_simple_canon_sexp (ci->ski, keyid)
+        && ci->subject_dn && !strcmp (ci->subject_dn, subject_dn))
+      {
+        ksba_cert_ref (ci->cert);
+        release_cache_lock ();
+        return ci->cert;
+      }
 
   release_cache_lock ();
   return NULL;
@@ -1104,7 +1260,6 @@ ksba_cert_t
 find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
 {
   gpg_error_t err;
-  int seq;
   ksba_cert_t cert = NULL;
   cert_fetch_context_t context = NULL;
   ksba_sexp_t subj;
@@ -1119,21 +1274,19 @@ find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
     {
       cert_item_t ci;
       cert_ref_t cr;
-      int i;
 
       /* For efficiency reasons we won't use get_cert_bysubject here. */
       acquire_cache_read_lock ();
-      for (i=0; i < 256; i++)
-        for (ci=cert_cache[i]; ci; ci = ci->next)
-          if (ci->cert && ci->subject_dn
-              && !strcmp (ci->subject_dn, subject_dn))
-            for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
-              if (!memcmp (ci->fpr, cr->fpr, 20))
-                {
-                  ksba_cert_ref (ci->cert);
-                  release_cache_lock ();
-                  return ci->cert; /* We use this certificate. */
-                }
+      for (ci = subject_index[subject_index_slot (subject_dn)];
+           ci; ci = ci->next_subject)
+        if (!strcmp (ci->subject_dn, subject_dn))
+          for (cr=ctrl->ocsp_certs; cr; cr = cr->next)
+            if (!memcmp (ci->fpr, cr->fpr, 20))
+              {
+                ksba_cert_ref (ci->cert);
+                release_cache_lock ();
+                return ci->cert; /* We use this certificate. */
+              }
       release_cache_lock ();
       if (DBG_LOOKUP)
         log_debug ("find_cert_bysubject: certificate not in ocsp_certs\n");
@@ -1141,19 +1294,10 @@ find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
 
 
   /* First we check whether the certificate is cached.  */
-  for (seq=0; (cert = get_cert_bysubject (subject_dn, seq)); seq++)
-    {
-      if (!keyid)
-        break; /* No keyid requested, so return the first one found. */
-      if (!ksba_cert_get_subj_key_id (cert, NULL, &subj)
-          && !cmp_simple_canon_sexp (keyid, subj))
-        {
-          xfree (subj);
-          break; /* Found matching cert. */
-        }
-      xfree (subj);
-      ksba_cert_release (cert);
-    }
+  if (keyid)
+    cert = get_cert_byski (subject_dn, keyid);
+  else
+    cert = get_cert_bysubject (subject_dn, 0);
   if (cert)
     return cert; /* Done.  */
 
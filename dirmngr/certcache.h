@@ -70,6 +70,10 @@ ksba_cert_t get_cert_byissuer (const char *issuer_dn, unsigned int seq);
    set to 0 and bumped up to get the next issuer with that DN. */
 ksba_cert_t get_cert_bysubject (const char *subject_dn, unsigned int seq);
 
+/* Return the certificate matching SUBJECT_DN and the subject key id
+   KEYID.  */
+ksba_cert_t get_cert_byski (const char *subject_dn, ksba_sexp_t keyid);
+
 /* Given PATTERN, which is a string as used by GnuPG to specify a
    certificate, return all matching certificates by calling the
    supplied function RETFNC.  */
@@ -122,8 +122,22 @@
 /* The number of DB files we may have open at one time.  We need to
    limit this because there is no guarantee that the number of issuers
    has a upper limit.  We are currently using mmap, so it is a good
-   idea anyway to limit the number of opened cache files. */
-#define MAX_OPEN_DB_FILES 5
+   idea anyway to limit the number of opened cache files.  An opened
+   file is kept mapped across requests until it needs to make room for
+   another one; with the serial filter most lookups do not even need
+   to open a file, thus this limit is rarely reached. */
+#define MAX_OPEN_DB_FILES 32
+
+/* The number of slots in the issuer index of the cache.  Must be a
+   power of 2.  */
+#define ISSUER_INDEX_SIZE 1024
+
+/* The number of bits per revoked serial number in the serial filter
+   and the number of probes per serial number.  With these values
+   about 1% of the lookups for a non-revoked certificate need to
+   consult the DB file.  */
+#define SERIAL_FILTER_BITS 10
+#define SERIAL_FILTER_PROBES 7
 
 
 static const char oidstr_crlNumber[] = "2.5.29.20";
@@ -159,6 +173,14 @@ struct crl_cache_entry_s
   unsigned int cdb_lru_count;  /* Used for LRU purposes. */
   int dbfile_checked;          /* Set to true if the dbfile_hash value has
                                   been checked one. */
+
+  struct crl_cache_entry_s *next_issuer; /* Next in the issuer index. */
+
+  /* A Bloom filter over the serial numbers listed in the cache file.
+     NULL if not yet built.  SERIAL_FILTER_MASK is the number of bits
+     in the filter minus one.  */
+  unsigned char *serial_filter;
+  unsigned int serial_filter_mask;
 };
 
 
@@ -166,16 +188,14 @@ struct crl_cache_entry_s
 struct crl_cache_s
 {
   crl_cache_entry_t entries;
+
+  /* The entries hashed by their issuer hash.  */
+  crl_cache_entry_t issuer_index[ISSUER_INDEX_SIZE];
 };
 
 typedef struct crl_cache_s *crl_cache_t;
 
 
-/* Prototypes.  */
-static crl_cache_entry_t find_entry (crl_cache_entry_t first,
-                                     const char *issuer_hash);
-
-
 
 /* The currently loaded cache object.  This is usually initialized
    right at startup.  */
@@ -374,6 +394,7 @@ release_one_cache_entry (crl_cache_entry_t entry)
         }
       xfree (entry->release_ptr);
       xfree (entry->check_trust_anchor);
+      xfree (entry->serial_filter);
       xfree (entry);
     }
 }
@@ -398,6 +419,61 @@ release_cache (crl_cache_t cache)
 }
 
 
+/* Return the slot of the issuer index for ISSUER_HASH.  */
+static unsigned int
+issuer_index_slot (const char *issuer_hash)
+{
+  unsigned int h = 0;
+
+  for (; *issuer_hash; issuer_hash++)
+    h = h * 31 + *(const unsigned char *)issuer_hash;
+  return h & (ISSUER_INDEX_SIZE - 1);
+}
+
+
+/* Insert ENTRY into the issuer index of CACHE.  */
+static void
+index_entry (crl_cache_t cache, crl_cache_entry_t entry)
+{
+  unsigned int slot = issuer_index_slot (entry->issuer_hash);
+
+  entry->next_issuer = cache->issuer_index[slot];
+  cache->issuer_index[slot] = entry;
+}
+
+
+/* Remove ENTRY from the issuer index of CACHE.  */
+static void
+unindex_entry (crl_cache_t cache, crl_cache_entry_t entry)
+{
+  crl_cache_entry_t *ep;
+
+  for (ep = &cache->issuer_index[issuer_index_slot (entry->issuer_hash)];
+       *ep; ep = &(*ep)->next_issuer)
+    if (*ep == entry)
+      {
+        *ep = entry->next_issuer;
+        entry->next_issuer = NULL;
+        break;
+      }
+}
+
+
+/* Find ISSUER_HASH in our CACHE.  Entries marked for deletion are
+   ignored.  */
+static crl_cache_entry_t
+find_entry (crl_cache_t cache, const char *issuer_hash)
+{
+  crl_cache_entry_t e;
+
+  for (e = cache->issuer_index[issuer_index_slot (issuer_hash)];
+       e; e = e->next_issuer)
+    if (!e->deleted && !strcmp (issuer_hash, e->issuer_hash))
+      return e;
+  return NULL;
+}
+
+
 /* Open the dir file FNAME or create a new one if it does not yet
    exist. */
 static estream_t
@@ -623,10 +699,8 @@ open_dir (crl_cache_t *r_cache)
               xfree (entry);
               entry = NULL;
             }
-          else if (find_entry (cache->entries, entry->issuer_hash))
+          else if (find_entry (cache, entry->issuer_hash))
             {
-              /* Fixme: The duplicate checking used is not very
-                 effective for large numbers of issuers. */
               log_info (_("duplicate entry detected in '%s' line %u\n"),
                         fname, lineno);
               xfree (entry);
@@ -637,6 +711,7 @@ open_dir (crl_cache_t *r_cache)
               line = NULL;
               *entrytail = entry;
               entrytail = &entry->next;
+              index_entry (cache, entry);
             }
         }
       else if (*line == '#')
@@ -856,7 +931,7 @@ update_dir (crl_cache_t cache)
               /* There should be no percent within the issuer hash
                  field, thus we can compare it pretty easily. */
               *endp = 0;
-              e = find_entry ( cache->entries, fieldp);
+              e = find_entry (cache, fieldp);
               *endp = ':'; /* Restore orginal line. */
               if (e && e->deleted)
                 {
@@ -1062,6 +1137,125 @@ check_dbfile (const char *fname, const char *md5hexvalue)
 }
 
 
+/* Compute the two hash values used for the serial filter probes of
+   the serial number SN with length SNLEN.  */
+static void
+serial_filter_hash (const unsigned char *sn, size_t snlen,
+                    unsigned int *r_h1, unsigned int *r_h2)
+{
+  unsigned int h = 2166136261u;  /* FNV-1a */
+  size_t n;
+
+  for (n=0; n < snlen; n++)
+    {
+      h ^= sn[n];
+      h *= 16777619u;
+    }
+  *r_h1 = h;
+  *r_h2 = cdb_hash (sn, snlen) | 1;
+}
+
+
+/* Add the serial number SN with length SNLEN to the serial filter of
+   ENTRY.  */
+static void
+serial_filter_add (crl_cache_entry_t entry,
+                   const unsigned char *sn, size_t snlen)
+{
+  unsigned int h1, h2, bit;
+  int i;
+
+  serial_filter_hash (sn, snlen, &h1, &h2);
+  for (i=0; i < SERIAL_FILTER_PROBES; i++, h1 += h2)
+    {
+      bit = h1 & entry->serial_filter_mask;
+      entry->serial_filter[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+
+/* Return true if the serial number SN with length SNLEN may be listed
+   in the cache file of ENTRY.  If false is returned the serial number
+   is definitely not listed.  */
+static int
+serial_filter_test (crl_cache_entry_t entry,
+                    const unsigned char *sn, size_t snlen)
+{
+  unsigned int h1, h2, bit;
+  int i;
+
+  serial_filter_hash (sn, snlen, &h1, &h2);
+  for (i=0; i < SERIAL_FILTER_PROBES; i++, h1 += h2)
+    {
+      bit = h1 & entry->serial_filter_mask;
+      if (!(entry->serial_filter[bit / 8] & (1 << (bit % 8))))
+        return 0;
+    }
+  return 1;
+}
+
+
+/* Build the serial filter of ENTRY from the opened cache file CDB.
+   On error no filter is built and all lookups use the cache file.  */
+static void
+build_serial_filter (crl_cache_entry_t entry, struct cdb *cdb)
+{
+  struct cdb_find cdbfp;
+  unsigned char keyrecord[256];
+  unsigned long count;
+  unsigned int nbits;
+  cdbi_t n;
+  int rc;
+
+  /* First count the items to size the filter.  */
+  count = 0;
+  rc = cdb_findinit (&cdbfp, cdb, NULL, 0);
+  while (!rc && (rc=cdb_findnext (&cdbfp)) > 0)
+    {
+      rc = 0;
+      count++;
+    }
+  if (rc)
+    goto failure;
+
+  for (nbits = 64; nbits / SERIAL_FILTER_BITS < count; nbits <<= 1)
+    if (nbits >= 0x80000000u)
+      goto failure;
+
+  entry->serial_filter = xtrycalloc (1, nbits / 8);
+  if (!entry->serial_filter)
+    goto failure;
+  entry->serial_filter_mask = nbits - 1;
+
+  rc = cdb_findinit (&cdbfp, cdb, NULL, 0);
+  while (!rc && (rc=cdb_findnext (&cdbfp)) > 0)
+    {
+      rc = 0;
+      n = cdb_keylen (cdb);
+      if (n > sizeof keyrecord
+          || cdb_read (cdb, keyrecord, n, cdb_keypos (cdb)))
+        {
+          rc = -1;
+          break;
+        }
+      serial_filter_add (entry, keyrecord, n);
+    }
+  if (rc)
+    goto failure;
+
+  if (opt.verbose)
+    log_info ("serial filter for issuer id %s: %lu items, %u bytes\n",
+              entry->issuer_hash, count, nbits / 8);
+  return;
+
+ failure:
+  log_info ("can't build serial filter for issuer id %s\n",
+            entry->issuer_hash);
+  xfree (entry->serial_filter);
+  entry->serial_filter = NULL;
+}
+
+
 /* Open the cache file for ENTRY.  This function implements a caching
    strategy and might close unused cache files. It is required to use
    unlock_db_file after using the file. */
@@ -1162,6 +1356,9 @@ lock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
   entry->cdb_use_count = 1;
   entry->cdb_lru_count = 0;
 
+  if (entry->dbfile_checked && !entry->serial_filter)
+    build_serial_filter (entry, entry->cdb);
+
   return entry->cdb;
 }
 
@@ -1194,22 +1391,12 @@ unlock_db_file (crl_cache_t cache, crl_cache_entry_t entry)
         cache->entries = enext;
       else
         eprev->next = enext;
+      unindex_entry (cache, entry);
       /* FIXME: Do we leak ENTRY? */
     }
 }
 
 
-/* Find ISSUER_HASH in our cache FIRST. This may be used to enumerate
-   the linked list we use to keep the CRLs of an issuer. */
-static crl_cache_entry_t
-find_entry (crl_cache_entry_t first, const char *issuer_hash)
-{
-  while (first && (first->deleted || strcmp (issuer_hash, first->issuer_hash)))
-    first = first->next;
-  return first;
-}
-
-
 /* Create a new CRL cache. This fucntion is usually called only once.
    never fail. */
 void
@@ -1278,7 +1465,7 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
 
   (void)ctrl;
 
-  entry = find_entry (cache->entries, issuer_hash);
+  entry = find_entry (cache, issuer_hash);
   if (!entry)
     {
       log_info (_("no CRL available for issuer id %s\n"), issuer_hash );
@@ -1324,19 +1511,30 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
       return CRL_CACHE_CANTUSE;
     }
 
-  cdb = lock_db_file (cache, entry);
-  if (!cdb)
-    return CRL_CACHE_DONTKNOW; /* Hmmm, not the best error code. */
-
-  if (!entry->dbfile_checked)
+  /* The serial filter is only built after the cache file has been
+     checked; if the serial number is not in the filter it is not
+     listed in the CRL and we don't need to look at the file.  */
+  if (entry->serial_filter && !serial_filter_test (entry, sn, snlen))
     {
-      log_error (_("cached CRL for issuer id %s tampered; we need to update\n")
-                 , issuer_hash);
-      unlock_db_file (cache, entry);
-      return CRL_CACHE_DONTKNOW;
+      cdb = NULL;
+      rc = 0;
     }
+  else
+    {
+      cdb = lock_db_file (cache, entry);
+      if (!cdb)
+        return CRL_CACHE_DONTKNOW; /* Hmmm, not the best error code. */
 
-  rc = cdb_find (cdb, sn, snlen);
+      if (!entry->dbfile_checked)
+        {
+          log_error (_("cached CRL for issuer id %s tampered; "
+                       "we need to update\n"), issuer_hash);
+          unlock_db_file (cache, entry);
+          return CRL_CACHE_DONTKNOW;
+        }
+
+      rc = cdb_find (cdb, sn, snlen);
+    }
   if (rc == 1)
     {
       n = cdb_datalen (cdb);
@@ -1400,7 +1598,8 @@ cache_isvalid (ctrl_t ctrl, const char *issuer_hash,
         }
     }
 
-  unlock_db_file (cache, entry);
+  if (cdb)
+    unlock_db_file (cache, entry);
 
   return retval;
 }
@@ -2175,7 +2374,7 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   /* Check whether we already have an entry for this issuer and mark
      it as deleted. We better use a loop, just in case duplicates got
      somehow into the list. */
-  for (e = cache->entries; (e=find_entry (e, entry->issuer_hash)); e = e->next)
+  while ((e = find_entry (cache, entry->issuer_hash)))
     e->deleted = 1;
 
   /* Rename the temporary DB to the real name. */
@@ -2190,7 +2389,8 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
     do
       {
         any = 0;
-        for (e = cache->entries; e; e = e->next)
+        for (e = cache->issuer_index[issuer_index_slot (entry->issuer_hash)];
+             e; e = e->next_issuer)
           if (!e->cdb_use_count && e->cdb
               && !strcmp (e->issuer_hash, entry->issuer_hash))
             {
@@ -2222,6 +2422,12 @@ crl_cache_insert (ctrl_t ctrl, const char *url, ksba_reader_t reader)
   /* Link the new entry in. */
   entry->next = cache->entries;
   cache->entries = entry;
+  index_entry (cache, entry);
+
+  /* Open the new cache file right away; this builds the serial
+     filter and keeps the file mapped for the following lookups.  */
+  if (lock_db_file (cache, entry))
+    unlock_db_file (cache, entry);
   entry = NULL;
 
   err = update_dir (cache);
@@ -59,6 +59,7 @@
 #include "certcache.h"
 #include "crlcache.h"
 #include "crlfetch.h"
+#include "ocsp.h"
 #include "misc.h"
 #if USE_LDAP
 # include "ldapserver.h"
@@ -68,6 +69,7 @@
 # include "ldap-wrapper.h"
 #endif
 #include "../common/init.h"
+#include "../common/conn-loop.h"
 #include "gc-opt-flags.h"
 
 /* The plain Windows version uses the windows service system.  For
@@ -138,6 +140,7 @@ enum cmd_and_opt_values {
   oForce,
   oAllowOCSP,
   oSocketName,
+  oConnectionThreads,
   oLDAPWrapperProgram,
   oHTTPWrapperProgram,
   oIgnoreCertExtension,
@@ -218,6 +221,7 @@ static ARGPARSE_OPTS opts[] = {
 
 
   ARGPARSE_s_s (oSocketName, "socket-name", "@"),  /* Only for debugging.  */
+  ARGPARSE_s_u (oConnectionThreads, "connection-threads", "@"),
 
   ARGPARSE_s_u (oFakedSystemTime, "faked-system-time", "@"), /*(epoch time)*/
   ARGPARSE_p_u (oDebug,    "debug", "@"),
@@ -903,6 +907,9 @@ main (int argc, char **argv)
         case oForce: opt.force = 1; break;
 
         case oSocketName: socket_name = pargs.r.ret_str; break;
+        case oConnectionThreads:
+          opt.connection_threads = pargs.r.ret_ulong;
+          break;
 
         default : pargs.err = configfp? 1:2; break;
 	}
@@ -1717,6 +1724,9 @@ reread_configuration (void)
     }
   fclose (fp);
 
+  /* The CA certificates for TLS may have changed.  */
+  ks_hkp_reload ();
+
   set_debug ();
 }
 
@@ -1731,6 +1741,7 @@ dirmngr_sighup_action (void)
   reread_configuration ();
   cert_cache_deinit (0);
   crl_cache_deinit ();
+  ocsp_cache_flush ();
   cert_cache_init ();
   crl_cache_init ();
 }
@@ -1750,6 +1761,7 @@ handle_signal (int signo)
 
     case SIGUSR1:
       cert_cache_print_stats ();
+      ocsp_cache_print_stats ();
       break;
 
     case SIGUSR2:
@@ -1859,6 +1871,8 @@ handle_tick (void)
     }
 #endif /*HAVE_W32_SYSTEM*/
 
+  ks_hkp_expire_connections ();
+
   if (time_for_housekeeping_p (gnupg_get_time ()))
     {
       npth_t thread;
@@ -1941,23 +1955,21 @@ start_connection_thread (void *arg)
 static void
 handle_connections (assuan_fd_t listen_fd)
 {
-  npth_attr_t tattr;
+  gpg_error_t err;
 #ifndef HAVE_W32_SYSTEM
   int signo;
 #endif
   struct sockaddr_un paddr;
   socklen_t plen = sizeof( paddr );
   gnupg_fd_t fd;
-  int nfd, ret;
-  fd_set fdset, read_fdset;
+  int ret;
+  conn_watch_t watch;
+  conn_pool_t pool;
   struct timespec abstime;
   struct timespec curtime;
   struct timespec timeout;
   int saved_errno;
 
-  npth_attr_init (&tattr);
-  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
-
 #ifndef HAVE_W32_SYSTEM /* FIXME */
   npth_sigev_init ();
   npth_sigev_add (SIGHUP);
@@ -1968,12 +1980,19 @@ handle_connections (assuan_fd_t listen_fd)
   npth_sigev_fini ();
 #endif
 
-  /* Setup the fdset.  It has only one member.  This is because we use
-     pth_select instead of pth_accept to properly sync timeouts with
-     to full second.  */
-  FD_ZERO (&fdset);
-  FD_SET (FD2INT (listen_fd), &fdset);
-  nfd = FD2INT (listen_fd);
+  /* Setup the watcher.  It has only one member.  This is because we
+     use a select like function instead of accept to properly sync
+     timeouts with to full second.  */
+  err = conn_watch_new (&watch);
+  if (!err)
+    err = conn_watch_add (watch, listen_fd);
+  if (err)
+    log_fatal ("error creating the connection watcher: %s\n",
+               gpg_strerror (err));
+
+  err = conn_pool_new (&pool, opt.connection_threads);
+  if (err)
+    log_fatal ("error creating the thread pool: %s\n", gpg_strerror (err));
 
   npth_clock_gettime (&abstime);
   abstime.tv_sec += TIMERTICK_INTERVAL;
@@ -1989,12 +2008,9 @@ handle_connections (assuan_fd_t listen_fd)
 
           /* Do not accept new connections but keep on running the
              loop to cope with the timer events.  */
-          FD_ZERO (&fdset);
+          conn_watch_clear (watch);
 	}
 
-      /* Take a copy of the fdset.  */
-      read_fdset = fdset;
-
       npth_clock_gettime (&curtime);
       if (!(npth_timercmp (&curtime, &abstime, <)))
 	{
@@ -2006,13 +2022,13 @@ handle_connections (assuan_fd_t listen_fd)
       npth_timersub (&abstime, &curtime, &timeout);
 
 #ifndef HAVE_W32_SYSTEM
-      ret = npth_pselect (nfd+1, &read_fdset, NULL, NULL, &timeout, npth_sigev_sigmask());
+      ret = conn_watch_wait (watch, &timeout, npth_sigev_sigmask());
       saved_errno = errno;
 
       while (npth_sigev_get_pending(&signo))
 	handle_signal (signo);
 #else
-      ret = npth_eselect (nfd+1, &read_fdset, NULL, NULL, &timeout, NULL, NULL);
+      ret = conn_watch_wait (watch, &timeout, NULL, NULL);
       saved_errno = errno;
 #endif
 
@@ -2029,7 +2045,7 @@ handle_connections (assuan_fd_t listen_fd)
 	   next timeout.  */
 	continue;
 
-      if (!shutdown_pending && FD_ISSET (FD2INT (listen_fd), &read_fdset))
+      if (!shutdown_pending && conn_watch_ready (watch, listen_fd))
 	{
           plen = sizeof paddr;
 	  fd = INT2FD (npth_accept (FD2INT(listen_fd),
@@ -2042,27 +2058,27 @@ handle_connections (assuan_fd_t listen_fd)
             {
               char threadname[50];
               union int_and_ptr_u argval;
-	      npth_t thread;
 
               argval.afd = fd;
               snprintf (threadname, sizeof threadname-1,
                         "conn fd=%d", FD2INT(fd));
               threadname[sizeof threadname -1] = 0;
 
-              ret = npth_create (&thread, &tattr, start_connection_thread, argval.aptr);
-	      if (ret)
+              err = conn_pool_run (pool, start_connection_thread,
+                                   argval.aptr, threadname);
+	      if (err)
                 {
                   log_error ("error spawning connection handler: %s\n",
-                             strerror (ret) );
+                             gpg_strerror (err) );
                   assuan_sock_close (fd);
                 }
-	      npth_setname_np (thread, threadname);
             }
           fd = GNUPG_INVALID_FD;
 	}
     }
 
-  npth_attr_destroy (&tattr);
+  conn_pool_release (pool);
+  conn_watch_release (watch);
   cleanup ();
   log_info ("%s %s stopped\n", strusage(11), strusage(13));
 }
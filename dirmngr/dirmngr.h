@@ -130,6 +130,9 @@ struct
                                        considered valid after thisUpdate. */
   unsigned int ocsp_current_period; /* Seconds a response is considered
                                        current after nextUpdate. */
+
+  unsigned int connection_threads;  /* Number of threads kept for reuse
+                                       by new connections.  */
 } opt;
 
 
@@ -187,6 +190,8 @@ void dirmngr_sighup_action (void);
 
 /*-- Various housekeeping functions.  --*/
 void ks_hkp_housekeeping (time_t curtime);
+void ks_hkp_expire_connections (void);
+void ks_hkp_reload (void);
 
 
 /*-- server.c --*/
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <npth.h>
 
 #include "dirmngr.h"
 #include "misc.h"
@@ -50,6 +51,33 @@ copy_stream (estream_t in, estream_t out)
 }
 
 
+/* The maximum number of concurrent requests ks_action_get sends to
+   one keyserver.  */
+#define MAX_CONCURRENT_GETS 8
+
+/* The state of one ks_action_get run against an HKP keyserver.  */
+struct get_batch_s
+{
+  npth_mutex_t lock;    /* Protects DONE.  */
+  npth_cond_t cond;     /* Signaled when a job has been added to DONE.  */
+  struct server_control_s wctrl;  /* The control object for the jobs.  */
+  parsed_uri_t uri;     /* The keyserver.  */
+  struct get_job_s *done;  /* The finished jobs.  */
+};
+
+/* One key retrieval run by a get_worker thread.  */
+struct get_job_s
+{
+  struct get_job_s *next;
+  struct get_batch_s *batch;
+  const char *pattern;
+  gpg_error_t err;      /* The error from ks_hkp_get.  */
+  gpg_error_t read_err; /* The error from reading the response.  */
+  char *source;         /* The host which delivered the key.  */
+  estream_t data;       /* A memory stream with the key.  */
+};
+
+
 /* Called by the engine's help functions to print the actual help.  */
 gpg_error_t
 ks_print_help (ctrl_t ctrl, const char *text)
@@ -180,6 +208,173 @@ ks_action_search (ctrl_t ctrl, strlist_t patterns, estream_t outfp)
 }
 
 
+/* The thread to get one key for ks_action_get.  The key is read into
+   a memory stream because only the main thread may write to the
+   client.  */
+static void *
+get_worker (void *arg)
+{
+  struct get_job_s *job = arg;
+  struct get_batch_s *batch = job->batch;
+  estream_t infp;
+
+  job->err = ks_hkp_get (&batch->wctrl, batch->uri, job->pattern,
+                         &job->source, &infp);
+  if (!job->err)
+    {
+      job->data = es_fopenmem (0, "w+b");
+      if (!job->data)
+        job->read_err = gpg_error_from_syserror ();
+      else
+        {
+          job->read_err = copy_stream (infp, job->data);
+          es_rewind (job->data);
+        }
+      es_fclose (infp);
+    }
+
+  npth_mutex_lock (&batch->lock);
+  job->next = batch->done;
+  batch->done = job;
+  npth_cond_signal (&batch->cond);
+  npth_mutex_unlock (&batch->lock);
+  return NULL;
+}
+
+
+/* Get the keys for PATTERNS from the HKP keyserver URI and write them
+   to OUTFP.  Up to MAX_CONCURRENT_GETS requests are run in parallel
+   and the keys are written in the order they arrive.  Errors of
+   single keys are not returned but the first of them is stored at
+   R_FIRST_ERR.  R_ANY_DATA is set if a key has been written.  */
+static gpg_error_t
+get_from_hkp (ctrl_t ctrl, parsed_uri_t uri, strlist_t patterns,
+              estream_t outfp, gpg_error_t *r_first_err, int *r_any_data)
+{
+  gpg_error_t err = 0;
+  struct get_batch_s batch;
+  struct get_job_s *job, *list;
+  npth_attr_t tattr;
+  struct timespec abstime;
+  unsigned int running = 0;
+  strlist_t sl;
+  npth_t thread;
+  int res;
+
+  memset (&batch, 0, sizeof batch);
+  batch.uri = uri;
+  /* The jobs use a copy of CTRL without the connection to the client
+     so that they won't write status lines.  */
+  batch.wctrl = *ctrl;
+  batch.wctrl.server_local = NULL;
+
+  res = npth_mutex_init (&batch.lock, NULL);
+  if (res)
+    return gpg_error_from_errno (res);
+  res = npth_cond_init (&batch.cond, NULL);
+  if (res)
+    {
+      npth_mutex_destroy (&batch.lock);
+      return gpg_error_from_errno (res);
+    }
+  res = npth_attr_init (&tattr);
+  if (res)
+    {
+      npth_cond_destroy (&batch.cond);
+      npth_mutex_destroy (&batch.lock);
+      return gpg_error_from_errno (res);
+    }
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_DETACHED);
+
+  sl = patterns;
+  for (;;)
+    {
+      /* Start new jobs.  After an error we only wait for the running
+         jobs because they use BATCH.  */
+      for (; !err && sl && running < MAX_CONCURRENT_GETS; sl = sl->next)
+        {
+          job = xtrycalloc (1, sizeof *job);
+          if (!job)
+            {
+              err = gpg_error_from_syserror ();
+              break;
+            }
+          job->batch = &batch;
+          job->pattern = sl->d;
+          res = npth_create (&thread, &tattr, get_worker, job);
+          if (res)
+            {
+              err = gpg_error_from_errno (res);
+              log_error ("error spawning get worker thread: %s\n",
+                         strerror (res));
+              xfree (job);
+              break;
+            }
+          running++;
+        }
+      if (!running)
+        break;
+
+      /* Wait for finished jobs.  Send a tick every second to detect
+         a cancel request.  */
+      npth_mutex_lock (&batch.lock);
+      while (!batch.done)
+        {
+          npth_clock_gettime (&abstime);
+          abstime.tv_sec += 1;
+          if (npth_cond_timedwait (&batch.cond, &batch.lock, &abstime)
+              == ETIMEDOUT && !err)
+            {
+              npth_mutex_unlock (&batch.lock);
+              err = dirmngr_tick (ctrl);
+              npth_mutex_lock (&batch.lock);
+            }
+        }
+      list = batch.done;
+      batch.done = NULL;
+      npth_mutex_unlock (&batch.lock);
+
+      for (; list; list = job)
+        {
+          job = list->next;
+          running--;
+          if (list->err)
+            {
+              /* It is possible that a server does not carry a key,
+                 thus we only save the error and continue with the
+                 next pattern.  */
+              if (!*r_first_err)
+                *r_first_err = list->err;
+            }
+          else if (err)
+            ;
+          else if (list->read_err)
+            {
+              /* Reading from the keyserver should never fail, thus
+                 return this error.  */
+              err = list->read_err;
+            }
+          else
+            {
+              err = dirmngr_status (ctrl, "SOURCE", list->source, NULL);
+              if (!err)
+                err = copy_stream (list->data, outfp);
+              if (!err)
+                *r_any_data = 1;
+            }
+          es_fclose (list->data);
+          xfree (list->source);
+          xfree (list);
+        }
+    }
+
+  npth_attr_destroy (&tattr);
+  npth_cond_destroy (&batch.cond);
+  npth_mutex_destroy (&batch.lock);
+  return err;
+}
+
+
 /* Get the requested keys (matching PATTERNS) using all configured
    keyservers and write the result to the provided output stream.  */
 gpg_error_t
@@ -189,9 +384,7 @@ ks_action_get (ctrl_t ctrl, strlist_t patterns, estream_t outfp)
   gpg_error_t first_err = 0;
   int any_server = 0;
   int any_data = 0;
-  strlist_t sl;
   uri_item_t uri;
-  estream_t infp;
 
   if (!patterns)
     return gpg_error (GPG_ERR_NO_USER_ID);
@@ -207,30 +400,10 @@ ks_action_get (ctrl_t ctrl, strlist_t patterns, estream_t outfp)
       if (uri->parsed_uri->is_http)
         {
           any_server = 1;
-          for (sl = patterns; !err && sl; sl = sl->next)
-            {
-              err = ks_hkp_get (ctrl, uri->parsed_uri, sl->d, &infp);
-              if (err)
-                {
-                  /* It is possible that a server does not carry a
-                     key, thus we only save the error and continue
-                     with the next pattern.  FIXME: It is an open
-                     question how to return such an error condition to
-                     the caller.  */
-                  first_err = err;
-                  err = 0;
-                }
-              else
-                {
-                  err = copy_stream (infp, outfp);
-                  /* Reading from the keyserver should never fail, thus
-                     return this error.  */
-                  if (!err)
-                    any_data = 1;
-                  es_fclose (infp);
-                  infp = NULL;
-                }
-            }
+          /* FIXME: It is an open question how to return the error
+             for a key not found to the caller.  */
+          err = get_from_hkp (ctrl, uri->parsed_uri, patterns, outfp,
+                              &first_err, &any_data);
         }
       if (any_data)
         break; /* Stop loop after a keyserver returned something.  */
@@ -66,6 +66,11 @@
 /* Number of retries done for a dead host etc.  */
 #define SEND_REQUEST_RETRIES 3
 
+/* The maximum number of idle connections kept open per host and the
+   number of seconds an idle connection is kept.  */
+#define KEEPALIVE_MAX_PER_HOST 4
+#define KEEPALIVE_IDLE_TIMEOUT 5
+
 /* Objects used to maintain information about hosts.  */
 struct hostinfo_s;
 typedef struct hostinfo_s *hostinfo_t;
@@ -923,11 +928,62 @@ ks_hkp_housekeeping (time_t curtime)
 }
 
 
+/* The session shared by all requests.  */
+static http_session_t keepalive_session;
+
+
+/* Close the idle connections of the shared session which have not
+   been used for KEEPALIVE_IDLE_TIMEOUT seconds.  This is called from
+   the timer tick so that idle connections don't linger until the next
+   request.  */
+void
+ks_hkp_expire_connections (void)
+{
+  http_session_expire_idle (keepalive_session);
+}
+
+
+/* Drop the shared session so that the next request uses the current
+   TLS configuration.  Requests still using the old session are not
+   affected.  */
+void
+ks_hkp_reload (void)
+{
+  http_session_release (keepalive_session);
+  keepalive_session = NULL;
+}
+
+
+/* Get the session for a request.  All requests share one session
+   which keeps idle connections, including TLS connections, open for
+   reuse by the next request to the same host.  */
+static gpg_error_t
+get_session (http_session_t *r_session)
+{
+  gpg_error_t err;
+
+  *r_session = NULL;
+  if (!keepalive_session)
+    {
+      err = http_session_new (&keepalive_session, NULL);
+      if (err)
+        return err;
+      http_session_set_log_cb (keepalive_session, cert_log_cb);
+      http_session_set_keepalive (keepalive_session,
+                                  KEEPALIVE_MAX_PER_HOST,
+                                  KEEPALIVE_IDLE_TIMEOUT);
+    }
+  *r_session = http_session_ref (keepalive_session);
+  return 0;
+}
+
+
 /* Send an HTTP request.  On success returns an estream object at
    R_FP.  HOSTPORTSTR is only used for diagnostics.  If HTTPHOST is
    not NULL it will be used as HTTP "Host" header.  If POST_CB is not
    NULL a post request is used and that callback is called to allow
-   writing the post data.  */
+   writing the post data; it may be called a second time if an idle
+   connection turned out to be closed by the server.  */
 static gpg_error_t
 send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
               const char *httphost, unsigned int httpflags,
@@ -938,23 +994,22 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   http_session_t session = NULL;
   http_t http = NULL;
   int redirects_left = MAX_REDIRECTS;
+  int retried = 0;
   estream_t fp = NULL;
   char *request_buffer = NULL;
 
   *r_fp = NULL;
 
-  err = http_session_new (&session, NULL);
+ once_more:
+  err = get_session (&session);
   if (err)
     goto leave;
-  http_session_set_log_cb (session, cert_log_cb);
-
- once_more:
   err = http_open (&http,
                    post_cb? HTTP_REQ_POST : HTTP_REQ_GET,
                    request,
                    httphost,
                    /* fixme: AUTH */ NULL,
-                   httpflags,
+                   httpflags | (retried? HTTP_FLAG_NO_REUSE : 0),
                    /* fixme: proxy*/ NULL,
                    session,
                    NULL,
@@ -978,6 +1033,19 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
     }
   if (err)
     {
+      if (!retried && http_may_retry (http))
+        {
+          /* The server closed the idle connection.  */
+          if (opt.verbose)
+            log_info ("idle connection to '%s' lost - retrying\n",
+                      hostportstr);
+          retried = 1;
+          http_close (http, 0);
+          http = NULL;
+          http_session_release (session);
+          session = NULL;
+          goto once_more;
+        }
       /* Fixme: After a redirection we show the old host name.  */
       log_error (_("error connecting to '%s': %s\n"),
                  hostportstr, gpg_strerror (err));
@@ -989,6 +1057,19 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
   err = http_wait_response (http);
   if (err)
     {
+      if (!retried && http_may_retry (http))
+        {
+          /* The server closed the idle connection.  */
+          if (opt.verbose)
+            log_info ("idle connection to '%s' lost - retrying\n",
+                      hostportstr);
+          retried = 1;
+          http_close (http, 0);
+          http = NULL;
+          http_session_release (session);
+          session = NULL;
+          goto once_more;
+        }
       log_error (_("error reading HTTP response for '%s': %s\n"),
                  hostportstr, gpg_strerror (err));
       goto leave;
@@ -1024,6 +1105,8 @@ send_request (ctrl_t ctrl, const char *request, const char *hostportstr,
                 request = request_buffer;
                 http_close (http, 0);
                 http = NULL;
+                http_session_release (session);
+                session = NULL;
                 goto once_more;
               }
             err = gpg_error_from_syserror ();
@@ -1300,9 +1383,12 @@ ks_hkp_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
 
 /* Get the key described key the KEYSPEC string from the keyserver
    identified by URI.  On success R_FP has an open stream to read the
-   data.  */
+   data.  If R_SOURCE is not NULL the name of the host which delivered
+   the key is stored there instead of emitting a SOURCE status line;
+   the caller needs to xfree it.  */
 gpg_error_t
-ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
+ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
+            char **r_source, estream_t *r_fp)
 {
   gpg_error_t err;
   KEYDB_SEARCH_DESC desc;
@@ -1318,6 +1404,8 @@ ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
   unsigned int tries = SEND_REQUEST_RETRIES;
 
   *r_fp = NULL;
+  if (r_source)
+    *r_source = NULL;
 
   /* Remove search type indicator and adjust PATTERN accordingly.
      Note that HKP keyservers like the 0x to be present when searching
@@ -1394,9 +1482,17 @@ ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec, estream_t *r_fp)
   if (err)
     goto leave;
 
-  err = dirmngr_status (ctrl, "SOURCE", hostport, NULL);
-  if (err)
-    goto leave;
+  if (r_source)
+    {
+      *r_source = hostport;
+      hostport = NULL;
+    }
+  else
+    {
+      err = dirmngr_status (ctrl, "SOURCE", hostport, NULL);
+      if (err)
+        goto leave;
+    }
 
   /* Return the read stream and close the HTTP context.  */
   *r_fp = fp;
@@ -1,5 +1,5 @@
 /* ocsp.c - OCSP management
- *      Copyright (C) 2004, 2007 g10 Code GmbH
+ *      Copyright (C) 2004, 2007, 2015 g10 Code GmbH
  *
  * This file is part of DirMngr.
  *
@@ -22,6 +22,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include <assert.h>
 
 #include "dirmngr.h"
@@ -34,6 +36,16 @@
 /* The maximum size we allow as a response from an OCSP reponder. */
 #define MAX_RESPONSE_SIZE 65536
 
+/* The directory below the cache directory used to store verified OCSP
+   responses.  */
+#define OCSP_CACHE_DIR "ocsp.d"
+
+/* The version of the files in OCSP_CACHE_DIR.  */
+#define OCSP_CACHE_FILE_VERSION 1
+
+/* The maximum number of responses we keep in memory.  */
+#define OCSP_CACHE_MAX_ITEMS 4096
+
 
 static const char oidstr_ocsp[] = "1.3.6.1.5.5.7.48.1";
 
@@ -47,6 +59,46 @@ static const char oidstr_ocsp[] = "1.3.6.1.5.5.7.48.1";
 static const char oidstr_certHash[] = "1.3.36.8.3.13";
 
 
+/* The status of a certificate as returned by the OCSP responder.  */
+struct cert_status_s
+{
+  ksba_status_t status;
+  ksba_crl_reason_t reason;
+  ksba_isotime_t this_update;
+  ksba_isotime_t next_update;
+  ksba_isotime_t revocation_time;
+};
+
+
+/* An item of the OCSP response cache.  Only responses with a verified
+   signature are put into the cache; thus a cache hit does not require
+   any public key operation.  The items are kept in a hash table
+   indexed by the first byte of the issuer key hash.  No locking is
+   required because the memory cache functions do not call any
+   function which may switch threads.  The verified responses are
+   also stored in OCSP_CACHE_DIR; their signature is verified again
+   when they are loaded.  */
+struct ocsp_cache_item_s
+{
+  struct ocsp_cache_item_s *next;
+  struct cert_status_s cs;
+  int default_signer;  /* The response was checked against the
+                          configured default signer.  */
+  char key[1];  /* The cache key as returned by make_cache_key.  */
+};
+typedef struct ocsp_cache_item_s *ocsp_cache_item_t;
+
+static ocsp_cache_item_t ocsp_cache[256];
+static unsigned int ocsp_cache_nitems;
+
+/* Statistics for the OCSP response cache.  */
+static struct
+{
+  unsigned long hits;    /* Number of responses found in memory.  */
+  unsigned long loads;   /* Number of responses loaded from disk.  */
+  unsigned long misses;  /* Number of requests sent to a responder.  */
+} ocsp_cache_stats;
+
 
 
 /* Read from FP and return a newly allocated buffer in R_BUFFER with the
@@ -114,48 +166,467 @@ read_response (estream_t fp, unsigned char **r_buffer, size_t *r_buflen)
 }
 
 
-/* Construct an OCSP request, send it to the configured OCSP responder
-   and parse the response. On success the OCSP context may be used to
-   further process the reponse. */
+/* Return the key used to cache the response about CERT issued by
+   ISSUER_CERT.  This is the hex encoded SHA-1 hash of the issuer's
+   public key, a dash and the hex encoded serial number of CERT.
+   Returns NULL if no key can be build.  */
+static char *
+make_cache_key (ksba_cert_t cert, ksba_cert_t issuer_cert)
+{
+  ksba_sexp_t pk, sn;
+  size_t pklen;
+  char *keyhash = NULL;
+  char *serial = NULL;
+  char *key = NULL;
+
+  pk = ksba_cert_get_public_key (issuer_cert);
+  pklen = pk? gcry_sexp_canon_len (pk, 0, NULL, NULL) : 0;
+  if (pklen)
+    keyhash = hashify_data ((const char *)pk, pklen);
+  sn = ksba_cert_get_serial (cert);
+  if (sn)
+    serial = serial_hex (sn);
+  /* The key is also used as file name; thus we limit its length.  */
+  if (keyhash && serial && strlen (serial) <= 128)
+    key = strconcat (keyhash, "-", serial, NULL);
+  xfree (serial);
+  xfree (keyhash);
+  ksba_free (sn);
+  ksba_free (pk);
+  return key;
+}
+
+
+/* Return true if the status CS may be used at CURRENT_TIME.  A
+   response without a nextUpdate indicates that newer information is
+   always available; such responses are never cached.  */
+static int
+status_is_current (const struct cert_status_s *cs,
+                   const ksba_isotime_t current_time)
+{
+  ksba_isotime_t tmp_time;
+
+  if (cs->status != KSBA_STATUS_GOOD && cs->status != KSBA_STATUS_REVOKED)
+    return 0;
+  if (!*cs->this_update || !*cs->next_update)
+    return 0;
+  if (strcmp (cs->next_update, current_time) <= 0)
+    return 0;
+
+  gnupg_copy_time (tmp_time, current_time);
+  add_seconds_to_isotime (tmp_time, opt.ocsp_max_clock_skew);
+  if (strcmp (cs->this_update, tmp_time) > 0)
+    return 0;  /* The status is from the future.  */
+
+  gnupg_copy_time (tmp_time, cs->this_update);
+  add_seconds_to_isotime (tmp_time, opt.ocsp_max_period);
+  if (!*tmp_time || strcmp (tmp_time, current_time) < 0)
+    return 0;
+
+  return 1;
+}
+
+
+/* Remove all items from the memory cache.  If ONLY_OUTDATED is set
+   only items which may not be used anymore are removed.  */
+static void
+purge_cache (int only_outdated)
+{
+  ocsp_cache_item_t item, prev, next;
+  ksba_isotime_t current_time;
+  int idx;
+
+  gnupg_get_isotime (current_time);
+  for (idx=0; idx < DIM (ocsp_cache); idx++)
+    for (prev=NULL, item=ocsp_cache[idx]; item; item=next)
+      {
+        next = item->next;
+        if (only_outdated && status_is_current (&item->cs, current_time))
+          {
+            prev = item;
+            continue;
+          }
+        if (prev)
+          prev->next = next;
+        else
+          ocsp_cache[idx] = next;
+        xfree (item);
+        ocsp_cache_nitems--;
+      }
+}
+
+
+/* Look up KEY in the memory cache and store the status at R_CS.
+   DEFAULT_SIGNER tells whether the response needs to be signed by the
+   configured default signer.  Returns true if a usable item has been
+   found.  */
+static int
+cache_lookup (const char *key, int default_signer, struct cert_status_s *r_cs)
+{
+  ocsp_cache_item_t item, prev;
+  ksba_isotime_t current_time;
+  int idx = xtoi_2 (key);
+
+  for (prev=NULL, item=ocsp_cache[idx]; item; prev=item, item=item->next)
+    if (!strcmp (item->key, key))
+      break;
+  if (!item)
+    return 0;
+
+  /* Unlink the item so that it can be moved to the front.  */
+  if (prev)
+    prev->next = item->next;
+  else
+    ocsp_cache[idx] = item->next;
+
+  gnupg_get_isotime (current_time);
+  if (!status_is_current (&item->cs, current_time))
+    {
+      xfree (item);
+      ocsp_cache_nitems--;
+      return 0;
+    }
+
+  item->next = ocsp_cache[idx];
+  ocsp_cache[idx] = item;
+
+  /* A response from a responder which would not be asked now can't
+     be used; query_responder will verify the stored response
+     again.  */
+  if (item->default_signer != default_signer)
+    return 0;
+
+  *r_cs = item->cs;
+  return 1;
+}
+
+
+/* Put the status CS for KEY into the memory cache.  DEFAULT_SIGNER is
+   as for cache_lookup.  */
+static void
+cache_insert (const char *key, int default_signer,
+              const struct cert_status_s *cs)
+{
+  ocsp_cache_item_t item;
+  int idx = xtoi_2 (key);
+
+  for (item=ocsp_cache[idx]; item; item=item->next)
+    if (!strcmp (item->key, key))
+      break;
+  if (item)
+    {
+      /* Replace the old status.  */
+      item->cs = *cs;
+      item->default_signer = default_signer;
+      return;
+    }
+
+  if (ocsp_cache_nitems >= OCSP_CACHE_MAX_ITEMS)
+    {
+      purge_cache (1);
+      /* If all items are still in use we start over; the responses
+         can be reloaded from disk.  */
+      if (ocsp_cache_nitems >= OCSP_CACHE_MAX_ITEMS)
+        purge_cache (0);
+    }
+
+  item = xtrymalloc (sizeof *item + strlen (key));
+  if (!item)
+    {
+      log_error (_("allocating list item failed: %s\n"),
+                 gpg_strerror (gpg_error_from_syserror ()));
+      return;
+    }
+  strcpy (item->key, key);
+  item->cs = *cs;
+  item->default_signer = default_signer;
+  item->next = ocsp_cache[idx];
+  ocsp_cache[idx] = item;
+  ocsp_cache_nitems++;
+}
+
+
+/* Return the name of the file with the response for KEY.  SUFFIX is
+   appended to the name.  */
+static char *
+cache_file_name (const char *key, const char *suffix)
+{
+  char *bname, *fname;
+
+  bname = strconcat (key, suffix, NULL);
+  if (!bname)
+    return NULL;
+  fname = make_filename (opt.homedir_cache, OCSP_CACHE_DIR, bname, NULL);
+  xfree (bname);
+  return fname;
+}
+
+
+/* Store the RESPONSE of RESPONSELEN bytes for KEY in the cache
+   directory.  NONCE is the nonce which was used for the request; it is
+   required to parse the response again.  Errors are logged but
+   otherwise ignored.  The file starts with a version byte, a byte
+   with the length of the nonce and the nonce, followed by the DER
+   encoded response.  */
+static void
+cache_store_response (const char *key,
+                      const unsigned char *nonce, size_t noncelen,
+                      const unsigned char *response, size_t responselen)
+{
+  static unsigned int counter;
+  char *dname, *fname = NULL, *tmpfname = NULL;
+  char suffix[50];
+  estream_t fp;
+
+  if (noncelen > 255)
+    return;
+
+  dname = make_filename (opt.homedir_cache, OCSP_CACHE_DIR, NULL);
+  if (access (dname, F_OK) && gnupg_mkdir (dname, "-rwx"))
+    {
+      log_error (_("error creating directory '%s': %s\n"),
+                 dname, strerror (errno));
+      goto leave;
+    }
+
+  fname = cache_file_name (key, ".der");
+  /* Several threads may store a response for the same key; thus the
+     name of the temporary file needs to be unique.  */
+  snprintf (suffix, sizeof suffix, ".%lu-%u.tmp",
+            (unsigned long)getpid (), counter++);
+  tmpfname = cache_file_name (key, suffix);
+  if (!fname || !tmpfname)
+    goto leave;
+
+  fp = es_fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      log_error (_("error creating '%s': %s\n"), tmpfname, strerror (errno));
+      goto leave;
+    }
+  es_putc (OCSP_CACHE_FILE_VERSION, fp);
+  es_putc (noncelen, fp);
+  es_write (fp, nonce, noncelen, NULL);
+  es_write (fp, response, responselen, NULL);
+  if (es_ferror (fp) || es_fclose (fp))
+    {
+      log_error (_("error writing '%s': %s\n"), tmpfname, strerror (errno));
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+#ifdef HAVE_W32_SYSTEM
+  /* No atomic mv on W32 systems.  */
+  gnupg_remove (fname);
+#endif
+  if (rename (tmpfname, fname))
+    {
+      log_error (_("error renaming '%s' to '%s': %s\n"),
+                 tmpfname, fname, strerror (errno));
+      gnupg_remove (tmpfname);
+    }
+
+ leave:
+  xfree (tmpfname);
+  xfree (fname);
+  xfree (dname);
+}
+
+
+/* Read the response for KEY from the cache directory.  On success the
+   response is stored at R_RESPONSE and R_RESPONSELEN and the nonce
+   used for the request at NONCE, which must provide 255 bytes, and
+   R_NONCELEN.  */
+static gpg_error_t
+cache_read_response (const char *key,
+                     unsigned char *nonce, size_t *r_noncelen,
+                     unsigned char **r_response, size_t *r_responselen)
+{
+  gpg_error_t err;
+  char *fname;
+  estream_t fp;
+  int c;
+  size_t n;
+
+  *r_response = NULL;
+  fname = cache_file_name (key, ".der");
+  if (!fname)
+    return gpg_error_from_syserror ();
+  fp = es_fopen (fname, "rb");
+  xfree (fname);
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  err = 0;
+  if (es_getc (fp) != OCSP_CACHE_FILE_VERSION
+      || (c = es_getc (fp)) == EOF
+      || es_read (fp, nonce, c, &n) || n != c)
+    err = gpg_error (GPG_ERR_INV_OBJ);
+  else
+    {
+      *r_noncelen = c;
+      err = read_response (fp, r_response, r_responselen);
+    }
+  es_fclose (fp);
+  return err;
+}
+
+
+/* Remove the stored response for KEY.  */
+static void
+cache_remove_response (const char *key)
+{
+  char *fname = cache_file_name (key, ".der");
+
+  if (fname)
+    gnupg_remove (fname);
+  xfree (fname);
+}
+
+
+/* Flush the memory cache.  The responses stored on disk are kept; they
+   are verified again before they are used.  */
+void
+ocsp_cache_flush (void)
+{
+  purge_cache (0);
+}
+
+
+/* Return the statistics of the OCSP response cache.  */
+void
+ocsp_cache_get_stats (unsigned long *r_hits, unsigned long *r_loads,
+                      unsigned long *r_misses, unsigned int *r_entries)
+{
+  *r_hits = ocsp_cache_stats.hits;
+  *r_loads = ocsp_cache_stats.loads;
+  *r_misses = ocsp_cache_stats.misses;
+  *r_entries = ocsp_cache_nitems;
+}
+
+
+/* Print some statistics to the log file.  */
+void
+ocsp_cache_print_stats (void)
+{
+  log_info (_("OCSP cache: %u responses; %lu hits, %lu loaded,"
+              " %lu requested\n"),
+            ocsp_cache_nitems, ocsp_cache_stats.hits,
+            ocsp_cache_stats.loads, ocsp_cache_stats.misses);
+}
+
+
+
+
+/* Prepare OCSP to deal with the status of CERT issued by ISSUER_CERT.
+   If *R_NONCELEN is zero a fresh nonce is created and stored at NONCE,
+   which must provide 32 bytes, and its length at R_NONCELEN.  Else the
+   given nonce is used; this is required to parse a cached response.  */
+static gpg_error_t
+prepare_ocsp (ksba_ocsp_t ocsp, ksba_cert_t cert, ksba_cert_t issuer_cert,
+              unsigned char *nonce, size_t *r_noncelen)
+{
+  gpg_error_t err;
+  size_t n;
+
+  err = ksba_ocsp_add_target (ocsp, cert, issuer_cert);
+  if (err)
+    {
+      log_error (_("error setting OCSP target: %s\n"), gpg_strerror (err));
+      return err;
+    }
+
+  if (!*r_noncelen)
+    {
+      n = ksba_ocsp_set_nonce (ocsp, NULL, 0);
+      if (n > 32)
+        n = 32;
+      gcry_create_nonce (nonce, n);
+      *r_noncelen = n;
+    }
+  ksba_ocsp_set_nonce (ocsp, nonce, *r_noncelen);
+  return 0;
+}
+
+
+/* Parse the RESPONSE of RESPONSELEN bytes received from URL into
+   OCSP and hash it using MD.  */
+static gpg_error_t
+parse_ocsp_response (ksba_ocsp_t ocsp, gcry_md_hd_t md, const char *url,
+                     unsigned char *response, size_t responselen)
+{
+  gpg_error_t err;
+  ksba_ocsp_response_status_t response_status;
+  const char *t;
+
+  err = ksba_ocsp_parse_response (ocsp, response, responselen,
+                                  &response_status);
+  if (err)
+    {
+      log_error (_("error parsing OCSP response for '%s': %s\n"),
+                 url, gpg_strerror (err));
+      return err;
+    }
+
+  switch (response_status)
+    {
+    case KSBA_OCSP_RSPSTATUS_SUCCESS:      t = "success"; break;
+    case KSBA_OCSP_RSPSTATUS_MALFORMED:    t = "malformed"; break;
+    case KSBA_OCSP_RSPSTATUS_INTERNAL:     t = "internal error"; break;
+    case KSBA_OCSP_RSPSTATUS_TRYLATER:     t = "try later"; break;
+    case KSBA_OCSP_RSPSTATUS_SIGREQUIRED:  t = "must sign request"; break;
+    case KSBA_OCSP_RSPSTATUS_UNAUTHORIZED: t = "unauthorized"; break;
+    case KSBA_OCSP_RSPSTATUS_REPLAYED:     t = "replay detected"; break;
+    case KSBA_OCSP_RSPSTATUS_OTHER:        t = "other (unknown)"; break;
+    case KSBA_OCSP_RSPSTATUS_NONE:         t = "no status"; break;
+    default:                               t = "[unknown status]"; break;
+    }
+  if (response_status == KSBA_OCSP_RSPSTATUS_SUCCESS)
+    {
+      if (opt.verbose)
+        log_info (_("OCSP responder at '%s' status: %s\n"), url, t);
+
+      err = ksba_ocsp_hash_response (ocsp, response, responselen,
+                                     HASH_FNC, md);
+      if (err)
+        log_error (_("hashing the OCSP response for '%s' failed: %s\n"),
+                   url, gpg_strerror (err));
+    }
+  else
+    {
+      log_error (_("OCSP responder at '%s' status: %s\n"), url, t);
+      err = gpg_error (GPG_ERR_GENERAL);
+    }
+
+  return err;
+}
+
+
+/* Construct an OCSP request for the target set by prepare_ocsp, send
+   it to the configured OCSP responder and parse the response. On
+   success the OCSP context may be used to further process the reponse
+   and the raw response is stored at R_RESPONSE and R_RESPONSELEN. */
 static gpg_error_t
 do_ocsp_request (ctrl_t ctrl, ksba_ocsp_t ocsp, gcry_md_hd_t md,
-                 const char *url, ksba_cert_t cert, ksba_cert_t issuer_cert)
+                 const char *url,
+                 unsigned char **r_response, size_t *r_responselen)
 {
   gpg_error_t err;
   unsigned char *request, *response;
   size_t requestlen, responselen;
   http_t http;
-  ksba_ocsp_response_status_t response_status;
-  const char *t;
   int redirects_left = 2;
   char *free_this = NULL;
 
   (void)ctrl;
 
+  *r_response = NULL;
+
   if (opt.disable_http)
     {
       log_error (_("OCSP request not possible due to disabled HTTP\n"));
       return gpg_error (GPG_ERR_NOT_SUPPORTED);
     }
 
-  err = ksba_ocsp_add_target (ocsp, cert, issuer_cert);
-  if (err)
-    {
-      log_error (_("error setting OCSP target: %s\n"), gpg_strerror (err));
-      return err;
-    }
-
-  {
-    size_t n;
-    unsigned char nonce[32];
-
-    n = ksba_ocsp_set_nonce (ocsp, NULL, 0);
-    if (n > sizeof nonce)
-      n = sizeof nonce;
-    gcry_create_nonce (nonce, n);
-    ksba_ocsp_set_nonce (ocsp, nonce, n);
-  }
-
   err = ksba_ocsp_build_request (ocsp, &request, &requestlen);
   if (err)
     {
@@ -249,48 +720,14 @@ do_ocsp_request (ctrl_t ctrl, ksba_ocsp_t ocsp, gcry_md_hd_t md,
       return err;
     }
 
-  err = ksba_ocsp_parse_response (ocsp, response, responselen,
-                                  &response_status);
+  err = parse_ocsp_response (ocsp, md, url, response, responselen);
   if (err)
-    {
-      log_error (_("error parsing OCSP response for '%s': %s\n"),
-                 url, gpg_strerror (err));
-      xfree (response);
-      xfree (free_this);
-      return err;
-    }
-
-  switch (response_status)
-    {
-    case KSBA_OCSP_RSPSTATUS_SUCCESS:      t = "success"; break;
-    case KSBA_OCSP_RSPSTATUS_MALFORMED:    t = "malformed"; break;
-    case KSBA_OCSP_RSPSTATUS_INTERNAL:     t = "internal error"; break;
-    case KSBA_OCSP_RSPSTATUS_TRYLATER:     t = "try later"; break;
-    case KSBA_OCSP_RSPSTATUS_SIGREQUIRED:  t = "must sign request"; break;
-    case KSBA_OCSP_RSPSTATUS_UNAUTHORIZED: t = "unauthorized"; break;
-    case KSBA_OCSP_RSPSTATUS_REPLAYED:     t = "replay detected"; break;
-    case KSBA_OCSP_RSPSTATUS_OTHER:        t = "other (unknown)"; break;
-    case KSBA_OCSP_RSPSTATUS_NONE:         t = "no status"; break;
-    default:                               t = "[unknown status]"; break;
-    }
-  if (response_status == KSBA_OCSP_RSPSTATUS_SUCCESS)
-    {
-      if (opt.verbose)
-        log_info (_("OCSP responder at '%s' status: %s\n"), url, t);
-
-      err = ksba_ocsp_hash_response (ocsp, response, responselen,
-                                     HASH_FNC, md);
-      if (err)
-        log_error (_("hashing the OCSP response for '%s' failed: %s\n"),
-                   url, gpg_strerror (err));
-    }
+    xfree (response);
   else
     {
-      log_error (_("OCSP responder at '%s' status: %s\n"), url, t);
-      err = gpg_error (GPG_ERR_GENERAL);
+      *r_response = response;
+      *r_responselen = responselen;
     }
-
-  xfree (response);
   xfree (free_this);
   return err;
 }
@@ -511,73 +948,124 @@ check_signature (ctrl_t ctrl,
 }
 
 
-/* Check whether the certificate either given by fingerprint CERT_FPR
-   or directly through the CERT object is valid by running an OCSP
-   transaction.  With FORCE_DEFAULT_RESPONDER set only the configured
-   default responder is used. */
-gpg_error_t
-ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
-              int force_default_responder)
+/* Check the signature of the response parsed into OCSP and hashed
+   using MD and store the status of CERT at R_CS.  DEFAULT_SIGNER is
+   the list of signers of the default OCSP responder or NULL if the
+   responder has been taken from the certificate.  */
+static gpg_error_t
+check_ocsp_response (ctrl_t ctrl, ksba_ocsp_t ocsp, gcry_md_hd_t md,
+                     fingerprint_list_t default_signer, ksba_cert_t cert,
+                     struct cert_status_s *r_cs)
 {
   gpg_error_t err;
-  ksba_ocsp_t ocsp = NULL;
-  ksba_cert_t issuer_cert = NULL;
-  ksba_sexp_t sigval = NULL;
+  ksba_sexp_t sigval;
   gcry_sexp_t s_sig = NULL;
-  ksba_isotime_t current_time;
-  ksba_isotime_t this_update, next_update, revocation_time, produced_at;
-  ksba_isotime_t tmp_time;
-  ksba_status_t status;
-  ksba_crl_reason_t reason;
-  char *url_buffer = NULL;
-  const char *url;
-  gcry_md_hd_t md = NULL;
-  int i, idx;
-  char *oid;
-  ksba_name_t name;
-  fingerprint_list_t default_signer = NULL;
+  ksba_isotime_t produced_at;
 
-  /* Get the certificate.  */
-  if (cert)
-    {
-      ksba_cert_ref (cert);
-
-      err = find_issuing_cert (ctrl, cert, &issuer_cert);
-      if (err)
-        {
-          log_error (_("issuer certificate not found: %s\n"),
-                     gpg_strerror (err));
-          goto leave;
-        }
-    }
-  else
+  /* Check that the answer has a valid signature. */
+  sigval = ksba_ocsp_get_sig_val (ocsp, produced_at);
+  if (!sigval || !*produced_at)
     {
-      cert = get_cert_local (ctrl, cert_fpr);
-      if (!cert)
-        {
-          log_error (_("caller did not return the target certificate\n"));
-          err = gpg_error (GPG_ERR_GENERAL);
-          goto leave;
-        }
-      issuer_cert = get_issuing_cert_local (ctrl, NULL);
-      if (!issuer_cert)
-        {
-          log_error (_("caller did not return the issuing certificate\n"));
-          err = gpg_error (GPG_ERR_GENERAL);
-          goto leave;
-        }
+      err = gpg_error (GPG_ERR_INV_OBJ);
+      goto leave;
     }
+  if ( (err = canon_sexp_to_gcry (sigval, &s_sig)) )
+    goto leave;
+  err = check_signature (ctrl, ocsp, s_sig, md, default_signer);
+  if (err)
+    goto leave;
+
+  /* We only support one certificate per request.  Check that the
+     answer matches the right certificate. */
+  err = ksba_ocsp_get_status (ocsp, cert,
+                              &r_cs->status, r_cs->this_update,
+                              r_cs->next_update, r_cs->revocation_time,
+                              &r_cs->reason);
+  if (err)
+    log_error (_("error getting OCSP status for target certificate: %s\n"),
+               gpg_strerror (err));
+
+ leave:
+  gcry_sexp_release (s_sig);
+  xfree (sigval);
+  return err;
+}
+
+
+/* Get the status of CERT issued by ISSUER_CERT from the response
+   stored in the cache directory under KEY and store it at R_CS.  The
+   signature of the response is verified again using DEFAULT_SIGNER as
+   described for check_ocsp_response.  A response which can't be used
+   anymore is removed.  */
+static gpg_error_t
+load_cached_response (ctrl_t ctrl, const char *key,
+                      ksba_cert_t cert, ksba_cert_t issuer_cert,
+                      fingerprint_list_t default_signer,
+                      struct cert_status_s *r_cs)
+{
+  gpg_error_t err;
+  ksba_ocsp_t ocsp = NULL;
+  gcry_md_hd_t md = NULL;
+  unsigned char nonce[255];
+  size_t noncelen;
+  unsigned char *response;
+  size_t responselen;
+  ksba_isotime_t current_time;
+
+  err = cache_read_response (key, nonce, &noncelen, &response, &responselen);
+  if (err)
+    return err;
 
-  /* Create an OCSP instance.  */
   err = ksba_ocsp_new (&ocsp);
+  if (!err)
+    err = gcry_md_open (&md, GCRY_MD_SHA1, 0);
+  if (!err)
+    err = prepare_ocsp (ocsp, cert, issuer_cert, nonce, &noncelen);
+  if (!err)
+    err = parse_ocsp_response (ocsp, md, key, response, responselen);
+  if (!err)
+    err = check_ocsp_response (ctrl, ocsp, md, default_signer, cert, r_cs);
+  if (!err)
+    {
+      gnupg_get_isotime (current_time);
+      if (!status_is_current (r_cs, current_time))
+        err = gpg_error (GPG_ERR_TIME_CONFLICT);
+    }
   if (err)
     {
-      log_error (_("failed to allocate OCSP context: %s\n"),
-                 gpg_strerror (err));
-      goto leave;
+      if (opt.verbose)
+        log_info ("removing cached OCSP response '%s': %s\n",
+                  key, gpg_strerror (err));
+      cache_remove_response (key);
     }
 
+  gcry_md_close (md);
+  ksba_ocsp_release (ocsp);
+  xfree (response);
+  return err;
+}
+
+
+/* Figure out the OCSP responder to ask about CERT.  With
+   FORCE_DEFAULT_RESPONDER set only the configured default responder
+   is used.  On success the URL of the responder is stored at R_URL
+   and, if it has been taken from the certificate, also at
+   R_URL_BUFFER which must be released by the caller.  If the default
+   responder is used its signer is stored at R_DEFAULT_SIGNER.  */
+static gpg_error_t
+get_responder (ksba_cert_t cert, int force_default_responder,
+               char **r_url_buffer, const char **r_url,
+               fingerprint_list_t *r_default_signer)
+{
+  gpg_error_t err = 0;
+  const char *url;
+  int i, idx;
+  char *oid;
+  ksba_name_t name;
 
+  *r_url_buffer = NULL;
+  *r_url = NULL;
+  *r_default_signer = NULL;
 
   /* Figure out the OCSP responder to use.
      1. Try to get the reponder from the certificate.
@@ -596,7 +1084,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
               char *p = ksba_name_get_uri (name, i);
               if (p && (!ascii_strncasecmp (p, "http:", 5)
                         || !ascii_strncasecmp (p, "https:", 6)))
-                url = url_buffer = p;
+                url = *r_url_buffer = p;
               else
                 xfree (p);
             }
@@ -609,6 +1097,7 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
       log_error (_("can't get authorityInfoAccess: %s\n"), gpg_strerror (err));
       goto leave;
     }
+  err = 0;
   if (!url)
     {
       if (!opt.ocsp_responder || !*opt.ocsp_responder)
@@ -624,14 +1113,70 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
           goto leave;
         }
       url = opt.ocsp_responder;
-      default_signer = opt.ocsp_signer;
-      if (opt.verbose)
+      *r_default_signer = opt.ocsp_signer;
+    }
+  *r_url = url;
+
+ leave:
+  if (err)
+    {
+      xfree (*r_url_buffer);
+      *r_url_buffer = NULL;
+    }
+  return err;
+}
+
+
+/* Get the status of CERT issued by ISSUER_CERT by running an OCSP
+   transaction with the responder at URL and store it at R_CS.  If
+   DEFAULT_SIGNER is not NULL the response must be signed by one of
+   the listed certificates.  If CACHE_KEY is not NULL a response
+   stored in the cache directory is used instead of asking the
+   responder and a new response is put into the cache.  */
+static gpg_error_t
+query_responder (ctrl_t ctrl, ksba_cert_t cert, ksba_cert_t issuer_cert,
+                 const char *url, fingerprint_list_t default_signer,
+                 const char *cache_key, struct cert_status_s *r_cs)
+{
+  gpg_error_t err;
+  ksba_ocsp_t ocsp = NULL;
+  gcry_md_hd_t md = NULL;
+  unsigned char nonce[32];
+  size_t noncelen = 0;
+  unsigned char *response = NULL;
+  size_t responselen;
+  ksba_isotime_t current_time;
+
+  if (opt.verbose)
+    {
+      if (default_signer)
         log_info (_("using default OCSP responder '%s'\n"), url);
+      else
+        log_info (_("using OCSP responder '%s'\n"), url);
     }
-  else
+
+  /* A stored response is used only if it can be verified in the same
+     way as a response from the responder we would ask now.  */
+  if (cache_key
+      && !load_cached_response (ctrl, cache_key, cert, issuer_cert,
+                                default_signer, r_cs))
     {
       if (opt.verbose)
-        log_info (_("using OCSP responder '%s'\n"), url);
+        log_info (_("using cached OCSP response\n"));
+      ocsp_cache_stats.loads++;
+      cache_insert (cache_key, !!default_signer, r_cs);
+      err = 0;
+      goto leave;
+    }
+  ocsp_cache_stats.misses++;
+
+  /* Create an OCSP instance.  */
+  err = ksba_ocsp_new (&ocsp);
+  if (err)
+    {
+      log_error (_("failed to allocate OCSP context: %s\n"),
+                 gpg_strerror (err));
+      goto leave;
     }
 
   /* Ask the OCSP responder. */
@@ -642,40 +1187,109 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
                  gpg_strerror (err));
       goto leave;
     }
-  err = do_ocsp_request (ctrl, ocsp, md, url, cert, issuer_cert);
+  err = prepare_ocsp (ocsp, cert, issuer_cert, nonce, &noncelen);
   if (err)
     goto leave;
-
-  /* We got a useful answer, check that the answer has a valid signature. */
-  sigval = ksba_ocsp_get_sig_val (ocsp, produced_at);
-  if (!sigval || !*produced_at)
-    {
-      err = gpg_error (GPG_ERR_INV_OBJ);
-      goto leave;
-    }
-  if ( (err = canon_sexp_to_gcry (sigval, &s_sig)) )
+  err = do_ocsp_request (ctrl, ocsp, md, url, &response, &responselen);
+  if (err)
     goto leave;
-  xfree (sigval);
-  sigval = NULL;
-  err = check_signature (ctrl, ocsp, s_sig, md, default_signer);
+
+  /* We got a useful answer, check it and get the status. */
+  err = check_ocsp_response (ctrl, ocsp, md, default_signer, cert, r_cs);
   if (err)
     goto leave;
 
-  /* We only support one certificate per request.  Check that the
-     answer matches the right certificate. */
-  err = ksba_ocsp_get_status (ocsp, cert,
-                              &status, this_update, next_update,
-                              revocation_time, &reason);
+  gnupg_get_isotime (current_time);
+  if (cache_key && status_is_current (r_cs, current_time))
+    {
+      cache_insert (cache_key, !!default_signer, r_cs);
+      cache_store_response (cache_key, nonce, noncelen,
+                            response, responselen);
+    }
+
+ leave:
+  gcry_md_close (md);
+  ksba_ocsp_release (ocsp);
+  xfree (response);
+  return err;
+}
+
+
+/* Check whether the certificate either given by fingerprint CERT_FPR
+   or directly through the CERT object is valid by running an OCSP
+   transaction.  With FORCE_DEFAULT_RESPONDER set only the configured
+   default responder is used.  A cached response is used if it is
+   still current. */
+gpg_error_t
+ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
+              int force_default_responder)
+{
+  gpg_error_t err;
+  ksba_cert_t issuer_cert = NULL;
+  ksba_isotime_t current_time;
+  ksba_isotime_t tmp_time;
+  struct cert_status_s cs;
+  char *cache_key = NULL;
+  char *url_buffer = NULL;
+  const char *url;
+  fingerprint_list_t default_signer;
+
+  /* Get the certificate.  */
+  if (cert)
+    {
+      ksba_cert_ref (cert);
+
+      err = find_issuing_cert (ctrl, cert, &issuer_cert);
+      if (err)
+        {
+          log_error (_("issuer certificate not found: %s\n"),
+                     gpg_strerror (err));
+          goto leave;
+        }
+    }
+  else
+    {
+      cert = get_cert_local (ctrl, cert_fpr);
+      if (!cert)
+        {
+          log_error (_("caller did not return the target certificate\n"));
+          err = gpg_error (GPG_ERR_GENERAL);
+          goto leave;
+        }
+      issuer_cert = get_issuing_cert_local (ctrl, NULL);
+      if (!issuer_cert)
+        {
+          log_error (_("caller did not return the issuing certificate\n"));
+          err = gpg_error (GPG_ERR_GENERAL);
+          goto leave;
+        }
+    }
+
+  /* Get the status from the cache or the OCSP responder.  A cached
+     status is only used if it has been checked against the same
+     signer as the one of the responder we would ask now.  */
+  err = get_responder (cert, force_default_responder,
+                       &url_buffer, &url, &default_signer);
   if (err)
+    goto leave;
+  cache_key = make_cache_key (cert, issuer_cert);
+  if (cache_key && cache_lookup (cache_key, !!default_signer, &cs))
     {
-      log_error (_("error getting OCSP status for target certificate: %s\n"),
-                 gpg_strerror (err));
-      goto leave;
+      ocsp_cache_stats.hits++;
+      if (opt.verbose)
+        log_info (_("using cached OCSP response\n"));
+    }
+  else
+    {
+      err = query_responder (ctrl, cert, issuer_cert,
+                             url, default_signer, cache_key, &cs);
+      if (err)
+        goto leave;
     }
 
   /* In case the certificate has been revoked, we better invalidate
      our cached validation status. */
-  if (status == KSBA_STATUS_REVOKED)
+  if (cs.status == KSBA_STATUS_REVOKED)
     {
       time_t validated_at = 0; /* That is: No cached validation available. */
       err = ksba_cert_set_user_data (cert, "validated_at",
@@ -694,77 +1308,78 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
   if (opt.verbose)
     {
       log_info (_("certificate status is: %s  (this=%s  next=%s)\n"),
-                status == KSBA_STATUS_GOOD? _("good"):
-                status == KSBA_STATUS_REVOKED? _("revoked"):
-                status == KSBA_STATUS_UNKNOWN? _("unknown"):
-                status == KSBA_STATUS_NONE? _("none"): "?",
-                this_update, next_update);
-      if (status == KSBA_STATUS_REVOKED)
+                cs.status == KSBA_STATUS_GOOD? _("good"):
+                cs.status == KSBA_STATUS_REVOKED? _("revoked"):
+                cs.status == KSBA_STATUS_UNKNOWN? _("unknown"):
+                cs.status == KSBA_STATUS_NONE? _("none"): "?",
+                cs.this_update, cs.next_update);
+      if (cs.status == KSBA_STATUS_REVOKED)
         log_info (_("certificate has been revoked at: %s due to: %s\n"),
-                  revocation_time,
-                  reason == KSBA_CRLREASON_UNSPECIFIED?   "unspecified":
-                  reason == KSBA_CRLREASON_KEY_COMPROMISE? "key compromise":
-                  reason == KSBA_CRLREASON_CA_COMPROMISE?   "CA compromise":
-                  reason == KSBA_CRLREASON_AFFILIATION_CHANGED?
+                  cs.revocation_time,
+                  cs.reason == KSBA_CRLREASON_UNSPECIFIED?   "unspecified":
+                  cs.reason == KSBA_CRLREASON_KEY_COMPROMISE? "key compromise":
+                  cs.reason == KSBA_CRLREASON_CA_COMPROMISE?   "CA compromise":
+                  cs.reason == KSBA_CRLREASON_AFFILIATION_CHANGED?
                                                       "affiliation changed":
-                  reason == KSBA_CRLREASON_SUPERSEDED?   "superseeded":
-                  reason == KSBA_CRLREASON_CESSATION_OF_OPERATION?
+                  cs.reason == KSBA_CRLREASON_SUPERSEDED?   "superseeded":
+                  cs.reason == KSBA_CRLREASON_CESSATION_OF_OPERATION?
                                                   "cessation of operation":
-                  reason == KSBA_CRLREASON_CERTIFICATE_HOLD?
+                  cs.reason == KSBA_CRLREASON_CERTIFICATE_HOLD?
                                                   "certificate on hold":
-                  reason == KSBA_CRLREASON_REMOVE_FROM_CRL?
+                  cs.reason == KSBA_CRLREASON_REMOVE_FROM_CRL?
                                                   "removed from CRL":
-                  reason == KSBA_CRLREASON_PRIVILEGE_WITHDRAWN?
+                  cs.reason == KSBA_CRLREASON_PRIVILEGE_WITHDRAWN?
                                                   "privilege withdrawn":
-                  reason == KSBA_CRLREASON_AA_COMPROMISE? "AA compromise":
-                  reason == KSBA_CRLREASON_OTHER?   "other":"?");
+                  cs.reason == KSBA_CRLREASON_AA_COMPROMISE? "AA compromise":
+                  cs.reason == KSBA_CRLREASON_OTHER?   "other":"?");
 
     }
 
 
-  if (status == KSBA_STATUS_REVOKED)
+  if (cs.status == KSBA_STATUS_REVOKED)
     err = gpg_error (GPG_ERR_CERT_REVOKED);
-  else if (status == KSBA_STATUS_UNKNOWN)
+  else if (cs.status == KSBA_STATUS_UNKNOWN)
     err = gpg_error (GPG_ERR_NO_DATA);
-  else if (status != KSBA_STATUS_GOOD)
+  else if (cs.status != KSBA_STATUS_GOOD)
     err = gpg_error (GPG_ERR_GENERAL);
 
   /* Allow for some clock skew. */
   gnupg_get_isotime (current_time);
   add_seconds_to_isotime (current_time, opt.ocsp_max_clock_skew);
 
-  if (strcmp (this_update, current_time) > 0 )
+  if (strcmp (cs.this_update, current_time) > 0 )
     {
       log_error (_("OCSP responder returned a status in the future\n"));
-      log_info ("used now: %s  this_update: %s\n", current_time, this_update);
+      log_info ("used now: %s  this_update: %s\n",
+                current_time, cs.this_update);
       if (!err)
         err = gpg_error (GPG_ERR_TIME_CONFLICT);
     }
 
   /* Check that THIS_UPDATE is not too far back in the past. */
-  gnupg_copy_time (tmp_time, this_update);
+  gnupg_copy_time (tmp_time, cs.this_update);
   add_seconds_to_isotime (tmp_time,
                           opt.ocsp_max_period+opt.ocsp_max_clock_skew);
   if (!*tmp_time || strcmp (tmp_time, current_time) < 0 )
     {
       log_error (_("OCSP responder returned a non-current status\n"));
       log_info ("used now: %s  this_update: %s\n",
-                current_time, this_update);
+                current_time, cs.this_update);
       if (!err)
         err = gpg_error (GPG_ERR_TIME_CONFLICT);
     }
 
   /* Check that we are not beyound NEXT_UPDATE  (plus some extra time). */
-  if (*next_update)
+  if (*cs.next_update)
     {
-      gnupg_copy_time (tmp_time, next_update);
+      gnupg_copy_time (tmp_time, cs.next_update);
       add_seconds_to_isotime (tmp_time,
                               opt.ocsp_current_period+opt.ocsp_max_clock_skew);
       if (!*tmp_time && strcmp (tmp_time, current_time) < 0 )
         {
           log_error (_("OCSP responder returned an too old status\n"));
           log_info ("used now: %s  next_update: %s\n",
-                    current_time, next_update);
+                    current_time, cs.next_update);
           if (!err)
             err = gpg_error (GPG_ERR_TIME_CONFLICT);
         }
@@ -772,13 +1387,10 @@ ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
 
 
  leave:
-  gcry_md_close (md);
-  gcry_sexp_release (s_sig);
-  xfree (sigval);
+  xfree (url_buffer);
+  xfree (cache_key);
   ksba_cert_release (issuer_cert);
   ksba_cert_release (cert);
-  ksba_ocsp_release (ocsp);
-  xfree (url_buffer);
   return err;
 }
 
@@ -28,4 +28,14 @@ gpg_error_t ocsp_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *cert_fpr,
 /* Release the list of OCSP certificates hold in the CTRL object. */
 void release_ctrl_ocsp_certs (ctrl_t ctrl);
 
+/* Flush the in-memory OCSP response cache.  */
+void ocsp_cache_flush (void);
+
+/* Return statistics about the OCSP response cache.  */
+void ocsp_cache_get_stats (unsigned long *r_hits, unsigned long *r_loads,
+                           unsigned long *r_misses, unsigned int *r_entries);
+
+/* Print statistics about the OCSP response cache to the log.  */
+void ocsp_cache_print_stats (void);
+
 #endif /*OCSP_H*/
@@ -1775,7 +1775,10 @@ static const char hlp_getinfo[] =
   "version     - Return the version of the program.\n"
   "pid         - Return the process id of the server.\n"
   "\n"
-  "socket_name - Return the name of the socket.\n";
+  "socket_name - Return the name of the socket.\n"
+  "ocsp_cache_stats - Return the number of OCSP responses taken from\n"
+  "              the memory cache, loaded from disk and requested\n"
+  "              from a responder, and the number of cached responses.\n";
 static gpg_error_t
 cmd_getinfo (assuan_context_t ctx, char *line)
 {
@@ -1805,6 +1808,17 @@ cmd_getinfo (assuan_context_t ctx, char *line)
       else
         err = gpg_error (GPG_ERR_NO_DATA);
     }
+  else if (!strcmp (line, "ocsp_cache_stats"))
+    {
+      char numbuf[100];
+      unsigned long hits, loads, misses;
+      unsigned int entries;
+
+      ocsp_cache_get_stats (&hits, &loads, &misses, &entries);
+      snprintf (numbuf, sizeof numbuf, "%lu %lu %lu %u",
+                hits, loads, misses, entries);
+      err = assuan_send_data (ctx, numbuf, strlen (numbuf));
+    }
   else
     err = set_error (GPG_ERR_ASS_PARAMETER, "unknown value for WHAT");
 
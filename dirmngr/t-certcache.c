@@ -0,0 +1,407 @@
+/* t-certcache.c - Module test and benchmark for certcache.c
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The certificates used here are created by patching the serial
+   number, the subject and the subject key id of a template
+   certificate.  Their signatures are thus not valid, which does not
+   matter for the cache.  Run "t-certcache --bench [N]" to time the
+   lookups for cache sizes up to N certificates.  */
+
+/* We include the module to get access to its internal functions.  */
+#include "certcache.c"
+
+#include <time.h>
+
+
+#define pass()  do { ; } while(0)
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                     errcount++;                                 \
+                   } while(0)
+
+static int errcount;
+
+
+/* An end entity certificate with the serial number 0x11223344556677,
+   the subject "CN=t-certcache 00000000" and the issuer
+   "CN=t-certcache CA".  */
+static const char template_der[] =
+  "\x30\x82\x01\x70\x30\x82\x01\x15\xa0\x03\x02\x01\x02\x02\x07\x11"
+  "\x22\x33\x44\x55\x66\x77\x30\x0a\x06\x08\x2a\x86\x48\xce\x3d\x04"
+  "\x03\x02\x30\x19\x31\x17\x30\x15\x06\x03\x55\x04\x03\x0c\x0e\x74"
+  "\x2d\x63\x65\x72\x74\x63\x61\x63\x68\x65\x20\x43\x41\x30\x1e\x17"
+  "\x0d\x32\x36\x31\x30\x31\x36\x30\x30\x33\x33\x35\x36\x5a\x17\x0d"
+  "\x33\x36\x31\x30\x31\x33\x30\x30\x33\x33\x35\x36\x5a\x30\x1f\x31"
+  "\x1d\x30\x1b\x06\x03\x55\x04\x03\x0c\x14\x74\x2d\x63\x65\x72\x74"
+  "\x63\x61\x63\x68\x65\x20\x30\x30\x30\x30\x30\x30\x30\x30\x30\x59"
+  "\x30\x13\x06\x07\x2a\x86\x48\xce\x3d\x02\x01\x06\x08\x2a\x86\x48"
+  "\xce\x3d\x03\x01\x07\x03\x42\x00\x04\x88\x82\x18\x87\xb0\xf1\x72"
+  "\xb9\xe5\xaf\x99\x4e\x99\xdc\x8d\x58\x49\x42\x0e\x3e\xd0\x69\x73"
+  "\xf1\x59\xda\xe5\xdb\x31\xef\xaf\xf5\x82\x5a\x62\x51\x39\x07\x8c"
+  "\x43\x94\xe3\x3f\xf4\xc7\x6f\x77\xd9\xb0\x14\xae\x4d\x43\x47\xb5"
+  "\x1c\x39\xb4\x0b\xe4\xac\x6b\xd3\x91\xa3\x42\x30\x40\x30\x1d\x06"
+  "\x03\x55\x1d\x0e\x04\x16\x04\x14\x5c\x91\xfc\xf2\x38\x99\xde\x05"
+  "\x5f\x13\xb4\x29\x1f\x59\x65\x0e\x6a\x09\xd1\xbb\x30\x1f\x06\x03"
+  "\x55\x1d\x23\x04\x18\x30\x16\x80\x14\xff\xe3\x1f\x6b\x0b\x44\x57"
+  "\xb0\xfd\x3a\xeb\x05\x0b\xff\xbd\x05\x1b\x24\x28\x1c\x30\x0a\x06"
+  "\x08\x2a\x86\x48\xce\x3d\x04\x03\x02\x03\x49\x00\x30\x46\x02\x21"
+  "\x00\xf7\xef\x68\x0f\xf5\x69\x8b\x7d\x0c\x08\xfc\x7e\xd1\xf8\x81"
+  "\x07\x62\x54\xf3\xa7\xb8\x2a\x92\xde\xe7\x09\x61\xb1\x74\x27\x1d"
+  "\xfd\x02\x21\x00\xf5\x3c\xb3\x09\x6d\xcf\xf6\xa4\x50\x80\xf0\x06"
+  "\x85\x3b\xbb\x01\xe5\xba\xd2\x04\x77\x5e\x0e\x94\x53\x7f\x0b\x7c"
+  "\xa5\x40\x50\xad";
+
+#define ISSUER_DN "CN=t-certcache CA"
+
+/* The offsets of the serial number, the digits of the subject and
+   the subject key id in TEMPLATE_DER.  */
+static size_t serial_off, subject_off, ski_off;
+
+
+
+/* Return the offset of the LEN bytes at PATTERN in TEMPLATE_DER.  */
+static size_t
+find_in_template (const void *pattern, size_t len)
+{
+  size_t n;
+
+  for (n=0; n + len < sizeof template_der; n++)
+    if (!memcmp (template_der + n, pattern, len))
+      return n;
+  fprintf (stderr, "pattern not found in the template\n");
+  exit (1);
+}
+
+
+static void
+find_offsets (void)
+{
+  serial_off = find_in_template ("\x02\x07\x11\x22\x33\x44\x55\x66\x77", 9)+2;
+  subject_off = find_in_template ("00000000", 8);
+  ski_off = find_in_template ("\x04\x14\x5c\x91\xfc\xf2", 6) + 2;
+}
+
+
+/* Store IDX as a 4 byte big endian integer at BUFFER.  */
+static void
+put_idx (unsigned char *buffer, unsigned int idx)
+{
+  buffer[0] = idx >> 24;
+  buffer[1] = idx >> 16;
+  buffer[2] = idx >>  8;
+  buffer[3] = idx;
+}
+
+
+/* Return a new certificate object for the certificate number IDX.  */
+static ksba_cert_t
+make_cert (unsigned int idx)
+{
+  unsigned char der[sizeof template_der - 1];
+  char digits[9];
+  ksba_cert_t cert;
+
+  memcpy (der, template_der, sizeof der);
+  put_idx (der + serial_off + 3, idx);
+  snprintf (digits, sizeof digits, "%08x", idx);
+  memcpy (der + subject_off, digits, 8);
+  put_idx (der + ski_off, idx);
+
+  if (ksba_cert_new (&cert)
+      || ksba_cert_init_from_mem (cert, der, sizeof der))
+    {
+      fprintf (stderr, "error creating certificate %u\n", idx);
+      exit (1);
+    }
+  return cert;
+}
+
+
+/* Build the lookup keys for the certificate number IDX.  SUBJECT
+   needs to have space for 32 bytes, SN and SKI for 40 bytes each.  */
+static void
+make_keys (unsigned int idx, char *subject,
+           unsigned char *sn, unsigned char *ski)
+{
+  snprintf (subject, 32, "CN=t-certcache %08x", idx);
+
+  memcpy (sn, "(7:", 3);
+  memcpy (sn + 3, template_der + serial_off, 3);
+  put_idx (sn + 6, idx);
+  sn[10] = ')';
+
+  memcpy (ski, "(20:", 4);
+  put_idx (ski + 4, idx);
+  memcpy (ski + 8, template_der + ski_off + 4, 16);
+  ski[24] = ')';
+}
+
+
+/* Remove all certificates from the cache.  */
+static void
+flush_cache (void)
+{
+  cert_cache_deinit (1);
+  initialization_done = 1;
+}
+
+
+/* Put the certificates FIRST to FIRST+COUNT-1 into the cache.  */
+static void
+fill_cache (unsigned int first, unsigned int count, int loaded)
+{
+  ksba_cert_t cert;
+  unsigned int idx;
+
+  acquire_cache_write_lock ();
+  for (idx=first; idx < first + count; idx++)
+    {
+      cert = make_cert (idx);
+      if (put_cert (cert, loaded, 0, NULL))
+        fail (idx);
+      ksba_cert_release (cert);
+    }
+  release_cache_lock ();
+}
+
+
+/* Check that CERT has the subject SUBJECT and release CERT.  */
+static void
+check_subject (ksba_cert_t cert, const char *subject)
+{
+  char *dn;
+
+  dn = ksba_cert_get_subject (cert, 0);
+  if (!dn || strcmp (dn, subject))
+    fail (0);
+  ksba_free (dn);
+  ksba_cert_release (cert);
+}
+
+
+/* Look up the certificate number IDX using all indexes and return
+   the number of lookups which found it.  */
+static int
+lookup_cert (unsigned int idx)
+{
+  char subject[32];
+  unsigned char sn[40], ski[40];
+  ksba_cert_t cert;
+  int found = 0;
+
+  make_keys (idx, subject, sn, ski);
+
+  cert = get_cert_bysn (ISSUER_DN, sn);
+  if (cert)
+    {
+      check_subject (cert, subject);
+      found++;
+    }
+
+  cert = get_cert_bysubject (subject, 0);
+  if (cert)
+    {
+      check_subject (cert, subject);
+      found++;
+      cert = get_cert_bysubject (subject, 1);
+      if (cert)
+        {
+          fail (idx);
+          ksba_cert_release (cert);
+        }
+    }
+
+  cert = get_cert_byski (subject, ski);
+  if (cert)
+    {
+      check_subject (cert, subject);
+      found++;
+    }
+
+  return found;
+}
+
+
+
+static void
+test_lookup (void)
+{
+  unsigned int idx;
+  ksba_cert_t cert;
+  char subject[32];
+  unsigned char sn[40], ski[40], dummy[40];
+
+  fill_cache (0, 2000, 1);
+  for (idx=0; idx < 2000; idx++)
+    if (lookup_cert (idx) != 3)
+      fail (idx);
+  if (lookup_cert (2000))
+    fail (2000);
+
+  /* The subject key id of one cert with the subject of another.  */
+  make_keys (5, subject, sn, ski);
+  make_keys (6, subject, sn, dummy);
+  cert = get_cert_byski (subject, ski);
+  if (cert)
+    {
+      fail (0);
+      ksba_cert_release (cert);
+    }
+
+  flush_cache ();
+  for (idx=0; idx < 2000; idx += 100)
+    if (lookup_cert (idx))
+      fail (idx);
+}
+
+
+/* Check that the indexes stay consistent if certificates are dropped
+   from the cache.  */
+static void
+test_drop (void)
+{
+  unsigned int idx, count, found;
+  int n;
+
+  count = MAX_EXTRA_CACHED_CERTS + 100;
+  fill_cache (0, count, 0);
+  for (found=idx=0; idx < count; idx++)
+    {
+      n = lookup_cert (idx);
+      if (n == 3)
+        found++;
+      else if (n)
+        fail (idx);
+    }
+  if (!found || found != total_extra_certificates)
+    fail (found);
+
+  flush_cache ();
+}
+
+
+/* Time the lookups for several cache sizes up to MAXCERTS.  */
+static void
+run_bench (unsigned int maxcerts)
+{
+  static const char *names[3] = { "bysn", "bysubject", "byski" };
+  unsigned int ncerts, idx;
+  char subject[32];
+  unsigned char sn[40], ski[40];
+  ksba_cert_t cert;
+  clock_t start;
+  int what;
+
+  for (ncerts=1000; ncerts <= maxcerts; ncerts *= 4)
+    {
+      fill_cache (0, ncerts, 1);
+      printf ("%6u certs:", ncerts);
+      for (what=0; what < 3; what++)
+        {
+          start = clock ();
+          for (idx=0; idx < ncerts; idx++)
+            {
+              make_keys (idx, subject, sn, ski);
+              if (!what)
+                cert = get_cert_bysn (ISSUER_DN, sn);
+              else if (what == 1)
+                cert = get_cert_bysubject (subject, 0);
+              else
+                cert = get_cert_byski (subject, ski);
+              if (!cert)
+                fail (idx);
+              ksba_cert_release (cert);
+            }
+          printf ("  %s %.2fus", names[what],
+                  (double)(clock () - start) * 1000000 / CLOCKS_PER_SEC
+                  / ncerts);
+        }
+      putchar ('\n');
+      flush_cache ();
+    }
+}
+
+
+
+/* Stubs for the functions used to fetch certificates.  */
+gpg_error_t
+ca_cert_fetch (ctrl_t ctrl, cert_fetch_context_t *context, const char *dn)
+{
+  (void)ctrl;
+  (void)context;
+  (void)dn;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+gpg_error_t
+fetch_next_ksba_cert (cert_fetch_context_t context, ksba_cert_t *r_cert)
+{
+  (void)context;
+  *r_cert = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+void
+end_cert_fetch (cert_fetch_context_t context)
+{
+  (void)context;
+}
+
+ksba_cert_t
+get_cert_local (ctrl_t ctrl, const char *issuer)
+{
+  (void)ctrl;
+  (void)issuer;
+  return NULL;
+}
+
+ksba_cert_t
+get_cert_local_ski (ctrl_t ctrl, const char *name, ksba_sexp_t keyid)
+{
+  (void)ctrl;
+  (void)name;
+  (void)keyid;
+  return NULL;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (!gcry_check_version (NEED_LIBGCRYPT_VERSION))
+    {
+      fprintf (stderr, "libgcrypt is too old\n");
+      return 1;
+    }
+  npth_init ();
+  init_cache_lock ();
+  initialization_done = 1;
+  find_offsets ();
+
+  if (argc > 1 && !strcmp (argv[1], "--bench"))
+    {
+      run_bench (argc > 2? atoi (argv[2]) : 16000);
+      return !!errcount;
+    }
+
+  test_lookup ();
+  test_drop ();
+
+  return !!errcount;
+}
@@ -0,0 +1,413 @@
+/* t-crlcache.c - Module test for the serial filter in crlcache.c
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The test writes cache files with known serial numbers, puts an
+   entry for them into the CRL cache and checks the lookups.  Whether
+   a lookup consulted the cache file is told by the LRU counter of
+   the entry which is bumped by each unlock_db_file.  */
+
+/* We include the module to get access to its internal functions.  */
+#include "crlcache.c"
+
+
+#define pass()  do { ; } while(0)
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                     errcount++;                                 \
+                   } while(0)
+
+#define TESTDIR "t-crlcache.d"
+
+/* The issuer hashes used for the cache entries.  */
+#define ISSUER_HASH "0123456789ABCDEF0123456789ABCDEF01234567"
+#define EMPTY_ISSUER_HASH "89ABCDEF0123456789ABCDEF0123456789ABCDEF"
+
+/* The number of serial numbers listed in the cache file.  */
+#define NSERIALS 3000
+
+/* The length of the test serial numbers.  */
+#define SNLEN 12
+
+static int verbose;
+static int errcount;
+
+
+/* Store the serial number number I into BUFFER.  The serial numbers
+   listed in the cache file have LISTED set.  */
+static void
+make_serial (unsigned char *buffer, unsigned int i, int listed)
+{
+  memset (buffer, 0, SNLEN);
+  buffer[0] = listed? 0x01 : 0x02;
+  buffer[SNLEN-4] = i >> 24;
+  buffer[SNLEN-3] = i >> 16;
+  buffer[SNLEN-2] = i >> 8;
+  buffer[SNLEN-1] = i;
+}
+
+
+/* Write the cache file for ISSUER_HASH listing the first NITEMS
+   serial numbers and add an entry for it to the cache.  Returns the
+   entry.  */
+static crl_cache_entry_t
+add_entry (const char *issuer_hash, unsigned int nitems)
+{
+  crl_cache_t cache = get_current_cache ();
+  crl_cache_entry_t entry;
+  struct cdb_make cdb;
+  unsigned char sn[SNLEN];
+  unsigned char record[16];
+  unsigned char md5[16];
+  char *fname;
+  int fd;
+  unsigned int i;
+
+  fname = make_db_file_name (issuer_hash);
+  fd = open (fname, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  if (fd == -1)
+    {
+      fprintf (stderr, "error creating '%s': %s\n", fname, strerror (errno));
+      exit (1);
+    }
+  cdb_make_start (&cdb, fd);
+  record[0] = 1;
+  memcpy (record+1, "20150101T000000", 15);
+  for (i=0; i < nitems; i++)
+    {
+      make_serial (sn, i, 1);
+      if (cdb_make_add (&cdb, sn, SNLEN, record, 16))
+        {
+          fprintf (stderr, "error writing '%s': %s\n",
+                   fname, strerror (errno));
+          exit (1);
+        }
+    }
+  if (cdb_make_finish (&cdb) || close (fd) || hash_dbfile (fname, md5))
+    {
+      fprintf (stderr, "error finishing '%s': %s\n", fname, strerror (errno));
+      exit (1);
+    }
+  xfree (fname);
+
+  entry = xcalloc (1, sizeof *entry);
+  entry->release_ptr = xmalloc (40 + 1 + 32 + 1);
+  entry->issuer_hash = entry->release_ptr;
+  strcpy (entry->issuer_hash, issuer_hash);
+  entry->dbfile_hash = entry->issuer_hash + 40 + 1;
+  bin2hex (md5, 16, entry->dbfile_hash);
+  strcpy (entry->next_update, "99991231T235959");
+  entry->next = cache->entries;
+  cache->entries = entry;
+  index_entry (cache, entry);
+
+  return entry;
+}
+
+
+/* Remove the cache file of ISSUER_HASH.  */
+static void
+remove_db_file (const char *issuer_hash)
+{
+  char *fname = make_db_file_name (issuer_hash);
+
+  gnupg_remove (fname);
+  xfree (fname);
+}
+
+
+/* Check that the filter is built on the first use of the cache file
+   and that it does not reject any listed serial number.  */
+static void
+test_filter (crl_cache_entry_t entry)
+{
+  crl_cache_t cache = get_current_cache ();
+  unsigned char sn[SNLEN];
+  unsigned int i, fp;
+
+  if (entry->serial_filter)
+    fail (0);
+  if (!lock_db_file (cache, entry))
+    {
+      fail (1);
+      return;
+    }
+  unlock_db_file (cache, entry);
+  if (!entry->dbfile_checked)
+    fail (2);
+  if (!entry->serial_filter)
+    {
+      fail (3);
+      return;
+    }
+  /* With 10 bits per item the filter has at least 32768 bits.  */
+  if (entry->serial_filter_mask + 1 < NSERIALS * SERIAL_FILTER_BITS)
+    fail (4);
+
+  for (i=0; i < NSERIALS; i++)
+    {
+      make_serial (sn, i, 1);
+      if (!serial_filter_test (entry, sn, SNLEN))
+        {
+          fail (5);
+          break;
+        }
+    }
+
+  /* Even with bad luck the false positive rate must be far below
+     5%.  */
+  for (fp=i=0; i < NSERIALS; i++)
+    {
+      make_serial (sn, i, 0);
+      if (serial_filter_test (entry, sn, SNLEN))
+        fp++;
+    }
+  if (verbose)
+    fprintf (stderr, "false positives: %u of %u\n", fp, NSERIALS);
+  if (fp * 20 >= NSERIALS)
+    fail (6);
+}
+
+
+/* Check the lookups through the cache.  Listed serial numbers are
+   reported as revoked.  Serial numbers rejected by the filter are
+   valid without consulting the cache file; the others need to be
+   looked up in the file.  */
+static void
+test_isvalid (crl_cache_entry_t entry)
+{
+  unsigned char sn[SNLEN];
+  unsigned int i, lru;
+  int maybe;
+  crl_cache_result_t result;
+
+  for (i=0; i < NSERIALS; i++)
+    {
+      make_serial (sn, i, 1);
+      lru = entry->cdb_lru_count;
+      result = cache_isvalid (NULL, ISSUER_HASH, sn, SNLEN, 0);
+      if (result != CRL_CACHE_INVALID)
+        {
+          fail (i);
+          break;
+        }
+      if (entry->cdb_lru_count != lru + 1)
+        {
+          fail (i);
+          break;
+        }
+    }
+
+  for (i=0; i < NSERIALS; i++)
+    {
+      make_serial (sn, i, 0);
+      maybe = serial_filter_test (entry, sn, SNLEN);
+      lru = entry->cdb_lru_count;
+      result = cache_isvalid (NULL, ISSUER_HASH, sn, SNLEN, 0);
+      if (result != CRL_CACHE_VALID)
+        {
+          fail (i);
+          break;
+        }
+      if (entry->cdb_lru_count != lru + !!maybe)
+        {
+          fail (i);
+          break;
+        }
+    }
+
+  /* Make sure that a serial number which is not listed but passes
+     the filter is still looked up in the file.  */
+  make_serial (sn, NSERIALS, 0);
+  serial_filter_add (entry, sn, SNLEN);
+  lru = entry->cdb_lru_count;
+  result = cache_isvalid (NULL, ISSUER_HASH, sn, SNLEN, 0);
+  if (result != CRL_CACHE_VALID)
+    fail (0);
+  if (entry->cdb_lru_count != lru + 1)
+    fail (1);
+}
+
+
+/* Check that a filter is also built for an empty CRL and that no
+   lookup needs the cache file then.  */
+static void
+test_empty (crl_cache_entry_t entry)
+{
+  crl_cache_t cache = get_current_cache ();
+  unsigned char sn[SNLEN];
+  unsigned int i, lru;
+
+  if (!lock_db_file (cache, entry))
+    {
+      fail (0);
+      return;
+    }
+  unlock_db_file (cache, entry);
+  if (!entry->serial_filter)
+    {
+      fail (1);
+      return;
+    }
+
+  lru = entry->cdb_lru_count;
+  for (i=0; i < 100; i++)
+    {
+      make_serial (sn, i, 1);
+      if (cache_isvalid (NULL, EMPTY_ISSUER_HASH, sn, SNLEN, 0)
+          != CRL_CACHE_VALID)
+        {
+          fail (2);
+          break;
+        }
+    }
+  if (entry->cdb_lru_count != lru)
+    fail (3);
+}
+
+
+/* Check that no filter is built for a tampered cache file.  */
+static void
+test_tampered (crl_cache_entry_t entry)
+{
+  unsigned char sn[SNLEN];
+
+  /* Damage the checksum.  */
+  entry->dbfile_hash[0] = entry->dbfile_hash[0] == '0'? '1' : '0';
+
+  make_serial (sn, 0, 0);
+  if (cache_isvalid (NULL, ISSUER_HASH, sn, SNLEN, 0) != CRL_CACHE_DONTKNOW)
+    fail (0);
+  if (entry->serial_filter)
+    fail (1);
+}
+
+
+/* Stubs for the functions of the other modules.  */
+gpg_error_t
+crl_fetch (ctrl_t ctrl, const char *url, ksba_reader_t *reader)
+{
+  (void)ctrl;
+  (void)url;
+  *reader = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+gpg_error_t
+crl_fetch_default (ctrl_t ctrl, const char *issuer, ksba_reader_t *reader)
+{
+  (void)ctrl;
+  (void)issuer;
+  *reader = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+void
+crl_close_reader (ksba_reader_t reader)
+{
+  (void)reader;
+}
+
+ksba_cert_t
+find_cert_bysn (ctrl_t ctrl, const char *issuer_dn, ksba_sexp_t serialno)
+{
+  (void)ctrl;
+  (void)issuer_dn;
+  (void)serialno;
+  return NULL;
+}
+
+ksba_cert_t
+find_cert_bysubject (ctrl_t ctrl, const char *subject_dn, ksba_sexp_t keyid)
+{
+  (void)ctrl;
+  (void)subject_dn;
+  (void)keyid;
+  return NULL;
+}
+
+gpg_error_t
+validate_cert_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t r_exptime,
+                     int mode, char **r_trust_anchor)
+{
+  (void)ctrl;
+  (void)cert;
+  (void)r_exptime;
+  (void)mode;
+  (void)r_trust_anchor;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+gpg_error_t
+get_istrusted_from_client (ctrl_t ctrl, const char *hexfpr)
+{
+  (void)ctrl;
+  (void)hexfpr;
+  return gpg_error (GPG_ERR_NOT_TRUSTED);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  crl_cache_entry_t entry, empty_entry;
+  char *dname;
+
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  if (!gcry_check_version (NEED_LIBGCRYPT_VERSION))
+    {
+      fprintf (stderr, "libgcrypt is too old\n");
+      return 1;
+    }
+
+  opt.verbose = verbose;
+  opt.homedir = opt.homedir_data = opt.homedir_cache = TESTDIR;
+
+  dname = make_filename (opt.homedir_cache, DBDIR_D, NULL);
+  if ((access (TESTDIR, F_OK) && gnupg_mkdir (TESTDIR, "-rwx"))
+      || (access (dname, F_OK) && gnupg_mkdir (dname, "-rwx")))
+    {
+      fprintf (stderr, "error creating '%s': %s\n", dname, strerror (errno));
+      return 1;
+    }
+  current_cache = xcalloc (1, sizeof *current_cache);
+
+  entry = add_entry (ISSUER_HASH, NSERIALS);
+  empty_entry = add_entry (EMPTY_ISSUER_HASH, 0);
+
+  test_filter (entry);
+  test_isvalid (entry);
+  test_empty (empty_entry);
+
+  /* Start over with a fresh entry for the tampered test.  */
+  crl_cache_deinit ();
+  current_cache = xcalloc (1, sizeof *current_cache);
+  entry = add_entry (ISSUER_HASH, NSERIALS);
+  test_tampered (entry);
+
+  crl_cache_deinit ();
+  remove_db_file (ISSUER_HASH);
+  remove_db_file (EMPTY_ISSUER_HASH);
+  rmdir (dname);
+  rmdir (TESTDIR);
+  xfree (dname);
+
+  return !!errcount;
+}
@@ -0,0 +1,457 @@
+/* t-ks-action.c - Module test for the concurrent key retrieval
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The HKP engine is replaced by a stub which answers each request
+   after a delay given by the pattern.  A pattern has the form
+   "DELAY:NAME" or "DELAY:!CODE" where DELAY is in milliseconds, NAME
+   is returned as the key and CODE is the error code to return.  */
+
+/* We include the module to get access to its internal functions.  */
+#include "ks-action.c"
+
+
+#define pass()  do { ; } while(0)
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                     errcount++;                                 \
+                   } while(0)
+
+static int verbose;
+static int errcount;
+
+/* The control object of the client connection and a dummy for its
+   connection to the client.  */
+static struct server_control_s main_ctrl;
+static int dummy_server_local;
+
+/* The stream which receives the SOURCE status lines and the keys.  */
+static estream_t output;
+
+/* Statistics of the stubs.  */
+static unsigned int ngets;        /* Number of calls to ks_hkp_get.  */
+static unsigned int running;      /* Number of active ks_hkp_get calls.  */
+static unsigned int max_running;  /* Maximum of RUNNING.  */
+static unsigned int nticks;       /* Number of calls to dirmngr_tick.  */
+static unsigned int cancel_tick;  /* Cancel at this tick if not 0.  */
+static int wrong_ctrl;            /* A stub got an unexpected CTRL.  */
+
+
+static void
+reset_stubs (void)
+{
+  ngets = running = max_running = nticks = cancel_tick = 0;
+  wrong_ctrl = 0;
+  if (output)
+    es_fclose (output);
+  output = es_fopenmem (0, "w+b");
+  if (!output)
+    {
+      fprintf (stderr, "error creating the output stream\n");
+      exit (1);
+    }
+}
+
+
+/* Return the data written to OUTPUT as a string.  The caller must
+   xfree it.  */
+static char *
+get_output (void)
+{
+  void *buffer;
+  size_t buflen;
+
+  if (es_fwrite ("", 1, 1, output) != 1
+      || es_fclose_snatch (output, &buffer, &buflen))
+    {
+      fprintf (stderr, "error reading the output stream\n");
+      exit (1);
+    }
+  output = NULL;
+  return buffer;
+}
+
+
+/* Build a list of patterns from the NULL terminated array ARRAY.  */
+static strlist_t
+make_patterns (const char **array)
+{
+  strlist_t list = NULL;
+
+  for (; *array; array++)
+    append_to_strlist (&list, *array);
+  return list;
+}
+
+
+/* Run get_from_hkp for PATTERNS and compare the output with EXPECTED.
+   The error is returned and the first error of single keys is stored
+   at R_FIRST_ERR.  */
+static gpg_error_t
+run_get (const char **patterns, const char *expected,
+         gpg_error_t *r_first_err, int testno)
+{
+  gpg_error_t err;
+  struct parsed_uri_s uri;
+  strlist_t list;
+  int any_data = 0;
+  char *result;
+
+  memset (&uri, 0, sizeof uri);
+  uri.is_http = 1;
+  list = make_patterns (patterns);
+  *r_first_err = 0;
+  err = get_from_hkp (&main_ctrl, &uri, list, output, r_first_err, &any_data);
+  free_strlist (list);
+
+  result = get_output ();
+  if (strcmp (result, expected))
+    {
+      fprintf (stderr, "test %d: output mismatch:\n%s", testno, result);
+      fail (testno);
+    }
+  if (any_data != !!*expected)
+    fail (testno);
+  if (running || wrong_ctrl)
+    fail (testno);
+  if (verbose)
+    fprintf (stderr, "test %d: %u requests, %u at once, %u ticks: %s\n",
+             testno, ngets, max_running, nticks, gpg_strerror (err));
+  xfree (result);
+  return err;
+}
+
+
+/* The keys are written in the order they arrive.  */
+static void
+test_order (void)
+{
+  static const char *patterns[] = { "300:a", "100:b", "200:c", NULL };
+  gpg_error_t err, first_err;
+
+  reset_stubs ();
+  err = run_get (patterns,
+                 "SOURCE host-b\nkey b\n"
+                 "SOURCE host-c\nkey c\n"
+                 "SOURCE host-a\nkey a\n", &first_err, 1);
+  if (err || first_err || ngets != 3 || max_running != 3)
+    fail (1);
+}
+
+
+/* Not more than MAX_CONCURRENT_GETS requests run at the same time.  */
+static void
+test_limit (void)
+{
+  const char *patterns[MAX_CONCURRENT_GETS * 2 + 2];
+  char names[MAX_CONCURRENT_GETS * 2 + 1][20];
+  char expected[(MAX_CONCURRENT_GETS * 2 + 1) * 40];
+  gpg_error_t err, first_err;
+  int i;
+
+  *expected = 0;
+  for (i=0; i < DIM (names); i++)
+    {
+      /* Each key arrives after all keys of the earlier rounds.  */
+      snprintf (names[i], sizeof names[i], "%d:k%02d",
+                (i / MAX_CONCURRENT_GETS + 1) * 100
+                + (i % MAX_CONCURRENT_GETS) * 20, i);
+      patterns[i] = names[i];
+      snprintf (expected + strlen (expected), 40,
+                "SOURCE host-k%02d\nkey k%02d\n", i, i);
+    }
+  patterns[i] = NULL;
+
+  reset_stubs ();
+  err = run_get (patterns, expected, &first_err, 2);
+  if (err || first_err || ngets != DIM (names)
+      || max_running != MAX_CONCURRENT_GETS)
+    fail (2);
+}
+
+
+/* Errors of single keys don't stop the batch; the first error to
+   arrive is returned separately.  */
+static void
+test_errors (void)
+{
+  /* The error codes are GPG_ERR_GENERAL and GPG_ERR_NO_DATA.  */
+  static const char *patterns[] = { "300:!1", "100:!58", "200:d", NULL };
+  static const char *only_errors[] = { "200:!1", "100:!58", NULL };
+  gpg_error_t err, first_err;
+  struct uri_item_s keyserver;
+  struct parsed_uri_s uri;
+  strlist_t list;
+
+  reset_stubs ();
+  err = run_get (patterns, "SOURCE host-d\nkey d\n", &first_err, 3);
+  if (err || gpg_err_code (first_err) != GPG_ERR_NO_DATA || ngets != 3)
+    fail (3);
+
+  /* Without any key ks_action_get returns the first error.  */
+  memset (&uri, 0, sizeof uri);
+  uri.is_http = 1;
+  memset (&keyserver, 0, sizeof keyserver);
+  keyserver.parsed_uri = &uri;
+  main_ctrl.keyservers = &keyserver;
+  reset_stubs ();
+  list = make_patterns (only_errors);
+  err = ks_action_get (&main_ctrl, list, output);
+  free_strlist (list);
+  main_ctrl.keyservers = NULL;
+  xfree (get_output ());
+  if (gpg_err_code (err) != GPG_ERR_NO_DATA || running || wrong_ctrl)
+    fail (4);
+}
+
+
+/* A cancel request detected by the tick stops the batch.  The running
+   requests are waited for but no new ones are started and no more
+   keys are written.  */
+static void
+test_cancel (void)
+{
+  const char *patterns[MAX_CONCURRENT_GETS + 3];
+  char names[MAX_CONCURRENT_GETS + 2][20];
+  gpg_error_t err, first_err;
+  int i;
+
+  for (i=0; i < DIM (names); i++)
+    {
+      snprintf (names[i], sizeof names[i], "1500:k%02d", i);
+      patterns[i] = names[i];
+    }
+  patterns[i] = NULL;
+
+  reset_stubs ();
+  cancel_tick = 1;
+  err = run_get (patterns, "", &first_err, 5);
+  if (gpg_err_code (err) != GPG_ERR_CANCELED || first_err
+      || ngets != MAX_CONCURRENT_GETS || nticks != 1)
+    fail (5);
+}
+
+
+
+/* Stubs for the functions of the other modules.  */
+gpg_error_t
+ks_hkp_get (ctrl_t ctrl, parsed_uri_t uri, const char *keyspec,
+            char **r_source, estream_t *r_fp)
+{
+  gpg_error_t err = 0;
+  const char *name;
+  int delay;
+
+  (void)uri;
+
+  *r_source = NULL;
+  *r_fp = NULL;
+  if (ctrl == &main_ctrl || ctrl->server_local)
+    wrong_ctrl = 1;
+
+  ngets++;
+  running++;
+  if (running > max_running)
+    max_running = running;
+  delay = atoi (keyspec);
+  name = strchr (keyspec, ':');
+  name = name? name + 1 : keyspec;
+  npth_usleep (delay * 1000);
+  running--;
+
+  if (*name == '!')
+    return gpg_error (atoi (name + 1));
+
+  *r_source = xtryasprintf ("host-%s", name);
+  *r_fp = es_fopenmem (0, "w+b");
+  if (!*r_source || !*r_fp)
+    err = gpg_error_from_syserror ();
+  else
+    {
+      es_fprintf (*r_fp, "key %s\n", name);
+      es_rewind (*r_fp);
+    }
+  if (err)
+    {
+      xfree (*r_source);
+      *r_source = NULL;
+      if (*r_fp)
+        es_fclose (*r_fp);
+      *r_fp = NULL;
+    }
+  return err;
+}
+
+gpg_error_t
+dirmngr_status (ctrl_t ctrl, const char *keyword, ...)
+{
+  va_list arg_ptr;
+  const char *text;
+
+  if (ctrl != &main_ctrl)
+    wrong_ctrl = 1;
+  es_fputs (keyword, output);
+  va_start (arg_ptr, keyword);
+  while ((text = va_arg (arg_ptr, const char *)))
+    es_fprintf (output, " %s", text);
+  va_end (arg_ptr);
+  es_putc ('\n', output);
+  return 0;
+}
+
+gpg_error_t
+dirmngr_tick (ctrl_t ctrl)
+{
+  if (ctrl != &main_ctrl)
+    wrong_ctrl = 1;
+  nticks++;
+  if (cancel_tick && nticks >= cancel_tick)
+    return gpg_error (GPG_ERR_CANCELED);
+  return 0;
+}
+
+gpg_error_t
+dirmngr_status_help (ctrl_t ctrl, const char *text)
+{
+  (void)ctrl;
+  (void)text;
+  return 0;
+}
+
+gpg_error_t
+http_parse_uri (parsed_uri_t *ret_uri, const char *uri, int no_scheme_check)
+{
+  (void)uri;
+  (void)no_scheme_check;
+  *ret_uri = NULL;
+  return gpg_error (GPG_ERR_NOT_IMPLEMENTED);
+}
+
+void
+http_release_parsed_uri (parsed_uri_t uri)
+{
+  (void)uri;
+}
+
+gpg_error_t
+ks_hkp_resolve (ctrl_t ctrl, parsed_uri_t uri)
+{
+  (void)ctrl;
+  (void)uri;
+  return gpg_error (GPG_ERR_NOT_IMPLEMENTED);
+}
+
+gpg_error_t
+ks_hkp_help (ctrl_t ctrl, parsed_uri_t uri)
+{
+  (void)ctrl;
+  (void)uri;
+  return 0;
+}
+
+gpg_error_t
+ks_hkp_search (ctrl_t ctrl, parsed_uri_t uri, const char *pattern,
+               estream_t *r_fp)
+{
+  (void)ctrl;
+  (void)uri;
+  (void)pattern;
+  *r_fp = NULL;
+  return gpg_error (GPG_ERR_NOT_IMPLEMENTED);
+}
+
+gpg_error_t
+ks_hkp_put (ctrl_t ctrl, parsed_uri_t uri, const void *data, size_t datalen)
+{
+  (void)ctrl;
+  (void)uri;
+  (void)data;
+  (void)datalen;
+  return gpg_error (GPG_ERR_NOT_IMPLEMENTED);
+}
+
+gpg_error_t
+ks_http_help (ctrl_t ctrl, parsed_uri_t uri)
+{
+  (void)ctrl;
+  (void)uri;
+  return 0;
+}
+
+gpg_error_t
+ks_http_fetch (ctrl_t ctrl, const char *url, estream_t *r_fp)
+{
+  (void)ctrl;
+  (void)url;
+  *r_fp = NULL;
+  return gpg_error (GPG_ERR_NOT_IMPLEMENTED);
+}
+
+gpg_error_t
+ks_finger_help (ctrl_t ctrl, parsed_uri_t uri)
+{
+  (void)ctrl;
+  (void)uri;
+  return 0;
+}
+
+gpg_error_t
+ks_finger_fetch (ctrl_t ctrl, parsed_uri_t uri, estream_t *r_fp)
+{
+  (void)ctrl;
+  (void)uri;
+  *r_fp = NULL;
+  return gpg_error (GPG_ERR_NOT_IMPLEMENTED);
+}
+
+gpg_error_t
+ks_kdns_help (ctrl_t ctrl, parsed_uri_t uri)
+{
+  (void)ctrl;
+  (void)uri;
+  return 0;
+}
+
+gpg_error_t
+ks_kdns_fetch (ctrl_t ctrl, parsed_uri_t uri, estream_t *r_fp)
+{
+  (void)ctrl;
+  (void)uri;
+  *r_fp = NULL;
+  return gpg_error (GPG_ERR_NOT_IMPLEMENTED);
+}
+
+
+int
+main (int argc, char **argv)
+{
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  npth_init ();
+  main_ctrl.server_local = (void *)&dummy_server_local;
+
+  test_order ();
+  test_limit ();
+  test_errors ();
+  test_cancel ();
+
+  if (output)
+    es_fclose (output);
+  return !!errcount;
+}
@@ -0,0 +1,528 @@
+/* t-ocsp.c - Module test for the OCSP response cache in ocsp.c
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The test uses a real OCSP response about an end entity certificate
+   signed by its CA.  The response has been created with OpenSSL; it
+   was produced at 2026-10-16 01:28:14 UTC and is valid for 7 days.
+   We fake the current time to use it.  No requests are sent because
+   HTTP is disabled.  */
+
+/* We include the module to get access to its internal functions.  */
+#include "ocsp.c"
+
+#include <dirent.h>
+
+#include "crlfetch.h"
+
+
+#define pass()  do { ; } while(0)
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                     errcount++;                                 \
+                   } while(0)
+
+#define TESTDIR "t-ocsp.d"
+
+/* A time at which the response is valid and one after its
+   nextUpdate.  */
+#define VALID_TIME    "20261017T000000"
+#define EXPIRED_TIME  "20261024T000000"
+
+/* The SHA-1 fingerprint of the CA certificate.  */
+#define CA_FPR "3C71CCCD1ED7A04C0F7A5FFE59ADFCA6B93A3D74"
+
+static int verbose;
+static int errcount;
+
+
+/* The CA certificate "CN=t-ocsp CA".  */
+static const char ca_der[] =
+  "\x30\x82\x01\xe0\x30\x82\x01\x49\xa0\x03\x02\x01\x02\x02\x01\x01"
+  "\x30\x0d\x06\x09\x2a\x86\x48\x86\xf7\x0d\x01\x01\x05\x05\x00\x30"
+  "\x14\x31\x12\x30\x10\x06\x03\x55\x04\x03\x0c\x09\x74\x2d\x6f\x63"
+  "\x73\x70\x20\x43\x41\x30\x1e\x17\x0d\x32\x36\x31\x30\x31\x36\x30"
+  "\x31\x32\x38\x31\x34\x5a\x17\x0d\x33\x36\x31\x30\x31\x33\x30\x31"
+  "\x32\x38\x31\x34\x5a\x30\x14\x31\x12\x30\x10\x06\x03\x55\x04\x03"
+  "\x0c\x09\x74\x2d\x6f\x63\x73\x70\x20\x43\x41\x30\x81\x9f\x30\x0d"
+  "\x06\x09\x2a\x86\x48\x86\xf7\x0d\x01\x01\x01\x05\x00\x03\x81\x8d"
+  "\x00\x30\x81\x89\x02\x81\x81\x00\xa7\x58\x66\xfa\xd4\x17\x8f\x85"
+  "\xa5\xae\x58\xfd\x5f\x1b\x8f\x38\x91\xfb\x94\x7a\x7a\x84\x6e\x27"
+  "\x0b\xc6\x64\x95\x39\x73\xe2\x05\x22\x43\x5e\x83\x0b\x6a\xb9\x2f"
+  "\xc1\x8b\xdc\xa1\x0e\xd2\xd9\x16\x2e\x52\x1c\x45\xbe\xe6\xed\x00"
+  "\xbb\xa9\x6e\x35\x20\xa6\xae\xa5\xeb\x55\x52\x34\xc6\xff\xd6\x15"
+  "\x14\xe1\x88\x30\xc0\xa5\x5c\x97\x28\x1a\x3e\x24\xd7\xd9\x53\x15"
+  "\x62\x7b\x03\x0e\x1a\xe3\xbf\xc5\xfe\x93\xd5\xee\x04\x6b\x08\xed"
+  "\x67\x13\x72\xb0\x15\x80\x1a\x36\x7f\x84\x72\xf1\x54\xcc\x8e\xe4"
+  "\x66\xc1\xc4\x36\x13\xed\x8e\xb1\x02\x03\x01\x00\x01\xa3\x42\x30"
+  "\x40\x30\x0f\x06\x03\x55\x1d\x13\x01\x01\xff\x04\x05\x30\x03\x01"
+  "\x01\xff\x30\x0e\x06\x03\x55\x1d\x0f\x01\x01\xff\x04\x04\x03\x02"
+  "\x01\x86\x30\x1d\x06\x03\x55\x1d\x0e\x04\x16\x04\x14\xd8\xda\x14"
+  "\x68\x75\x20\x32\xe7\x61\x00\x2f\x8f\x83\x65\x6c\x1a\xdd\xc6\xc5"
+  "\x5f\x30\x0d\x06\x09\x2a\x86\x48\x86\xf7\x0d\x01\x01\x05\x05\x00"
+  "\x03\x81\x81\x00\x42\x2d\x15\xde\x86\xa6\x49\x61\x0d\x21\x4e\xfd"
+  "\x19\x0c\x3d\x6f\xdc\xbb\x64\xd5\xf8\x91\xf2\xc0\xe4\xff\x4c\xf3"
+  "\xec\xb0\x68\x49\x95\x08\x51\xbe\xae\xad\x1c\x91\x4f\xd5\x02\x26"
+  "\xa2\xd9\x84\x95\x4e\x5e\xcc\x37\x42\x64\xc1\xc2\xfe\x5f\x13\x3c"
+  "\xa3\x08\x76\x44\xeb\x9a\xc6\xb4\xf6\x80\xe4\xd9\x04\xf2\xee\x5b"
+  "\xbf\x8e\x9e\x8b\x32\x30\x44\x98\x43\x61\x69\xe3\x5d\xa2\x90\xa9"
+  "\xa5\x64\x1d\x06\xd1\x1e\xc2\xad\xcd\xc9\x65\xbe\xbb\xf1\xed\xab"
+  "\xe7\xe4\xa9\xd5\xb0\x98\x8d\xfc\x0d\x82\xc0\x8b\xc6\x30\xd7\x9d"
+  "\xa4\x2e\xb5\xd7";
+
+/* The end entity certificate "CN=t-ocsp 1" with the serial number
+   0x1234 issued by the CA.  */
+static const char ee_der[] =
+  "\x30\x82\x01\xeb\x30\x82\x01\x54\xa0\x03\x02\x01\x02\x02\x02\x12"
+  "\x34\x30\x0d\x06\x09\x2a\x86\x48\x86\xf7\x0d\x01\x01\x05\x05\x00"
+  "\x30\x14\x31\x12\x30\x10\x06\x03\x55\x04\x03\x0c\x09\x74\x2d\x6f"
+  "\x63\x73\x70\x20\x43\x41\x30\x1e\x17\x0d\x32\x36\x31\x30\x31\x36"
+  "\x30\x31\x32\x38\x31\x34\x5a\x17\x0d\x33\x36\x31\x30\x31\x33\x30"
+  "\x31\x32\x38\x31\x34\x5a\x30\x13\x31\x11\x30\x0f\x06\x03\x55\x04"
+  "\x03\x0c\x08\x74\x2d\x6f\x63\x73\x70\x20\x31\x30\x81\x9f\x30\x0d"
+  "\x06\x09\x2a\x86\x48\x86\xf7\x0d\x01\x01\x01\x05\x00\x03\x81\x8d"
+  "\x00\x30\x81\x89\x02\x81\x81\x00\xda\x00\x0a\xb0\x32\xfb\x43\x96"
+  "\xf0\x3f\xc3\x02\x25\xf4\xb6\x00\x22\x36\x40\x6e\x42\x39\x79\x15"
+  "\x3d\x2b\xdf\xa6\x17\xcb\xa2\xff\x66\x5f\xdc\xb6\x74\xe8\xca\xe3"
+  "\x6f\x5c\x2f\x09\x07\x0b\xa3\x1b\x9d\x14\x2f\x04\x90\x39\x72\x88"
+  "\x9c\x9f\x86\xf5\xe5\xc2\xef\x99\x0e\x46\xc4\x41\xee\x53\xd6\x94"
+  "\x15\xe5\xc2\x0f\x47\x30\x54\xf6\xf4\x7b\x4b\xc8\x07\xfd\xcf\xe9"
+  "\xf6\x7b\x62\xc4\x89\x6f\x75\x28\x4d\xf1\x07\xd2\x0a\x60\xe6\x8b"
+  "\x5b\x9f\x53\x02\xc0\xd5\x09\x11\xcf\x0a\xc9\x3e\x30\x57\x95\xa7"
+  "\x11\xf1\x82\xe2\x45\xc8\x45\x41\x02\x03\x01\x00\x01\xa3\x4d\x30"
+  "\x4b\x30\x09\x06\x03\x55\x1d\x13\x04\x02\x30\x00\x30\x1f\x06\x03"
+  "\x55\x1d\x23\x04\x18\x30\x16\x80\x14\xd8\xda\x14\x68\x75\x20\x32"
+  "\xe7\x61\x00\x2f\x8f\x83\x65\x6c\x1a\xdd\xc6\xc5\x5f\x30\x1d\x06"
+  "\x03\x55\x1d\x0e\x04\x16\x04\x14\x92\x47\x6e\x5e\xe5\x6f\x45\xab"
+  "\xd7\xd8\x5c\xcb\xae\x8e\x35\xce\x47\x48\x26\xd3\x30\x0d\x06\x09"
+  "\x2a\x86\x48\x86\xf7\x0d\x01\x01\x05\x05\x00\x03\x81\x81\x00\x39"
+  "\x0b\x37\x25\xb0\x9f\x33\x6c\x63\x34\xb2\xea\xdb\xbc\xa1\xed\x10"
+  "\x9d\x90\x15\xfc\x56\xb2\x19\xf5\xe1\x65\xbe\x38\xac\x2f\x70\x60"
+  "\xb1\x2e\x3c\x1a\x61\x93\x4b\xce\xd9\x43\x0c\x2e\xf5\x0f\xe3\x30"
+  "\xb8\xb3\x5d\xe1\xba\x5b\xd7\x33\xe5\x60\x42\x99\x1d\xdd\xc8\x2d"
+  "\x27\x7a\x7f\x94\xdd\x99\x10\xf8\x7d\x4e\x95\x08\xa2\xdc\x26\xd8"
+  "\xa2\x3b\x2d\x68\x11\x55\x49\xaa\x07\x6c\x09\xb6\xf2\x90\x1e\xd1"
+  "\xa6\xf9\xc1\x5b\x9f\xb5\x51\x4e\xe4\xc5\x66\x65\x50\xd4\x36\xa8"
+  "\xa9\x80\x88\xc3\x1b\xd8\xf0\x68\x2b\xc6\xdf\x59\xbc\x1c\x4a";
+
+/* The response of the CA about the end entity certificate with the
+   status good.  */
+static const char response_der[] =
+  "\x30\x82\x01\x69\x0a\x01\x00\xa0\x82\x01\x62\x30\x82\x01\x5e\x06"
+  "\x09\x2b\x06\x01\x05\x05\x07\x30\x01\x01\x04\x82\x01\x4f\x30\x82"
+  "\x01\x4b\x30\x81\xb5\xa1\x16\x30\x14\x31\x12\x30\x10\x06\x03\x55"
+  "\x04\x03\x0c\x09\x74\x2d\x6f\x63\x73\x70\x20\x43\x41\x18\x0f\x32"
+  "\x30\x32\x36\x31\x30\x31\x36\x30\x31\x32\x38\x31\x34\x5a\x30\x65"
+  "\x30\x63\x30\x3b\x30\x09\x06\x05\x2b\x0e\x03\x02\x1a\x05\x00\x04"
+  "\x14\xb8\xa1\xb5\x5d\x73\x44\xd8\x89\x89\x51\xbe\x89\x70\xd9\xb2"
+  "\x78\xe0\xbe\x65\x0d\x04\x14\xd8\xda\x14\x68\x75\x20\x32\xe7\x61"
+  "\x00\x2f\x8f\x83\x65\x6c\x1a\xdd\xc6\xc5\x5f\x02\x02\x12\x34\x80"
+  "\x00\x18\x0f\x32\x30\x32\x36\x31\x30\x31\x36\x30\x31\x32\x38\x31"
+  "\x34\x5a\xa0\x11\x18\x0f\x32\x30\x32\x36\x31\x30\x32\x33\x30\x31"
+  "\x32\x38\x31\x34\x5a\xa1\x23\x30\x21\x30\x1f\x06\x09\x2b\x06\x01"
+  "\x05\x05\x07\x30\x01\x02\x04\x12\x04\x10\x38\x8a\x15\xd8\xa4\x62"
+  "\x0f\x56\x9e\x4c\xad\x60\xdb\x7b\xa6\x2d\x30\x0d\x06\x09\x2a\x86"
+  "\x48\x86\xf7\x0d\x01\x01\x05\x05\x00\x03\x81\x81\x00\x2a\x90\xe5"
+  "\xa4\x5f\xed\x24\xcf\xcb\xb5\xfd\x27\x91\x2a\x01\x9e\x38\x2f\xce"
+  "\x05\x83\x73\x02\xc9\x5f\x8d\x5b\x50\x57\x72\x55\x5d\xe1\x08\x9a"
+  "\xf9\x67\x01\x6d\x75\x38\x1b\xea\xdc\xf4\x93\x59\xfe\x65\xdf\x92"
+  "\x28\xc3\xbd\xe5\x61\xad\x1d\x3a\x4e\x94\x83\xdd\x62\xc2\xab\xf2"
+  "\xe3\xb8\x54\xa1\x5a\x79\xb6\xe8\x6f\xc2\xf1\x13\x19\x73\xdf\xa4"
+  "\x72\xcf\xa3\x7f\x98\x74\x59\x6b\x61\x12\xc7\xaf\xcb\xb3\xf0\xfb"
+  "\xcd\x8e\x26\x59\x31\xae\x51\xff\x81\xdc\xa1\xd7\xd1\x0a\x01\xbf"
+  "\xef\x9d\x11\x05\x8b\x41\x4c\x45\xaf\x51\xa0\x77\x41";
+
+/* The nonce used for the request.  */
+static const unsigned char nonce[16] =
+  { 0x38, 0x8a, 0x15, 0xd8, 0xa4, 0x62, 0x0f, 0x56,
+    0x9e, 0x4c, 0xad, 0x60, 0xdb, 0x7b, 0xa6, 0x2d };
+
+
+static ksba_cert_t
+parse_cert (const char *der, size_t derlen)
+{
+  ksba_cert_t cert;
+
+  if (ksba_cert_new (&cert)
+      || ksba_cert_init_from_mem (cert, der, derlen))
+    {
+      fprintf (stderr, "error parsing a test certificate\n");
+      exit (1);
+    }
+  return cert;
+}
+
+
+/* Set the current time to the ISO time STRING.  */
+static void
+set_time (const char *string)
+{
+  gnupg_set_time (isotime2epoch (string), 0);
+}
+
+
+static void
+store_response (const char *key)
+{
+  cache_store_response (key, nonce, sizeof nonce,
+                        (const unsigned char *)response_der,
+                        sizeof response_der - 1);
+}
+
+
+/* Return the number of files in the cache directory whose name ends
+   in SUFFIX.  With REMOVE set the files are also removed.  */
+static int
+count_files (const char *suffix, int remove)
+{
+  char *dname, *fname;
+  DIR *dir;
+  struct dirent *ep;
+  size_t n;
+  int count = 0;
+
+  dname = make_filename (opt.homedir_cache, OCSP_CACHE_DIR, NULL);
+  dir = opendir (dname);
+  if (dir)
+    {
+      while ((ep = readdir (dir)))
+        {
+          n = strlen (ep->d_name);
+          if (n < strlen (suffix)
+              || strcmp (ep->d_name + n - strlen (suffix), suffix)
+              || *ep->d_name == '.')
+            continue;
+          count++;
+          if (remove)
+            {
+              fname = make_filename (dname, ep->d_name, NULL);
+              gnupg_remove (fname);
+              xfree (fname);
+            }
+        }
+      closedir (dir);
+    }
+  xfree (dname);
+  return count;
+}
+
+
+/* Test the memory cache.  */
+static void
+test_memory_cache (const char *key)
+{
+  struct cert_status_s cs, cs2;
+
+  memset (&cs, 0, sizeof cs);
+  cs.status = KSBA_STATUS_GOOD;
+  strcpy (cs.this_update, "20261016T012814");
+  strcpy (cs.next_update, "20261023T012814");
+
+  set_time (VALID_TIME);
+  cache_insert (key, 1, &cs);
+  if (ocsp_cache_nitems != 1)
+    fail (1);
+  memset (&cs2, 0, sizeof cs2);
+  if (!cache_lookup (key, 1, &cs2))
+    fail (1);
+  else if (cs2.status != KSBA_STATUS_GOOD
+           || strcmp (cs2.next_update, cs.next_update))
+    fail (1);
+
+  /* A status checked against another signer is not used but kept.  */
+  if (cache_lookup (key, 0, &cs2))
+    fail (2);
+  if (ocsp_cache_nitems != 1 || !cache_lookup (key, 1, &cs2))
+    fail (2);
+
+  /* Replacing the item makes it usable for the other signer.  */
+  cache_insert (key, 0, &cs);
+  if (ocsp_cache_nitems != 1 || !cache_lookup (key, 0, &cs2)
+      || cache_lookup (key, 1, &cs2))
+    fail (3);
+
+  /* An outdated item is removed by a lookup.  */
+  set_time (EXPIRED_TIME);
+  if (cache_lookup (key, 0, &cs2))
+    fail (4);
+  if (ocsp_cache_nitems)
+    fail (4);
+
+  /* A status without a nextUpdate is never current.  */
+  set_time (VALID_TIME);
+  *cs.next_update = 0;
+  cache_insert (key, 1, &cs);
+  if (cache_lookup (key, 1, &cs2))
+    fail (5);
+  if (ocsp_cache_nitems)
+    fail (5);
+}
+
+
+/* Test storing and loading of responses.  */
+static void
+test_disk_cache (ctrl_t ctrl, ksba_cert_t cert, ksba_cert_t issuer_cert,
+                 const char *key)
+{
+  gpg_error_t err;
+  struct fingerprint_list_s signer, wrong_signer;
+  struct cert_status_s cs;
+  estream_t fp;
+  char *fname;
+
+  memset (&signer, 0, sizeof signer);
+  strcpy (signer.hexfpr, CA_FPR);
+  memset (&wrong_signer, 0, sizeof wrong_signer);
+  strcpy (wrong_signer.hexfpr, "0000000000000000000000000000000000000000");
+
+  set_time (VALID_TIME);
+  store_response (key);
+  if (count_files (".der", 0) != 1 || count_files (".tmp", 0))
+    fail (1);
+
+  /* Load the response as default signer's response and as the one
+     of the responder taken from the certificate.  */
+  memset (&cs, 0, sizeof cs);
+  err = load_cached_response (ctrl, key, cert, issuer_cert, &signer, &cs);
+  if (err)
+    {
+      fprintf (stderr, "loading the response failed: %s\n",
+               gpg_strerror (err));
+      fail (2);
+    }
+  else if (cs.status != KSBA_STATUS_GOOD
+           || strcmp (cs.this_update, "20261016T012814")
+           || strcmp (cs.next_update, "20261023T012814"))
+    fail (2);
+  if (load_cached_response (ctrl, key, cert, issuer_cert, NULL, &cs))
+    fail (3);
+
+  /* A response not signed by the default signer is removed.  */
+  if (!load_cached_response (ctrl, key, cert, issuer_cert,
+                             &wrong_signer, &cs))
+    fail (4);
+  if (count_files (".der", 0))
+    fail (4);
+
+  /* So is an outdated response.  */
+  store_response (key);
+  set_time (EXPIRED_TIME);
+  err = load_cached_response (ctrl, key, cert, issuer_cert, &signer, &cs);
+  if (gpg_err_code (err) != GPG_ERR_TIME_CONFLICT)
+    fail (5);
+  if (count_files (".der", 0))
+    fail (5);
+
+  /* A file of another version is not used.  */
+  set_time (VALID_TIME);
+  store_response (key);
+  fname = cache_file_name (key, ".der");
+  fp = es_fopen (fname, "r+b");
+  if (!fp || es_putc (OCSP_CACHE_FILE_VERSION + 1, fp) == EOF
+      || es_fclose (fp))
+    fail (6);
+  xfree (fname);
+  err = load_cached_response (ctrl, key, cert, issuer_cert, &signer, &cs);
+  if (gpg_err_code (err) != GPG_ERR_INV_OBJ)
+    fail (6);
+  count_files (".der", 1);
+}
+
+
+/* Check that ocsp_isvalid uses the memory cache, reloads a response
+   from disk after the memory cache has been flushed and asks the
+   responder if the response is outdated.  */
+static void
+test_isvalid (ctrl_t ctrl, ksba_cert_t cert, const char *key)
+{
+  gpg_error_t err;
+  unsigned long hits, loads, misses;
+  unsigned int entries;
+
+  ocsp_cache_flush ();
+  memset (&ocsp_cache_stats, 0, sizeof ocsp_cache_stats);
+  set_time (VALID_TIME);
+  store_response (key);
+
+  err = ocsp_isvalid (ctrl, cert, NULL, 1);
+  ocsp_cache_get_stats (&hits, &loads, &misses, &entries);
+  if (err || hits || loads != 1 || misses || entries != 1)
+    fail (1);
+
+  err = ocsp_isvalid (ctrl, cert, NULL, 1);
+  ocsp_cache_get_stats (&hits, &loads, &misses, &entries);
+  if (err || hits != 1 || loads != 1 || misses)
+    fail (2);
+
+  ocsp_cache_flush ();
+  err = ocsp_isvalid (ctrl, cert, NULL, 1);
+  ocsp_cache_get_stats (&hits, &loads, &misses, &entries);
+  if (err || hits != 1 || loads != 2 || misses || entries != 1)
+    fail (3);
+
+  /* The outdated response is dropped from both caches and the
+     responder is asked, which fails because HTTP is disabled.  */
+  set_time (EXPIRED_TIME);
+  err = ocsp_isvalid (ctrl, cert, NULL, 1);
+  ocsp_cache_get_stats (&hits, &loads, &misses, &entries);
+  if (gpg_err_code (err) != GPG_ERR_NOT_SUPPORTED
+      || hits != 1 || loads != 2 || misses != 1 || entries)
+    fail (4);
+  if (count_files (".der", 0))
+    fail (4);
+}
+
+
+
+/* Stubs for the functions of the other modules.  */
+gpg_error_t
+ca_cert_fetch (ctrl_t ctrl, cert_fetch_context_t *context, const char *dn)
+{
+  (void)ctrl;
+  (void)context;
+  (void)dn;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+gpg_error_t
+fetch_next_ksba_cert (cert_fetch_context_t context, ksba_cert_t *r_cert)
+{
+  (void)context;
+  *r_cert = NULL;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+void
+end_cert_fetch (cert_fetch_context_t context)
+{
+  (void)context;
+}
+
+ksba_cert_t
+get_cert_local (ctrl_t ctrl, const char *issuer)
+{
+  (void)ctrl;
+  (void)issuer;
+  return NULL;
+}
+
+ksba_cert_t
+get_issuing_cert_local (ctrl_t ctrl, const char *issuer)
+{
+  (void)ctrl;
+  (void)issuer;
+  return NULL;
+}
+
+ksba_cert_t
+get_cert_local_ski (ctrl_t ctrl, const char *name, ksba_sexp_t keyid)
+{
+  (void)ctrl;
+  (void)name;
+  (void)keyid;
+  return NULL;
+}
+
+gpg_error_t
+validate_cert_chain (ctrl_t ctrl, ksba_cert_t cert, ksba_isotime_t r_exptime,
+                     int mode, char **r_trust_anchor)
+{
+  (void)ctrl;
+  (void)cert;
+  (void)r_exptime;
+  (void)mode;
+  (void)r_trust_anchor;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+}
+
+gpg_error_t
+dirmngr_status (ctrl_t ctrl, const char *keyword, ...)
+{
+  (void)ctrl;
+  (void)keyword;
+  return 0;
+}
+
+
+int
+main (int argc, char **argv)
+{
+  struct server_control_s ctrl;
+  struct fingerprint_list_s signer;
+  ksba_cert_t cert, issuer_cert;
+  char *key;
+
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  if (!gcry_check_version (NEED_LIBGCRYPT_VERSION))
+    {
+      fprintf (stderr, "libgcrypt is too old\n");
+      return 1;
+    }
+  npth_init ();
+
+  opt.verbose = verbose;
+  opt.homedir = opt.homedir_data = opt.homedir_cache = TESTDIR;
+  opt.disable_http = 1;
+  opt.ocsp_responder = "http://localhost/";
+  memset (&signer, 0, sizeof signer);
+  strcpy (signer.hexfpr, CA_FPR);
+  opt.ocsp_signer = &signer;
+  opt.ocsp_max_clock_skew = 10 * 60;
+  opt.ocsp_max_period = 90 * 86400;
+  opt.ocsp_current_period = 3 * 60 * 60;
+
+  count_files ("", 1);
+  if (access (TESTDIR, F_OK) && gnupg_mkdir (TESTDIR, "-rwx"))
+    {
+      fprintf (stderr, "error creating '%s': %s\n", TESTDIR, strerror (errno));
+      return 1;
+    }
+  cert_cache_init ();
+
+  memset (&ctrl, 0, sizeof ctrl);
+  cert = parse_cert (ee_der, sizeof ee_der - 1);
+  issuer_cert = parse_cert (ca_der, sizeof ca_der - 1);
+  if (cache_cert (issuer_cert))
+    {
+      fprintf (stderr, "error caching the CA certificate\n");
+      return 1;
+    }
+  key = make_cache_key (cert, issuer_cert);
+  if (!key)
+    {
+      fprintf (stderr, "error creating the cache key\n");
+      return 1;
+    }
+
+  test_memory_cache (key);
+  test_disk_cache (&ctrl, cert, issuer_cert, key);
+  test_isvalid (&ctrl, cert, key);
+
+  xfree (key);
+  release_ctrl_ocsp_certs (&ctrl);
+  ksba_cert_release (issuer_cert);
+  ksba_cert_release (cert);
+  cert_cache_deinit (1);
+  count_files ("", 1);
+  rmdir (TESTDIR "/" OCSP_CACHE_DIR);
+  rmdir (TESTDIR);
+
+  return !!errcount;
+}
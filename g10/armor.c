@@ -39,13 +39,6 @@
 
 #define MAX_LINELEN 20000
 
-#define CRCINIT 0xB704CE
-#define CRCPOLY 0X864CFB
-#define CRCUPDATE(a,c) do {						    \
-			a = ((a) << 8) ^ crc_table[((a)&0xff >> 16) ^ (c)]; \
-			a &= 0x00ffffff;				    \
-		    } while(0)
-static u32 crc_table[256];
 static byte bintoasc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
 			 "abcdefghijklmnopqrstuvwxyz"
 			 "0123456789+/";
@@ -163,25 +156,9 @@ push_armor_filter (armor_filter_context_t *afx, iobuf_t iobuf)
 static void
 initialize(void)
 {
-    int i, j;
-    u32 t;
+    int i;
     byte *s;
 
-    /* init the crc lookup table */
-    crc_table[0] = 0;
-    for(i=j=0; j < 128; j++ ) {
-	t = crc_table[j];
-	if( t & 0x00800000 ) {
-	    t <<= 1;
-	    crc_table[i++] = t ^ CRCPOLY;
-	    crc_table[i++] = t;
-	}
-	else {
-	    t <<= 1;
-	    crc_table[i++] = t;
-	    crc_table[i++] = t ^ CRCPOLY;
-	}
-    }
     /* build the helptable for radix64 to bin conversion */
     for(i=0; i < 256; i++ )
 	asctobin[i] = 255; /* used to detect invalid characters */
@@ -546,7 +523,7 @@ check_input( armor_filter_context_t *afx, IOBUF a )
 	afx->faked = 1;
     else {
 	afx->inp_checked = 1;
-	afx->crc = CRCINIT;
+	afx->crc = RADIX64_CRCINIT;
 	afx->idx = 0;
 	afx->radbuf[0] = 0;
     }
@@ -722,7 +699,7 @@ fake_packet( armor_filter_context_t *afx, IOBUF a,
 	    }
 	}
 	afx->inp_checked = 1;
-	afx->crc = CRCINIT;
+	afx->crc = RADIX64_CRCINIT;
 	afx->idx = 0;
 	afx->radbuf[0] = 0;
     }
@@ -751,7 +728,7 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
     int checkcrc=0;
     int rc = 0;
     size_t n = 0;
-    int  idx, i, onlypad=0;
+    int  idx, onlypad=0;
     u32 crc;
 
     crc = afx->crc;
@@ -759,8 +736,24 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
     val = afx->radbuf[0];
     for( n=0; n < size; ) {
 
-	if( afx->buffer_pos < afx->buffer_len )
+	if( afx->buffer_pos < afx->buffer_len ) {
+	    if( !idx && size - n >= 3 ) {
+		/* Fast path: decode all complete groups of the line
+		 * at once.  Everything else, including the padding
+		 * and damaged input, is handled below.  */
+		size_t used, len = afx->buffer_len - afx->buffer_pos;
+
+		if( len > (size - n) / 3 * 4 )
+		    len = (size - n) / 3 * 4;
+		n += radix64_decode_block (buf + n,
+					   afx->buffer + afx->buffer_pos,
+					   len, &used);
+		afx->buffer_pos += used;
+		if( used )
+		    continue;
+	    }
 	    c = afx->buffer[afx->buffer_pos++];
+	}
 	else { /* read the next line */
 	    unsigned maxlen = MAX_LINELEN;
 	    afx->buffer_pos = 0;
@@ -817,9 +810,7 @@ radix64_read( armor_filter_context_t *afx, IOBUF a, size_t *retn,
 	idx = (idx+1) % 4;
     }
 
-    for(i=0; i < n; i++ )
-	crc = (crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ buf[i]];
-    crc &= 0x00ffffff;
+    crc = radix64_crc24 (crc, buf, n);
     afx->crc = crc;
     afx->idx = idx;
     afx->radbuf[0] = val;
@@ -1121,7 +1112,7 @@ armor_filter( void *opaque, int control,
 	    afx->status++;
 	    afx->idx = 0;
 	    afx->idx2 = 0;
-	    afx->crc = CRCINIT;
+	    afx->crc = RADIX64_CRCINIT;
 
 	}
 	crc = afx->crc;
@@ -1130,11 +1121,30 @@ armor_filter( void *opaque, int control,
 	for(i=0; i < idx; i++ )
 	    radbuf[i] = afx->radbuf[i];
 
-	for(i=0; i < size; i++ )
-	    crc = (crc << 8) ^ crc_table[((crc >> 16)&0xff) ^ buf[i]];
-	crc &= 0x00ffffff;
+	crc = radix64_crc24 (crc, buf, size);
 
 	for( ; size; buf++, size-- ) {
+	    while( !idx && size >= 3 ) {
+		/* Fast path: encode the remaining part of the line at
+		 * once.  */
+		char line[64];
+		size_t nquads = (64/4) - idx2;
+
+		if( nquads > size / 3 )
+		    nquads = size / 3;
+		iobuf_write (a, line,
+			     radix64_encode_block (line, buf, nquads * 3));
+		buf += nquads * 3;
+		size -= nquads * 3;
+		idx2 += nquads;
+		if( idx2 >= (64/4) )
+		  { /* pgp doesn't like 72 here */
+		    iobuf_writestr(a,afx->eol);
+		    idx2=0;
+		  }
+	    }
+	    if( !size )
+		break;
 	    radbuf[idx++] = *buf;
 	    if( idx > 2 ) {
 		idx = 0;
@@ -1393,7 +1403,7 @@ unarmor_pump (UnarmorPump x, int c)
         /* i.e. wait for one empty line */
         if ( c == '\n' ) {
             x->state = STA_read_data;
-            x->crc = CRCINIT;
+            x->crc = RADIX64_CRCINIT;
             x->val = 0;
             x->pos = 0;
         }
@@ -1494,8 +1504,9 @@ unarmor_pump (UnarmorPump x, int c)
     }
 
     if ( !(rval & ~255) ) { /* compute the CRC */
-        x->crc = (x->crc << 8) ^ crc_table[((x->crc >> 16)&0xff) ^ rval];
-        x->crc &= 0x00ffffff;
+        byte tmp = rval;
+
+        x->crc = radix64_crc24 (x->crc, &tmp, 1);
     }
 
     return rval;
@@ -507,8 +507,8 @@ do_plaintext( IOBUF out, int ctb, PKT_plaintext *pt )
 {
     int i, rc = 0;
     u32 n;
-    byte buf[1000]; /* this buffer has the plaintext! */
-    int nbytes;
+    const byte *buf;
+    size_t nbytes;
 
     write_header(out, ctb, calc_plaintext( pt ) );
     iobuf_put(out, pt->mode );
@@ -519,14 +519,16 @@ do_plaintext( IOBUF out, int ctb, PKT_plaintext *pt )
     if (rc)
       return rc;
 
+    /* Copy straight from the buffer of the source iobuf; this avoids
+       an intermediate buffer which would need to be wiped.  */
     n = 0;
-    while( (nbytes=iobuf_read(pt->buf, buf, 1000)) != -1 ) {
+    while( !iobuf_borrow (pt->buf, &buf, &nbytes) ) {
       rc = iobuf_write (out, buf, nbytes);
       if (rc)
         break;
+      iobuf_consume (pt->buf, nbytes);
       n += nbytes;
     }
-    wipememory(buf,1000); /* burn the buffer */
     if( (ctb&0x40) && !pt->len )
       iobuf_set_partial_block_mode(out, 0 ); /* turn off partial */
     if( pt->len && n != pt->len )
@@ -49,10 +49,23 @@
 
 #define CONTROL_D ('D' - 'A' + 1)
 
+/* Number of hashes sent with one PKSIGN_MULTI command.  */
+#define PKSIGN_MULTI_CHUNK 1024
+
 
 static assuan_context_t agent_ctx = NULL;
 static int did_early_card_test;
 
+/* The sorted keygrips of all secret keys available to the agent.
+   They are used instead of asking the agent for each key while
+   agent_cache_secret_keygrips is in effect.  */
+static struct
+{
+  int valid;
+  size_t ngrips;
+  unsigned char *grips;  /* NGRIPS keygrips of 20 bytes each.  */
+} seckey_grips;
+
 struct default_inq_parm_s
 {
   ctrl_t ctrl;
@@ -72,6 +85,15 @@ struct cipher_parm_s
   size_t ciphertextlen;
 };
 
+struct pksign_multi_parm_s
+{
+  struct default_inq_parm_s *dflt;
+  unsigned char **digests;
+  int ndigests;
+  size_t digestlen;
+  int digestalgo;
+};
+
 struct writecert_parm_s
 {
   struct default_inq_parm_s *dflt;
@@ -1545,6 +1567,66 @@ agent_get_s2k_count (unsigned long *r_count)
 
 
 
+static int
+compare_keygrips (const void *a, const void *b)
+{
+  return memcmp (a, b, 20);
+}
+
+
+/* With ENABLE set, retrieve the keygrips of all secret keys with one
+   HAVEKEY --list request and use them for the following calls of
+   agent_probe_secret_key and agent_probe_any_secret_key.  This saves
+   a round trip to the agent for each key when listing many keys.
+   Secret keys added or removed in the meantime are not noticed; thus
+   the caller should disable the cache again with ENABLE cleared as
+   soon as possible.  If the agent does not support the --list
+   option, the keys are probed one by one as before.  */
+void
+agent_cache_secret_keygrips (ctrl_t ctrl, int enable)
+{
+  gpg_error_t err;
+  membuf_t data;
+  unsigned char *buf;
+  size_t len;
+
+  xfree (seckey_grips.grips);
+  seckey_grips.grips = NULL;
+  seckey_grips.ngrips = 0;
+  seckey_grips.valid = 0;
+  if (!enable || start_agent (ctrl, 0))
+    return;
+
+  init_membuf (&data, 1024);
+  err = assuan_transact (agent_ctx, "HAVEKEY --list",
+                         membuf_data_cb, &data,
+                         NULL, NULL, NULL, NULL);
+  buf = get_membuf (&data, &len);
+  if (err || !buf || (len % 20))
+    {
+      if (opt.verbose > 1)
+        log_info ("HAVEKEY --list failed: %s\n",
+                  err? gpg_strerror (err) : "invalid response");
+      xfree (buf);
+      return;
+    }
+  qsort (buf, len / 20, 20, compare_keygrips);
+  seckey_grips.grips = buf;
+  seckey_grips.ngrips = len / 20;
+  seckey_grips.valid = 1;
+}
+
+
+/* Return true if the key with GRIP is in the cached list of secret
+   keygrips.  */
+static int
+have_cached_keygrip (const unsigned char *grip)
+{
+  return !!bsearch (grip, seckey_grips.grips, seckey_grips.ngrips, 20,
+                    compare_keygrips);
+}
+
+
 /* Ask the agent whether a secret key for the given public key is
    available.  Returns 0 if available.  */
 gpg_error_t
@@ -1554,6 +1636,16 @@ agent_probe_secret_key (ctrl_t ctrl, PKT_public_key *pk)
   char line[ASSUAN_LINELENGTH];
   char *hexgrip;
 
+  if (seckey_grips.valid)
+    {
+      unsigned char grip[20];
+
+      err = keygrip_from_pk (pk, grip);
+      if (err)
+        return err;
+      return have_cached_keygrip (grip)? 0 : gpg_error (GPG_ERR_NO_SECKEY);
+    }
+
   err = start_agent (ctrl, 0);
   if (err)
     return err;
@@ -1581,6 +1673,23 @@ agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock)
   int nkeys;
   unsigned char grip[20];
 
+  if (seckey_grips.valid)
+    {
+      for (kbctx=NULL; (node = walk_kbnode (keyblock, &kbctx, 0)); )
+        if (node->pkt->pkttype == PKT_PUBLIC_KEY
+            || node->pkt->pkttype == PKT_PUBLIC_SUBKEY
+            || node->pkt->pkttype == PKT_SECRET_KEY
+            || node->pkt->pkttype == PKT_SECRET_SUBKEY)
+          {
+            err = keygrip_from_pk (node->pkt->pkt.public_key, grip);
+            if (err)
+              return err;
+            if (have_cached_keygrip (grip))
+              return 0;
+          }
+      return gpg_error (GPG_ERR_NO_SECKEY);
+    }
+
   err = start_agent (ctrl, 0);
   if (err)
     return err;
@@ -1951,6 +2060,157 @@ agent_pksign (ctrl_t ctrl, const char *cache_nonce,
 
 
 
+/* Handle a HASHES inquiry.  Note, we only send the data,
+   assuan_transact takes care of flushing and writing the END. */
+static gpg_error_t
+inq_hashes_cb (void *opaque, const char *line)
+{
+  struct pksign_multi_parm_s *parm = opaque;
+  gpg_error_t err;
+  char *buf, *p;
+  int i;
+
+  if (!has_leading_keyword (line, "HASHES"))
+    return default_inq_cb (parm->dflt, line);
+
+  /* Each line is "<algo> <hexstring>\n"; the algo number has at most
+     3 digits.  */
+  buf = xtrymalloc (parm->ndigests * (parm->digestlen*2 + 5) + 1);
+  if (!buf)
+    return gpg_error_from_syserror ();
+  for (p=buf, i=0; i < parm->ndigests; i++)
+    {
+      p += sprintf (p, "%d ", parm->digestalgo);
+      bin2hex (parm->digests[i], parm->digestlen, p);
+      p += strlen (p);
+      *p++ = '\n';
+    }
+  err = assuan_send_data (parm->dflt->ctx, buf, p - buf);
+  xfree (buf);
+  return err;
+}
+
+
+/* Call the agent to sign the NDIGESTS hashes in DIGESTS, each
+   DIGESTLEN bytes long and created with DIGESTALGO, using the key
+   identified by the hex string KEYGRIP.  In contrast to calling
+   agent_pksign for each hash the key needs to be unlocked only once.
+   On success the signatures are stored at R_SIGVALS, which must
+   provide space for NDIGESTS items.  */
+gpg_error_t
+agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                    const char *keygrip, const char *desc,
+                    u32 *keyid, u32 *mainkeyid, int pubkey_algo,
+                    unsigned char **digests, int ndigests,
+                    size_t digestlen, int digestalgo,
+                    gcry_sexp_t *r_sigvals)
+{
+  gpg_error_t err;
+  char line[ASSUAN_LINELENGTH];
+  membuf_t data;
+  struct default_inq_parm_s dfltparm;
+  struct pksign_multi_parm_s parm;
+  int i, n, count;
+  unsigned char *buf;
+  size_t len, off, siglen;
+
+  memset (&dfltparm, 0, sizeof dfltparm);
+  dfltparm.ctrl = ctrl;
+  dfltparm.keyinfo.keyid       = keyid;
+  dfltparm.keyinfo.mainkeyid   = mainkeyid;
+  dfltparm.keyinfo.pubkey_algo = pubkey_algo;
+
+  for (i=0; i < ndigests; i++)
+    r_sigvals[i] = NULL;
+  if (digestlen > 64)
+    return gpg_error (GPG_ERR_GENERAL);
+
+  err = start_agent (ctrl, 0);
+  if (err)
+    return err;
+  dfltparm.ctx = agent_ctx;
+
+  err = assuan_transact (agent_ctx, "RESET",
+                         NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    return err;
+
+  snprintf (line, DIM(line)-1, "SIGKEY %s", keygrip);
+  line[DIM(line)-1] = 0;
+  err = assuan_transact (agent_ctx, line, NULL, NULL, NULL, NULL, NULL, NULL);
+  if (err)
+    return err;
+
+  /* The agent limits the size of the inquired data; thus we send
+     the hashes in chunks.  */
+  err = 0;
+  for (i=0; i < ndigests; i += count)
+    {
+      count = ndigests - i;
+      if (count > PKSIGN_MULTI_CHUNK)
+        count = PKSIGN_MULTI_CHUNK;
+
+      if (desc)
+        {
+          snprintf (line, DIM(line)-1, "SETKEYDESC %s", desc);
+          line[DIM(line)-1] = 0;
+          err = assuan_transact (agent_ctx, line,
+                                 NULL, NULL, NULL, NULL, NULL, NULL);
+          if (err)
+            goto leave;
+        }
+
+      parm.dflt = &dfltparm;
+      parm.digests = digests + i;
+      parm.ndigests = count;
+      parm.digestlen = digestlen;
+      parm.digestalgo = digestalgo;
+
+      init_membuf (&data, 1024);
+      snprintf (line, sizeof line, "PKSIGN_MULTI%s%s",
+                cache_nonce? " -- ":"",
+                cache_nonce? cache_nonce:"");
+      err = assuan_transact (agent_ctx, line,
+                             membuf_data_cb, &data,
+                             inq_hashes_cb, &parm,
+                             NULL, NULL);
+      buf = get_membuf (&data, &len);
+      if (!err && !buf)
+        err = gpg_error_from_syserror ();
+
+      /* The signatures are returned as a sequence of canonical
+         encoded S-expressions.  */
+      for (n=0, off=0; !err && off < len; n++)
+        {
+          siglen = gcry_sexp_canon_len (buf + off, len - off, NULL, NULL);
+          if (!siglen || n >= count)
+            err = gpg_error (GPG_ERR_INV_RESPONSE);
+          else
+            err = gcry_sexp_sscan (&r_sigvals[i+n], NULL,
+                                   (char*)buf + off, siglen);
+          off += siglen;
+        }
+      if (!err && n != count)
+        err = gpg_error (GPG_ERR_INV_RESPONSE);
+      xfree (buf);
+      if (err)
+        goto leave;
+    }
+
+ leave:
+  if (err)
+    {
+      for (i=0; i < ndigests; i++)
+        {
+          gcry_sexp_release (r_sigvals[i]);
+          r_sigvals[i] = NULL;
+        }
+    }
+  return err;
+}
+
+
+
 /* Handle a CIPHERTEXT inquiry.  Note, we only send the data,
    assuan_transact takes care of flushing and writing the END. */
 static gpg_error_t
@@ -146,6 +146,10 @@ gpg_error_t agent_probe_secret_key (ctrl_t ctrl, PKT_public_key *pk);
    keys (primary or sub) in KEYBLOCK.  Returns 0 if available.  */
 gpg_error_t agent_probe_any_secret_key (ctrl_t ctrl, kbnode_t keyblock);
 
+/* Answer the two functions above from one list of all secret keys
+   retrieved from the agent.  */
+void agent_cache_secret_keygrips (ctrl_t ctrl, int enable);
+
 
 /* Return infos about the secret key with HEXKEYGRIP.  */
 gpg_error_t agent_get_keyinfo (ctrl_t ctrl, const char *hexkeygrip,
@@ -168,6 +172,14 @@ gpg_error_t agent_pksign (ctrl_t ctrl, const char *cache_nonce,
                           int digestalgo,
                           gcry_sexp_t *r_sigval);
 
+/* Create signatures for many hashes with one key.  */
+gpg_error_t agent_pksign_multi (ctrl_t ctrl, const char *cache_nonce,
+                                const char *hexkeygrip, const char *desc,
+                                u32 *keyid, u32 *mainkeyid, int pubkey_algo,
+                                unsigned char **digests, int ndigests,
+                                size_t digestlen, int digestalgo,
+                                gcry_sexp_t *r_sigvals);
+
 /* Decrypt a ciphertext.  */
 gpg_error_t agent_pkdecrypt (ctrl_t ctrl, const char *keygrip, const char *desc,
                              u32 *keyid, u32 *mainkeyid, int pubkey_algo,
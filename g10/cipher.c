@@ -39,6 +39,27 @@
 #define MIN_PARTIAL_SIZE 512
 
 
+/* Emit the BEGIN_ENCRYPTION status and the notes about the cipher
+   algorithm for CFX.  This is done by the cipher filter when it
+   writes the header.  If the cipher filter runs in a pipeline worker
+   this needs to be called by the main thread before the first data
+   is written.  */
+void
+cipher_filter_begin (cipher_filter_context_t *cfx)
+{
+    char buf[20];
+
+    if (cfx->begin_done)
+        return;
+    cfx->begin_done = 1;
+
+    sprintf (buf, "%d %d",
+             cfx->dek->use_mdc? DIGEST_ALGO_SHA1 : 0, cfx->dek->algo);
+    write_status_text (STATUS_BEGIN_ENCRYPTION, buf);
+    print_cipher_algo_note (cfx->dek->algo);
+}
+
+
 static void
 write_header( cipher_filter_context_t *cfx, IOBUF a )
 {
@@ -64,12 +85,7 @@ write_header( cipher_filter_context_t *cfx, IOBUF a )
 	    gcry_md_debug (cfx->mdc_hash, "creatmdc");
     }
 
-    {
-        char buf[20];
-
-        sprintf (buf, "%d %d", ed.mdc_method, cfx->dek->algo);
-        write_status_text (STATUS_BEGIN_ENCRYPTION, buf);
-    }
+    cipher_filter_begin (cfx);
 
     init_packet( &pkt );
     pkt.pkttype = cfx->dek->use_mdc? PKT_ENCRYPTED_MDC : PKT_ENCRYPTED;
@@ -80,7 +96,6 @@ write_header( cipher_filter_context_t *cfx, IOBUF a )
     gcry_randomize (temp, nprefix, GCRY_STRONG_RANDOM );
     temp[nprefix] = temp[nprefix-2];
     temp[nprefix+1] = temp[nprefix-1];
-    print_cipher_algo_note( cfx->dek->algo );
     err = openpgp_cipher_open (&cfx->cipher_hd,
 			       cfx->dek->algo,
 			       GCRY_CIPHER_MODE_CFB,
@@ -0,0 +1,496 @@
+/* compress-mt.c - Parallel deflate for the compress filter
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The input is split into blocks which are compressed independently
+   by a pool of worker threads.  Each block is primed with the last
+   window of the preceding block's input as dictionary, so that the
+   compression ratio is nearly the same as with a single stream.  All
+   but the last block are terminated by a sync flush which aligns
+   them on a byte boundary; the last one is finished normally.  The
+   concatenation of the blocks is thus a single valid deflate stream
+   which can be read by any OpenPGP implementation.  For ZLIB the
+   header and the Adler-32 checksum are added by the main thread.
+
+   The worker threads never touch an iobuf; all output is written by
+   the caller's thread in the order of the blocks.  */
+
+#include <config.h>
+
+#ifdef HAVE_ZIP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <npth.h>
+
+#include "gpg.h"
+#include "util.h"
+#include "iobuf.h"
+#include "options.h"
+#include "filter.h"
+#include "main.h"
+
+
+/* Size of the input blocks.  */
+#define BLOCK_SIZE (128*1024)
+
+/* The maximum number of worker threads.  */
+#define MAX_THREADS 64
+
+
+/* A block of input and the compressed data generated from it.  */
+struct block_s
+{
+  struct block_s *next;       /* Next block in the work queue.  */
+  struct block_s *next_out;   /* Next block in output order.  */
+  int last;                   /* This is the final block.  */
+  int done;                   /* The block has been processed.  */
+  int zrc;                    /* Error code from zlib or Z_OK.  */
+  size_t dictlen;
+  byte *dict;                 /* The dictionary (tail of the last block).  */
+  size_t inlen;
+  byte *in;                   /* The input data (BLOCK_SIZE bytes).  */
+  size_t outlen;
+  size_t outsize;
+  byte *out;                  /* The compressed data.  */
+};
+
+
+struct compress_mt_s
+{
+  int algo;          /* COMPRESS_ALGO_ZIP or COMPRESS_ALGO_ZLIB.  */
+  int level;         /* The zlib compression level.  */
+  int wbits;         /* The window size in bits.  */
+  int nthreads;
+  npth_t *threads;
+  int stop;          /* Tell the workers to terminate.  */
+
+  npth_mutex_t lock;       /* Protects the queue and the DONE flags.  */
+  npth_cond_t work_cond;   /* Signaled when a block is queued.  */
+  npth_cond_t done_cond;   /* Signaled when a block is done.  */
+
+  struct block_s *queue;       /* Blocks waiting for a worker.  */
+  struct block_s *queue_tail;
+  struct block_s *pending;     /* Blocks in output order.  */
+  struct block_s *pending_tail;
+  int npending;
+
+  struct block_s *cur;   /* The block currently being filled.  */
+  uLong adler;           /* Checksum of the input for ZLIB.  */
+  int header_done;       /* The ZLIB header has been written.  */
+};
+
+
+static void
+release_block (struct block_s *blk)
+{
+  if (!blk)
+    return;
+  xfree (blk->dict);
+  xfree (blk->in);
+  xfree (blk->out);
+  xfree (blk);
+}
+
+
+/* Compress BLK.  This runs in a worker thread without holding the
+   npth lock; thus it must not call any gpg functions besides the
+   memory allocators.  */
+static int
+compress_block (compress_mt_t mt, struct block_s *blk)
+{
+  z_stream zs;
+  int zrc;
+  byte *p;
+
+  memset (&zs, 0, sizeof zs);
+  zrc = deflateInit2 (&zs, mt->level, Z_DEFLATED, -mt->wbits, 8,
+                      Z_DEFAULT_STRATEGY);
+  if (zrc != Z_OK)
+    return zrc;
+  if (blk->dictlen)
+    {
+      zrc = deflateSetDictionary (&zs, blk->dict, blk->dictlen);
+      if (zrc != Z_OK)
+        goto leave;
+    }
+
+  /* The bound does not include the marker of the sync flush.  */
+  blk->outsize = deflateBound (&zs, blk->inlen) + 16;
+  blk->out = xtrymalloc (blk->outsize);
+  if (!blk->out)
+    {
+      zrc = Z_MEM_ERROR;
+      goto leave;
+    }
+  zs.next_in = blk->in;
+  zs.avail_in = blk->inlen;
+  zs.next_out = blk->out;
+  zs.avail_out = blk->outsize;
+  for (;;)
+    {
+      zrc = deflate (&zs, blk->last? Z_FINISH : Z_SYNC_FLUSH);
+      if (blk->last && zrc == Z_STREAM_END)
+        {
+          zrc = Z_OK;
+          break;
+        }
+      if (zrc != Z_OK && zrc != Z_BUF_ERROR)
+        break;
+      if (!blk->last && zs.avail_out)
+        {
+          zrc = Z_OK;
+          break;
+        }
+      /* Out of space; this should not happen due to deflateBound.  */
+      p = xtryrealloc (blk->out, 2 * blk->outsize);
+      if (!p)
+        {
+          zrc = Z_MEM_ERROR;
+          break;
+        }
+      blk->out = p;
+      zs.next_out = blk->out + blk->outsize;
+      zs.avail_out = blk->outsize;
+      blk->outsize *= 2;
+    }
+  blk->outlen = blk->outsize - zs.avail_out;
+
+ leave:
+  deflateEnd (&zs);
+  return zrc;
+}
+
+
+static void *
+worker_thread (void *arg)
+{
+  compress_mt_t mt = arg;
+  struct block_s *blk;
+  int zrc;
+
+  npth_mutex_lock (&mt->lock);
+  for (;;)
+    {
+      while (!mt->queue && !mt->stop)
+        npth_cond_wait (&mt->work_cond, &mt->lock);
+      if (!mt->queue)
+        break;
+      blk = mt->queue;
+      mt->queue = blk->next;
+      if (!mt->queue)
+        mt->queue_tail = NULL;
+      npth_mutex_unlock (&mt->lock);
+
+      npth_unprotect ();
+      zrc = compress_block (mt, blk);
+      npth_protect ();
+
+      npth_mutex_lock (&mt->lock);
+      blk->zrc = zrc;
+      blk->done = 1;
+      npth_cond_broadcast (&mt->done_cond);
+    }
+  npth_mutex_unlock (&mt->lock);
+  return NULL;
+}
+
+
+/* Create a context for parallel compression with NTHREADS worker
+   threads.  ALGO and LEVEL are the same as used for deflateInit.
+   Returns NULL if the threads could not be started; the caller
+   should then fall back to the single threaded code.  */
+compress_mt_t
+compress_mt_new (int algo, int level, int nthreads)
+{
+  compress_mt_t mt;
+  npth_attr_t tattr;
+  int i, rc;
+
+  if (nthreads > MAX_THREADS)
+    nthreads = MAX_THREADS;
+
+  mt = xtrycalloc (1, sizeof *mt);
+  if (!mt)
+    return NULL;
+  mt->algo = algo;
+  mt->level = level;
+  mt->wbits = algo == COMPRESS_ALGO_ZIP? 13 : MAX_WBITS;
+  mt->adler = adler32 (0L, Z_NULL, 0);
+  mt->threads = xtrycalloc (nthreads, sizeof *mt->threads);
+  if (!mt->threads)
+    {
+      xfree (mt);
+      return NULL;
+    }
+  npth_mutex_init (&mt->lock, NULL);
+  npth_cond_init (&mt->work_cond, NULL);
+  npth_cond_init (&mt->done_cond, NULL);
+
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  for (i=0; i < nthreads; i++)
+    {
+      rc = npth_create (&mt->threads[i], &tattr, worker_thread, mt);
+      if (rc)
+        {
+          log_error ("error spawning compress thread: %s\n", strerror (rc));
+          break;
+        }
+      mt->nthreads++;
+    }
+  npth_attr_destroy (&tattr);
+  if (!mt->nthreads)
+    {
+      compress_mt_release (mt);
+      return NULL;
+    }
+  if (DBG_FILTER)
+    log_debug ("compress_mt: started %d threads\n", mt->nthreads);
+  return mt;
+}
+
+
+/* Write the output of finished blocks to A.  If ALL is set, wait
+   for all blocks, otherwise only wait until there are fewer than
+   twice the number of threads outstanding.  */
+static int
+write_blocks (compress_mt_t mt, iobuf_t a, int all)
+{
+  struct block_s *blk;
+  int rc;
+
+  for (;;)
+    {
+      npth_mutex_lock (&mt->lock);
+      blk = mt->pending;
+      if (blk && !blk->done && (all || mt->npending >= 2 * mt->nthreads))
+        while (!blk->done)
+          npth_cond_wait (&mt->done_cond, &mt->lock);
+      if (!blk || !blk->done)
+        {
+          npth_mutex_unlock (&mt->lock);
+          return 0;
+        }
+      mt->pending = blk->next_out;
+      if (!mt->pending)
+        mt->pending_tail = NULL;
+      mt->npending--;
+      npth_mutex_unlock (&mt->lock);
+
+      if (blk->zrc != Z_OK)
+        log_fatal ("zlib deflate problem: rc=%d\n", blk->zrc);
+      if (DBG_FILTER)
+        log_debug ("compress_mt: block of %u bytes compressed to %u\n",
+                   (unsigned int)blk->inlen, (unsigned int)blk->outlen);
+      rc = iobuf_write (a, blk->out, blk->outlen);
+      release_block (blk);
+      if (rc)
+        {
+          log_debug ("deflate: iobuf_write failed\n");
+          return rc;
+        }
+    }
+}
+
+
+/* Hand the current block to the workers.  */
+static int
+submit_block (compress_mt_t mt, int last, iobuf_t a)
+{
+  struct block_s *blk = mt->cur;
+  struct block_s *next = NULL;
+  size_t dictsize = (size_t)1 << mt->wbits;
+  int rc;
+
+  if (!mt->header_done)
+    {
+      if (mt->algo == COMPRESS_ALGO_ZLIB)
+        {
+          /* Same as the header written by deflate.  */
+          unsigned int hdr, flags;
+
+          if (mt->level >= 0 && mt->level < 2)
+            flags = 0;
+          else if (mt->level >= 0 && mt->level < 6)
+            flags = 1;
+          else if (mt->level == 6 || mt->level == Z_DEFAULT_COMPRESSION)
+            flags = 2;
+          else
+            flags = 3;
+          hdr = ((Z_DEFLATED + ((mt->wbits - 8) << 4)) << 8) | (flags << 6);
+          hdr += 31 - (hdr % 31);
+          rc = iobuf_put (a, hdr >> 8);
+          if (!rc)
+            rc = iobuf_put (a, hdr);
+          if (rc)
+            return rc;
+        }
+      mt->header_done = 1;
+    }
+
+  if (!last)
+    {
+      /* Prepare the next block, primed with our tail.  */
+      next = xtrycalloc (1, sizeof *next);
+      if (next)
+        {
+          next->in = xtrymalloc (BLOCK_SIZE);
+          next->dict = xtrymalloc (dictsize);
+        }
+      if (!next || !next->in || !next->dict)
+        {
+          rc = gpg_error_from_syserror ();
+          release_block (next);
+          return rc;
+        }
+      next->dictlen = blk->inlen < dictsize? blk->inlen : dictsize;
+      memcpy (next->dict, blk->in + blk->inlen - next->dictlen,
+              next->dictlen);
+    }
+
+  if (mt->algo == COMPRESS_ALGO_ZLIB)
+    mt->adler = adler32 (mt->adler, blk->in, blk->inlen);
+
+  blk->last = last;
+  npth_mutex_lock (&mt->lock);
+  if (mt->queue_tail)
+    mt->queue_tail->next = blk;
+  else
+    mt->queue = blk;
+  mt->queue_tail = blk;
+  if (mt->pending_tail)
+    mt->pending_tail->next_out = blk;
+  else
+    mt->pending = blk;
+  mt->pending_tail = blk;
+  mt->npending++;
+  npth_cond_signal (&mt->work_cond);
+  npth_mutex_unlock (&mt->lock);
+
+  mt->cur = next;
+  return write_blocks (mt, a, last);
+}
+
+
+/* Compress LENGTH bytes from BUFFER and write the result to A.  */
+int
+compress_mt_write (compress_mt_t mt, const byte *buffer, size_t length,
+                   iobuf_t a)
+{
+  size_t n;
+  int rc;
+
+  if (!mt->cur)
+    {
+      mt->cur = xtrycalloc (1, sizeof *mt->cur);
+      if (!mt->cur || !(mt->cur->in = xtrymalloc (BLOCK_SIZE)))
+        {
+          rc = gpg_error_from_syserror ();
+          release_block (mt->cur);
+          mt->cur = NULL;
+          return rc;
+        }
+    }
+
+  while (length)
+    {
+      n = BLOCK_SIZE - mt->cur->inlen;
+      if (n > length)
+        n = length;
+      memcpy (mt->cur->in + mt->cur->inlen, buffer, n);
+      mt->cur->inlen += n;
+      buffer += n;
+      length -= n;
+      if (mt->cur->inlen == BLOCK_SIZE)
+        {
+          rc = submit_block (mt, 0, a);
+          if (rc)
+            return rc;
+        }
+    }
+  return 0;
+}
+
+
+/* Compress the remaining data, wait for all blocks and write the
+   trailer.  */
+int
+compress_mt_finish (compress_mt_t mt, iobuf_t a)
+{
+  int rc;
+
+  if (!mt->cur)
+    {
+      rc = compress_mt_write (mt, NULL, 0, a);
+      if (rc)
+        return rc;
+    }
+  rc = submit_block (mt, 1, a);
+  if (rc)
+    return rc;
+
+  if (mt->algo == COMPRESS_ALGO_ZLIB)
+    {
+      byte trailer[4];
+
+      trailer[0] = mt->adler >> 24;
+      trailer[1] = mt->adler >> 16;
+      trailer[2] = mt->adler >> 8;
+      trailer[3] = mt->adler;
+      rc = iobuf_write (a, trailer, 4);
+    }
+  return rc;
+}
+
+
+/* Stop the workers and release MT.  */
+void
+compress_mt_release (compress_mt_t mt)
+{
+  struct block_s *blk;
+  int i;
+
+  if (!mt)
+    return;
+
+  npth_mutex_lock (&mt->lock);
+  mt->stop = 1;
+  npth_cond_broadcast (&mt->work_cond);
+  npth_mutex_unlock (&mt->lock);
+  for (i=0; i < mt->nthreads; i++)
+    npth_join (mt->threads[i], NULL);
+
+  /* Blocks left after an error.  The queue is a subset of the
+     pending list.  */
+  while ((blk = mt->pending))
+    {
+      mt->pending = blk->next_out;
+      release_block (blk);
+    }
+  release_block (mt->cur);
+  npth_cond_destroy (&mt->done_cond);
+  npth_cond_destroy (&mt->work_cond);
+  npth_mutex_destroy (&mt->lock);
+  xfree (mt->threads);
+  xfree (mt);
+}
+
+#endif /*HAVE_ZIP*/
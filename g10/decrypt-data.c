@@ -77,6 +77,7 @@ int
 decrypt_data (ctrl_t ctrl, void *procctx, PKT_encrypted *ed, DEK *dek)
 {
   decode_filter_ctx_t dfx;
+  pipeline_stage_t stage = NULL;
   byte *p;
   int rc=0, c, i;
   byte temp[32];
@@ -221,8 +222,17 @@ decrypt_data (ctrl_t ctrl, void *procctx, PKT_encrypted *ed, DEK *dek)
   else
     iobuf_push_filter ( ed->buf, decode_filter, dfx );
 
+  /* In pipelined mode reading and decrypting runs in its own thread
+     while the main thread processes the plaintext packets.  */
+  if (opt.pipeline && push_pipeline_stage (ed->buf, &stage))
+    stage = NULL;
+
   proc_packets (ctrl, procctx, ed->buf );
   ed->buf = NULL;
+  /* If the packets have not been read up to the end the worker may
+     still be running; it must be stopped before we look at DFX.  */
+  pipeline_stage_stop (stage);
+  release_pipeline_stage (stage);
   if (dfx->eof_seen > 1 )
     rc = gpg_error (GPG_ERR_INV_PACKET);
   else if ( ed->mdc_method )
@@ -405,8 +415,9 @@ decode_filter( void *opaque, int control, IOBUF a, byte *buf, size_t *ret_len)
 {
   decode_filter_ctx_t fc = opaque;
   size_t size = *ret_len;
-  size_t n;
-  int c, rc = 0;
+  size_t n, len;
+  const byte *p;
+  int rc = 0;
 
 
   if ( control == IOBUFCTRL_UNDERFLOW && fc->eof_seen )
@@ -418,40 +429,32 @@ decode_filter( void *opaque, int control, IOBUF a, byte *buf, size_t *ret_len)
     {
       assert(a);
 
-      if (fc->partial)
+      /* Decrypt directly from the buffer of the underlying iobuf to
+         avoid an extra copy.  */
+      for (n=0; n < size && (fc->partial || fc->length); n += len)
         {
-          for (n=0; n < size; n++ )
+          if (iobuf_borrow (a, &p, &len))
             {
-              c = iobuf_get(a);
-              if (c == -1)
-                {
-                  fc->eof_seen = 1; /* Normal EOF. */
-                  break;
-                }
-              buf[n] = c;
+              /* EOF is normal in partial mode but premature
+                 otherwise.  */
+              fc->eof_seen = fc->partial? 1 : 3;
+              break;
             }
-        }
-      else
-        {
-          for (n=0; n < size && fc->length; n++, fc->length--)
-            {
-              c = iobuf_get(a);
-              if (c == -1)
-                {
-                  fc->eof_seen = 3; /* Premature EOF. */
-                  break;
-                }
-              buf[n] = c;
-            }
-          if (!fc->length)
-            fc->eof_seen = 1; /* Normal EOF.  */
-        }
-      if (n)
-        {
+          if (len > size - n)
+            len = size - n;
+          if (!fc->partial && len > fc->length)
+            len = fc->length;
           if (fc->cipher_hd)
-            gcry_cipher_decrypt (fc->cipher_hd, buf, n, NULL, 0);
+            gcry_cipher_decrypt (fc->cipher_hd, buf + n, len, p, len);
+          else
+            memcpy (buf + n, p, len);
+          iobuf_consume (a, len);
+          if (!fc->partial)
+            fc->length -= len;
         }
-      else
+      if (!fc->partial && !fc->length)
+        fc->eof_seen = 1; /* Normal EOF.  */
+      if (!n)
         {
           if (!fc->eof_seen)
             fc->eof_seen = 1;
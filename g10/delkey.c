@@ -217,6 +217,8 @@ do_delete_key( const char *username, int secret, int force, int *r_sec_avail )
                          gpg_strerror (err));
               goto leave;
             }
+          if (pk)
+            mark_key_changed (pk);
 	}
 
       /* Note that the ownertrust being cleared will trigger a
@@ -670,9 +670,25 @@ encrypt_crypt (ctrl_t ctrl, int filefd, const char *filename,
   else
     cfx.datalen = filesize && !do_compress ? filesize : 0;
 
+  /* In pipelined mode the writing of the output and the encryption
+     each run in their own thread.  The status output can't be done
+     by the cipher filter in that case.  If a stage can't be pushed
+     the filters below simply run in the main thread.  */
+  if (opt.pipeline)
+    {
+      cipher_filter_begin (&cfx);
+      if ((rc2 = push_pipeline_stage (out, NULL)))
+        log_info ("error creating the output pipeline stage: %s\n",
+                  gpg_strerror (rc2));
+    }
+
   /* Register the cipher filter. */
   iobuf_push_filter (out, cipher_filter, &cfx);
 
+  if (opt.pipeline && (rc2 = push_pipeline_stage (out, NULL)))
+    log_info ("error creating the cipher pipeline stage: %s\n",
+              gpg_strerror (rc2));
+
   /* Register the compress filter. */
   if (do_compress)
     {
@@ -704,6 +720,11 @@ encrypt_crypt (ctrl_t ctrl, int filefd, const char *filename,
         }
     }
 
+  /* And reading the input as well.  */
+  if (opt.pipeline && (rc2 = push_pipeline_stage (inp, NULL)))
+    log_info ("error creating the input pipeline stage: %s\n",
+              gpg_strerror (rc2));
+
   /* Do the work. */
   if (!opt.no_literal)
     {
@@ -96,6 +96,7 @@ typedef struct {
     gcry_md_hd_t mdc_hash;
     byte enchash[20];
     int create_mdc; /* flag will be set by the cipher filter */
+    int begin_done; /* BEGIN_ENCRYPTION has been emitted.  */
 } cipher_filter_context_t;
 
 
@@ -143,7 +144,24 @@ void push_compress_filter(iobuf_t out,compress_filter_context_t *zfx,int algo);
 void push_compress_filter2(iobuf_t out,compress_filter_context_t *zfx,
 			   int algo,int rel);
 
+/*-- compress-mt.c --*/
+struct compress_mt_s;
+typedef struct compress_mt_s *compress_mt_t;
+compress_mt_t compress_mt_new (int algo, int level, int nthreads);
+int  compress_mt_write (compress_mt_t mt, const byte *buffer, size_t length,
+                        iobuf_t a);
+int  compress_mt_finish (compress_mt_t mt, iobuf_t a);
+void compress_mt_release (compress_mt_t mt);
+
+/*-- pipeline.c --*/
+struct pipeline_stage_s;
+typedef struct pipeline_stage_s *pipeline_stage_t;
+gpg_error_t push_pipeline_stage (iobuf_t a, pipeline_stage_t *r_stage);
+void pipeline_stage_stop (pipeline_stage_t st);
+void release_pipeline_stage (pipeline_stage_t st);
+
 /*-- cipher.c --*/
+void cipher_filter_begin (cipher_filter_context_t *cfx);
 int cipher_filter( void *opaque, int control,
 		   iobuf_t chain, byte *buf, size_t *ret_len);
 
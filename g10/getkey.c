@@ -37,11 +37,13 @@
 #include "keyserver-internal.h"
 #include "call-agent.h"
 
-#define MAX_PK_CACHE_ENTRIES   PK_UID_CACHE_SIZE
-#define MAX_UID_CACHE_ENTRIES  PK_UID_CACHE_SIZE
+/* The default size of the key and user id caches.  The actual size
+   may be changed with --key-cache-size.  */
+#define DEFAULT_KEY_CACHE_SIZE  PK_UID_CACHE_SIZE
+#define MIN_KEY_CACHE_SIZE      5
 
-#if MAX_PK_CACHE_ENTRIES < 2
-#error We need the cache for key creation
+#if DEFAULT_KEY_CACHE_SIZE < MIN_KEY_CACHE_SIZE
+#error We need the caches for key creation
 #endif
 
 struct getkey_ctx_s
@@ -71,38 +73,74 @@ static struct
 } lkup_stats[21];
 #endif
 
-typedef struct keyid_list
+/* Statistics for the caches.  */
+struct cache_stats_s
 {
-  struct keyid_list *next;
-  char fpr[MAX_FINGERPRINT_LEN];
-  u32 keyid[2];
-} *keyid_list_t;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long inserts;
+  unsigned long evictions;
+};
 
 
-#if MAX_PK_CACHE_ENTRIES
+/* The public key cache.  The entries are hashed on the keyid and
+   linked in the order of their last use so that the least recently
+   used entry can be evicted.  */
 typedef struct pk_cache_entry
 {
-  struct pk_cache_entry *next;
+  struct pk_cache_entry *next;   /* Next entry in the hash chain.  */
+  struct pk_cache_entry *newer;  /* Next more recently used entry.  */
+  struct pk_cache_entry *older;  /* Next less recently used entry.  */
   u32 keyid[2];
   PKT_public_key *pk;
 } *pk_cache_entry_t;
-static pk_cache_entry_t pk_cache;
-static int pk_cache_entries;	/* Number of entries in pk cache.  */
-static int pk_cache_disabled;
-#endif
 
-#if MAX_UID_CACHE_ENTRIES < 5
-#error we really need the userid cache
-#endif
+static struct
+{
+  pk_cache_entry_t *table;  /* Hash table with TABLESIZE slots.  */
+  unsigned int tablesize;
+  pk_cache_entry_t newest;
+  pk_cache_entry_t oldest;
+  unsigned int entries;
+  unsigned int max_entries;
+  int disabled;
+  struct cache_stats_s stats;
+} pk_cache;
+
+
+/* The user id cache.  Each entry holds the primary user id of a
+   keyblock along with the list of its keys.  The keys are hashed on
+   their keyid and on their fingerprint.  */
+typedef struct keyid_list
+{
+  struct keyid_list *next;
+  struct keyid_list *kid_next;  /* Next item in the keyid hash chain.  */
+  struct keyid_list *fpr_next;  /* Next item in the fpr hash chain.  */
+  struct user_id_db *owner;     /* The user id entry of this key.  */
+  char fpr[MAX_FINGERPRINT_LEN];
+  u32 keyid[2];
+} *keyid_list_t;
+
 typedef struct user_id_db
 {
-  struct user_id_db *next;
+  struct user_id_db *newer;  /* Next more recently used entry.  */
+  struct user_id_db *older;  /* Next less recently used entry.  */
   keyid_list_t keyids;
   int len;
   char name[1];
 } *user_id_db_t;
-static user_id_db_t user_id_db;
-static int uid_cache_entries;	/* Number of entries in uid cache. */
+
+static struct
+{
+  keyid_list_t *kid_table;  /* Hash tables with TABLESIZE slots.  */
+  keyid_list_t *fpr_table;
+  unsigned int tablesize;
+  user_id_db_t newest;
+  user_id_db_t oldest;
+  unsigned int entries;
+  unsigned int max_entries;
+  struct cache_stats_s stats;
+} uid_cache;
 
 static void merge_selfsigs (kbnode_t keyblock);
 static int lookup (getkey_ctx_t ctx, kbnode_t *ret_keyblock, int want_secret);
@@ -125,14 +163,140 @@ print_stats ()
 #endif
 
 
+/* Return the configured number of entries for the key caches.  */
+static unsigned int
+key_cache_size (void)
+{
+  if (!opt.key_cache_size)
+    return DEFAULT_KEY_CACHE_SIZE;
+  if (opt.key_cache_size < MIN_KEY_CACHE_SIZE)
+    return MIN_KEY_CACHE_SIZE;
+  return opt.key_cache_size;
+}
+
+
+/* Return the size of the hash tables for a cache of MAX_ENTRIES.  */
+static unsigned int
+key_cache_tablesize (unsigned int max_entries)
+{
+  unsigned int n;
+
+  for (n = 64; n < max_entries && n < (1u << 24); n <<= 1)
+    ;
+  return n;
+}
+
+
+static unsigned int
+keyid_hash (const u32 *keyid, unsigned int tablesize)
+{
+  return (keyid[1] ^ (keyid[0] >> 16)) & (tablesize - 1);
+}
+
+
+static unsigned int
+fpr_hash (const char *fpr, unsigned int tablesize)
+{
+  const byte *p = (const byte *)fpr;
+
+  /* For v3 keys only the first 16 bytes of FPR are used.  */
+  return ((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]) & (tablesize - 1);
+}
+
+
+/* Unlink the entry CE from the LRU list of the pk cache.  */
+static void
+pk_cache_unlink_lru (pk_cache_entry_t ce)
+{
+  if (ce->newer)
+    ce->newer->older = ce->older;
+  else
+    pk_cache.newest = ce->older;
+  if (ce->older)
+    ce->older->newer = ce->newer;
+  else
+    pk_cache.oldest = ce->newer;
+  ce->newer = ce->older = NULL;
+}
+
+
+/* Put the entry CE at the head of the LRU list of the pk cache.  */
+static void
+pk_cache_push_lru (pk_cache_entry_t ce)
+{
+  ce->older = pk_cache.newest;
+  if (pk_cache.newest)
+    pk_cache.newest->newer = ce;
+  else
+    pk_cache.oldest = ce;
+  pk_cache.newest = ce;
+}
+
+
+/* Remove the entry CE from the pk cache and release it.  */
+static void
+pk_cache_remove (pk_cache_entry_t ce)
+{
+  pk_cache_entry_t *cep;
+
+  for (cep = &pk_cache.table[keyid_hash (ce->keyid, pk_cache.tablesize)];
+       *cep; cep = &(*cep)->next)
+    if (*cep == ce)
+      {
+        *cep = ce->next;
+        break;
+      }
+  pk_cache_unlink_lru (ce);
+  free_public_key (ce->pk);
+  xfree (ce);
+  pk_cache.entries--;
+}
+
+
+/* Return the entry for KEYID from the pk cache or NULL.  If
+   COUNT_IT is set the lookup is accounted in the statistics and the
+   entry is marked as most recently used.  */
+static pk_cache_entry_t
+pk_cache_lookup (u32 *keyid, int count_it)
+{
+  pk_cache_entry_t ce;
+
+  if (!pk_cache.table)
+    ce = NULL;
+  else
+    {
+      for (ce = pk_cache.table[keyid_hash (keyid, pk_cache.tablesize)];
+           ce; ce = ce->next)
+        if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
+          break;
+    }
+
+  if (count_it)
+    {
+      if (!ce)
+        pk_cache.stats.misses++;
+      else
+        {
+          pk_cache.stats.hits++;
+          if (ce != pk_cache.newest)
+            {
+              pk_cache_unlink_lru (ce);
+              pk_cache_push_lru (ce);
+            }
+        }
+    }
+  return ce;
+}
+
+
 void
 cache_public_key (PKT_public_key * pk)
 {
-#if MAX_PK_CACHE_ENTRIES
-  pk_cache_entry_t ce, ce2;
+  pk_cache_entry_t ce;
   u32 keyid[2];
+  unsigned int hash;
 
-  if (pk_cache_disabled)
+  if (pk_cache.disabled)
     return;
 
   if (pk->flags.dont_cache)
@@ -150,44 +314,37 @@ cache_public_key (PKT_public_key * pk)
   else
     return; /* Don't know how to get the keyid.  */
 
-  for (ce = pk_cache; ce; ce = ce->next)
-    if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-      {
-	if (DBG_CACHE)
-	  log_debug ("cache_public_key: already in cache\n");
-	return;
-      }
+  if (!pk_cache.table)
+    {
+      pk_cache.max_entries = key_cache_size ();
+      pk_cache.tablesize = key_cache_tablesize (pk_cache.max_entries);
+      pk_cache.table = xcalloc (pk_cache.tablesize, sizeof *pk_cache.table);
+    }
 
-  if (pk_cache_entries >= MAX_PK_CACHE_ENTRIES)
+  if (pk_cache_lookup (keyid, 0))
     {
-      int n;
+      if (DBG_CACHE)
+        log_debug ("cache_public_key: already in cache\n");
+      return;
+    }
 
-      /* Remove the last 50% of the entries.  */
-      for (ce = pk_cache, n = 0; ce && n < pk_cache_entries/2; n++)
-        ce = ce->next;
-      if (ce != pk_cache && ce->next)
-        {
-          ce2 = ce->next;
-          ce->next = NULL;
-          ce = ce2;
-          for (; ce; ce = ce2)
-            {
-              ce2 = ce->next;
-              free_public_key (ce->pk);
-              xfree (ce);
-              pk_cache_entries--;
-            }
-        }
-      assert (pk_cache_entries < MAX_PK_CACHE_ENTRIES);
+  /* Evict the least recently used entries.  */
+  while (pk_cache.entries >= pk_cache.max_entries)
+    {
+      pk_cache.stats.evictions++;
+      pk_cache_remove (pk_cache.oldest);
     }
-  pk_cache_entries++;
-  ce = xmalloc (sizeof *ce);
-  ce->next = pk_cache;
-  pk_cache = ce;
+
+  ce = xmalloc_clear (sizeof *ce);
   ce->pk = copy_public_key (NULL, pk);
   ce->keyid[0] = keyid[0];
   ce->keyid[1] = keyid[1];
-#endif
+  hash = keyid_hash (keyid, pk_cache.tablesize);
+  ce->next = pk_cache.table[hash];
+  pk_cache.table[hash] = ce;
+  pk_cache_push_lru (ce);
+  pk_cache.entries++;
+  pk_cache.stats.inserts++;
 }
 
 
@@ -243,6 +400,125 @@ release_keyid_list (keyid_list_t k)
     }
 }
 
+
+/* Unlink the entry R from the LRU list of the user id cache.  */
+static void
+uid_cache_unlink_lru (user_id_db_t r)
+{
+  if (r->newer)
+    r->newer->older = r->older;
+  else
+    uid_cache.newest = r->older;
+  if (r->older)
+    r->older->newer = r->newer;
+  else
+    uid_cache.oldest = r->newer;
+  r->newer = r->older = NULL;
+}
+
+
+/* Put the entry R at the head of the LRU list of the user id cache.  */
+static void
+uid_cache_push_lru (user_id_db_t r)
+{
+  r->older = uid_cache.newest;
+  if (uid_cache.newest)
+    uid_cache.newest->newer = r;
+  else
+    uid_cache.oldest = r;
+  uid_cache.newest = r;
+}
+
+
+/* Remove the entry R from the user id cache and release it.  */
+static void
+uid_cache_remove (user_id_db_t r)
+{
+  keyid_list_t a, *ap;
+
+  for (a = r->keyids; a; a = a->next)
+    {
+      for (ap = &uid_cache.kid_table[keyid_hash (a->keyid,
+                                                 uid_cache.tablesize)];
+           *ap; ap = &(*ap)->kid_next)
+        if (*ap == a)
+          {
+            *ap = a->kid_next;
+            break;
+          }
+      for (ap = &uid_cache.fpr_table[fpr_hash (a->fpr, uid_cache.tablesize)];
+           *ap; ap = &(*ap)->fpr_next)
+        if (*ap == a)
+          {
+            *ap = a->fpr_next;
+            break;
+          }
+    }
+  uid_cache_unlink_lru (r);
+  release_keyid_list (r->keyids);
+  xfree (r);
+  uid_cache.entries--;
+}
+
+
+/* Account a lookup in the user id cache which returned R.  */
+static user_id_db_t
+uid_cache_count (user_id_db_t r)
+{
+  if (!r)
+    uid_cache.stats.misses++;
+  else
+    {
+      uid_cache.stats.hits++;
+      if (r != uid_cache.newest)
+        {
+          uid_cache_unlink_lru (r);
+          uid_cache_push_lru (r);
+        }
+    }
+  return r;
+}
+
+
+/* Return the user id cache entry with a key matching KEYID or NULL.  */
+static user_id_db_t
+uid_cache_lookup_kid (u32 *keyid)
+{
+  keyid_list_t a;
+
+  if (!uid_cache.kid_table)
+    return uid_cache_count (NULL);
+  for (a = uid_cache.kid_table[keyid_hash (keyid, uid_cache.tablesize)];
+       a; a = a->kid_next)
+    if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
+      return uid_cache_count (a->owner);
+  return uid_cache_count (NULL);
+}
+
+
+/* Return the user id cache entry with a key matching the fingerprint
+   FPR of size MAX_FINGERPRINT_LEN or NULL.  If COUNT_IT is set the
+   lookup is accounted in the statistics.  */
+static user_id_db_t
+uid_cache_lookup_fpr (const char *fpr, int count_it)
+{
+  keyid_list_t a;
+  user_id_db_t r = NULL;
+
+  if (uid_cache.fpr_table)
+    {
+      for (a = uid_cache.fpr_table[fpr_hash (fpr, uid_cache.tablesize)];
+           a; a = a->fpr_next)
+        if (!memcmp (a->fpr, fpr, MAX_FINGERPRINT_LEN))
+          {
+            r = a->owner;
+            break;
+          }
+    }
+  return count_it? uid_cache_count (r) : r;
+}
+
+
 /****************
  * Store the association of keyid and userid
  * Feed only public keys to this function.
@@ -254,34 +530,39 @@ cache_user_id (KBNODE keyblock)
   const char *uid;
   size_t uidlen;
   keyid_list_t keyids = NULL;
+  keyid_list_t a;
+  unsigned int hash;
   KBNODE k;
 
+  if (!uid_cache.kid_table)
+    {
+      uid_cache.max_entries = key_cache_size ();
+      uid_cache.tablesize = key_cache_tablesize (uid_cache.max_entries);
+      uid_cache.kid_table = xcalloc (uid_cache.tablesize,
+                                     sizeof *uid_cache.kid_table);
+      uid_cache.fpr_table = xcalloc (uid_cache.tablesize,
+                                     sizeof *uid_cache.fpr_table);
+    }
+
   for (k = keyblock; k; k = k->next)
     {
       if (k->pkt->pkttype == PKT_PUBLIC_KEY
 	  || k->pkt->pkttype == PKT_PUBLIC_SUBKEY)
 	{
-	  keyid_list_t a = xmalloc_clear (sizeof *a);
+	  a = xmalloc_clear (sizeof *a);
 	  /* Hmmm: For a long list of keyids it might be an advantage
 	   * to append the keys.  */
           fingerprint_from_pk (k->pkt->pkt.public_key, a->fpr, NULL);
 	  keyid_from_pk (k->pkt->pkt.public_key, a->keyid);
 	  /* First check for duplicates.  */
-	  for (r = user_id_db; r; r = r->next)
-	    {
-	      keyid_list_t b = r->keyids;
-	      for (b = r->keyids; b; b = b->next)
-		{
-		  if (!memcmp (b->fpr, a->fpr, MAX_FINGERPRINT_LEN))
-		    {
-		      if (DBG_CACHE)
-			log_debug ("cache_user_id: already in cache\n");
-		      release_keyid_list (keyids);
-		      xfree (a);
-		      return;
-		    }
-		}
-	    }
+          if (uid_cache_lookup_fpr (a->fpr, 0))
+            {
+              if (DBG_CACHE)
+                log_debug ("cache_user_id: already in cache\n");
+              release_keyid_list (keyids);
+              xfree (a);
+              return;
+            }
 	  /* Now put it into the cache.  */
 	  a->next = keyids;
 	  keyids = a;
@@ -293,47 +574,60 @@ cache_user_id (KBNODE keyblock)
 
   uid = get_primary_uid (keyblock, &uidlen);
 
-  if (uid_cache_entries >= MAX_UID_CACHE_ENTRIES)
+  /* Evict the least recently used entries.  */
+  while (uid_cache.entries >= uid_cache.max_entries)
     {
-      /* fixme: use another algorithm to free some cache slots */
-      r = user_id_db;
-      user_id_db = r->next;
-      release_keyid_list (r->keyids);
-      xfree (r);
-      uid_cache_entries--;
+      uid_cache.stats.evictions++;
+      uid_cache_remove (uid_cache.oldest);
     }
-  r = xmalloc (sizeof *r + uidlen - 1);
+
+  r = xmalloc_clear (sizeof *r + uidlen - 1);
   r->keyids = keyids;
   r->len = uidlen;
   memcpy (r->name, uid, r->len);
-  r->next = user_id_db;
-  user_id_db = r;
-  uid_cache_entries++;
+  for (a = keyids; a; a = a->next)
+    {
+      a->owner = r;
+      hash = keyid_hash (a->keyid, uid_cache.tablesize);
+      a->kid_next = uid_cache.kid_table[hash];
+      uid_cache.kid_table[hash] = a;
+      hash = fpr_hash (a->fpr, uid_cache.tablesize);
+      a->fpr_next = uid_cache.fpr_table[hash];
+      uid_cache.fpr_table[hash] = a;
+    }
+  uid_cache_push_lru (r);
+  uid_cache.entries++;
+  uid_cache.stats.inserts++;
 }
 
 
 void
 getkey_disable_caches ()
 {
-#if MAX_PK_CACHE_ENTRIES
-  {
-    pk_cache_entry_t ce, ce2;
-
-    for (ce = pk_cache; ce; ce = ce2)
-      {
-	ce2 = ce->next;
-	free_public_key (ce->pk);
-	xfree (ce);
-      }
-    pk_cache_disabled = 1;
-    pk_cache_entries = 0;
-    pk_cache = NULL;
-  }
-#endif
+  while (pk_cache.oldest)
+    pk_cache_remove (pk_cache.oldest);
+  pk_cache.disabled = 1;
   /* fixme: disable user id cache ? */
 }
 
 
+/* Print statistics about the key and user id caches.  */
+void
+getkey_dump_stats (void)
+{
+  log_info ("pk cache: %u/%u entries; hits=%lu misses=%lu"
+            " inserts=%lu evictions=%lu\n",
+            pk_cache.entries, key_cache_size (),
+            pk_cache.stats.hits, pk_cache.stats.misses,
+            pk_cache.stats.inserts, pk_cache.stats.evictions);
+  log_info ("uid cache: %u/%u entries; hits=%lu misses=%lu"
+            " inserts=%lu evictions=%lu\n",
+            uid_cache.entries, key_cache_size (),
+            uid_cache.stats.hits, uid_cache.stats.misses,
+            uid_cache.stats.inserts, uid_cache.stats.evictions);
+}
+
+
 static void
 pk_from_block (GETKEY_CTX ctx, PKT_public_key * pk, KBNODE keyblock)
 {
@@ -354,23 +648,18 @@ get_pubkey (PKT_public_key * pk, u32 * keyid)
   int internal = 0;
   int rc = 0;
 
-#if MAX_PK_CACHE_ENTRIES
   if (pk)
     {
       /* Try to get it from the cache.  We don't do this when pk is
          NULL as it does not guarantee that the user IDs are
          cached. */
-      pk_cache_entry_t ce;
-      for (ce = pk_cache; ce; ce = ce->next)
-	{
-	  if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-	    {
-	      copy_public_key (pk, ce->pk);
-	      return 0;
-	    }
-	}
+      pk_cache_entry_t ce = pk_cache_lookup (keyid, 1);
+      if (ce)
+        {
+          copy_public_key (pk, ce->pk);
+          return 0;
+        }
     }
-#endif
   /* More init stuff.  */
   if (!pk)
     {
@@ -428,22 +717,16 @@ get_pubkey_fast (PKT_public_key * pk, u32 * keyid)
   u32 pkid[2];
 
   assert (pk);
-#if MAX_PK_CACHE_ENTRIES
   {
     /* Try to get it from the cache */
-    pk_cache_entry_t ce;
+    pk_cache_entry_t ce = pk_cache_lookup (keyid, 1);
 
-    for (ce = pk_cache; ce; ce = ce->next)
+    if (ce)
       {
-	if (ce->keyid[0] == keyid[0] && ce->keyid[1] == keyid[1])
-	  {
-	    if (pk)
-	      copy_public_key (pk, ce->pk);
-	    return 0;
-	  }
+        copy_public_key (pk, ce->pk);
+        return 0;
       }
   }
-#endif
 
   hd = keydb_new ();
   rc = keydb_search_kid (hd, keyid);
@@ -2724,17 +3007,9 @@ get_user_id_string (u32 * keyid)
   /* Try it two times; second pass reads from key resources.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
-	{
-	  keyid_list_t a;
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
-		{
-		  return xasprintf ("%s %.*s", keystr (keyid), r->len, r->name);
-		}
-	    }
-	}
+      r = uid_cache_lookup_kid (keyid);
+      if (r)
+        return xasprintf ("%s %.*s", keystr (keyid), r->len, r->name);
     }
   while (++pass < 2 && !get_pubkey (NULL, keyid));
   return xasprintf ("%s [?]", keystr (keyid));
@@ -2755,23 +3030,15 @@ char *
 get_long_user_id_string (u32 * keyid)
 {
   user_id_db_t r;
-  keyid_list_t a;
   int pass = 0;
   /* Try it two times; second pass reads from key resources.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
-	{
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
-		{
-		  return xasprintf ("%08lX%08lX %.*s",
-                                    (ulong) keyid[0], (ulong) keyid[1],
-                                    r->len, r->name);
-		}
-	    }
-	}
+      r = uid_cache_lookup_kid (keyid);
+      if (r)
+        return xasprintf ("%08lX%08lX %.*s",
+                          (ulong) keyid[0], (ulong) keyid[1],
+                          r->len, r->name);
     }
   while (++pass < 2 && !get_pubkey (NULL, keyid));
   return xasprintf ("%08lX%08lX [?]", (ulong) keyid[0], (ulong) keyid[1]);
@@ -2789,23 +3056,16 @@ get_user_id (u32 * keyid, size_t * rn)
   /* Try it two times; second pass reads from key resources.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
-	{
-	  keyid_list_t a;
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (a->keyid[0] == keyid[0] && a->keyid[1] == keyid[1])
-		{
-                  /* An empty string as user id is possible.  Make
-                     sure that the malloc allocates one byte and does
-                     not bail out.  */
-		  p = xmalloc (r->len? r->len : 1);
-		  memcpy (p, r->name, r->len);
-		  *rn = r->len;
-		  return p;
-		}
-	    }
-	}
+      r = uid_cache_lookup_kid (keyid);
+      if (r)
+        {
+          /* An empty string as user id is possible.  Make sure that
+             the malloc allocates one byte and does not bail out.  */
+          p = xmalloc (r->len? r->len : 1);
+          memcpy (p, r->name, r->len);
+          *rn = r->len;
+          return p;
+        }
     }
   while (++pass < 2 && !get_pubkey (NULL, keyid));
   p = xstrdup (user_id_not_found_utf8 ());
@@ -2837,23 +3097,16 @@ get_user_id_byfpr (const byte *fpr, size_t *rn)
   /* Try it two times; second pass reads from key resources.  */
   do
     {
-      for (r = user_id_db; r; r = r->next)
-	{
-	  keyid_list_t a;
-	  for (a = r->keyids; a; a = a->next)
-	    {
-	      if (!memcmp (a->fpr, fpr, MAX_FINGERPRINT_LEN))
-		{
-                  /* An empty string as user id is possible.  Make
-                     sure that the malloc allocates one byte and does
-                     not bail out.  */
-		  p = xmalloc (r->len? r->len : 1);
-		  memcpy (p, r->name, r->len);
-		  *rn = r->len;
-		  return p;
-		}
-	    }
-	}
+      r = uid_cache_lookup_fpr ((const char *)fpr, 1);
+      if (r)
+        {
+          /* An empty string as user id is possible.  Make sure that
+             the malloc allocates one byte and does not bail out.  */
+          p = xmalloc (r->len? r->len : 1);
+          memcpy (p, r->name, r->len);
+          *rn = r->len;
+          return p;
+        }
     }
   while (++pass < 2 && !get_pubkey_byfpr (NULL, fpr));
   p = xstrdup (user_id_not_found_utf8 ());
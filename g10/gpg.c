@@ -40,6 +40,7 @@
 #define INCLUDED_BY_MAIN_MODULE 1
 #include "gpg.h"
 #include <assuan.h>
+#include <npth.h>
 #include "../common/iobuf.h"
 #include "util.h"
 #include "packet.h"
@@ -220,6 +221,8 @@ enum cmd_and_opt_values
     oCompressLevel,
     oBZ2CompressLevel,
     oBZ2DecompressLowmem,
+    oCompressThreads,
+    oPipeline,
     oPassphrase,
     oPassphraseFD,
     oPassphraseFile,
@@ -380,6 +383,11 @@ enum cmd_and_opt_values
     oAllowWeakDigestAlgos,
     oFakedSystemTime,
     oNoAutostart,
+    oKeyCacheSize,
+    oTrustDBCacheSize,
+    oTrustDBMmap,
+    oTrustDBCertGraph,
+    oIOBufSize,
 
     oNoop
   };
@@ -495,6 +503,8 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_i (oCompressLevel, "compress-level", "@"),
   ARGPARSE_s_i (oBZ2CompressLevel, "bzip2-compress-level", "@"),
   ARGPARSE_s_n (oBZ2DecompressLowmem, "bzip2-decompress-lowmem", "@"),
+  ARGPARSE_s_i (oCompressThreads, "compress-threads", "@"),
+  ARGPARSE_s_n (oPipeline, "pipeline", "@"),
 
   ARGPARSE_s_n (oTextmodeShort, NULL, "@"),
   ARGPARSE_s_n (oTextmode,      "textmode", N_("use canonical text mode")),
@@ -757,6 +767,11 @@ static ARGPARSE_OPTS opts[] = {
   ARGPARSE_s_s (oKeyidFormat, "keyid-format", "@"),
   ARGPARSE_s_n (oExitOnStatusWriteError, "exit-on-status-write-error", "@"),
   ARGPARSE_s_i (oLimitCardInsertTries, "limit-card-insert-tries", "@"),
+  ARGPARSE_s_u (oKeyCacheSize, "key-cache-size", "@"),
+  ARGPARSE_s_u (oTrustDBCacheSize, "trustdb-cache-size", "@"),
+  ARGPARSE_s_n (oTrustDBMmap, "trustdb-mmap", "@"),
+  ARGPARSE_s_n (oTrustDBCertGraph, "trustdb-cert-graph", "@"),
+  ARGPARSE_s_u (oIOBufSize, "iobuf-size", "@"),
 
   ARGPARSE_s_n (oAllowMultisigVerification,
                 "allow-multisig-verification", "@"),
@@ -2711,6 +2726,8 @@ main (int argc, char **argv)
 	  case oCompressLevel: opt.compress_level = pargs.r.ret_int; break;
 	  case oBZ2CompressLevel: opt.bz2_compress_level = pargs.r.ret_int; break;
 	  case oBZ2DecompressLowmem: opt.bz2_decompress_lowmem=1; break;
+	  case oCompressThreads: opt.compress_threads = pargs.r.ret_int; break;
+	  case oPipeline: opt.pipeline = 1; break;
 	  case oPassphrase:
 	    set_passphrase_from_string(pargs.r.ret_str);
 	    break;
@@ -3068,6 +3085,21 @@ main (int argc, char **argv)
             opt.limit_card_insert_tries = pargs.r.ret_int;
             break;
 
+          case oKeyCacheSize:
+            opt.key_cache_size = pargs.r.ret_ulong;
+            break;
+
+          case oTrustDBCacheSize:
+            opt.tdb_cache_size = pargs.r.ret_ulong;
+            break;
+
+          case oTrustDBMmap: opt.tdb_mmap = 1; break;
+          case oTrustDBCertGraph: opt.tdb_cert_graph = 1; break;
+
+          case oIOBufSize:
+            iobuf_set_default_buffer_size (pargs.r.ret_ulong * 1024);
+            break;
+
 	  case oRequireCrossCert: opt.flags.require_cross_cert=1; break;
 	  case oNoRequireCrossCert: opt.flags.require_cross_cert=0; break;
 
@@ -3260,6 +3292,20 @@ main (int argc, char **argv)
     if (DBG_CLOCK)
       log_clock ("start");
 
+    /* Worker threads are only used for parallel compression and the
+       pipelined mode; thus we initialize nPth only if requested.  */
+    if (opt.compress_threads > 1 || opt.pipeline)
+      {
+        int rc = npth_init ();
+        if (rc)
+          {
+            log_info ("error initializing nPth: %s - "
+                      "not using threads\n", strerror (rc));
+            opt.compress_threads = 0;
+            opt.pipeline = 0;
+          }
+      }
+
     /* Do these after the switch(), so they can override settings. */
     if(PGP6)
       {
@@ -3363,7 +3409,7 @@ main (int argc, char **argv)
 	switch(cmd)
 	  {
 	  case aSign:
-	    cmdname="--sign";
+	    cmdname= detached_sig? NULL : "--sign";
 	    break;
 	  case aClearsign:
 	    cmdname="--clearsign";
@@ -3643,6 +3689,11 @@ main (int argc, char **argv)
 
       case aSign: /* sign the given file */
 	sl = NULL;
+	if (detached_sig && multifile) {
+	    /* Create one detached signature for each file.  */
+	    sign_files_detached (ctrl, argc, argv, locusr);
+	    break;
+	}
 	if( detached_sig ) { /* sign all files */
 	    for( ; argc; argc--, argv++ )
 		add_to_strlist( &sl, *argv );
@@ -4266,6 +4317,11 @@ g10_exit( int rc )
   gcry_control (GCRYCTL_UPDATE_RANDOM_SEED_FILE);
   if (DBG_CLOCK)
     log_clock ("stop");
+  if (DBG_CACHE)
+    {
+      keydb_dump_stats ();
+      getkey_dump_stats ();
+    }
   if ( (opt.debug & DBG_MEMSTAT_VALUE) )
     {
       gcry_control (GCRYCTL_DUMP_MEMORY_STATS);
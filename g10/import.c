@@ -1088,7 +1088,9 @@ import_one (ctrl_t ctrl,
       if (rc)
         log_error (_("error writing keyring '%s': %s\n"),
                    keydb_get_resource_name (hd), g10_errstr(rc));
-      else if (!(opt.import_options & IMPORT_KEEP_OWNERTTRUST))
+      else
+        mark_key_changed (pk);
+      if (!rc && !(opt.import_options & IMPORT_KEEP_OWNERTTRUST))
         {
           /* This should not be possible since we delete the
              ownertrust when a key is deleted, but it can happen if
@@ -1184,8 +1186,12 @@ import_one (ctrl_t ctrl,
           if (rc)
             log_error (_("error writing keyring '%s': %s\n"),
                        keydb_get_resource_name (hd), g10_errstr(rc) );
-          else if (non_self)
-            revalidation_mark ();
+          else
+            {
+              mark_key_changed (pk);
+              if (non_self)
+                revalidation_mark ();
+            }
 
           /* We are ready.  */
           if (!opt.quiet && !silent)
@@ -1873,6 +1879,8 @@ import_revoke_cert( const char *fname, kbnode_t node, struct stats_s *stats )
   if (rc)
     log_error (_("error writing keyring '%s': %s\n"),
                keydb_get_resource_name (hd), g10_errstr(rc) );
+  else
+    mark_key_changed (pk);
   keydb_release (hd);
   hd = NULL;
 
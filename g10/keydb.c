@@ -63,6 +63,74 @@ static struct resource_item all_resources[MAX_KEYDB_RESOURCES];
 static int used_resources;
 static void *primary_keyring=NULL;
 
+/* A cache of keyblock images used to speed up repeated searches by
+   fingerprint or long keyid.  The cache is shared by all handles of
+   the process.  Each entry stores the result of a successful search
+   as a keyblock image along with the signature status vector and the
+   numbers of the found key and user id.  For keyboxes the image is
+   instantly available; for keyrings it is created from the parsed
+   keyblock.  The entries are hashed on the search value and kept on
+   a LRU list to bound the size of the cache.  Because the result of
+   a search depends on all resources, the entire cache is flushed if
+   one of them has been modified; either by us or, as detected by
+   comparing the stamps of the files, by another process.  */
+#define KEYBLOCK_CACHE_SIZE    512
+#define KEYBLOCK_CACHE_BUCKETS 128
+
+enum keyblock_cache_keytypes {
+  KEYBLOCK_CACHE_KEY_FPR,
+  KEYBLOCK_CACHE_KEY_KID
+};
+
+struct keyblock_cache_key_s
+{
+  enum keyblock_cache_keytypes type;
+  byte value[MAX_FINGERPRINT_LEN];  /* The fingerprint or keyid.  */
+};
+
+struct keyblock_cache_entry_s
+{
+  struct keyblock_cache_entry_s *next;      /* Hash chain.  */
+  struct keyblock_cache_entry_s *lru_prev;  /* Towards the newest.  */
+  struct keyblock_cache_entry_s *lru_next;  /* Towards the oldest.  */
+  unsigned int refcount;  /* References from the cache and handles.  */
+  struct keyblock_cache_key_s key;
+  iobuf_t iobuf;          /* Image of the keyblock.  */
+  u32 *sigstatus;
+  int pk_no;
+  int uid_no;
+};
+typedef struct keyblock_cache_entry_s *keyblock_cache_entry_t;
+
+/* The state of a resource file used to detect modifications.  */
+struct resource_stamp_s
+{
+  off_t size;
+  time_t mtime;
+  time_t ctime;
+  ino_t ino;
+  u32 generation;  /* The keybox generation or 0.  */
+  int racy;        /* The file may be modified unnoticed.  */
+};
+
+static struct
+{
+  keyblock_cache_entry_t buckets[KEYBLOCK_CACHE_BUCKETS];
+  keyblock_cache_entry_t newest;
+  keyblock_cache_entry_t oldest;
+  unsigned int count;
+  int nstamps;     /* Number of valid STAMPS or -1 if not set.  */
+  struct resource_stamp_s stamps[MAX_KEYDB_RESOURCES];
+  struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long evictions;
+    unsigned long flushes;
+  } stats;
+} keyblock_cache = { { NULL }, NULL, NULL, 0, -1 };
+
+
 struct keydb_handle
 {
   int locked;
@@ -72,42 +140,334 @@ struct keydb_handle
   int current;
   int used;   /* Number of items in ACTIVE. */
   struct resource_item active[MAX_KEYDB_RESOURCES];
-};
-
 
-/* This is a simple cache used to return the last result of a
-   successful fingerprint search.  This works only for keybox resources
-   because (due to lack of a copy_keyblock function) we need to store
-   an image of the keyblock which is fortunately instantly available
-   for keyboxes.  */
-enum keyblock_cache_states {
-  KEYBLOCK_CACHE_EMPTY,
-  KEYBLOCK_CACHE_PREPARED,
-  KEYBLOCK_CACHE_FILLED
+  /* The cache entry found by the last search or NULL.  */
+  keyblock_cache_entry_t cached;
+  /* If set the keyblock found by the last search shall be stored in
+     the cache under CACHE_KEY.  */
+  int cache_prepared;
+  struct keyblock_cache_key_s cache_key;
 };
 
-struct {
-  enum keyblock_cache_states state;
-  byte fpr[MAX_FINGERPRINT_LEN];
-  iobuf_t iobuf; /* Image of the keyblock.  */
-  u32 *sigstatus;
-  int pk_no;
-  int uid_no;
-} keyblock_cache;
-
 
 static int lock_all (KEYDB_HANDLE hd);
 static void unlock_all (KEYDB_HANDLE hd);
+static gpg_error_t build_keyblock_image (kbnode_t keyblock,
+                                         iobuf_t *r_iobuf,
+                                         u32 **r_sigstatus);
+
+
+/* Build the cache key for the search description DESC.  Returns true
+   if the search mode may be served from the cache.  */
+static int
+keyblock_cache_key_from_desc (KEYDB_SEARCH_DESC *desc,
+                              struct keyblock_cache_key_s *key)
+{
+  memset (key, 0, sizeof *key);
+  switch (desc->mode)
+    {
+    case KEYDB_SEARCH_MODE_FPR20:
+    case KEYDB_SEARCH_MODE_FPR:
+      key->type = KEYBLOCK_CACHE_KEY_FPR;
+      memcpy (key->value, desc->u.fpr, 20);
+      return 1;
+
+    case KEYDB_SEARCH_MODE_LONG_KID:
+      key->type = KEYBLOCK_CACHE_KEY_KID;
+      key->value[0] = desc->u.kid[0] >> 24;
+      key->value[1] = desc->u.kid[0] >> 16;
+      key->value[2] = desc->u.kid[0] >>  8;
+      key->value[3] = desc->u.kid[0];
+      key->value[4] = desc->u.kid[1] >> 24;
+      key->value[5] = desc->u.kid[1] >> 16;
+      key->value[6] = desc->u.kid[1] >>  8;
+      key->value[7] = desc->u.kid[1];
+      return 1;
+
+    default:
+      return 0;
+    }
+}
+
+
+static unsigned int
+keyblock_cache_hash (const struct keyblock_cache_key_s *key)
+{
+  const byte *p;
+
+  /* The low order bytes of a keyid are the same as the last bytes of
+     a v4 fingerprint; both are well distributed.  */
+  p = key->type == KEYBLOCK_CACHE_KEY_FPR? key->value + 16 : key->value + 4;
+  return (((p[0] << 8) | p[1]) ^ ((p[2] << 8) | p[3])
+          ^ key->type) % KEYBLOCK_CACHE_BUCKETS;
+}
 
 
+static void
+keyblock_cache_entry_unref (keyblock_cache_entry_t entry)
+{
+  if (!entry)
+    return;
+  assert (entry->refcount);
+  if (--entry->refcount)
+    return;
+  xfree (entry->sigstatus);
+  iobuf_close (entry->iobuf);
+  xfree (entry);
+}
+
+
+/* Remove ENTRY from the cache.  */
+static void
+keyblock_cache_unlink (keyblock_cache_entry_t entry)
+{
+  keyblock_cache_entry_t *rp;
+
+  for (rp = &keyblock_cache.buckets[keyblock_cache_hash (&entry->key)];
+       *rp; rp = &(*rp)->next)
+    if (*rp == entry)
+      {
+        *rp = entry->next;
+        break;
+      }
+
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    keyblock_cache.newest = entry->lru_next;
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    keyblock_cache.oldest = entry->lru_prev;
+
+  entry->next = entry->lru_prev = entry->lru_next = NULL;
+  keyblock_cache.count--;
+  keyblock_cache_entry_unref (entry);
+}
+
+
+/* Flush the entire cache.  This needs to be called after a
+   modification of a resource.  */
 static void
 keyblock_cache_clear (void)
 {
-  keyblock_cache.state = KEYBLOCK_CACHE_EMPTY;
-  xfree (keyblock_cache.sigstatus);
-  keyblock_cache.sigstatus = NULL;
-  iobuf_close (keyblock_cache.iobuf);
-  keyblock_cache.iobuf = NULL;
+  if (keyblock_cache.count)
+    {
+      keyblock_cache.stats.flushes++;
+      while (keyblock_cache.oldest)
+        keyblock_cache_unlink (keyblock_cache.oldest);
+    }
+  keyblock_cache.nstamps = -1;
+}
+
+
+/* Forget the cache state of the last search on HD.  */
+static void
+keyblock_cache_reset_hd (KEYDB_HANDLE hd)
+{
+  keyblock_cache_entry_unref (hd->cached);
+  hd->cached = NULL;
+  hd->cache_prepared = 0;
+}
+
+
+static void
+get_resource_stamp (struct resource_item *resource,
+                    struct resource_stamp_s *stamp)
+{
+  const char *fname = NULL;
+  struct stat st;
+  time_t now;
+
+  memset (stamp, 0, sizeof *stamp);
+  switch (resource->type)
+    {
+    case KEYDB_RESOURCE_TYPE_NONE:
+      break;
+    case KEYDB_RESOURCE_TYPE_KEYRING:
+      fname = keyring_get_resource_name (resource->u.kr);
+      break;
+    case KEYDB_RESOURCE_TYPE_KEYBOX:
+      fname = keybox_get_resource_name (resource->u.kb);
+      break;
+    }
+
+  now = time (NULL);
+  if (fname && !stat (fname, &st))
+    {
+      stamp->size  = st.st_size;
+      stamp->mtime = st.st_mtime;
+      stamp->ctime = st.st_ctime;
+      stamp->ino   = st.st_ino;
+      /* The times have a resolution of one second.  Thus a change
+         done in the same second as we look at the file may go
+         unnoticed.  A keybox has a generation counter which is
+         bumped by each change and so we can rely on it instead.  */
+      if (resource->type != KEYDB_RESOURCE_TYPE_KEYBOX
+          || keybox_get_generation (resource->u.kb, &stamp->generation))
+        stamp->racy = (st.st_mtime >= now || st.st_ctime >= now);
+    }
+}
+
+
+/* Flush the cache if one of the resources used by HD has been
+   modified since the cache was filled.  This is done for each
+   cacheable search and thus only the size, inode and times of the
+   files and the generation of keyboxes are compared.  If one of the
+   files was modified in the same second as we looked at it, the
+   cache is not trusted.  */
+static void
+keyblock_cache_check_stamps (KEYDB_HANDLE hd)
+{
+  struct resource_stamp_s stamps[MAX_KEYDB_RESOURCES];
+  int i, racy = 0;
+
+  for (i=0; i < hd->used; i++)
+    get_resource_stamp (&hd->active[i], &stamps[i]);
+  for (i=0; i < keyblock_cache.nstamps; i++)
+    racy |= keyblock_cache.stamps[i].racy;
+
+  if (keyblock_cache.nstamps != hd->used || racy
+      || memcmp (keyblock_cache.stamps, stamps, hd->used * sizeof *stamps))
+    {
+      if (DBG_CACHE && keyblock_cache.count)
+        log_debug ("keyblock_cache: resources modified - flushing\n");
+      keyblock_cache_clear ();
+      memcpy (keyblock_cache.stamps, stamps, hd->used * sizeof *stamps);
+      keyblock_cache.nstamps = hd->used;
+    }
+}
+
+
+/* Return the cache entry for KEY or NULL if not found.  */
+static keyblock_cache_entry_t
+keyblock_cache_lookup (const struct keyblock_cache_key_s *key)
+{
+  keyblock_cache_entry_t entry;
+
+  for (entry = keyblock_cache.buckets[keyblock_cache_hash (key)];
+       entry; entry = entry->next)
+    if (entry->key.type == key->type
+        && !memcmp (entry->key.value, key->value, sizeof key->value))
+      break;
+  if (!entry)
+    return NULL;
+
+  /* Move to the front of the LRU list.  */
+  if (entry->lru_prev)
+    {
+      entry->lru_prev->lru_next = entry->lru_next;
+      if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+      else
+        keyblock_cache.oldest = entry->lru_prev;
+      entry->lru_prev = NULL;
+      entry->lru_next = keyblock_cache.newest;
+      keyblock_cache.newest->lru_prev = entry;
+      keyblock_cache.newest = entry;
+    }
+  return entry;
+}
+
+
+/* Store the keyblock image IOBUF with SIGSTATUS, PK_NO and UID_NO in
+   the cache using the key prepared by the last search on HD.  This
+   function takes ownership of IOBUF and SIGSTATUS.  */
+static void
+keyblock_cache_put (KEYDB_HANDLE hd, iobuf_t iobuf, u32 *sigstatus,
+                    int pk_no, int uid_no)
+{
+  keyblock_cache_entry_t entry;
+  unsigned int hash;
+
+  assert (hd->cache_prepared);
+  hd->cache_prepared = 0;
+
+  /* Replace an entry stored in the meantime by another handle.  */
+  entry = keyblock_cache_lookup (&hd->cache_key);
+  if (entry)
+    keyblock_cache_unlink (entry);
+
+  while (keyblock_cache.count >= KEYBLOCK_CACHE_SIZE)
+    {
+      keyblock_cache.stats.evictions++;
+      keyblock_cache_unlink (keyblock_cache.oldest);
+    }
+
+  entry = xmalloc_clear (sizeof *entry);
+  entry->key       = hd->cache_key;
+  entry->iobuf     = iobuf;
+  entry->sigstatus = sigstatus;
+  entry->pk_no     = pk_no;
+  entry->uid_no    = uid_no;
+  entry->refcount  = 1;
+
+  hash = keyblock_cache_hash (&entry->key);
+  entry->next = keyblock_cache.buckets[hash];
+  keyblock_cache.buckets[hash] = entry;
+  entry->lru_next = keyblock_cache.newest;
+  if (keyblock_cache.newest)
+    keyblock_cache.newest->lru_prev = entry;
+  else
+    keyblock_cache.oldest = entry;
+  keyblock_cache.newest = entry;
+  keyblock_cache.count++;
+  keyblock_cache.stats.stores++;
+}
+
+
+/* Store a copy of the parsed KEYBLOCK in the cache.  This is used
+   for keyring resources which do not provide a keyblock image.  */
+static void
+keyblock_cache_put_keyblock (KEYDB_HANDLE hd, kbnode_t keyblock)
+{
+  kbnode_t node;
+  iobuf_t tmpbuf, iobuf;
+  u32 *sigstatus;
+  int pk_count, uid_count, pk_no, uid_no;
+
+  pk_count = uid_count = pk_no = uid_no = 0;
+  for (node = keyblock; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_PUBLIC_KEY
+          || node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        {
+          pk_count++;
+          if ((node->flag & 1))
+            pk_no = pk_count;
+        }
+      else if (node->pkt->pkttype == PKT_USER_ID)
+        {
+          uid_count++;
+          if ((node->flag & 2))
+            uid_no = uid_count;
+        }
+    }
+
+  if (build_keyblock_image (keyblock, &tmpbuf, &sigstatus))
+    {
+      hd->cache_prepared = 0;
+      return;
+    }
+  iobuf = iobuf_temp_with_content (iobuf_get_temp_buffer (tmpbuf),
+                                   iobuf_get_temp_length (tmpbuf));
+  iobuf_close (tmpbuf);
+  keyblock_cache_put (hd, iobuf, sigstatus, pk_no, uid_no);
+}
+
+
+/* Print statistics about the keyblock cache.  */
+void
+keydb_dump_stats (void)
+{
+  log_info ("keyblock cache: %u entries; hits=%lu misses=%lu"
+            " stores=%lu evictions=%lu flushes=%lu\n",
+            keyblock_cache.count,
+            keyblock_cache.stats.hits,
+            keyblock_cache.stats.misses,
+            keyblock_cache.stats.stores,
+            keyblock_cache.stats.evictions,
+            keyblock_cache.stats.flushes);
 }
 
 
@@ -582,6 +942,7 @@ keydb_release (KEYDB_HANDLE hd)
   assert (active_handles > 0);
   active_handles--;
 
+  keyblock_cache_reset_hd (hd);
   unlock_all (hd);
   for (i=0; i < hd->used; i++)
     {
@@ -602,6 +963,46 @@ keydb_release (KEYDB_HANDLE hd)
 }
 
 
+/* If the last search of HD has been served from the cache, HD does
+   not know the resource and the position of the keyblock.  Repeat
+   the search without using the cache so that the keyblock can be
+   modified or the name of its resource be returned.  */
+static gpg_error_t
+keyblock_cache_locate (KEYDB_HANDLE hd)
+{
+  KEYDB_SEARCH_DESC desc;
+  const byte *p;
+  int no_caching;
+  gpg_error_t err;
+
+  if (!hd->cached || hd->found >= 0)
+    return 0;
+
+  memset (&desc, 0, sizeof desc);
+  p = hd->cached->key.value;
+  if (hd->cached->key.type == KEYBLOCK_CACHE_KEY_FPR)
+    {
+      desc.mode = KEYDB_SEARCH_MODE_FPR;
+      memcpy (desc.u.fpr, p, 20);
+    }
+  else
+    {
+      desc.mode = KEYDB_SEARCH_MODE_LONG_KID;
+      desc.u.kid[0] = ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+      desc.u.kid[1] = ((u32)p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+    }
+
+  err = keydb_search_reset (hd);
+  if (err)
+    return err;
+  no_caching = hd->no_caching;
+  hd->no_caching = 1;
+  err = keydb_search (hd, &desc, 1, NULL);
+  hd->no_caching = no_caching;
+  return err;
+}
+
+
 /* Set a flag on handle to not use cached results.  This is required
    for updating a keyring and for key listins.  Fixme: Using a new
    parameter for keydb_new might be a better solution.  */
@@ -630,6 +1031,8 @@ keydb_get_resource_name (KEYDB_HANDLE hd)
   if (!hd)
     return NULL;
 
+  keyblock_cache_locate (hd);
+
   if ( hd->found >= 0 && hd->found < hd->used)
     idx = hd->found;
   else if ( hd->current >= 0 && hd->current < hd->used)
@@ -904,16 +1307,19 @@ keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
-  if (keyblock_cache.state == KEYBLOCK_CACHE_FILLED)
+  if (hd->cached)
     {
-      iobuf_seek (keyblock_cache.iobuf, 0);
-      err = parse_keyblock_image (keyblock_cache.iobuf,
-                                  keyblock_cache.pk_no,
-                                  keyblock_cache.uid_no,
-                                  keyblock_cache.sigstatus,
+      iobuf_seek (hd->cached->iobuf, 0);
+      err = parse_keyblock_image (hd->cached->iobuf,
+                                  hd->cached->pk_no,
+                                  hd->cached->uid_no,
+                                  hd->cached->sigstatus,
                                   ret_kb);
       if (err)
-        keyblock_cache_clear ();
+        {
+          keyblock_cache_reset_hd (hd);
+          keyblock_cache_clear ();
+        }
       return err;
     }
 
@@ -927,6 +1333,8 @@ keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
       break;
     case KEYDB_RESOURCE_TYPE_KEYRING:
       err = keyring_get_keyblock (hd->active[hd->found].u.kr, ret_kb);
+      if (!err && hd->cache_prepared)
+        keyblock_cache_put_keyblock (hd, *ret_kb);
       break;
     case KEYDB_RESOURCE_TYPE_KEYBOX:
       {
@@ -940,14 +1348,8 @@ keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
           {
             err = parse_keyblock_image (iobuf, pk_no, uid_no, sigstatus,
                                         ret_kb);
-            if (!err && keyblock_cache.state == KEYBLOCK_CACHE_PREPARED)
-              {
-                keyblock_cache.state     = KEYBLOCK_CACHE_FILLED;
-                keyblock_cache.sigstatus = sigstatus;
-                keyblock_cache.iobuf     = iobuf;
-                keyblock_cache.pk_no     = pk_no;
-                keyblock_cache.uid_no    = uid_no;
-              }
+            if (!err && hd->cache_prepared)
+              keyblock_cache_put (hd, iobuf, sigstatus, pk_no, uid_no);
             else
               {
                 xfree (sigstatus);
@@ -958,8 +1360,7 @@ keydb_get_keyblock (KEYDB_HANDLE hd, KBNODE *ret_kb)
       break;
     }
 
-  if (keyblock_cache.state != KEYBLOCK_CACHE_FILLED)
-    keyblock_cache_clear ();
+  hd->cache_prepared = 0;
 
   return err;
 }
@@ -1066,6 +1467,10 @@ keydb_update_keyblock (KEYDB_HANDLE hd, kbnode_t kb)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
+  err = keyblock_cache_locate (hd);
+  if (err)
+    return err;
+
   keyblock_cache_clear ();
 
   if (hd->found < 0 || hd->found >= hd->used)
@@ -1181,6 +1586,10 @@ keydb_delete_keyblock (KEYDB_HANDLE hd)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
+  rc = keyblock_cache_locate (hd);
+  if (rc)
+    return rc;
+
   keyblock_cache_clear ();
 
   if (hd->found < 0 || hd->found >= hd->used)
@@ -1323,7 +1732,7 @@ keydb_search_reset (KEYDB_HANDLE hd)
   if (!hd)
     return gpg_error (GPG_ERR_INV_ARG);
 
-  keyblock_cache_clear ();
+  keyblock_cache_reset_hd (hd);
 
   if (DBG_CLOCK)
     log_clock ("keydb_search_reset");
@@ -1411,6 +1820,8 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
               size_t ndesc, size_t *descindex)
 {
   gpg_error_t rc;
+  struct keyblock_cache_key_s cache_key;
+  int cacheable, at_start, skip_first;
 
   if (descindex)
     *descindex = 0; /* Make sure it is always set on return.  */
@@ -1424,22 +1835,41 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
   if (DBG_CACHE)
     dump_search_desc (hd, "keydb_search", desc, ndesc);
 
-  /* NB: If one of the exact search modes below is used in a loop to
-     walk over all keys (with the same fingerprint) the caching must
-     have been disabled for the handle.  */
-  if (!hd->no_caching
-      && ndesc == 1
-      && (desc[0].mode == KEYDB_SEARCH_MODE_FPR20
-          || desc[0].mode == KEYDB_SEARCH_MODE_FPR)
-      && keyblock_cache.state  == KEYBLOCK_CACHE_FILLED
-      && !memcmp (keyblock_cache.fpr, desc[0].u.fpr, 20))
+  cacheable = (!hd->no_caching && ndesc == 1
+               && keyblock_cache_key_from_desc (desc, &cache_key));
+
+  /* A cache entry describes the first match of a search; thus the
+     cache may only be used if the search starts at the beginning.
+     If the last search has been served from the cache the resources
+     have not been moved and a repeated search needs to skip the
+     keyblock already returned.  */
+  skip_first = (cacheable && hd->cached
+                && hd->cached->key.type == cache_key.type
+                && !memcmp (hd->cached->key.value, cache_key.value,
+                            sizeof cache_key.value));
+  keyblock_cache_reset_hd (hd);
+  at_start = (hd->found < 0 && hd->current == 0);
+
+  if (cacheable && at_start && !skip_first)
     {
-      /* (DESCINDEX is already set).  */
-      if (DBG_CLOCK)
-        log_clock ("keydb_search leave (cached)");
-      return 0;
+      keyblock_cache_entry_t entry;
+
+      keyblock_cache_check_stamps (hd);
+      entry = keyblock_cache_lookup (&cache_key);
+      if (entry)
+        {
+          keyblock_cache.stats.hits++;
+          entry->refcount++;
+          hd->cached = entry;
+          /* (DESCINDEX is already set).  */
+          if (DBG_CLOCK)
+            log_clock ("keydb_search leave (cached)");
+          return 0;
+        }
+      keyblock_cache.stats.misses++;
     }
 
+ next_match:
   rc = -1;
   while ((rc == -1 || gpg_err_code (rc) == GPG_ERR_EOF)
          && hd->current >= 0 && hd->current < hd->used)
@@ -1472,14 +1902,17 @@ keydb_search (KEYDB_HANDLE hd, KEYDB_SEARCH_DESC *desc,
         ? gpg_error (GPG_ERR_NOT_FOUND)
         : rc);
 
-  keyblock_cache_clear ();
-  if (!hd->no_caching
-      && !rc
-      && ndesc == 1 && (desc[0].mode == KEYDB_SEARCH_MODE_FPR20
-                        || desc[0].mode == KEYDB_SEARCH_MODE_FPR))
+  if (!rc && skip_first)
+    {
+      skip_first = 0;
+      at_start = 0;
+      goto next_match;
+    }
+
+  if (!rc && cacheable && at_start)
     {
-      keyblock_cache.state = KEYBLOCK_CACHE_PREPARED;
-      memcpy (keyblock_cache.fpr, desc[0].u.fpr, 20);
+      hd->cache_prepared = 1;
+      hd->cache_key = cache_key;
     }
 
   if (DBG_CLOCK)
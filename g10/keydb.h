@@ -151,6 +151,7 @@ gpg_error_t keydb_search_first (KEYDB_HANDLE hd);
 gpg_error_t keydb_search_next (KEYDB_HANDLE hd);
 gpg_error_t keydb_search_kid (KEYDB_HANDLE hd, u32 *kid);
 gpg_error_t keydb_search_fpr (KEYDB_HANDLE hd, const byte *fpr);
+void keydb_dump_stats (void);
 
 /*-- pkclist.c --*/
 void show_revocation_reason( PKT_public_key *pk, int mode );
@@ -210,6 +211,7 @@ char *gpg_format_keydesc (PKT_public_key *pk, int mode, int escaped);
 /*-- getkey.c --*/
 void cache_public_key( PKT_public_key *pk );
 void getkey_disable_caches(void);
+void getkey_dump_stats (void);
 int get_pubkey( PKT_public_key *pk, u32 *keyid );
 int get_pubkey_fast ( PKT_public_key *pk, u32 *keyid );
 KBNODE get_pubkeyblock( u32 *keyid );
@@ -2201,6 +2201,7 @@ keyedit_menu (ctrl_t ctrl, const char *username, strlist_t locusr,
                   log_error (_("update failed: %s\n"), g10_errstr (err));
                   break;
                 }
+              mark_key_changed (keyblock->pkt->pkt.public_key);
 	    }
 	  else
 	    tty_printf (_("Key not changed so no update needed.\n"));
@@ -2403,6 +2404,7 @@ keyedit_quick_sign (ctrl_t ctrl, const char *fpr, strlist_t uids,
           log_error (_("update failed: %s\n"), gpg_strerror (err));
           goto leave;
         }
+      mark_key_changed (keyblock->pkt->pkt.public_key);
     }
   else
     log_info (_("Key not changed so no update needed.\n"));
@@ -4099,6 +4099,7 @@ do_generate_keypair (struct para_data_s *para,
                               & PUBKEY_USAGE_ENC)) );
 
           pk = find_kbnode (pub_root, PKT_PUBLIC_KEY)->pkt->pkt.public_key;
+          mark_key_changed (pk);
 
           keyid_from_pk (pk, pk->main_keyid);
           register_trusted_keyid (pk->main_keyid);
@@ -448,6 +448,10 @@ list_all (int secret, int mark_secret)
 
   memset (&stats, 0, sizeof (stats));
 
+  /* Ask the agent only once for all secret keys.  */
+  if (secret || mark_secret)
+    agent_cache_secret_keygrips (NULL, 1);
+
   hd = keydb_new ();
   if (!hd)
     rc = gpg_error (GPG_ERR_GENERAL);
@@ -512,6 +516,8 @@ list_all (int secret, int mark_secret)
     print_signature_stats (&stats);
 
 leave:
+  if (secret || mark_secret)
+    agent_cache_secret_keygrips (NULL, 0);
   release_kbnode (keyblock);
   keydb_release (hd);
 }
@@ -83,6 +83,8 @@ struct
   int compress_level;
   int bz2_compress_level;
   int bz2_decompress_lowmem;
+  int compress_threads;   /* Number of threads for compression.  */
+  int pipeline;           /* Run en-/decryption stages in threads.  */
   const char *def_secret_key;
   char *def_recipient;
   int def_recipient_self;
@@ -207,6 +209,21 @@ struct
      value. */
   int limit_card_insert_tries;
 
+  /* Number of entries in the key and user id caches; 0 for the
+     default.  */
+  unsigned int key_cache_size;
+
+  /* Number of records in the trustdb record cache; 0 for the
+     default.  */
+  unsigned int tdb_cache_size;
+
+  /* Read the trustdb through a shared read-only mapping.  */
+  int tdb_mmap;
+
+  /* Build the web of trust by following the certifications from
+     the ultimately trusted keys.  */
+  int tdb_cert_graph;
+
 #ifdef ENABLE_CARD_SUPPORT
   /* FIXME: We don't needs this here as it is done in scdaemon. */
   const char *ctapi_driver; /* Library to access the ctAPI. */
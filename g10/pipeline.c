@@ -0,0 +1,505 @@
+/* pipeline.c - Run parts of an iobuf filter chain in their own thread
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A pipeline stage is a filter which hands the data over to a worker
+   thread through a bounded ring of buffers.  The worker runs the part
+   of the filter chain below the stage: for an output iobuf it writes
+   the data to the lower filters, for an input iobuf it reads ahead
+   from them.  Pushing stages between filters, for example around the
+   cipher filter, thus lets reading, compression, encryption and
+   writing run concurrently.
+
+   Worker threads run the lower filters without holding the nPth lock.
+   The filters only touch their own context and the part of the chain
+   owned by the worker, so that is safe as long as no other code
+   accesses the chain below a stage while it is active.  The thread
+   using a stage (the "client") is either the main thread, which holds
+   the lock, or the worker of a stage further up, which does not.  The
+   latter is tracked with the CLIENT_UNPROTECTED flag, which is set for
+   the lifetime of the upper worker.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <npth.h>
+
+#include "gpg.h"
+#include "util.h"
+#include "iobuf.h"
+#include "options.h"
+#include "filter.h"
+#include "main.h"
+
+
+/* The number and size of the buffers in the ring.  */
+#define NSLOTS    4
+#define SLOT_SIZE (64*1024)
+
+
+struct pipeline_stage_s
+{
+  int refcount;
+  int use;                /* 1 for input, 2 for output.  */
+  int client_unprotected; /* The client runs without the nPth lock.  */
+  pipeline_stage_t below; /* The next stage down the chain or NULL.  */
+
+  iobuf_t chain;          /* The part of the chain run by the worker.  */
+  npth_t thread;
+  int running;            /* The worker has been started.  */
+
+  npth_mutex_t lock;      /* Protects the fields below.  */
+  npth_cond_t cond;       /* Signaled on any state change.  */
+  byte *slot[NSLOTS];
+  size_t slotlen[NSLOTS];
+  unsigned int head;      /* Index of the first ready slot.  */
+  unsigned int count;     /* Number of ready slots.  */
+  size_t offset;          /* Read offset into the head slot (input).  */
+  int eof;                /* No more data will be produced.  */
+  int stop;               /* The worker shall terminate.  */
+  int done;               /* The worker has terminated.  */
+  int error;              /* Error code from the worker.  */
+};
+
+
+static void
+client_lock (pipeline_stage_t st)
+{
+  if (st->client_unprotected)
+    npth_protect ();
+  npth_mutex_lock (&st->lock);
+}
+
+
+static void
+client_unlock (pipeline_stage_t st)
+{
+  npth_mutex_unlock (&st->lock);
+  if (st->client_unprotected)
+    npth_unprotect ();
+}
+
+
+/* Drop a reference.  Must be called with the nPth lock held.  */
+static void
+stage_unref (pipeline_stage_t st)
+{
+  int i;
+
+  if (!st)
+    return;
+  npth_mutex_lock (&st->lock);
+  i = --st->refcount;
+  npth_mutex_unlock (&st->lock);
+  if (i)
+    return;
+
+  stage_unref (st->below);
+  for (i=0; i < NSLOTS; i++)
+    xfree (st->slot[i]);
+  npth_cond_destroy (&st->cond);
+  npth_mutex_destroy (&st->lock);
+  xfree (st);
+}
+
+
+/* The worker of an output stage: write the ready slots to the
+   chain.  */
+static void
+output_worker (pipeline_stage_t st)
+{
+  unsigned int idx;
+  int rc;
+
+  npth_mutex_lock (&st->lock);
+  for (;;)
+    {
+      while (!st->count && !st->eof && !st->stop)
+        npth_cond_wait (&st->cond, &st->lock);
+      if (!st->count || st->stop)
+        break;
+      idx = st->head;
+      npth_mutex_unlock (&st->lock);
+
+      npth_unprotect ();
+      rc = iobuf_write (st->chain, st->slot[idx], st->slotlen[idx]);
+      npth_protect ();
+
+      npth_mutex_lock (&st->lock);
+      st->head = (st->head + 1) % NSLOTS;
+      st->count--;
+      if (rc)
+        {
+          st->error = rc;
+          st->stop = 1;
+        }
+      npth_cond_broadcast (&st->cond);
+    }
+  npth_mutex_unlock (&st->lock);
+}
+
+
+/* The worker of an input stage: read ahead from the chain.  */
+static void
+input_worker (pipeline_stage_t st)
+{
+  unsigned int idx;
+  int n;
+
+  npth_mutex_lock (&st->lock);
+  for (;;)
+    {
+      while (st->count == NSLOTS && !st->stop)
+        npth_cond_wait (&st->cond, &st->lock);
+      if (st->stop || st->eof)
+        break;
+      idx = (st->head + st->count) % NSLOTS;
+      npth_mutex_unlock (&st->lock);
+
+      /* Note that a short read means that an EOF has been seen and a
+         filter might have been popped; we must not read again.  */
+      npth_unprotect ();
+      n = iobuf_read (st->chain, st->slot[idx], SLOT_SIZE);
+      npth_protect ();
+
+      npth_mutex_lock (&st->lock);
+      if (n > 0)
+        {
+          st->slotlen[idx] = n;
+          st->count++;
+        }
+      if (n < SLOT_SIZE)
+        {
+          st->eof = 1;
+          st->error = iobuf_error (st->chain);
+        }
+      npth_cond_broadcast (&st->cond);
+    }
+  npth_mutex_unlock (&st->lock);
+}
+
+
+static void *
+stage_thread (void *arg)
+{
+  pipeline_stage_t st = arg;
+
+  if (st->use == 1)
+    input_worker (st);
+  else
+    output_worker (st);
+
+  npth_mutex_lock (&st->lock);
+  st->done = 1;
+  npth_cond_broadcast (&st->cond);
+  npth_mutex_unlock (&st->lock);
+  return NULL;
+}
+
+
+/* Start the worker thread.  The chain is only known at the time the
+   filter is called for the first time.  */
+static int
+start_worker (pipeline_stage_t st, iobuf_t chain)
+{
+  npth_attr_t tattr;
+  int rc;
+
+  if (st->running)
+    return 0;
+
+  st->chain = chain;
+  if (st->client_unprotected)
+    npth_protect ();
+  npth_attr_init (&tattr);
+  npth_attr_setdetachstate (&tattr, NPTH_CREATE_JOINABLE);
+  rc = npth_create (&st->thread, &tattr, stage_thread, st);
+  npth_attr_destroy (&tattr);
+  if (st->client_unprotected)
+    npth_unprotect ();
+  if (rc)
+    {
+      log_error ("error spawning pipeline thread: %s\n", strerror (rc));
+      return gpg_error_from_errno (rc);
+    }
+  st->running = 1;
+  return 0;
+}
+
+
+/* Tell the worker to terminate and wait for it.  For an output stage
+   all pending data is written first.  Returns the error code from
+   the worker.  */
+static int
+stop_worker (pipeline_stage_t st)
+{
+  int rc;
+
+  client_lock (st);
+  st->eof = 1;
+  if (st->use == 1)
+    st->stop = 1;
+  npth_cond_broadcast (&st->cond);
+  while (st->running && !st->done)
+    npth_cond_wait (&st->cond, &st->lock);
+  rc = st->error;
+  npth_mutex_unlock (&st->lock);
+
+  if (st->running)
+    {
+      npth_join (st->thread, NULL);
+      st->running = 0;
+    }
+  /* The client of the stage below is again the thread which is our
+     client.  */
+  if (st->below)
+    st->below->client_unprotected = st->client_unprotected;
+  if (st->client_unprotected)
+    npth_unprotect ();
+  return rc;
+}
+
+
+/* Hand LENGTH bytes from BUFFER to the worker.  */
+static int
+stage_write (pipeline_stage_t st, iobuf_t chain,
+             const byte *buffer, size_t length)
+{
+  unsigned int idx;
+  size_t n;
+  int rc;
+
+  rc = start_worker (st, chain);
+  if (rc)
+    return rc;
+
+  client_lock (st);
+  while (length)
+    {
+      while (st->count == NSLOTS && !st->error)
+        npth_cond_wait (&st->cond, &st->lock);
+      if (st->error)
+        break;
+      /* The slot after the ready ones is being filled.  */
+      idx = (st->head + st->count) % NSLOTS;
+      n = SLOT_SIZE - st->offset;
+      if (n > length)
+        n = length;
+      memcpy (st->slot[idx] + st->offset, buffer, n);
+      st->offset += n;
+      buffer += n;
+      length -= n;
+      if (st->offset == SLOT_SIZE)
+        {
+          st->slotlen[idx] = st->offset;
+          st->offset = 0;
+          st->count++;
+          npth_cond_broadcast (&st->cond);
+        }
+    }
+  rc = st->error;
+  client_unlock (st);
+  return rc;
+}
+
+
+/* Hand the partly filled slot to the worker.  */
+static void
+stage_flush_slot (pipeline_stage_t st)
+{
+  unsigned int idx;
+
+  client_lock (st);
+  while (st->count == NSLOTS && !st->error)
+    npth_cond_wait (&st->cond, &st->lock);
+  if (!st->error && st->offset)
+    {
+      idx = (st->head + st->count) % NSLOTS;
+      st->slotlen[idx] = st->offset;
+      st->offset = 0;
+      st->count++;
+      npth_cond_broadcast (&st->cond);
+    }
+  client_unlock (st);
+}
+
+
+/* Get up to *R_LENGTH bytes from the worker.  */
+static int
+stage_read (pipeline_stage_t st, iobuf_t chain,
+            byte *buffer, size_t *r_length)
+{
+  size_t size = *r_length;
+  size_t nread = 0;
+  size_t n;
+  int rc;
+
+  *r_length = 0;
+  rc = start_worker (st, chain);
+  if (rc)
+    return rc;
+
+  client_lock (st);
+  while (nread < size)
+    {
+      while (!st->count && !st->eof)
+        npth_cond_wait (&st->cond, &st->lock);
+      if (!st->count)
+        break;
+      n = st->slotlen[st->head] - st->offset;
+      if (n > size - nread)
+        n = size - nread;
+      memcpy (buffer + nread, st->slot[st->head] + st->offset, n);
+      nread += n;
+      st->offset += n;
+      if (st->offset == st->slotlen[st->head])
+        {
+          st->offset = 0;
+          st->head = (st->head + 1) % NSLOTS;
+          st->count--;
+          npth_cond_broadcast (&st->cond);
+        }
+      /* Don't wait for more data if we already have something.  */
+      if (!st->count)
+        break;
+    }
+  rc = (!nread && !st->count && st->eof)? -1 : 0;
+  if (rc == -1 && st->error)
+    rc = st->error;
+  client_unlock (st);
+
+  *r_length = nread;
+  return rc;
+}
+
+
+static int
+pipeline_filter (void *opaque, int control,
+                 iobuf_t chain, byte *buf, size_t *ret_len)
+{
+  pipeline_stage_t st = opaque;
+  int unprotected;
+  int rc = 0;
+
+  if (control == IOBUFCTRL_UNDERFLOW)
+    {
+      rc = stage_read (st, chain, buf, ret_len);
+    }
+  else if (control == IOBUFCTRL_FLUSH)
+    {
+      rc = stage_write (st, chain, buf, *ret_len);
+    }
+  else if (control == IOBUFCTRL_FREE)
+    {
+      if (st->use == 2)
+        stage_flush_slot (st);
+      rc = stop_worker (st);
+      unprotected = st->client_unprotected;
+      if (unprotected)
+        npth_protect ();
+      stage_unref (st);
+      if (unprotected)
+        npth_unprotect ();
+    }
+  else if (control == IOBUFCTRL_DESC)
+    *(char**)buf = "pipeline_filter";
+  return rc;
+}
+
+
+/* Push a pipeline stage onto A.  Everything below the stage runs in
+   its own thread from now on.  If R_STAGE is not NULL a reference to
+   the stage is stored there; the caller must release it with
+   release_pipeline_stage.  Returns 0 on success or an error code; in
+   the latter case nothing has been pushed.  This may only be used if
+   nPth has been initialized.  */
+gpg_error_t
+push_pipeline_stage (iobuf_t a, pipeline_stage_t *r_stage)
+{
+  pipeline_stage_t st;
+  iobuf_t b;
+  int i, rc;
+
+  if (r_stage)
+    *r_stage = NULL;
+
+  st = xtrycalloc (1, sizeof *st);
+  if (!st)
+    return gpg_error_from_syserror ();
+  st->refcount = 1;
+  st->use = a->use == 1? 1 : 2;
+  npth_mutex_init (&st->lock, NULL);
+  npth_cond_init (&st->cond, NULL);
+  for (i=0; i < NSLOTS; i++)
+    if (!(st->slot[i] = xtrymalloc (SLOT_SIZE)))
+      {
+        rc = gpg_error_from_syserror ();
+        stage_unref (st);
+        return rc;
+      }
+
+  /* If there is another stage further down the chain, its client will
+     be our worker.  */
+  for (b = a; b; b = b->chain)
+    if (b->filter == pipeline_filter)
+      {
+        st->below = b->filter_ov;
+        st->below->refcount++;
+        st->below->client_unprotected = 1;
+        break;
+      }
+
+  rc = iobuf_push_filter (a, pipeline_filter, st);
+  if (rc)
+    {
+      if (st->below)
+        st->below->client_unprotected = 0;
+      stage_unref (st);
+      return rc;
+    }
+  if (r_stage)
+    {
+      st->refcount++;
+      *r_stage = st;
+    }
+  if (DBG_FILTER)
+    log_debug ("pipeline: pushed %s stage\n",
+               st->use == 1? "input" : "output");
+  return 0;
+}
+
+
+/* Make sure that the worker of ST has terminated.  For an input
+   stage this stops reading ahead.  This must be called before the
+   caller accesses the contexts of filters below the stage if the
+   stage has not yet been popped.  */
+void
+pipeline_stage_stop (pipeline_stage_t st)
+{
+  if (st && st->running)
+    stop_worker (st);
+}
+
+
+void
+release_pipeline_stage (pipeline_stage_t st)
+{
+  stage_unref (st);
+}
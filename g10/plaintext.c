@@ -265,19 +265,21 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	}
       else  /* Binary mode.  */
 	{
-	  byte *buffer = xmalloc (32768);
+	  const byte *buffer;
+	  size_t len;
+
+	  /* Work directly on the buffer of the source iobuf.  */
 	  while (pt->len)
 	    {
-	      int len = pt->len > 32768 ? 32768 : pt->len;
-	      len = iobuf_read (pt->buf, buffer, len);
-	      if (len == -1)
+	      if (iobuf_borrow (pt->buf, &buffer, &len))
 		{
 		  err = gpg_error_from_syserror ();
 		  log_error ("problem reading source (%u bytes remaining)\n",
 			     (unsigned) pt->len);
-		  xfree (buffer);
 		  goto leave;
 		}
+	      if (len > pt->len)
+		len = pt->len;
 	      if (mfx->md)
 		gcry_md_write (mfx->md, buffer, len);
 	      if (fp)
@@ -287,7 +289,6 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		      log_error ("error writing to '%s': %s\n",
 				 fname, "exceeded --max-output limit\n");
 		      err = gpg_error (GPG_ERR_TOO_LARGE);
-		      xfree (buffer);
 		      goto leave;
 		    }
 		  else if (es_fwrite (buffer, 1, len, fp) != len)
@@ -295,13 +296,12 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		      err = gpg_error_from_syserror ();
 		      log_error ("error writing to '%s': %s\n",
 				 fname, gpg_strerror (err));
-		      xfree (buffer);
 		      goto leave;
 		    }
 		}
+	      iobuf_consume (pt->buf, len);
 	      pt->len -= len;
 	    }
-	  xfree (buffer);
 	}
     }
   else if (!clearsig)
@@ -340,29 +340,15 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 	}
       else
 	{			/* binary mode */
-	  byte *buffer;
-	  int eof_seen = 0;
-
-          buffer = xtrymalloc (32768);
-          if (!buffer)
-            {
-              err = gpg_error_from_syserror ();
-              goto leave;
-            }
-
-	  while (!eof_seen)
+	  const byte *buffer;
+	  size_t len;
+
+	  /* Work directly on the buffer of the source iobuf.  We stop at
+	   * the first EOF: the underflow returning it has already popped
+	   * the block_filter off and another read would not catch the
+	   * boundary.  */
+	  while (!iobuf_borrow (pt->buf, &buffer, &len))
 	    {
-	      /* Why do we check for len < 32768:
-	       * If we won't, we would practically read 2 EOFs but
-	       * the first one has already popped the block_filter
-	       * off and therefore we don't catch the boundary.
-	       * So, always assume EOF if iobuf_read returns less bytes
-	       * then requested */
-	      int len = iobuf_read (pt->buf, buffer, 32768);
-	      if (len == -1)
-		break;
-	      if (len < 32768)
-		eof_seen = 1;
 	      if (mfx->md)
 		gcry_md_write (mfx->md, buffer, len);
 	      if (fp)
@@ -372,7 +358,6 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		      log_error ("error writing to '%s': %s\n",
 				 fname, "exceeded --max-output limit\n");
 		      err = gpg_error (GPG_ERR_TOO_LARGE);
-		      xfree (buffer);
 		      goto leave;
 		    }
 		  else if (es_fwrite (buffer, 1, len, fp) != len)
@@ -380,12 +365,11 @@ handle_plaintext (PKT_plaintext * pt, md_filter_context_t * mfx,
 		      err = gpg_error_from_syserror ();
 		      log_error ("error writing to '%s': %s\n",
 				 fname, gpg_strerror (err));
-		      xfree (buffer);
 		      goto leave;
 		    }
 		}
+	      iobuf_consume (pt->buf, len);
 	    }
-	  xfree (buffer);
 	}
       pt->buf = NULL;
     }
@@ -49,6 +49,9 @@
 #define LF "\n"
 #endif
 
+/* Number of files signed at once by sign_files_detached.  */
+#define SIGN_FILES_BATCH 256
+
 static int recipient_digest_algo=0;
 
 /****************
@@ -222,16 +225,14 @@ hash_sigversion_to_magic (gcry_md_hd_t md, const PKT_signature *sig)
 }
 
 
-/* Perform the sign operation.  If CACHE_NONCE is given the agent is
-   advised to use that cached passphrase fro the key.  */
-static int
-do_sign (PKT_public_key *pksk, PKT_signature *sig,
-	 gcry_md_hd_t md, int mdalgo, const char *cache_nonce)
+/* Prepare SIG for signing with PKSK: check the timestamps and store
+   the digest algorithm and the start of the digest from MD.  MDALGO
+   is the digest algorithm or 0 to use the one from MD.  */
+static gpg_error_t
+prepare_sig (PKT_public_key *pksk, PKT_signature *sig,
+             gcry_md_hd_t md, int mdalgo)
 {
-  gpg_error_t err;
-  gcry_mpi_t frame;
   byte *dp;
-  char *hexgrip;
 
   if (pksk->timestamp > sig->timestamp )
     {
@@ -257,40 +258,38 @@ do_sign (PKT_public_key *pksk, PKT_signature *sig,
   sig->digest_start[1] = dp[1];
   sig->data[0] = NULL;
   sig->data[1] = NULL;
+  return 0;
+}
 
 
-  err = hexkeygrip_from_pk (pksk, &hexgrip);
-  if (!err)
+/* Store the signature values from the S-expression S_SIGVAL as
+   returned by the agent into SIG.  */
+static void
+store_sigval (PKT_public_key *pksk, PKT_signature *sig, gcry_sexp_t s_sigval)
+{
+  if (pksk->pubkey_algo == GCRY_PK_RSA
+      || pksk->pubkey_algo == GCRY_PK_RSA_S)
+    sig->data[0] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
+  else if (openpgp_oid_is_ed25519 (pksk->pkey[0]))
     {
-      char *desc;
-      gcry_sexp_t s_sigval;
-
-      desc = gpg_format_keydesc (pksk, FORMAT_KEYDESC_NORMAL, 1);
-      err = agent_pksign (NULL/*ctrl*/, cache_nonce, hexgrip, desc,
-                          pksk->keyid, pksk->main_keyid, pksk->pubkey_algo,
-                          dp, gcry_md_get_algo_dlen (mdalgo), mdalgo,
-                          &s_sigval);
-      xfree (desc);
+      sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_OPAQUE);
+      sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_OPAQUE);
+    }
+  else
+    {
+      sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_USG);
+      sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
+    }
+}
 
-      if (err)
-        ;
-      else if (pksk->pubkey_algo == GCRY_PK_RSA
-               || pksk->pubkey_algo == GCRY_PK_RSA_S)
-        sig->data[0] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
-      else if (openpgp_oid_is_ed25519 (pksk->pkey[0]))
-        {
-          sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_OPAQUE);
-          sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_OPAQUE);
-        }
-      else
-        {
-          sig->data[0] = get_mpi_from_sexp (s_sigval, "r", GCRYMPI_FMT_USG);
-          sig->data[1] = get_mpi_from_sexp (s_sigval, "s", GCRYMPI_FMT_USG);
-        }
 
-      gcry_sexp_release (s_sigval);
-    }
-  xfree (hexgrip);
+/* Finish the sign operation for SIG over MD.  ERR is the result of
+   the agent operation.  Returns ERR or the error of the check.  */
+static gpg_error_t
+finish_sig (PKT_public_key *pksk, PKT_signature *sig, gcry_md_hd_t md,
+            gpg_error_t err)
+{
+  gcry_mpi_t frame;
 
   /* Check that the signature verification worked and nothing is
    * fooling us e.g. by a bug in the signature create code or by
@@ -334,6 +333,45 @@ do_sign (PKT_public_key *pksk, PKT_signature *sig,
 }
 
 
+/* Perform the sign operation.  If CACHE_NONCE is given the agent is
+   advised to use that cached passphrase fro the key.  */
+static int
+do_sign (PKT_public_key *pksk, PKT_signature *sig,
+	 gcry_md_hd_t md, int mdalgo, const char *cache_nonce)
+{
+  gpg_error_t err;
+  char *hexgrip;
+
+  err = prepare_sig (pksk, sig, md, mdalgo);
+  if (err)
+    return err;
+
+  err = hexkeygrip_from_pk (pksk, &hexgrip);
+  if (!err)
+    {
+      char *desc;
+      gcry_sexp_t s_sigval;
+
+      desc = gpg_format_keydesc (pksk, FORMAT_KEYDESC_NORMAL, 1);
+      err = agent_pksign (NULL/*ctrl*/, cache_nonce, hexgrip, desc,
+                          pksk->keyid, pksk->main_keyid, pksk->pubkey_algo,
+                          gcry_md_read (md, sig->digest_algo),
+                          gcry_md_get_algo_dlen (sig->digest_algo),
+                          sig->digest_algo,
+                          &s_sigval);
+      xfree (desc);
+
+      if (!err)
+        store_sigval (pksk, sig, s_sigval);
+
+      gcry_sexp_release (s_sigval);
+    }
+  xfree (hexgrip);
+
+  return finish_sig (pksk, sig, md, err);
+}
+
+
 int
 complete_sig (PKT_signature *sig, PKT_public_key *pksk, gcry_md_hd_t md,
               const char *cache_nonce)
@@ -657,6 +695,51 @@ write_plaintext_packet (IOBUF out, IOBUF inp, const char *fname, int ptmode)
     return rc;
 }
 
+/* Create a new signature packet for PK over the data hashed into
+   HASH.  A finalized copy of HASH which also includes the signature
+   data is stored at R_MD.  HASH itself is not changed.  */
+static PKT_signature *
+new_sig_for_hash (PKT_public_key *pk, gcry_md_hd_t hash, int sigclass,
+                  u32 timestamp, u32 duration, gcry_md_hd_t *r_md)
+{
+  PKT_signature *sig;
+  gcry_md_hd_t md;
+
+  sig = xmalloc_clear (sizeof *sig);
+  if (duration || opt.sig_policy_url
+      || opt.sig_notations || opt.sig_keyserver_url)
+    sig->version = 4;
+  else
+    sig->version = pk->version;
+
+  keyid_from_pk (pk, sig->keyid);
+  sig->digest_algo = hash_for (pk);
+  sig->pubkey_algo = pk->pubkey_algo;
+  if (timestamp)
+    sig->timestamp = timestamp;
+  else
+    sig->timestamp = make_timestamp();
+  if (duration)
+    sig->expiredate = sig->timestamp + duration;
+  sig->sig_class = sigclass;
+
+  if (gcry_md_copy (&md, hash))
+    BUG ();
+
+  if (sig->version >= 4)
+    {
+      build_sig_subpkt_from_sig (sig);
+      mk_notation_policy_etc (sig, NULL, pk);
+    }
+
+  hash_sigversion_to_magic (md, sig);
+  gcry_md_final (md);
+
+  *r_md = md;
+  return sig;
+}
+
+
 /*
  * Write the signatures from the SK_LIST to OUT. HASH must be a non-finalized
  * hash which will not be changes here.
@@ -679,35 +762,7 @@ write_signature_packets (SK_LIST sk_list, IOBUF out, gcry_md_hd_t hash,
       pk = sk_rover->pk;
 
       /* Build the signature packet.  */
-      sig = xmalloc_clear (sizeof *sig);
-      if (duration || opt.sig_policy_url
-          || opt.sig_notations || opt.sig_keyserver_url)
-        sig->version = 4;
-      else
-        sig->version = pk->version;
-
-      keyid_from_pk (pk, sig->keyid);
-      sig->digest_algo = hash_for (pk);
-      sig->pubkey_algo = pk->pubkey_algo;
-      if (timestamp)
-        sig->timestamp = timestamp;
-      else
-        sig->timestamp = make_timestamp();
-      if (duration)
-        sig->expiredate = sig->timestamp + duration;
-      sig->sig_class = sigclass;
-
-      if (gcry_md_copy (&md, hash))
-        BUG ();
-
-      if (sig->version >= 4)
-        {
-          build_sig_subpkt_from_sig (sig);
-          mk_notation_policy_etc (sig, NULL, pk);
-        }
-
-      hash_sigversion_to_magic (md, sig);
-      gcry_md_final (md);
+      sig = new_sig_for_hash (pk, hash, sigclass, timestamp, duration, &md);
 
       rc = do_sign (pk, sig, md, hash_for (pk), cache_nonce);
       gcry_md_close (md);
@@ -1078,6 +1133,302 @@ sign_file (ctrl_t ctrl, strlist_t filenames, int detached, strlist_t locusr,
 
 
 
+/* Hash the file FNAME for a detached signature with the keys from
+   SK_LIST.  On success the not finalized hash context is stored at
+   R_MD.  */
+static gpg_error_t
+hash_file_for_signing (const char *fname, SK_LIST sk_list,
+                       progress_filter_context_t *pfx, gcry_md_hd_t *r_md)
+{
+  gpg_error_t err;
+  IOBUF inp;
+  md_filter_context_t mfx;
+  text_filter_context_t tfx;
+  SK_LIST sk_rover;
+
+  inp = iobuf_open (fname);
+  if (inp && is_secured_file (iobuf_get_fd (inp)))
+    {
+      iobuf_close (inp);
+      inp = NULL;
+      gpg_err_set_errno (EPERM);
+    }
+  if (!inp)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("can't open '%s': %s\n"), fname, strerror (errno));
+      return err;
+    }
+  handle_progress (pfx, inp, fname);
+
+  if (opt.textmode)
+    {
+      memset (&tfx, 0, sizeof tfx);
+      iobuf_push_filter (inp, text_filter, &tfx);
+    }
+
+  memset (&mfx, 0, sizeof mfx);
+  if (gcry_md_open (&mfx.md, 0, 0))
+    BUG ();
+  if (DBG_HASHING)
+    gcry_md_debug (mfx.md, "sign");
+  for (sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
+    gcry_md_enable (mfx.md, hash_for (sk_rover->pk));
+  iobuf_push_filter (inp, md_filter, &mfx);
+
+  /* Read, so that the filter can calculate the digest.  */
+  while (iobuf_get (inp) != -1)
+    ;
+  iobuf_close (inp);
+
+  *r_md = mfx.md;
+  return 0;
+}
+
+
+/* Write the NSIGS signatures from SIGS, created by the keys from
+   SK_LIST, as a detached signature for FNAME.  */
+static gpg_error_t
+write_detached_sigs (const char *fname, SK_LIST sk_list, PKT_signature **sigs)
+{
+  gpg_error_t err;
+  IOBUF out;
+  armor_filter_context_t *afx = NULL;
+  SK_LIST sk_rover;
+  PACKET pkt;
+  int k;
+
+  err = open_outfile (-1, fname, opt.armor? 1: 2, 0, &out);
+  if (err)
+    return err;
+
+  if (opt.armor)
+    {
+      afx = new_armor_context ();
+      afx->what = 2;
+      push_armor_filter (afx, out);
+    }
+
+  for (k=0, sk_rover = sk_list; sk_rover; k++, sk_rover = sk_rover->next)
+    {
+      init_packet (&pkt);
+      pkt.pkttype = PKT_SIGNATURE;
+      pkt.pkt.signature = sigs[k];
+      err = build_packet (out, &pkt);
+      if (err)
+        {
+          log_error ("build signature packet failed: %s\n",
+                     gpg_strerror (err));
+          break;
+        }
+      if (is_status_enabled())
+        print_status_sig_created (sk_rover->pk, sigs[k], 'D');
+    }
+
+  if (err)
+    iobuf_cancel (out);
+  else
+    iobuf_close (out);
+  release_armor_context (afx);
+  return err;
+}
+
+
+/* Create detached signatures for the NFILES files in FNAMES.  The
+   hashes of all files are signed using one agent request per key.  */
+static void
+sign_files_batch (char **fnames, int nfiles, SK_LIST sk_list, int nkeys,
+                  u32 duration, progress_filter_context_t *pfx)
+{
+  gpg_error_t err;
+  gcry_md_hd_t *mds, *sigmds;
+  PKT_signature **sigs;
+  unsigned char **digests;
+  gcry_sexp_t *sigvals;
+  int *fidx;
+  int *failed;
+  SK_LIST sk_rover;
+  PKT_public_key *pk;
+  char *hexgrip, *desc;
+  int f, k, n, i;
+
+  mds = xcalloc (nfiles, sizeof *mds);
+  sigmds = xcalloc (nfiles, sizeof *sigmds);
+  sigs = xcalloc (nfiles * nkeys, sizeof *sigs);
+  digests = xcalloc (nfiles, sizeof *digests);
+  sigvals = xcalloc (nfiles, sizeof *sigvals);
+  fidx = xcalloc (nfiles, sizeof *fidx);
+  failed = xcalloc (nfiles, sizeof *failed);
+
+  for (f=0; f < nfiles; f++)
+    if (hash_file_for_signing (fnames[f], sk_list, pfx, &mds[f]))
+      failed[f] = 1;
+
+  for (k=0, sk_rover = sk_list; sk_rover; k++, sk_rover = sk_rover->next)
+    {
+      pk = sk_rover->pk;
+
+      for (n=f=0; f < nfiles; f++)
+        {
+          if (failed[f])
+            continue;
+          sigs[f*nkeys+k] = new_sig_for_hash (pk, mds[f],
+                                              opt.textmode? 0x01 : 0x00,
+                                              0, duration, &sigmds[f]);
+          if (prepare_sig (pk, sigs[f*nkeys+k], sigmds[f], hash_for (pk)))
+            {
+              failed[f] = 1;
+              continue;
+            }
+          digests[n] = gcry_md_read (sigmds[f], hash_for (pk));
+          fidx[n++] = f;
+        }
+      if (!n)
+        continue;
+
+      err = hexkeygrip_from_pk (pk, &hexgrip);
+      if (!err)
+        {
+          desc = gpg_format_keydesc (pk, FORMAT_KEYDESC_NORMAL, 1);
+          err = agent_pksign_multi (NULL/*ctrl*/, NULL, hexgrip, desc,
+                                    pk->keyid, pk->main_keyid,
+                                    pk->pubkey_algo,
+                                    digests, n,
+                                    gcry_md_get_algo_dlen (hash_for (pk)),
+                                    hash_for (pk), sigvals);
+          xfree (desc);
+          xfree (hexgrip);
+        }
+
+      for (i=0; i < n; i++)
+        {
+          f = fidx[i];
+          if (!err)
+            store_sigval (pk, sigs[f*nkeys+k], sigvals[i]);
+          if (finish_sig (pk, sigs[f*nkeys+k], sigmds[f], err))
+            failed[f] = 1;
+          gcry_sexp_release (sigvals[i]);
+          sigvals[i] = NULL;
+        }
+      for (f=0; f < nfiles; f++)
+        {
+          gcry_md_close (sigmds[f]);
+          sigmds[f] = NULL;
+        }
+    }
+
+  for (f=0; f < nfiles; f++)
+    {
+      print_file_status (STATUS_FILE_START, fnames[f], 4);
+      if (mds[f])
+        write_status_begin_signing (mds[f]);
+      if (!failed[f])
+        {
+          err = write_detached_sigs (fnames[f], sk_list, sigs + f*nkeys);
+          if (err)
+            failed[f] = 1;
+        }
+      if (failed[f])
+        log_error ("signing '%s' failed\n", fnames[f]);
+      write_status (STATUS_FILE_DONE);
+    }
+
+  for (f=0; f < nfiles; f++)
+    {
+      gcry_md_close (mds[f]);
+      for (k=0; k < nkeys; k++)
+        if (sigs[f*nkeys+k])
+          free_seckey_enc (sigs[f*nkeys+k]);
+    }
+  xfree (failed);
+  xfree (fidx);
+  xfree (sigvals);
+  xfree (digests);
+  xfree (sigs);
+  xfree (sigmds);
+  xfree (mds);
+}
+
+
+/* Create a detached signature for each of the NFILES files in FILES
+   using the keys from LOCUSR.  If NFILES is 0 the file names are read
+   from stdin.  The signatures for a batch of files are created with
+   one request to the agent, so that the secret key is unlocked only
+   once for all of them.  */
+void
+sign_files_detached (ctrl_t ctrl, int nfiles, char **files, strlist_t locusr)
+{
+  SK_LIST sk_list = NULL;
+  SK_LIST sk_rover;
+  progress_filter_context_t *pfx;
+  char *fnames[SIGN_FILES_BATCH];
+  int nkeys, n, i;
+  u32 duration;
+
+  (void)ctrl;
+
+  if (opt.outfile)
+    {
+      log_error(_("--output doesn't work for this command\n"));
+      return;
+    }
+
+  if (opt.ask_sig_expire && !opt.batch)
+    duration = ask_expire_interval(1,opt.def_sig_expire);
+  else
+    duration = parse_expire_string(opt.def_sig_expire);
+
+  if (build_sk_list (locusr, &sk_list, PUBKEY_USAGE_SIG))
+    return;
+  for (nkeys=0, sk_rover = sk_list; sk_rover; sk_rover = sk_rover->next)
+    nkeys++;
+
+  pfx = new_progress_context ();
+
+  if (!nfiles)
+    {
+      char line[2048];
+      unsigned int lno = 0;
+
+      n = 0;
+      while ( fgets(line, DIM(line), stdin) )
+        {
+          lno++;
+          if (!*line || line[strlen(line)-1] != '\n')
+            {
+              log_error("input line %u too long or missing LF\n", lno);
+              break;
+            }
+          line[strlen(line)-1] = '\0';
+          fnames[n++] = xstrdup (line);
+          if (n == SIGN_FILES_BATCH)
+            {
+              sign_files_batch (fnames, n, sk_list, nkeys, duration, pfx);
+              for (i=0; i < n; i++)
+                xfree (fnames[i]);
+              n = 0;
+            }
+        }
+      if (n)
+        sign_files_batch (fnames, n, sk_list, nkeys, duration, pfx);
+      for (i=0; i < n; i++)
+        xfree (fnames[i]);
+    }
+  else
+    {
+      for (; nfiles > 0; nfiles -= n, files += n)
+        {
+          n = nfiles < SIGN_FILES_BATCH? nfiles : SIGN_FILES_BATCH;
+          sign_files_batch (files, n, sk_list, nkeys, duration, pfx);
+        }
+    }
+
+  release_progress_context (pfx);
+  release_sk_list (sk_list);
+}
+
+
+
 /****************
  * make a clear signature. note that opt.armor is not needed
  */
@@ -119,6 +119,25 @@ export_ownertrust()
 }
 
 
+/* Note that the ownertrust of the key with fingerprint FPR changed.
+   V4 tells whether FPR is a v4 fingerprint; only those include the
+   key ID.  */
+static void
+mark_fpr_changed (const byte *fpr, int v4)
+{
+  u32 kid[2];
+
+  if (v4)
+    {
+      kid[0] = buftou32 (fpr+12);
+      kid[1] = buftou32 (fpr+16);
+      tdb_mark_key_changed (kid);
+    }
+  else
+    tdb_mark_key_changed (NULL);
+}
+
+
 void
 import_ownertrust( const char *fname )
 {
@@ -129,6 +148,7 @@ import_ownertrust( const char *fname )
     size_t n, fprlen;
     unsigned int otrust;
     byte fpr[20];
+    int v4;
     int any = 0;
     int rc;
 
@@ -182,6 +202,7 @@ import_ownertrust( const char *fname )
 	}
 	if( !otrust )
 	    continue; /* no otrust defined - no need to update or insert */
+	v4 = fprlen == 40;
 	/* convert the ascii fingerprint to binary */
 	for(p=line, fprlen=0; fprlen < 20 && *p != ':'; p += 2 )
 	    fpr[fprlen++] = HEXTOBIN(p[0]) * 16 + HEXTOBIN(p[1]);
@@ -199,6 +220,7 @@ import_ownertrust( const char *fname )
                   log_info("setting ownertrust to %u\n", otrust );
                 rec.r.trust.ownertrust = otrust;
                 write_record (&rec );
+                mark_fpr_changed (fpr, v4);
                 any = 1;
               }
 	}
@@ -210,6 +232,7 @@ import_ownertrust( const char *fname )
             memcpy (rec.r.trust.fingerprint, fpr, 20);
             rec.r.trust.ownertrust = otrust;
             write_record (&rec );
+            mark_fpr_changed (fpr, v4);
             any = 1;
 	}
 	else /* error */
@@ -27,6 +27,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "gpg.h"
 #include "status.h"
@@ -57,13 +60,19 @@
 #endif
 
 /****************
- * Yes, this is a very simple implementation. We should really
- * use a page aligned buffer and read complete pages.
- * To implement a simple trannsaction system, this is sufficient.
+ * The record cache is a hash table indexed by the record number.
+ * All used entries are also kept on a doubly linked list in least
+ * recently used order so that we can cheaply find a clean entry to
+ * evict.  Modified records are only marked dirty and written back in
+ * batches: either by tdbio_sync or when the cache is full.  The batch
+ * writer sorts the dirty records and coalesces runs of consecutive
+ * records into a single write.
  */
 typedef struct cache_ctrl_struct *CACHE_CTRL;
 struct cache_ctrl_struct {
-    CACHE_CTRL next;
+    CACHE_CTRL next;          /* Next entry in the hash bucket.  */
+    CACHE_CTRL lru_prev;      /* Next more recently used entry.  */
+    CACHE_CTRL lru_next;      /* Next less recently used entry.  */
     struct {
 	unsigned used:1;
 	unsigned dirty:1;
@@ -72,10 +81,17 @@ struct cache_ctrl_struct {
     char data[TRUST_RECORD_LEN];
 };
 
-#define MAX_CACHE_ENTRIES_SOFT	200    /* may be increased while in a */
+#define DEFAULT_CACHE_ENTRIES	4096   /* may be increased while in a */
 #define MAX_CACHE_ENTRIES_HARD	10000  /* transaction to this one */
-static CACHE_CTRL cache_list;
+#define MAX_FLUSH_BATCH 	128    /* max. # of records per write */
+static CACHE_CTRL *cache_table;  /* The hash buckets.  */
+static unsigned int cache_table_size; /* Number of buckets (power of 2).  */
+static unsigned int cache_max_entries;
+static CACHE_CTRL cache_lru_head; /* Most recently used entry.  */
+static CACHE_CTRL cache_lru_tail; /* Least recently used entry.  */
+static CACHE_CTRL cache_unused;   /* List of unused entries.  */
 static int cache_entries;
+static int cache_dirty_count;
 static int cache_is_dirty;
 
 /* a type used to pass infomation to cmp_krec_fpr */
@@ -97,6 +113,11 @@ static dotlock_t lockhandle;
 static int is_locked;
 static int  db_fd = -1;
 static int in_transaction;
+#ifdef HAVE_MMAP
+static const byte *db_map;      /* Mapping of the trustdb or NULL.  */
+static size_t db_map_len;       /* Length of that mapping.  */
+static int db_map_failed;       /* Mapping failed; don't try again.  */
+#endif
 
 static void open_db(void);
 
@@ -106,6 +127,100 @@ static void open_db(void);
  ************* record cache **********
  *************************************/
 
+/* Allocate the hash table for the record cache.  The size is taken
+   from the --trustdb-cache-size option.  */
+static void
+init_cache (void)
+{
+  unsigned int n;
+
+  cache_max_entries = opt.tdb_cache_size;
+  if (!cache_max_entries)
+    cache_max_entries = DEFAULT_CACHE_ENTRIES;
+  else if (cache_max_entries < 16)
+    cache_max_entries = 16;
+
+  /* Use a load factor of about two.  */
+  for (n = 16; n < cache_max_entries / 2 && n < (1u << 20); n <<= 1)
+    ;
+  cache_table_size = n;
+  cache_table = xcalloc (cache_table_size, sizeof *cache_table);
+}
+
+
+static inline unsigned int
+cache_hash (ulong recno)
+{
+  return recno & (cache_table_size - 1);
+}
+
+
+static CACHE_CTRL
+lookup_cache (ulong recno)
+{
+  CACHE_CTRL r;
+
+  if (!cache_table)
+    return NULL;
+  for (r = cache_table[cache_hash (recno)]; r; r = r->next)
+    if (r->recno == recno)
+      return r;
+  return NULL;
+}
+
+
+static void
+lru_unlink (CACHE_CTRL r)
+{
+  if (r->lru_prev)
+    r->lru_prev->lru_next = r->lru_next;
+  else
+    cache_lru_head = r->lru_next;
+  if (r->lru_next)
+    r->lru_next->lru_prev = r->lru_prev;
+  else
+    cache_lru_tail = r->lru_prev;
+  r->lru_prev = r->lru_next = NULL;
+}
+
+
+static void
+lru_push_front (CACHE_CTRL r)
+{
+  r->lru_prev = NULL;
+  r->lru_next = cache_lru_head;
+  if (cache_lru_head)
+    cache_lru_head->lru_prev = r;
+  else
+    cache_lru_tail = r;
+  cache_lru_head = r;
+}
+
+
+/* Remove the used entry R from the cache and put it onto the list of
+   unused entries.  */
+static void
+drop_cache_item (CACHE_CTRL r)
+{
+  CACHE_CTRL *rp;
+
+  for (rp = &cache_table[cache_hash (r->recno)]; *rp; rp = &(*rp)->next)
+    if (*rp == r)
+      {
+        *rp = r->next;
+        break;
+      }
+  lru_unlink (r);
+  if (r->flags.dirty)
+    cache_dirty_count--;
+  r->flags.used = 0;
+  r->flags.dirty = 0;
+  r->next = cache_unused;
+  cache_unused = r;
+  cache_entries--;
+}
+
+
 /****************
  * Get the data from therecord cache and return a
  * pointer into that cache.  Caller should copy
@@ -116,37 +231,134 @@ get_record_from_cache( ulong recno )
 {
     CACHE_CTRL r;
 
-    for( r = cache_list; r; r = r->next ) {
-	if( r->flags.used && r->recno == recno )
-	    return r->data;
+    r = lookup_cache (recno);
+    if (!r)
+	return NULL;
+    if (r != cache_lru_head) {
+	lru_unlink (r);
+	lru_push_front (r);
     }
-    return NULL;
+    return r->data;
 }
 
 
+/* Write NREC records from BUFFER starting at record RECNO to the
+   trustdb.  */
 static int
-write_cache_item( CACHE_CTRL r )
+write_records (ulong recno, const char *buffer, size_t nrec)
 {
-    gpg_error_t err;
-    int n;
-
-    if( lseek( db_fd, r->recno * TRUST_RECORD_LEN, SEEK_SET ) == -1 ) {
-        err = gpg_error_from_syserror ();
-	log_error(_("trustdb rec %lu: lseek failed: %s\n"),
-					    r->recno, strerror(errno) );
-	return err;
+  gpg_error_t err;
+  size_t nbytes = nrec * TRUST_RECORD_LEN;
+  ssize_t n;
+
+#ifdef HAVE_PWRITE
+  n = pwrite (db_fd, buffer, nbytes, (off_t)recno * TRUST_RECORD_LEN);
+#else
+  if (lseek (db_fd, (off_t)recno * TRUST_RECORD_LEN, SEEK_SET) == -1)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("trustdb rec %lu: lseek failed: %s\n"),
+                 recno, strerror (errno));
+      return err;
     }
-    n = write( db_fd, r->data, TRUST_RECORD_LEN);
-    if( n != TRUST_RECORD_LEN ) {
-        err = gpg_error_from_syserror ();
-	log_error(_("trustdb rec %lu: write failed (n=%d): %s\n"),
-					    r->recno, n, strerror(errno) );
-	return err;
+  n = write (db_fd, buffer, nbytes);
+#endif
+  if (n < 0 || (size_t)n != nbytes)
+    {
+      err = gpg_error_from_syserror ();
+      log_error (_("trustdb rec %lu: write failed (n=%d): %s\n"),
+                 recno, (int)n, strerror (errno));
+      return err;
     }
-    r->flags.dirty = 0;
+  return 0;
+}
+
+
+static int
+cmp_cache_recno (const void *a, const void *b)
+{
+  ulong ra = (*(const CACHE_CTRL *)a)->recno;
+  ulong rb = (*(const CACHE_CTRL *)b)->recno;
+
+  return ra < rb ? -1 : ra > rb ? 1 : 0;
+}
+
+
+/* Write all dirty cache entries back to the trustdb.  The entries
+   are sorted by record number and runs of consecutive records are
+   written with one system call.  The caller must hold the lock.  */
+static int
+flush_dirty_entries (void)
+{
+  CACHE_CTRL *list, r;
+  char *batch;
+  int nlist, i, j, k, rc = 0;
+
+  if (!cache_dirty_count)
     return 0;
+
+  list = xmalloc (cache_dirty_count * sizeof *list);
+  for (nlist = 0, r = cache_lru_head; r; r = r->lru_next)
+    if (r->flags.dirty)
+      list[nlist++] = r;
+  assert (nlist == cache_dirty_count);
+  qsort (list, nlist, sizeof *list, cmp_cache_recno);
+
+  batch = xmalloc (MAX_FLUSH_BATCH * TRUST_RECORD_LEN);
+  for (i = 0; i < nlist && !rc; i = j)
+    {
+      for (j = i + 1;
+           (j < nlist && j - i < MAX_FLUSH_BATCH
+            && list[j]->recno == list[j-1]->recno + 1);
+           j++)
+        ;
+      if (j - i == 1)
+        rc = write_records (list[i]->recno, list[i]->data, 1);
+      else
+        {
+          for (k = i; k < j; k++)
+            memcpy (batch + (k - i) * TRUST_RECORD_LEN,
+                    list[k]->data, TRUST_RECORD_LEN);
+          rc = write_records (list[i]->recno, batch, j - i);
+        }
+      if (!rc)
+        for (k = i; k < j; k++)
+          {
+            list[k]->flags.dirty = 0;
+            cache_dirty_count--;
+          }
+    }
+  xfree (batch);
+  xfree (list);
+  if (!cache_dirty_count)
+    cache_is_dirty = 0;
+  return rc;
+}
+
+
+/* Same as flush_dirty_entries but takes the lock if required.  */
+static int
+flush_dirty_entries_locked (void)
+{
+  int rc;
+  int did_lock = 0;
+
+  if( !is_locked ) {
+      if( dotlock_take( lockhandle, -1 ) )
+	  log_fatal("can't acquire lock - giving up\n");
+      else
+	  is_locked = 1;
+      did_lock = 1;
+  }
+  rc = flush_dirty_entries ();
+  if( did_lock && !opt.lock_once ) {
+      if( !dotlock_release (lockhandle) )
+	  is_locked = 0;
+  }
+  return rc;
 }
 
+
 /****************
  * Put data into the cache.  This function may flush the
  * some cache entries if there is not enough space available.
@@ -154,142 +366,78 @@ write_cache_item( CACHE_CTRL r )
 int
 put_record_into_cache( ulong recno, const char *data )
 {
-    CACHE_CTRL r, unused;
-    int dirty_count = 0;
-    int clean_count = 0;
+    CACHE_CTRL r;
+    int rc;
+
+    if (!cache_table)
+	init_cache ();
 
     /* see whether we already cached this one */
-    for( unused = NULL, r = cache_list; r; r = r->next ) {
-	if( !r->flags.used ) {
-	    if( !unused )
-		unused = r;
-	}
-	else if( r->recno == recno ) {
-	    if( !r->flags.dirty ) {
-		/* Hmmm: should we use a a copy and compare? */
-		if( memcmp(r->data, data, TRUST_RECORD_LEN ) ) {
-		    r->flags.dirty = 1;
-		    cache_is_dirty = 1;
-		}
+    r = lookup_cache (recno);
+    if (r) {
+	if( !r->flags.dirty ) {
+	    /* Hmmm: should we use a a copy and compare? */
+	    if( memcmp(r->data, data, TRUST_RECORD_LEN ) ) {
+		r->flags.dirty = 1;
+		cache_dirty_count++;
+		cache_is_dirty = 1;
 	    }
-	    memcpy( r->data, data, TRUST_RECORD_LEN );
-	    return 0;
 	}
-	if( r->flags.used ) {
-	    if( r->flags.dirty )
-		dirty_count++;
-	    else
-		clean_count++;
-	}
-    }
-    /* not in the cache: add a new entry */
-    if( unused ) { /* reuse this entry */
-	r = unused;
-	r->flags.used = 1;
-	r->recno = recno;
 	memcpy( r->data, data, TRUST_RECORD_LEN );
-	r->flags.dirty = 1;
-	cache_is_dirty = 1;
-	cache_entries++;
-	return 0;
-    }
-    /* see whether we reached the limit */
-    if( cache_entries < MAX_CACHE_ENTRIES_SOFT ) { /* no */
-	r = xmalloc( sizeof *r );
-	r->flags.used = 1;
-	r->recno = recno;
-	memcpy( r->data, data, TRUST_RECORD_LEN );
-	r->flags.dirty = 1;
-	r->next = cache_list;
-	cache_list = r;
-	cache_is_dirty = 1;
-	cache_entries++;
-	return 0;
-    }
-    /* cache is full: discard some clean entries */
-    if( clean_count ) {
-	int n = clean_count / 3; /* discard a third of the clean entries */
-	if( !n )
-	    n = 1;
-	for( unused = NULL, r = cache_list; r; r = r->next ) {
-	    if( r->flags.used && !r->flags.dirty ) {
-		if( !unused )
-		    unused = r;
-		r->flags.used = 0;
-		cache_entries--;
-		if( !--n )
-		    break;
-	    }
+	if (r != cache_lru_head) {
+	    lru_unlink (r);
+	    lru_push_front (r);
 	}
-	assert( unused );
-	r = unused;
-	r->flags.used = 1;
-	r->recno = recno;
-	memcpy( r->data, data, TRUST_RECORD_LEN );
-	r->flags.dirty = 1;
-	cache_is_dirty = 1;
-	cache_entries++;
 	return 0;
     }
-    /* no clean entries: have to flush some dirty entries */
-    if( in_transaction ) {
-	/* but we can't do this while in a transaction
-	 * we increase the cache size instead */
-	if( cache_entries < MAX_CACHE_ENTRIES_HARD ) { /* no */
-	    if( opt.debug && !(cache_entries % 100) )
-		log_debug("increasing tdbio cache size\n");
-	    r = xmalloc( sizeof *r );
-	    r->flags.used = 1;
-	    r->recno = recno;
-	    memcpy( r->data, data, TRUST_RECORD_LEN );
-	    r->flags.dirty = 1;
-	    r->next = cache_list;
-	    cache_list = r;
-	    cache_is_dirty = 1;
-	    cache_entries++;
-	    return 0;
+
+    /* Not in the cache: make room for a new entry.  Once half of the
+     * cache is dirty we write all dirty entries back in one batch so
+     * that the eviction below always finds a clean entry quickly.  */
+    if( cache_entries >= cache_max_entries ) {
+	if( !in_transaction && cache_dirty_count >= cache_max_entries / 2 ) {
+	    rc = flush_dirty_entries_locked ();
+	    if( rc )
+		return rc;
 	}
-	log_info(_("trustdb transaction too large\n"));
-	return G10ERR_RESOURCE_LIMIT;
-    }
-    if( dirty_count ) {
-	int n = dirty_count / 5; /* discard some dirty entries */
-	if( !n )
-	    n = 1;
-	if( !is_locked ) {
-	    if( dotlock_take( lockhandle, -1 ) )
-		log_fatal("can't acquire lock - giving up\n");
-	    else
-		is_locked = 1;
+	if( cache_dirty_count < cache_entries ) {
+	    /* Discard the least recently used clean entry.  */
+	    for( r = cache_lru_tail; r->flags.dirty; r = r->lru_prev )
+		;
+	    drop_cache_item (r);
 	}
-	for( unused = NULL, r = cache_list; r; r = r->next ) {
-	    if( r->flags.used && r->flags.dirty ) {
-		int rc = write_cache_item( r );
-		if( rc )
-		    return rc;
-		if( !unused )
-		    unused = r;
-		r->flags.used = 0;
-		cache_entries--;
-		if( !--n )
-		    break;
+	else if( in_transaction ) {
+	    /* We can't flush dirty entries while in a transaction;
+	     * we increase the cache size instead.  */
+	    if( cache_entries >= MAX_CACHE_ENTRIES_HARD ) {
+		log_info(_("trustdb transaction too large\n"));
+		return G10ERR_RESOURCE_LIMIT;
 	    }
+	    if( opt.debug && !(cache_entries % 100) )
+		log_debug("increasing tdbio cache size\n");
 	}
-	if( !opt.lock_once ) {
-	    if( !dotlock_release( lockhandle ) )
-		is_locked = 0;
-	}
-	assert( unused );
-	r = unused;
-	r->flags.used = 1;
-	r->recno = recno;
-	memcpy( r->data, data, TRUST_RECORD_LEN );
-	r->flags.dirty = 1;
-	cache_is_dirty = 1;
-	cache_entries++;
-	return 0;
+	else
+	    BUG();
+    }
+
+    /* Add a new entry.  */
+    if( cache_unused ) {
+	r = cache_unused;
+	cache_unused = r->next;
     }
-    BUG();
+    else
+	r = xmalloc( sizeof *r );
+    r->flags.used = 1;
+    r->flags.dirty = 1;
+    r->recno = recno;
+    memcpy( r->data, data, TRUST_RECORD_LEN );
+    r->next = cache_table[cache_hash (recno)];
+    cache_table[cache_hash (recno)] = r;
+    lru_push_front (r);
+    cache_entries++;
+    cache_dirty_count++;
+    cache_is_dirty = 1;
+    return 0;
 }
 
 
@@ -306,9 +454,6 @@ tdbio_is_dirty()
 int
 tdbio_sync()
 {
-    CACHE_CTRL r;
-    int did_lock = 0;
-
     if( db_fd == -1 )
 	open_db();
     if( in_transaction )
@@ -317,27 +462,7 @@ tdbio_sync()
     if( !cache_is_dirty )
 	return 0;
 
-    if( !is_locked ) {
-	if( dotlock_take( lockhandle, -1 ) )
-	    log_fatal("can't acquire lock - giving up\n");
-	else
-	    is_locked = 1;
-	did_lock = 1;
-    }
-    for( r = cache_list; r; r = r->next ) {
-	if( r->flags.used && r->flags.dirty ) {
-	    int rc = write_cache_item( r );
-	    if( rc )
-		return rc;
-	}
-    }
-    cache_is_dirty = 0;
-    if( did_lock && !opt.lock_once ) {
-	if( !dotlock_release (lockhandle) )
-	    is_locked = 0;
-    }
-
-    return 0;
+    return flush_dirty_entries_locked ();
 }
 
 #if 0
@@ -400,11 +525,12 @@ tdbio_cancel_transaction()
     /* remove all dirty marked entries, so that the original ones
      * are read back the next time */
     if( cache_is_dirty ) {
-	for( r = cache_list; r; r = r->next ) {
-	    if( r->flags.used && r->flags.dirty ) {
-		r->flags.used = 0;
-		cache_entries--;
-	    }
+	CACHE_CTRL r2;
+
+	for( r = cache_lru_head; r; r = r2 ) {
+	    r2 = r->lru_next;
+	    if( r->flags.dirty )
+		drop_cache_item (r);
 	}
 	cache_is_dirty = 0;
     }
@@ -589,6 +715,14 @@ tdbio_set_dbname( const char *new_dbname, int create, int *r_nofile)
 	    if( !opt.quiet )
 		log_info(_("%s: trustdb created\n"), db_name);
 
+	    /* A certification graph left over from a former trustdb
+	       does not match the new one.  */
+	    {
+	      char *graphname = tdbio_get_graph_fname ();
+	      gnupg_remove (graphname);
+	      xfree (graphname);
+	    }
+
 	    return 0;
 	}
     }
@@ -605,6 +739,15 @@ tdbio_get_dbname()
 }
 
 
+/* Return a malloced string with the name of the file used to keep
+   the certification graph of the trustdb.  */
+char *
+tdbio_get_graph_fname (void)
+{
+  return xstrconcat (db_name, EXTSEP_S "wot", NULL);
+}
+
+
 
 static void
 open_db()
@@ -1196,6 +1339,60 @@ tdbio_dump_record( TRUSTREC *rec, FILE *fp  )
     }
 }
 
+#ifdef HAVE_MMAP
+/* (Re-)map the trustdb so that it covers the entire file.  */
+static void
+map_db (void)
+{
+  struct stat st;
+  void *p;
+
+  if (fstat (db_fd, &st))
+    {
+      log_error (_("trustdb: fstat failed: %s\n"), strerror (errno));
+      db_map_failed = 1;
+      return;
+    }
+  if ((size_t)st.st_size == db_map_len || !st.st_size)
+    return;
+
+  if (db_map)
+    munmap ((void *)db_map, db_map_len);
+  db_map = NULL;
+  db_map_len = 0;
+  p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, db_fd, 0);
+  if (p == MAP_FAILED)
+    {
+      log_info ("trustdb: mmap failed: %s - using read\n", strerror (errno));
+      db_map_failed = 1;
+      return;
+    }
+  db_map = p;
+  db_map_len = st.st_size;
+}
+
+
+/* Return a pointer to record RECNUM in the mapped trustdb or NULL if
+   the record is not available.  Because all writes go through
+   write_records, the shared mapping always reflects the data on
+   disk.  Records which are not yet written are found in the
+   cache.  */
+static const byte *
+get_record_from_map (ulong recnum)
+{
+  size_t off = (size_t)recnum * TRUST_RECORD_LEN;
+
+  if (db_map_failed)
+    return NULL;
+  if (off + TRUST_RECORD_LEN > db_map_len)
+    map_db ();  /* The file may have grown.  */
+  if (!db_map || off + TRUST_RECORD_LEN > db_map_len)
+    return NULL;
+  return db_map + off;
+}
+#endif /*HAVE_MMAP*/
+
+
 /****************
  * read the record with number recnum
  * returns: -1 on error, 0 on success
@@ -1211,6 +1408,10 @@ tdbio_read_record( ulong recnum, TRUSTREC *rec, int expected )
     if( db_fd == -1 )
 	open_db();
     buf = get_record_from_cache( recnum );
+#ifdef HAVE_MMAP
+    if( !buf && opt.tdb_mmap )
+	buf = get_record_from_map (recnum);
+#endif
     if( !buf ) {
 	if( lseek( db_fd, recnum * TRUST_RECORD_LEN, SEEK_SET ) == -1 ) {
             err = gpg_error_from_syserror ();
@@ -273,6 +273,23 @@ revalidation_mark (void)
 }
 
 
+/* Note that the key PK changed.  With PK given as NULL any key may
+   have changed.  */
+void
+mark_key_changed (PKT_public_key *pk)
+{
+#ifdef NO_TRUST_MODELS
+  (void)pk;
+#else
+  u32 kid[2];
+
+  if (pk)
+    keyid_from_pk (pk, kid);
+  tdb_mark_key_changed (pk? kid : NULL);
+#endif
+}
+
+
 void
 check_trustdb_stale (void)
 {
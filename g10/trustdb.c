@@ -22,7 +22,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #ifndef DISABLE_REGEX
 #include <sys/types.h>
@@ -54,6 +57,63 @@ struct key_array
   KBNODE keyblock;
 };
 
+/*
+ * The certification graph used with --trustdb-cert-graph.  There is
+ * one node for each primary key and for each issuer of a
+ * certification.  The edges point from the issuer to the certified
+ * key.
+ */
+struct wot_edge
+{
+  struct wot_edge *next;
+  struct wot_node *node;     /* The certified key.  */
+};
+
+struct wot_node
+{
+  struct wot_node *next;     /* Next node in the hash bucket.  */
+  u32 kid[2];
+  unsigned long seqno;       /* Position in the keyring or 0 if the
+                                key is not in the keyring.  */
+  int mark;                  /* Used by validate_key_list_graph.  */
+  unsigned int changed:1;    /* The key changed since the graph has
+                                been stored.  */
+  unsigned int affected:1;   /* The key needs to be validated.  */
+  unsigned int has_fpr:1;    /* FPR is valid.  */
+  byte fpr[20];              /* The fingerprint padded with zeroes.  */
+  u32 uid_expire;            /* Earliest expiration of a user ID.  */
+  u32 expire;                /* Earliest expiration seen while
+                                validating the key.  */
+  struct wot_edge *signees;  /* Keys certified by this key.  */
+  /* The klist item of the last validation.  KLEVEL is the depth at
+     which the key has been put into the klist plus one or 0 if the
+     key has not been put into the klist.  */
+  int klevel;
+  byte ownertrust;
+  byte min_ownertrust;
+  byte trust_depth;
+  byte trust_value;
+  char *trust_regexp;
+  unsigned long idx;         /* Used by write_wot_graph.  */
+};
+
+struct wot_graph
+{
+  struct wot_node **table;
+  unsigned int size;         /* Number of buckets; a power of 2.  */
+  unsigned int count;        /* Number of nodes.  */
+  unsigned long maxseqno;    /* Highest sequence number.  */
+  unsigned long naffected;   /* Number of affected nodes.  */
+  off_t fileoff;             /* End of the stored graph.  */
+};
+
+/* The file format of the stored graph; see write_wot_graph.  */
+#define WOT_MAGIC       "WoTg"
+#define WOT_VERSION     1
+#define WOT_HEADER_LEN  40
+#define WOT_NODE_LEN    48
+#define WOT_CHANGE_LEN  9
+
 
 /* Control information for the trust DB.  */
 static struct
@@ -538,6 +598,45 @@ tdb_revalidation_mark (void)
   pending_check_trustdb = 1;
 }
 
+
+/*
+ * Note that the key with the key ID KID or its ownertrust changed so
+ * that the next validation using the certification graph takes a new
+ * look at it.  With KID given as NULL any key may have changed and
+ * the graph is dropped.
+ */
+void
+tdb_mark_key_changed (u32 *kid)
+{
+  char *fname;
+  FILE *fp;
+  byte buf[WOT_CHANGE_LEN];
+
+  init_trustdb ();
+  if (trustdb_args.no_trustdb)
+    return;
+
+  fname = tdbio_get_graph_fname ();
+  if (!kid)
+    gnupg_remove (fname);
+  else if ((fp = fopen (fname, "r+b")))
+    {
+      buf[0] = 'C';
+      u32tobuf (buf+1, kid[0]);
+      u32tobuf (buf+5, kid[1]);
+      if (fseek (fp, 0, SEEK_END)
+          || fwrite (buf, WOT_CHANGE_LEN, 1, fp) != 1)
+        {
+          fclose (fp);
+          gnupg_remove (fname);
+        }
+      else if (fclose (fp))
+        gnupg_remove (fname);
+    }
+  xfree (fname);
+}
+
+
 int
 trustdb_pending_check(void)
 {
@@ -673,6 +772,7 @@ void
 tdb_update_ownertrust (PKT_public_key *pk, unsigned int new_trust )
 {
   TRUSTREC rec;
+  u32 kid[2];
   int rc;
 
   if (trustdb_args.no_trustdb && opt.trust_model == TM_ALWAYS)
@@ -688,6 +788,8 @@ tdb_update_ownertrust (PKT_public_key *pk, unsigned int new_trust )
         {
           rec.r.trust.ownertrust = new_trust;
           write_record( &rec );
+          keyid_from_pk (pk, kid);
+          tdb_mark_key_changed (kid);
           tdb_revalidation_mark ();
           do_sync ();
         }
@@ -705,6 +807,8 @@ tdb_update_ownertrust (PKT_public_key *pk, unsigned int new_trust )
       fingerprint_from_pk (pk, rec.r.trust.fingerprint, &dummy);
       rec.r.trust.ownertrust = new_trust;
       write_record (&rec);
+      keyid_from_pk (pk, kid);
+      tdb_mark_key_changed (kid);
       tdb_revalidation_mark ();
       do_sync ();
       rc = 0;
@@ -779,6 +883,7 @@ int
 tdb_clear_ownertrusts (PKT_public_key *pk)
 {
   TRUSTREC rec;
+  u32 kid[2];
   int rc;
 
   init_trustdb ();
@@ -801,6 +906,8 @@ tdb_clear_ownertrusts (PKT_public_key *pk)
           rec.r.trust.ownertrust = 0;
           rec.r.trust.min_ownertrust = 0;
           write_record( &rec );
+          keyid_from_pk (pk, kid);
+          tdb_mark_key_changed (kid);
           tdb_revalidation_mark ();
           do_sync ();
           return 1;
@@ -1553,6 +1660,50 @@ search_skipfnc (void *opaque, u32 *kid, PKT_user_id *dummy)
 }
 
 
+/*
+ * Prepare KEYBLOCK and validate it against KLIST.  Returns true if
+ * the keyblock has at least one user ID signed by a key in KLIST; in
+ * this case the caller takes ownership of KEYBLOCK.  Keys which need
+ * not be looked at again are marked in FULL_TRUST.
+ */
+static int
+check_key_for_list (KBNODE keyblock, KeyHashTable full_trust,
+                    struct key_item *klist, u32 curtime, u32 *next_expire)
+{
+  PKT_public_key *pk;
+  KBNODE node;
+
+  /* prepare the keyblock for further processing */
+  merge_keys_and_selfsig (keyblock);
+  clear_kbnode_flags (keyblock);
+  pk = keyblock->pkt->pkt.public_key;
+  if (pk->has_expired || pk->flags.revoked)
+    {
+      /* it does not make sense to look further at those keys */
+      mark_keyblock_seen (full_trust, keyblock);
+      return 0;
+    }
+
+  if (!validate_one_keyblock (keyblock, klist, curtime, next_expire))
+    return 0;
+
+  if (pk->expiredate && pk->expiredate >= curtime
+      && pk->expiredate < *next_expire)
+    *next_expire = pk->expiredate;
+
+  /* Optimization - if all uids are fully trusted, then we
+     never need to consider this key as a candidate again. */
+  for (node=keyblock; node; node = node->next)
+    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
+      break;
+
+  if(node==NULL)
+    mark_keyblock_seen (full_trust, keyblock);
+
+  return 1;
+}
+
+
 /*
  * Scan all keys and return a key_array of all suitable keys from
  * kllist.  The caller has to pass keydb handle so that we don't use
@@ -1602,8 +1753,6 @@ validate_key_list (KEYDB_HANDLE hd, KeyHashTable full_trust,
   desc.mode = KEYDB_SEARCH_MODE_NEXT; /* change mode */
   do
     {
-      PKT_public_key *pk;
-
       rc = keydb_get_keyblock (hd, &keyblock);
       if (rc)
         {
@@ -1621,39 +1770,14 @@ validate_key_list (KEYDB_HANDLE hd, KeyHashTable full_trust,
           continue;
         }
 
-      /* prepare the keyblock for further processing */
-      merge_keys_and_selfsig (keyblock);
-      clear_kbnode_flags (keyblock);
-      pk = keyblock->pkt->pkt.public_key;
-      if (pk->has_expired || pk->flags.revoked)
+      if (check_key_for_list (keyblock, full_trust, klist,
+                              curtime, next_expire))
         {
-          /* it does not make sense to look further at those keys */
-          mark_keyblock_seen (full_trust, keyblock);
-        }
-      else if (validate_one_keyblock (keyblock, klist, curtime, next_expire))
-        {
-	  KBNODE node;
-
-          if (pk->expiredate && pk->expiredate >= curtime
-              && pk->expiredate < *next_expire)
-            *next_expire = pk->expiredate;
-
           if (nkeys == maxkeys) {
             maxkeys += 1000;
             keys = xrealloc (keys, (maxkeys+1) * sizeof *keys);
           }
           keys[nkeys++].keyblock = keyblock;
-
-	  /* Optimization - if all uids are fully trusted, then we
-	     never need to consider this key as a candidate again. */
-
-	  for (node=keyblock; node; node = node->next)
-	    if (node->pkt->pkttype == PKT_USER_ID && !(node->flag & 4))
-	      break;
-
-	  if(node==NULL)
-	    mark_keyblock_seen (full_trust, keyblock);
-
           keyblock = NULL;
         }
 
@@ -1673,6 +1797,942 @@ validate_key_list (KEYDB_HANDLE hd, KeyHashTable full_trust,
   return keys;
 }
 
+/*
+ * Functions for the validation using the certification graph.
+ *
+ * Instead of scanning the entire keyring once for each level of the
+ * web of trust, we use a graph of all certifications (signer ->
+ * signee).  At each level only the keys certified by a key of the
+ * current klist are then looked at.  Because validate_key_list
+ * ignores keys not signed by a key in klist, this yields the same
+ * results as the full scan.
+ *
+ * The graph and the klist items of the last validation are stored
+ * in a file next to the trustdb.  Keys changed since then are
+ * appended to that file by tdb_mark_key_changed.  The result for a
+ * key depends only on the keys from which it can be reached in the
+ * graph.  Thus the next validation re-reads only the changed keys
+ * and revalidates them and all keys reachable from them; for all
+ * other keys the trust records and the klist items of the last
+ * validation are kept.  The file is not used if the validation
+ * parameters or the set of ultimately trusted keys changed, if a key
+ * may have expired since the last validation, or if the trustdb has
+ * been updated without the graph.
+ */
+
+/* Iterate over all nodes of a graph.  */
+#define FOR_EACH_WOT_NODE(graph,i,n)                  \
+  for ((i)=0; (i) < (graph)->size; (i)++)             \
+    for ((n) = (graph)->table[(i)]; (n); (n) = (n)->next)
+
+static unsigned int
+wot_hash (u32 *kid)
+{
+  return kid[1] ^ (kid[0] >> 7);
+}
+
+
+static struct wot_graph *
+wot_new_graph (void)
+{
+  struct wot_graph *graph;
+
+  graph = xmalloc_clear (sizeof *graph);
+  graph->size = 1024;
+  graph->table = xcalloc (graph->size, sizeof *graph->table);
+  return graph;
+}
+
+
+/* Return the node for KID; create it if CREATE is set.  */
+static struct wot_node *
+wot_get_node (struct wot_graph *graph, u32 *kid, int create)
+{
+  struct wot_node *n;
+  unsigned int idx;
+
+  idx = wot_hash (kid) & (graph->size - 1);
+  for (n = graph->table[idx]; n; n = n->next)
+    if (n->kid[0] == kid[0] && n->kid[1] == kid[1])
+      return n;
+  if (!create)
+    return NULL;
+
+  if (graph->count >= 2 * graph->size)
+    {
+      /* Double the size of the table.  */
+      struct wot_node **tbl, *n2;
+      unsigned int i, newsize = 2 * graph->size;
+
+      tbl = xcalloc (newsize, sizeof *tbl);
+      for (i=0; i < graph->size; i++)
+        for (n = graph->table[i]; n; n = n2)
+          {
+            n2 = n->next;
+            n->next = tbl[wot_hash (n->kid) & (newsize - 1)];
+            tbl[wot_hash (n->kid) & (newsize - 1)] = n;
+          }
+      xfree (graph->table);
+      graph->table = tbl;
+      graph->size = newsize;
+      idx = wot_hash (kid) & (graph->size - 1);
+    }
+
+  n = xmalloc_clear (sizeof *n);
+  n->kid[0] = kid[0];
+  n->kid[1] = kid[1];
+  n->uid_expire = 0xffffffff;
+  n->expire = 0xffffffff;
+  n->next = graph->table[idx];
+  graph->table[idx] = n;
+  graph->count++;
+  return n;
+}
+
+
+static void
+release_wot_edges (struct wot_edge *e)
+{
+  struct wot_edge *e2;
+
+  for (; e; e = e2)
+    {
+      e2 = e->next;
+      xfree (e);
+    }
+}
+
+
+static void
+release_wot_graph (struct wot_graph *graph)
+{
+  struct wot_node *n, *n2;
+  unsigned int i;
+
+  if (!graph)
+    return;
+  for (i=0; i < graph->size; i++)
+    for (n = graph->table[i]; n; n = n2)
+      {
+        n2 = n->next;
+        release_wot_edges (n->signees);
+        xfree (n->trust_regexp);
+        xfree (n);
+      }
+  xfree (graph->table);
+  xfree (graph);
+}
+
+
+/*
+ * Add KEYBLOCK and its certifications to GRAPH.  Only the key IDs of
+ * the issuers are recorded; whether a certification is actually
+ * usable is decided later by validate_one_keyblock.  Keys in
+ * FULL_TRUST are not looked at by the first level of the full scan;
+ * for all other keys the expiration of their user IDs is stored at
+ * the node, as validate_one_keyblock would take it into account.
+ */
+static void
+wot_add_keyblock (struct wot_graph *graph, KBNODE keyblock,
+                  KeyHashTable full_trust)
+{
+  KBNODE node;
+  PKT_public_key *pk;
+  PKT_user_id *uid;
+  struct wot_node *signee, *signer;
+  struct wot_edge *e;
+  size_t fprlen;
+  u32 kid[2];
+  int in_uid;
+
+  pk = keyblock->pkt->pkt.public_key;
+  keyid_from_pk (pk, kid);
+  signee = wot_get_node (graph, kid, 1);
+  if (!signee->seqno)
+    signee->seqno = ++graph->maxseqno;
+  memset (signee->fpr, 0, sizeof signee->fpr);
+  fingerprint_from_pk (pk, signee->fpr, &fprlen);
+  signee->has_fpr = 1;
+
+  if (!test_key_hash_table (full_trust, kid))
+    {
+      merge_keys_and_selfsig (keyblock);
+      for (node = keyblock->next;
+           node && !pk->has_expired && !pk->flags.revoked;
+           node = node->next)
+        {
+          if (node->pkt->pkttype != PKT_USER_ID)
+            continue;
+          uid = node->pkt->pkt.user_id;
+          if (!uid->is_revoked && !uid->is_expired
+              && uid->expiredate && uid->expiredate < signee->uid_expire)
+            signee->uid_expire = uid->expiredate;
+        }
+    }
+
+  in_uid = 0;
+  for (node = keyblock->next; node; node = node->next)
+    {
+      if (node->pkt->pkttype == PKT_USER_ID)
+        in_uid = 1;
+      else if (node->pkt->pkttype == PKT_PUBLIC_SUBKEY)
+        in_uid = 0;
+      else if (in_uid && node->pkt->pkttype == PKT_SIGNATURE)
+        {
+          PKT_signature *sig = node->pkt->pkt.signature;
+
+          if (!IS_UID_SIG (sig)
+              || (sig->keyid[0] == kid[0] && sig->keyid[1] == kid[1]))
+            continue;
+          signer = wot_get_node (graph, sig->keyid, 1);
+          /* Certifications of one key are processed in a row;
+             thus checking the head suffices to avoid
+             duplicates.  */
+          if (signer->signees && signer->signees->node == signee)
+            continue;
+          e = xmalloc (sizeof *e);
+          e->node = signee;
+          e->next = signer->signees;
+          signer->signees = e;
+        }
+    }
+}
+
+
+/*
+ * Scan all keys and build the certification graph.  All nodes are
+ * marked as affected.  Returns NULL on error.
+ */
+static struct wot_graph *
+build_wot_graph (KEYDB_HANDLE hd, KeyHashTable full_trust)
+{
+  struct wot_graph *graph;
+  KBNODE keyblock = NULL;
+  KEYDB_SEARCH_DESC desc;
+  struct wot_node *n;
+  unsigned int i;
+  int rc;
+
+  graph = wot_new_graph ();
+
+  rc = keydb_search_reset (hd);
+  if (rc)
+    {
+      log_error ("keydb_search_reset failed: %s\n", g10_errstr(rc));
+      goto leave;
+    }
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_FIRST;
+  while (!(rc = keydb_search (hd, &desc, 1, NULL)))
+    {
+      desc.mode = KEYDB_SEARCH_MODE_NEXT;
+      rc = keydb_get_keyblock (hd, &keyblock);
+      if (rc)
+        {
+          log_error ("keydb_get_keyblock failed: %s\n", g10_errstr(rc));
+          goto leave;
+        }
+      if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
+        wot_add_keyblock (graph, keyblock, full_trust);
+      release_kbnode (keyblock);
+      keyblock = NULL;
+    }
+  if (gpg_err_code (rc) == GPG_ERR_NOT_FOUND)
+    rc = 0;
+  else
+    log_error ("keydb_search failed: %s\n", g10_errstr(rc));
+
+  if (!rc && opt.verbose)
+    log_info (_("%lu keys scanned for the web of trust\n"),
+              graph->maxseqno);
+
+  FOR_EACH_WOT_NODE (graph, i, n)
+    n->affected = 1;
+  graph->naffected = graph->count;
+
+ leave:
+  release_kbnode (keyblock);
+  if (rc)
+    {
+      release_wot_graph (graph);
+      graph = NULL;
+    }
+  return graph;
+}
+
+
+/*
+ * Compute a hash over the parameters of the validation and the
+ * ultimately trusted keys and store it at DIGEST.  A graph stored
+ * with a different hash can't be used.
+ */
+static void
+wot_params_digest (byte *digest)
+{
+  gcry_md_hd_t md;
+  struct key_item *k;
+  byte buf[8];
+
+  if (gcry_md_open (&md, GCRY_MD_SHA1, 0))
+    BUG ();
+  buf[0] = opt.trust_model;
+  buf[1] = opt.marginals_needed;
+  buf[2] = opt.completes_needed;
+  buf[3] = opt.max_cert_depth;
+  buf[4] = opt.min_cert_level;
+  gcry_md_write (md, buf, 5);
+  for (k = utk_list; k; k = k->next)
+    {
+      u32tobuf (buf, k->kid[0]);
+      u32tobuf (buf+4, k->kid[1]);
+      gcry_md_write (md, buf, 8);
+    }
+  memcpy (digest, gcry_md_read (md, GCRY_MD_SHA1), 20);
+  gcry_md_close (md);
+}
+
+
+/* Read LEN bytes from FP into BUFFER.  Returns true on success.  */
+static int
+wot_read (FILE *fp, void *buffer, size_t len)
+{
+  return !len || fread (buffer, len, 1, fp) == 1;
+}
+
+
+/*
+ * Read the certification graph of the last validation and the keys
+ * changed since then from the file FNAME.  DIGEST is the hash over
+ * the validation parameters, CREATED the creation time of the
+ * trustdb version record and CURTIME the time of this validation.
+ * Returns NULL if there is no usable graph.
+ */
+static struct wot_graph *
+read_wot_graph (const char *fname, const byte *digest, u32 created,
+                u32 curtime)
+{
+  struct wot_graph *graph = NULL;
+  struct wot_node **nodes = NULL;
+  struct wot_node *n;
+  struct wot_edge *e;
+  FILE *fp;
+  byte buf[WOT_NODE_LEN];
+  u32 nnodes, nedges, idx, kid[2];
+  size_t i;
+  int len;
+
+  fp = fopen (fname, "rb");
+  if (!fp)
+    return NULL;
+
+  if (!wot_read (fp, buf, WOT_HEADER_LEN)
+      || memcmp (buf, WOT_MAGIC, 4) || buf[4] != WOT_VERSION
+      || buftou32 (buf+8) != created
+      || buftou32 (buf+12) <= curtime
+      || memcmp (buf+20, digest, 20))
+    goto leave;
+  nnodes = buftou32 (buf+16);
+
+  graph = wot_new_graph ();
+  nodes = xtrycalloc (nnodes? nnodes : 1, sizeof *nodes);
+  if (!nodes)
+    goto fail;
+  for (i=0; i < nnodes; i++)
+    {
+      if (!wot_read (fp, buf, WOT_NODE_LEN))
+        goto fail;
+      kid[0] = buftou32 (buf);
+      kid[1] = buftou32 (buf+4);
+      n = wot_get_node (graph, kid, 1);
+      if (graph->count != i + 1)
+        goto fail;  /* Duplicate node.  */
+      nodes[i] = n;
+      n->seqno       = buftou32 (buf+8);
+      n->uid_expire  = buftou32 (buf+12);
+      n->expire      = buftou32 (buf+16);
+      n->has_fpr     = !!(buf[20] & 1);
+      memcpy (n->fpr, buf+21, 20);
+      n->klevel      = buf[41];
+      n->ownertrust  = buf[42];
+      n->min_ownertrust = buf[43];
+      n->trust_depth = buf[44];
+      n->trust_value = buf[45];
+      len = buftoushort (buf+46);
+      if (len)
+        {
+          n->trust_regexp = xmalloc (len + 1);
+          if (!wot_read (fp, n->trust_regexp, len))
+            goto fail;
+          n->trust_regexp[len] = 0;
+        }
+      if (n->seqno > graph->maxseqno)
+        graph->maxseqno = n->seqno;
+    }
+
+  for (i=0; i < nnodes; i++)
+    {
+      if (!wot_read (fp, buf, 4))
+        goto fail;
+      for (nedges = buftou32 (buf); nedges; nedges--)
+        {
+          if (!wot_read (fp, buf, 4))
+            goto fail;
+          idx = buftou32 (buf);
+          if (idx >= nnodes)
+            goto fail;
+          e = xmalloc (sizeof *e);
+          e->node = nodes[idx];
+          e->next = nodes[i]->signees;
+          nodes[i]->signees = e;
+        }
+    }
+
+  /* Now for the keys changed since the last validation.  */
+  while (fread (buf, WOT_CHANGE_LEN, 1, fp) == 1)
+    {
+      if (*buf != 'C')
+        goto fail;
+      kid[0] = buftou32 (buf+1);
+      kid[1] = buftou32 (buf+5);
+      n = wot_get_node (graph, kid, 1);
+      n->changed = 1;
+    }
+  if (ferror (fp))
+    goto fail;
+  graph->fileoff = ftello (fp);
+  goto leave;
+
+ fail:
+  log_info (_("error reading '%s': %s\n"), fname,
+            ferror (fp)? strerror (errno) : gpg_strerror (GPG_ERR_INV_DATA));
+  release_wot_graph (graph);
+  graph = NULL;
+ leave:
+  xfree (nodes);
+  fclose (fp);
+  return graph;
+}
+
+
+/*
+ * Re-read the keys marked as changed in GRAPH and replace their
+ * certifications.  Then mark them and all keys reachable from them
+ * as affected.  Returns 0 on success.
+ */
+static int
+update_wot_graph (KEYDB_HANDLE hd, struct wot_graph *graph,
+                  KeyHashTable full_trust)
+{
+  struct wot_node *n, **stack = NULL;
+  struct wot_edge *e, **ep;
+  KBNODE keyblock = NULL;
+  KEYDB_SEARCH_DESC desc;
+  size_t nstack = 0;
+  unsigned int i;
+  u32 kid[2];
+  int rc = 0, found;
+
+  /* Drop the certifications on the changed keys.  */
+  FOR_EACH_WOT_NODE (graph, i, n)
+    for (ep = &n->signees; (e = *ep); )
+      {
+        if (e->node->changed)
+          {
+            *ep = e->next;
+            xfree (e);
+          }
+        else
+          ep = &e->next;
+      }
+
+  /* Read them again.  Reading may add nodes; thus we first collect
+     the changed nodes.  */
+  stack = xmalloc ((graph->count + 1) * sizeof *stack);
+  FOR_EACH_WOT_NODE (graph, i, n)
+    if (n->changed)
+      stack[nstack++] = n;
+  while (nstack)
+    {
+      n = stack[--nstack];
+      n->affected = 1;
+      n->uid_expire = 0xffffffff;
+      found = 0;
+      rc = keydb_search_reset (hd);
+      if (rc)
+        {
+          log_error ("keydb_search_reset failed: %s\n", g10_errstr(rc));
+          goto leave;
+        }
+      memset (&desc, 0, sizeof desc);
+      desc.mode = KEYDB_SEARCH_MODE_LONG_KID;
+      desc.u.kid[0] = n->kid[0];
+      desc.u.kid[1] = n->kid[1];
+      while (!(rc = keydb_search (hd, &desc, 1, NULL)))
+        {
+          rc = keydb_get_keyblock (hd, &keyblock);
+          if (rc)
+            {
+              log_error ("keydb_get_keyblock failed: %s\n", g10_errstr(rc));
+              goto leave;
+            }
+          /* The search also matches subkeys.  */
+          if (keyblock->pkt->pkttype == PKT_PUBLIC_KEY)
+            {
+              keyid_from_pk (keyblock->pkt->pkt.public_key, kid);
+              if (kid[0] == n->kid[0] && kid[1] == n->kid[1])
+                {
+                  wot_add_keyblock (graph, keyblock, full_trust);
+                  found = 1;
+                }
+            }
+          release_kbnode (keyblock);
+          keyblock = NULL;
+        }
+      if (gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
+        {
+          log_error ("keydb_search failed: %s\n", g10_errstr(rc));
+          goto leave;
+        }
+      rc = 0;
+      if (!found)
+        n->seqno = 0;  /* The key has been deleted.  */
+    }
+  xfree (stack);
+
+  /* Mark all keys reachable from the changed keys.  */
+  stack = xmalloc ((graph->count + 1) * sizeof *stack);
+  FOR_EACH_WOT_NODE (graph, i, n)
+    if (n->affected)
+      stack[nstack++] = n;
+  while (nstack)
+    for (e = stack[--nstack]->signees; e; e = e->next)
+      if (!e->node->affected)
+        {
+          e->node->affected = 1;
+          stack[nstack++] = e->node;
+        }
+
+  FOR_EACH_WOT_NODE (graph, i, n)
+    if (n->affected)
+      graph->naffected++;
+  if (opt.verbose)
+    log_info (_("%lu of %u keys need to be validated again\n"),
+              graph->naffected, graph->count);
+
+ leave:
+  xfree (stack);
+  release_kbnode (keyblock);
+  return rc;
+}
+
+
+/*
+ * Clear the validity of the keys in GRAPH affected by changes as
+ * reset_trust_records does for all keys.  Also forget what the last
+ * validation stored for them.  Caller must sync.
+ */
+static void
+reset_wot_trust_records (struct wot_graph *graph)
+{
+  struct wot_node *n;
+  TRUSTREC rec, vrec;
+  ulong recno;
+  unsigned int i;
+  int rc, nreset = 0;
+
+  FOR_EACH_WOT_NODE (graph, i, n)
+    {
+      if (!n->affected)
+        continue;
+      n->expire = 0xffffffff;
+      n->klevel = 0;
+      xfree (n->trust_regexp);
+      n->trust_regexp = NULL;
+      if (!n->has_fpr)
+        continue;
+
+      rc = tdbio_search_trust_byfpr (n->fpr, &rec);
+      if (rc == -1)
+        continue;
+      if (rc)
+        {
+          tdbio_invalid ();
+          return;
+        }
+      if (rec.r.trust.min_ownertrust)
+        {
+          rec.r.trust.min_ownertrust = 0;
+          write_record (&rec);
+        }
+      for (recno = rec.r.trust.validlist; recno; recno = vrec.r.valid.next)
+        {
+          read_record (recno, &vrec, RECTYPE_VALID);
+          if ((vrec.r.valid.validity & TRUST_MASK)
+              || vrec.r.valid.marginal_count || vrec.r.valid.full_count)
+            {
+              vrec.r.valid.validity &= ~TRUST_MASK;
+              vrec.r.valid.marginal_count = vrec.r.valid.full_count = 0;
+              nreset++;
+              write_record (&vrec);
+            }
+        }
+    }
+
+  if (opt.verbose)
+    log_info (_("%lu keys processed (%d validity counts cleared)\n"),
+              graph->naffected, nreset);
+}
+
+
+/*
+ * Write GRAPH to the file FNAME.  DIGEST, CREATED and VALID_UNTIL
+ * are stored for read_wot_graph.  Keys appended to the old file
+ * while we were validating are copied to the new file.
+ *
+ * All numbers are stored in network byte order.  The file starts
+ * with a header of WOT_HEADER_LEN bytes:
+ *
+ *   4 bytes  WOT_MAGIC
+ *   1 byte   WOT_VERSION
+ *   3 bytes  reserved
+ *   4 bytes  creation time of the trustdb version record
+ *   4 bytes  time until which the graph may be used
+ *   4 bytes  number of nodes
+ *  20 bytes  digest over the validation parameters
+ *
+ * followed by one record of WOT_NODE_LEN bytes for each node:
+ *
+ *   8 bytes  key ID
+ *   4 bytes  sequence number
+ *   4 bytes  uid_expire
+ *   4 bytes  expire
+ *   1 byte   bit 0 is set if the fingerprint is valid
+ *  20 bytes  fingerprint
+ *   1 byte   klevel
+ *   4 bytes  ownertrust, min_ownertrust, trust_depth and trust_value
+ *   2 bytes  length of the trust regexp which directly follows
+ *
+ * and for each node the number of its signees as 4 bytes followed
+ * by the index of each signee as 4 bytes.  The changed keys are
+ * appended as records of WOT_CHANGE_LEN bytes: the letter 'C'
+ * followed by the key ID.
+ */
+static void
+write_wot_graph (struct wot_graph *graph, const char *fname,
+                 const byte *digest, u32 created, u32 valid_until)
+{
+  char *tmpfname;
+  FILE *fp, *oldfp;
+  struct wot_node *n;
+  struct wot_edge *e;
+  unsigned long idx = 0;
+  unsigned int i;
+  u32 nedges;
+  byte buf[WOT_NODE_LEN];
+  size_t len;
+  int rc = 0;
+
+  tmpfname = xstrconcat (fname, EXTSEP_S "tmp", NULL);
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      log_error (_("can't create '%s': %s\n"), tmpfname, strerror (errno));
+      xfree (tmpfname);
+      return;
+    }
+
+  memset (buf, 0, WOT_HEADER_LEN);
+  memcpy (buf, WOT_MAGIC, 4);
+  buf[4] = WOT_VERSION;
+  u32tobuf (buf+8, created);
+  u32tobuf (buf+12, valid_until);
+  u32tobuf (buf+16, graph->count);
+  memcpy (buf+20, digest, 20);
+  if (fwrite (buf, WOT_HEADER_LEN, 1, fp) != 1)
+    rc = -1;
+
+  FOR_EACH_WOT_NODE (graph, i, n)
+    {
+      n->idx = idx++;
+      len = n->trust_regexp? strlen (n->trust_regexp) : 0;
+      if (len > 0xffff)
+        len = 0;
+      u32tobuf (buf, n->kid[0]);
+      u32tobuf (buf+4, n->kid[1]);
+      u32tobuf (buf+8, n->seqno);
+      u32tobuf (buf+12, n->uid_expire);
+      u32tobuf (buf+16, n->expire);
+      buf[20] = n->has_fpr;
+      memcpy (buf+21, n->fpr, 20);
+      buf[41] = n->klevel;
+      buf[42] = n->ownertrust;
+      buf[43] = n->min_ownertrust;
+      buf[44] = n->trust_depth;
+      buf[45] = n->trust_value;
+      ushorttobuf (buf+46, len);
+      if (fwrite (buf, WOT_NODE_LEN, 1, fp) != 1
+          || (len && fwrite (n->trust_regexp, len, 1, fp) != 1))
+        rc = -1;
+    }
+
+  FOR_EACH_WOT_NODE (graph, i, n)
+    {
+      for (nedges = 0, e = n->signees; e; e = e->next)
+        nedges++;
+      u32tobuf (buf, nedges);
+      if (fwrite (buf, 4, 1, fp) != 1)
+        rc = -1;
+      for (e = n->signees; e; e = e->next)
+        {
+          u32tobuf (buf, e->node->idx);
+          if (fwrite (buf, 4, 1, fp) != 1)
+            rc = -1;
+        }
+    }
+
+  /* Copy the keys changed by other processes in the meantime.  */
+  oldfp = graph->fileoff? fopen (fname, "rb") : NULL;
+  if (oldfp)
+    {
+      if (!fseeko (oldfp, graph->fileoff, SEEK_SET))
+        while (fread (buf, WOT_CHANGE_LEN, 1, oldfp) == 1)
+          if (*buf != 'C' || fwrite (buf, WOT_CHANGE_LEN, 1, fp) != 1)
+            {
+              rc = -1;
+              break;
+            }
+      fclose (oldfp);
+    }
+
+  if (fclose (fp))
+    rc = -1;
+  if (rc)
+    {
+      log_error (_("error writing '%s': %s\n"), tmpfname, strerror (errno));
+      gnupg_remove (tmpfname);
+      gnupg_remove (fname);
+    }
+  else
+    {
+#if defined(HAVE_DOSISH_SYSTEM) || defined(__riscos__)
+      gnupg_remove (fname);
+#endif
+      if (rename (tmpfname, fname))
+        {
+          log_error (_("renaming '%s' to '%s' failed: %s\n"),
+                     tmpfname, fname, strerror (errno));
+          gnupg_remove (tmpfname);
+          gnupg_remove (fname);
+        }
+    }
+  xfree (tmpfname);
+}
+
+
+/* Store the klist item K which has been put into the klist at LEVEL
+   at its node in GRAPH.  */
+static void
+wot_store_klist_item (struct wot_graph *graph, struct key_item *k, int level)
+{
+  struct wot_node *n;
+
+  n = wot_get_node (graph, k->kid, 0);
+  if (!n)
+    return;
+  n->klevel = level;
+  n->ownertrust = k->ownertrust;
+  n->min_ownertrust = k->min_ownertrust;
+  n->trust_depth = k->trust_depth;
+  n->trust_value = k->trust_value;
+  xfree (n->trust_regexp);
+  n->trust_regexp = k->trust_regexp? xstrdup (k->trust_regexp) : NULL;
+}
+
+
+/*
+ * Add the klist items stored for LEVEL by the last validation to
+ * KLIST and return the new list.  Only keys not affected by changes
+ * are taken; the others have been validated again.  The keys are
+ * marked in USED.
+ */
+static struct key_item *
+wot_add_kept_klist_items (struct wot_graph *graph, int level,
+                          KeyHashTable used, struct key_item *klist)
+{
+  struct wot_node *n;
+  struct key_item *k;
+  unsigned int i;
+
+  if (graph->naffected == graph->count || level > 255)
+    return klist;
+
+  FOR_EACH_WOT_NODE (graph, i, n)
+    {
+      if (n->affected || n->klevel != level
+          || test_key_hash_table (used, n->kid))
+        continue;
+      add_key_hash_table (used, n->kid);
+      k = new_key_item ();
+      k->kid[0] = n->kid[0];
+      k->kid[1] = n->kid[1];
+      k->ownertrust = n->ownertrust;
+      k->min_ownertrust = n->min_ownertrust;
+      k->trust_depth = n->trust_depth;
+      k->trust_value = n->trust_value;
+      if (n->trust_regexp)
+        k->trust_regexp = xstrdup (n->trust_regexp);
+      k->next = klist;
+      klist = k;
+    }
+  return klist;
+}
+
+
+/* Return the earliest expiration stored in GRAPH.  */
+static u32
+wot_next_expire (struct wot_graph *graph)
+{
+  struct wot_node *n;
+  unsigned int i;
+  u32 next_expire = 0xffffffff;
+
+  FOR_EACH_WOT_NODE (graph, i, n)
+    {
+      if (n->uid_expire < next_expire)
+        next_expire = n->uid_expire;
+      if (n->expire < next_expire)
+        next_expire = n->expire;
+    }
+  return next_expire;
+}
+
+
+static int
+cmp_wot_node_seqno (const void *a, const void *b)
+{
+  const struct wot_node *na = *(const struct wot_node **)a;
+  const struct wot_node *nb = *(const struct wot_node **)b;
+
+  return na->seqno < nb->seqno ? -1 : na->seqno > nb->seqno ? 1 : 0;
+}
+
+
+/*
+ * This is the graph based version of validate_key_list.  Instead of
+ * scanning all keys, only the keys certified by keys in KLIST and
+ * affected by changes are looked up.  They are processed in the
+ * order of the keyring so that the results match the full scan.
+ * DEPTH is used to mark the nodes already queued for this level.
+ * The expirations seen are stored at the nodes.
+ */
+static struct key_array *
+validate_key_list_graph (KEYDB_HANDLE hd, struct wot_graph *graph,
+                         int depth, KeyHashTable full_trust,
+                         struct key_item *klist, u32 curtime)
+{
+  KBNODE keyblock = NULL;
+  struct key_array *keys = NULL;
+  struct wot_node **cand = NULL;
+  struct wot_node *n;
+  struct wot_edge *e;
+  struct key_item *k;
+  size_t ncand, maxcand, nkeys, maxkeys, i;
+  KEYDB_SEARCH_DESC desc;
+  u32 kid[2];
+  int rc;
+
+  maxkeys = 1000;
+  keys = xmalloc ((maxkeys+1) * sizeof *keys);
+  nkeys = 0;
+
+  /* Collect the candidates.  */
+  maxcand = 1000;
+  cand = xmalloc (maxcand * sizeof *cand);
+  ncand = 0;
+  for (k = klist; k; k = k->next)
+    {
+      n = wot_get_node (graph, k->kid, 0);
+      if (!n)
+        continue;
+      for (e = n->signees; e; e = e->next)
+        {
+          if (!e->node->affected
+              || e->node->mark == depth + 1
+              || test_key_hash_table (full_trust, e->node->kid))
+            continue;
+          e->node->mark = depth + 1;
+          if (ncand == maxcand)
+            {
+              maxcand += 1000;
+              cand = xrealloc (cand, maxcand * sizeof *cand);
+            }
+          cand[ncand++] = e->node;
+        }
+    }
+  qsort (cand, ncand, sizeof *cand, cmp_wot_node_seqno);
+
+  for (i=0; i < ncand; i++)
+    {
+      rc = keydb_search_reset (hd);
+      if (rc)
+        {
+          log_error ("keydb_search_reset failed: %s\n", g10_errstr(rc));
+          goto fail;
+        }
+      memset (&desc, 0, sizeof desc);
+      desc.mode = KEYDB_SEARCH_MODE_LONG_KID;
+      desc.u.kid[0] = cand[i]->kid[0];
+      desc.u.kid[1] = cand[i]->kid[1];
+      /* Loop to catch duplicate keys.  */
+      while (!(rc = keydb_search (hd, &desc, 1, NULL)))
+        {
+          rc = keydb_get_keyblock (hd, &keyblock);
+          if (rc)
+            {
+              log_error ("keydb_get_keyblock failed: %s\n", g10_errstr(rc));
+              goto fail;
+            }
+          /* The search also matches subkeys.  */
+          if (keyblock->pkt->pkttype != PKT_PUBLIC_KEY)
+            goto next;
+          keyid_from_pk (keyblock->pkt->pkt.public_key, kid);
+          if (kid[0] != cand[i]->kid[0] || kid[1] != cand[i]->kid[1])
+            goto next;
+
+          if (check_key_for_list (keyblock, full_trust, klist,
+                                  curtime, &cand[i]->expire))
+            {
+              if (nkeys == maxkeys) {
+                maxkeys += 1000;
+                keys = xrealloc (keys, (maxkeys+1) * sizeof *keys);
+              }
+              keys[nkeys++].keyblock = keyblock;
+              keyblock = NULL;
+            }
+        next:
+          release_kbnode (keyblock);
+          keyblock = NULL;
+        }
+      if (gpg_err_code (rc) != GPG_ERR_NOT_FOUND)
+        {
+          log_error ("keydb_search failed: %s\n", g10_errstr(rc));
+          goto fail;
+        }
+    }
+
+  xfree (cand);
+  keys[nkeys].keyblock = NULL;
+  return keys;
+
+ fail:
+  xfree (cand);
+  keys[nkeys].keyblock = NULL;
+  release_key_array (keys);
+  return NULL;
+}
+
+
 /* Caller must sync */
 static void
 reset_trust_records(void)
@@ -1749,14 +2809,20 @@ validate_keys (int interactive)
   int depth;
   int ot_unknown, ot_undefined, ot_never, ot_marginal, ot_full, ot_ultimate;
   KeyHashTable stored,used,full_trust;
+  struct wot_graph *graph = NULL;
+  char *graph_fname = NULL;
+  byte graph_digest[20];
   u32 start_time, next_expire;
 
   /* Make sure we have all sigs cached.  TODO: This is going to
      require some architectual re-thinking, as it is agonizingly slow.
      Perhaps combine this with reset_trust_records(), or only check
      the caches on keys that are actually involved in the web of
-     trust. */
-  keydb_rebuild_caches(0);
+     trust.  With the certification graph we only check the
+     signatures of keys reachable from the ultimately trusted keys,
+     so we skip this step. */
+  if (!opt.tdb_cert_graph)
+    keydb_rebuild_caches(0);
 
   start_time = make_timestamp ();
   next_expire = 0xffffffff; /* set next expire to the year 2106 */
@@ -1765,19 +2831,76 @@ validate_keys (int interactive)
   full_trust = new_key_hash_table ();
 
   kdb = keydb_new ();
-  reset_trust_records();
 
   /* Fixme: Instead of always building a UTK list, we could just build it
    * here when needed */
   if (!utk_list)
     {
+      reset_trust_records();
       if (!opt.quiet)
         log_info (_("no ultimately trusted keys found\n"));
       goto leave;
     }
 
-  /* mark all UTKs as used and fully_trusted and set validity to
-     ultimate */
+  /* mark all UTKs as used and fully_trusted */
+  for (k=utk_list; k; k = k->next)
+    {
+      KBNODE keyblock;
+
+      keyblock = get_pubkeyblock (k->kid);
+      if (keyblock)
+        {
+          mark_keyblock_seen (used, keyblock);
+          mark_keyblock_seen (stored, keyblock);
+          mark_keyblock_seen (full_trust, keyblock);
+          release_kbnode (keyblock);
+        }
+    }
+
+  if (opt.tdb_cert_graph)
+    {
+      graph_fname = tdbio_get_graph_fname ();
+      wot_params_digest (graph_digest);
+
+      /* When asking for ownertrust values all keys are looked at.  */
+      if (!interactive)
+        {
+          ulong created;
+
+          read_trust_options (NULL, &created, NULL, NULL, NULL, NULL, NULL);
+          graph = read_wot_graph (graph_fname, graph_digest,
+                                  created, start_time);
+          if (graph && update_wot_graph (kdb, graph, full_trust))
+            {
+              rc = G10ERR_GENERAL;
+              goto leave;
+            }
+        }
+      if (!graph)
+        {
+          struct stat statbuf;
+          off_t fileoff = 0;
+
+          /* Changes noted after this point are copied to the new
+             file.  */
+          if (!stat (graph_fname, &statbuf))
+            fileoff = statbuf.st_size;
+          graph = build_wot_graph (kdb, full_trust);
+          if (!graph)
+            {
+              rc = G10ERR_GENERAL;
+              goto leave;
+            }
+          graph->fileoff = fileoff;
+        }
+    }
+
+  if (graph && graph->naffected < graph->count)
+    reset_wot_trust_records (graph);
+  else
+    reset_trust_records();
+
+  /* set validity of all UTKs to ultimate */
   for (k=utk_list; k; k = k->next)
     {
       KBNODE keyblock;
@@ -1790,9 +2913,6 @@ validate_keys (int interactive)
                        " trusted key %s not found\n"), keystr(k->kid));
           continue;
         }
-      mark_keyblock_seen (used, keyblock);
-      mark_keyblock_seen (stored, keyblock);
-      mark_keyblock_seen (full_trust, keyblock);
       pk = keyblock->pkt->pkt.public_key;
       for (node=keyblock; node; node = node->next)
         {
@@ -1876,8 +2996,12 @@ validate_keys (int interactive)
         }
 
       /* Find all keys which are signed by a key in kdlist */
-      keys = validate_key_list (kdb, full_trust, klist,
-				start_time, &next_expire);
+      if (graph)
+        keys = validate_key_list_graph (kdb, graph, depth, full_trust,
+                                        klist, start_time);
+      else
+        keys = validate_key_list (kdb, full_trust, klist,
+                                  start_time, &next_expire);
       if (!keys)
         {
           log_error ("validate_key_list failed\n");
@@ -1939,6 +3063,8 @@ validate_keys (int interactive)
 				   pkt.public_key->trust_regexp);
 		      k->next = klist;
 		      klist = k;
+		      if (graph)
+			wot_store_klist_item (graph, k, depth + 1);
 		      break;
 		    }
 		}
@@ -1946,10 +3072,21 @@ validate_keys (int interactive)
 	}
       release_key_array (keys);
       keys = NULL;
+      /* Add the keys not validated again.  */
+      if (graph)
+        klist = wot_add_kept_klist_items (graph, depth + 1, used, klist);
       if (!klist)
         break; /* no need to dive in deeper */
     }
 
+  if (graph)
+    {
+      u32 graph_expire = wot_next_expire (graph);
+
+      if (graph_expire < next_expire)
+        next_expire = graph_expire;
+    }
+
  leave:
   keydb_release (kdb);
   release_key_array (keys);
@@ -1977,7 +3114,26 @@ validate_keys (int interactive)
 
       do_sync ();
       pending_check_trustdb = 0;
+
+      if (graph)
+        {
+          ulong created;
+
+          read_trust_options (NULL, &created, NULL, NULL, NULL, NULL, NULL);
+          write_wot_graph (graph, graph_fname, graph_digest,
+                           created, next_expire);
+        }
+    }
+
+  /* A graph not matching the trustdb must not be used.  */
+  if (!graph || rc || quit)
+    {
+      if (!graph_fname)
+        graph_fname = tdbio_get_graph_fname ();
+      gnupg_remove (graph_fname);
     }
+  release_wot_graph (graph);
+  xfree (graph_fname);
 
   return rc;
 }
@@ -83,6 +83,7 @@ void update_ownertrust (PKT_public_key *pk, unsigned int new_trust);
 int clear_ownertrusts (PKT_public_key *pk);
 
 void revalidation_mark (void);
+void mark_key_changed (PKT_public_key *pk);
 void check_trustdb_stale (void);
 void check_or_update_trustdb (void);
 
@@ -114,6 +115,7 @@ void tdb_check_trustdb_stale (void);
 void sync_trustdb( void );
 
 void tdb_revalidation_mark (void);
+void tdb_mark_key_changed (u32 *kid);
 int trustdb_pending_check(void);
 void tdb_check_or_update (void);
 
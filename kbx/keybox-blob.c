@@ -46,7 +46,8 @@
           bit 0 - RFU
           bit 1 - Is being or has been used for OpenPGP blobs
    - b4   Magic 'KBXf'
-   - u32  RFU
+   - u32  Generation; incremented with each update which changes the
+          offsets of blobs.  Used to validate the index file.
    - u32  file_created_at
    - u32  last_maintenance_run
    - u32  RFU
@@ -206,6 +207,8 @@ struct keyboxblob {
   byte *blob;
   size_t bloblen;
   off_t fileoffset;
+  int image_is_mapped;  /* BLOB points into a file mapping and is not
+                           owned by this object.  */
 
   /* stuff used only by keybox_create_blob */
   unsigned char *serialbuf;
@@ -994,6 +997,45 @@ _keybox_new_blob (KEYBOXBLOB *r_blob,
 }
 
 
+/* Make BLOB point to the memory mapped IMAGE of length IMAGELEN
+   which has been read from the file offset OFF.  The image is not
+   copied and BLOB must not be used after the mapping has been
+   released.  BLOB needs to be a blob object created by
+   _keybox_new_blob with a NULL image.  */
+void
+_keybox_set_mapped_blob_image (KEYBOXBLOB blob, const unsigned char *image,
+                               size_t imagelen, off_t off)
+{
+  assert (!blob->blob || blob->image_is_mapped);
+
+  blob->blob = (byte*)image;
+  blob->bloblen = imagelen;
+  blob->fileoffset = off;
+  blob->image_is_mapped = 1;
+}
+
+
+/* Create a new blob object with a copy of the image of BLOB and
+   store it at R_BLOB.  This is used to detach a blob from a file
+   mapping.  */
+int
+_keybox_copy_blob (KEYBOXBLOB *r_blob, KEYBOXBLOB blob)
+{
+  unsigned char *image;
+  int rc;
+
+  *r_blob = NULL;
+  image = xtrymalloc (blob->bloblen);
+  if (!image)
+    return gpg_error_from_syserror ();
+  memcpy (image, blob->blob, blob->bloblen);
+  rc = _keybox_new_blob (r_blob, image, blob->bloblen, blob->fileoffset);
+  if (rc)
+    xfree (image);
+  return rc;
+}
+
+
 void
 _keybox_release_blob (KEYBOXBLOB blob)
 {
@@ -1007,7 +1049,8 @@ _keybox_release_blob (KEYBOXBLOB blob)
     xfree (blob->uids[i].name);
   xfree (blob->uids );
   xfree (blob->sigs );
-  xfree (blob->blob );
+  if (!blob->image_is_mapped)
+    xfree (blob->blob );
   xfree (blob );
 }
 
@@ -1041,6 +1084,9 @@ _keybox_update_header_blob (KEYBOXBLOB blob, int for_openpgp)
       blob->blob[20+2] = (val >>  8);
       blob->blob[20+3] = (val      );
 
+      /* The offsets of the blobs change, thus start a new generation.  */
+      _keybox_bump_generation (blob->blob, blob->bloblen);
+
       if (for_openpgp)
         blob->blob[7] |= 0x02;  /* OpenPGP data may be available.  */
     }
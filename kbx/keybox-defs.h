@@ -32,6 +32,7 @@
         map_assuan_err_with_source (GPG_ERR_SOURCE_DEFAULT, (a))
 
 #include <sys/types.h> /* off_t */
+#include <time.h>      /* time_t */
 
 /* We include the type defintions from jnlib instead of defining our
    owns here.  This will not allow us build KBX in a standalone way
@@ -90,6 +91,27 @@ struct keybox_handle {
   CONST_KB_NAME kb;
   int secret;             /* this is for a secret keybox */
   FILE *fp;
+  /* If the file has been mapped into memory for searching, ADDR and
+     LEN describe the mapping and POS is the offset of the next blob
+     to read; POS replaces the file position of FP while mapped.  BLOB
+     is a blob object owned by this handle which is reused for every
+     blob read from the mapping.  SIZE and MTIME are used to detect
+     modifications of the file.  */
+  struct {
+    unsigned char *addr;
+    size_t len;
+    size_t pos;
+    KEYBOXBLOB blob;
+    off_t size;
+    time_t mtime;
+  } map;
+  /* The index file and its number of slots.  DISABLED is set if no
+     usable index is available for this handle.  */
+  struct {
+    FILE *fp;
+    u32 nslots;
+    int disabled;
+  } index;
   int eof;
   int error;
   int ephemeral;
@@ -103,6 +125,15 @@ struct keybox_handle {
 };
 
 
+/* The state of a keybox file as recorded in an index.  */
+struct keybox_file_state_s
+{
+  int valid;       /* The other fields are valid.  */
+  u32 generation;  /* The generation counter from the header blob.  */
+  off_t size;      /* The size of the file.  */
+};
+
+
 /* Openpgp helper structures. */
 struct _keybox_openpgp_key_info
 {
@@ -166,6 +197,10 @@ int _keybox_create_x509_blob (KEYBOXBLOB *r_blob, ksba_cert_t cert,
 int  _keybox_new_blob (KEYBOXBLOB *r_blob,
                        unsigned char *image, size_t imagelen,
                        off_t off);
+void _keybox_set_mapped_blob_image (KEYBOXBLOB blob,
+                                    const unsigned char *image,
+                                    size_t imagelen, off_t off);
+int  _keybox_copy_blob (KEYBOXBLOB *r_blob, KEYBOXBLOB blob);
 void _keybox_release_blob (KEYBOXBLOB blob);
 const unsigned char *_keybox_get_blob_image (KEYBOXBLOB blob, size_t *n);
 off_t _keybox_get_blob_fileoffset (KEYBOXBLOB blob);
@@ -182,8 +217,30 @@ void _keybox_destroy_openpgp_info (keybox_openpgp_info_t info);
 int _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp);
 int _keybox_read_blob2 (KEYBOXBLOB *r_blob, FILE *fp, int *skipped_deleted);
 int _keybox_write_blob (KEYBOXBLOB blob, FILE *fp);
+int _keybox_map_file (KEYBOX_HANDLE hd);
+gpg_error_t _keybox_unmap_file (KEYBOX_HANDLE hd);
+int _keybox_map_is_stale (KEYBOX_HANDLE hd);
+int _keybox_read_mapped_blob (KEYBOX_HANDLE hd, KEYBOXBLOB *r_blob);
+
+/*-- keybox-index.c --*/
+void _keybox_get_file_state (const char *fname,
+                             struct keybox_file_state_s *r_state);
+void _keybox_bump_generation (unsigned char *image, size_t imagelen);
+gpg_error_t _keybox_index_build (const char *fname);
+void _keybox_index_update (const char *fname,
+                           const struct keybox_file_state_s *oldstate,
+                           off_t off, KEYBOXBLOB blob);
+void _keybox_index_remove (const char *fname);
+void _keybox_index_close (KEYBOX_HANDLE hd);
+int _keybox_index_mode_p (int mode);
+gpg_error_t _keybox_index_lookup (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc,
+                                  size_t ndesc,
+                                  off_t **r_offsets, size_t *r_noffsets);
 
 /*-- keybox-search.c --*/
+#ifdef KEYBOX_WITH_X509
+int _keybox_get_x509_keygrip (KEYBOXBLOB blob, unsigned char *grip);
+#endif /*KEYBOX_WITH_X509*/
 gpg_err_code_t _keybox_get_flag_location (const unsigned char *buffer,
                                           size_t length,
                                           int what,
@@ -163,6 +163,8 @@ dump_header_blob (const byte *buffer, size_t length, FILE *fp)
   if ( memcmp (buffer+8, "KBXf", 4))
     fprintf (fp, "[Error: invalid magic number]\n");
 
+  n = get32 (buffer+12);
+  fprintf( fp, "generation: %lu\n", n );
   n = get32 (buffer+16);
   fprintf( fp, "created-at: %lu\n", n );
   n = get32 (buffer+20);
@@ -23,6 +23,11 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "keybox-defs.h"
 
@@ -125,6 +130,146 @@ _keybox_read_blob (KEYBOXBLOB *r_blob, FILE *fp)
 }
 
 
+/* Try to map the file opened at HD->FP into memory so that
+   _keybox_read_mapped_blob can be used instead of reading the blobs
+   through stdio.  The current position of FP is used as start
+   position.  Returns true if the file is mapped.  On failure nothing
+   is changed and the caller continues to use stdio.  */
+int
+_keybox_map_file (KEYBOX_HANDLE hd)
+{
+#ifdef HAVE_MMAP
+  struct stat st;
+  void *addr;
+  off_t off;
+
+  if (hd->map.addr)
+    return 1;
+  if (!hd->fp)
+    return 0;
+
+  if (fstat (fileno (hd->fp), &st) || !S_ISREG (st.st_mode))
+    return 0;
+  if (st.st_size <= 0 || (size_t)st.st_size != st.st_size)
+    return 0; /* Empty or too large for our address space.  */
+  off = ftello (hd->fp);
+  if (off == (off_t)-1 || off > st.st_size)
+    return 0;
+
+  if (!hd->map.blob && _keybox_new_blob (&hd->map.blob, NULL, 0, 0))
+    return 0;
+
+  addr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fileno (hd->fp), 0);
+  if (addr == MAP_FAILED)
+    return 0;
+
+  hd->map.addr = addr;
+  hd->map.len = st.st_size;
+  hd->map.pos = off;
+  hd->map.size = st.st_size;
+  hd->map.mtime = st.st_mtime;
+  return 1;
+#else /*!HAVE_MMAP*/
+  (void)hd;
+  return 0;
+#endif /*!HAVE_MMAP*/
+}
+
+
+/* Release the file mapping of HD.  If the file is still open, its
+   position is set to the position of the next blob in the mapping,
+   so that a search can continue using stdio.  */
+gpg_error_t
+_keybox_unmap_file (KEYBOX_HANDLE hd)
+{
+  gpg_error_t err = 0;
+
+#ifdef HAVE_MMAP
+  if (hd->map.addr)
+    {
+      if (hd->fp && fseeko (hd->fp, hd->map.pos, SEEK_SET))
+        err = gpg_error_from_syserror ();
+      munmap (hd->map.addr, hd->map.len);
+      hd->map.addr = NULL;
+      hd->map.len = 0;
+      hd->map.pos = 0;
+    }
+#endif /*HAVE_MMAP*/
+  _keybox_release_blob (hd->map.blob);
+  hd->map.blob = NULL;
+  return err;
+}
+
+
+/* Return true if the file mapped by HD has been modified since it
+   was mapped.  Updates done through the keybox functions release all
+   mappings; this is for changes done by other processes.  */
+int
+_keybox_map_is_stale (KEYBOX_HANDLE hd)
+{
+  struct stat st;
+
+  if (!hd->map.addr || !hd->fp)
+    return 0;
+  if (fstat (fileno (hd->fp), &st))
+    return 1;
+  return (st.st_size != hd->map.size || st.st_mtime != hd->map.mtime);
+}
+
+
+/* Same as _keybox_read_blob but read the blob from the memory
+   mapping of HD.  The returned blob is owned by HD and points
+   directly into the mapping; it is only valid until the next call
+   of this function or until the mapping is released.  Use
+   _keybox_copy_blob to keep it.  */
+int
+_keybox_read_mapped_blob (KEYBOX_HANDLE hd, KEYBOXBLOB *r_blob)
+{
+  const unsigned char *image;
+  size_t imagelen, avail;
+  off_t off;
+
+ again:
+  *r_blob = NULL;
+  off = hd->map.pos;
+  avail = hd->map.len - hd->map.pos;
+  if (!avail)
+    return -1; /* eof */
+  if (avail < 5)
+    {
+      hd->map.pos = hd->map.len;
+      return gpg_error (GPG_ERR_TOO_SHORT);
+    }
+
+  image = hd->map.addr + hd->map.pos;
+  imagelen = ((size_t)image[0] << 24) | (image[1] << 16)
+              | (image[2] << 8) | image[3];
+  if (imagelen < 5)
+    return gpg_error (GPG_ERR_TOO_SHORT);
+
+  if (!image[4] || imagelen > IMAGELEN_LIMIT)
+    {
+      /* Skip empty blobs and, like the stdio version, move behind
+         too large records so that the caller may ignore them.  */
+      hd->map.pos += imagelen > avail? avail : imagelen;
+      if (!image[4])
+        goto again;
+      return gpg_error (GPG_ERR_TOO_LARGE);
+    }
+
+  if (imagelen > avail)
+    {
+      hd->map.pos = hd->map.len;
+      return gpg_error (GPG_ERR_TOO_SHORT);
+    }
+
+  hd->map.pos += imagelen;
+  _keybox_set_mapped_blob_image (hd->map.blob, image, imagelen, off);
+  *r_blob = hd->map.blob;
+  return 0;
+}
+
+
 /* Write the block to the current file position */
 int
 _keybox_write_blob (KEYBOXBLOB blob, FILE *fp)
@@ -0,0 +1,808 @@
+/* keybox-index.c - Index files for keybox lookups
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+* The keybox index format
+
+   To avoid a linear scan of the keybox for lookups by fingerprint,
+   keyid or keygrip, an index file may be stored next to the keybox.
+   Its name is the name of the keybox with ".idx" appended.  The index
+   is a hash table mapping a 32 bit tag to the offsets of the blobs
+   carrying a key with that tag.  All integers are stored in network
+   byte order.
+
+   The tag of a key is taken from bytes 16 to 19 of its fingerprint as
+   stored in the blob.  Because the keybox matches keyids against
+   bytes 12 to 19 of the stored fingerprint, this single tag serves
+   lookups by fingerprint, long keyid and short keyid.  For X.509
+   blobs the first 4 bytes of the keygrip are used as a second tag.
+   The index only yields candidates; the search code always checks
+   the blob itself.
+
+** The header
+
+   - b4   Magic 'KBXi'
+   - byte Version number (1)
+   - b3   RFU
+   - u32  Generation of the keybox this index has been built for
+   - u32  High 32 bits of the size of the keybox
+   - u32  Low 32 bits of the size of the keybox
+   - u32  Number of slots (a power of 2)
+   - u32  Number of used slots
+   - u32  RFU
+
+** The slots
+
+   - u32  Tag
+   - byte Type (0 = unused slot, 1 = key, 2 = X.509 keygrip)
+   - b3   RFU
+   - u32  High 32 bits of the blob offset
+   - u32  Low 32 bits of the blob offset
+
+   Slots are located by linear probing starting at the slot given by
+   the tag modulo the number of slots.  The index is only valid if the
+   generation stored in the keybox header blob and the size of the
+   keybox match the values in the index header; every update of a
+   keybox increments the generation.
+*/
+
+#include <config.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "keybox-defs.h"
+#include "../common/sysutils.h"
+
+#define INDEX_VERSION     1
+#define INDEX_HEADER_LEN  32
+#define INDEX_SLOT_LEN    16
+#define INDEX_TYPE_KEY    1
+#define INDEX_TYPE_GRIP   2
+
+/* Number of slots read with one fread while probing.  */
+#define PROBE_CHUNK       32
+
+
+/* An entry of the index in its unpacked form.  */
+struct index_entry_s
+{
+  u32 tag;
+  int type;
+  off_t off;
+};
+
+/* A growable array of index entries.  */
+struct index_entries_s
+{
+  struct index_entry_s *items;
+  size_t count;
+  size_t size;
+};
+
+
+#if !defined(HAVE_FSEEKO) && !defined(fseeko)
+# define fseeko(a,b,c) fseek ((a), (long)(b), (c))
+#endif
+#if !defined(HAVE_FTELLO) && !defined(ftello)
+# define ftello(a) ((off_t)ftell ((a)))
+#endif
+
+
+static inline u32
+get16 (const unsigned char *buffer)
+{
+  return ((buffer[0] << 8) | buffer[1]);
+}
+
+static inline u32
+get32 (const unsigned char *buffer)
+{
+  return (((u32)buffer[0] << 24) | ((u32)buffer[1] << 16)
+          | ((u32)buffer[2] << 8) | buffer[3]);
+}
+
+static inline void
+put32 (unsigned char *buffer, u32 val)
+{
+  buffer[0] = val >> 24;
+  buffer[1] = val >> 16;
+  buffer[2] = val >>  8;
+  buffer[3] = val;
+}
+
+static inline off_t
+get_off (const unsigned char *buffer)
+{
+  off_t off;
+
+  /* Shift in two steps to cope with a 32 bit off_t.  */
+  off = get32 (buffer);
+  off <<= 16;
+  off <<= 16;
+  return off | get32 (buffer+4);
+}
+
+static inline void
+put_off (unsigned char *buffer, off_t off)
+{
+  put32 (buffer, (u32)((off >> 16) >> 16));
+  put32 (buffer+4, (u32)off);
+}
+
+
+/* Return a malloced string with the name of the index file for the
+   keybox FNAME.  */
+static char *
+make_index_fname (const char *fname)
+{
+  char *idxfname;
+
+  idxfname = xtrymalloc (strlen (fname) + 4 + 1);
+  if (idxfname)
+    strcpy (stpcpy (idxfname, fname), EXTSEP_S "idx");
+  return idxfname;
+}
+
+
+/* Store the generation and size of the keybox FNAME at R_STATE.  If
+   the file does not exist or has no header blob, R_STATE is marked
+   as not valid.  */
+void
+_keybox_get_file_state (const char *fname, struct keybox_file_state_s *r_state)
+{
+  FILE *fp;
+  struct stat st;
+  unsigned char header[32];
+
+  memset (r_state, 0, sizeof *r_state);
+  fp = fopen (fname, "rb");
+  if (!fp)
+    return;
+  if (!fstat (fileno (fp), &st)
+      && fread (header, sizeof header, 1, fp) == 1
+      && header[4] == KEYBOX_BLOBTYPE_HEADER)
+    {
+      r_state->generation = get32 (header+12);
+      r_state->size = st.st_size;
+      r_state->valid = 1;
+    }
+  fclose (fp);
+}
+
+
+/* Increment the generation counter in the header blob IMAGE of
+   length IMAGELEN.  Does nothing if IMAGE is not a header blob.  */
+void
+_keybox_bump_generation (unsigned char *image, size_t imagelen)
+{
+  if (imagelen >= 32 && image[4] == KEYBOX_BLOBTYPE_HEADER)
+    put32 (image+12, get32 (image+12) + 1);
+}
+
+
+/* Remove the index file of the keybox FNAME.  */
+void
+_keybox_index_remove (const char *fname)
+{
+  char *idxfname;
+
+  idxfname = make_index_fname (fname);
+  if (idxfname)
+    {
+      gnupg_remove (idxfname);
+      xfree (idxfname);
+    }
+}
+
+
+
+static gpg_error_t
+add_entry (struct index_entries_s *entries, u32 tag, int type, off_t off)
+{
+  if (entries->count == entries->size)
+    {
+      struct index_entry_s *tmp;
+      size_t newsize = entries->size? 2 * entries->size : 1024;
+
+      tmp = xtryrealloc (entries->items, newsize * sizeof *tmp);
+      if (!tmp)
+        return gpg_error_from_syserror ();
+      entries->items = tmp;
+      entries->size = newsize;
+    }
+  entries->items[entries->count].tag = tag;
+  entries->items[entries->count].type = type;
+  entries->items[entries->count].off = off;
+  entries->count++;
+  return 0;
+}
+
+
+/* Add the entries for the keys of BLOB at OFF to ENTRIES.  */
+static gpg_error_t
+add_blob_entries (struct index_entries_s *entries, KEYBOXBLOB blob, off_t off)
+{
+  gpg_error_t err;
+  const unsigned char *buffer;
+  size_t length, nkeys, keyinfolen, idx;
+  int type;
+
+  buffer = _keybox_get_blob_image (blob, &length);
+  if (length < 40)
+    return 0; /* Blob too short - ignore.  */
+  type = buffer[4];
+  if (type != KEYBOX_BLOBTYPE_PGP && type != KEYBOX_BLOBTYPE_X509)
+    return 0;
+
+  nkeys = get16 (buffer + 16);
+  keyinfolen = get16 (buffer + 18);
+  if (keyinfolen < 28 || 20 + keyinfolen*nkeys > length)
+    return 0; /* Invalid blob - the search won't match it either.  */
+
+  for (idx=0; idx < nkeys; idx++)
+    {
+      err = add_entry (entries, get32 (buffer + 20 + idx*keyinfolen + 16),
+                       INDEX_TYPE_KEY, off);
+      if (err)
+        return err;
+    }
+
+#ifdef KEYBOX_WITH_X509
+  if (type == KEYBOX_BLOBTYPE_X509)
+    {
+      unsigned char grip[20];
+
+      if (!_keybox_get_x509_keygrip (blob, grip))
+        {
+          err = add_entry (entries, get32 (grip), INDEX_TYPE_GRIP, off);
+          if (err)
+            return err;
+        }
+    }
+#endif /*KEYBOX_WITH_X509*/
+
+  return 0;
+}
+
+
+/* Write ENTRIES as new index for the keybox FNAME in the given
+   STATE.  The file is written to a temporary file and then renamed
+   so that readers always see a complete index.  */
+static gpg_error_t
+write_index (const char *fname, const struct keybox_file_state_s *state,
+             struct index_entries_s *entries)
+{
+  gpg_error_t err = 0;
+  char *idxfname, *tmpfname = NULL;
+  unsigned char *table = NULL;
+  unsigned char header[INDEX_HEADER_LEN];
+  u32 nslots, mask, slot;
+  size_t idx;
+  FILE *fp = NULL;
+
+  /* Keep the load factor below one half.  */
+  for (nslots = 16; nslots < 2 * entries->count; nslots <<= 1)
+    if (nslots >= 0x40000000)
+      return gpg_error (GPG_ERR_TOO_LARGE);
+  mask = nslots - 1;
+
+  idxfname = make_index_fname (fname);
+  if (!idxfname)
+    return gpg_error_from_syserror ();
+  tmpfname = xtrymalloc (strlen (idxfname) + 30);
+  if (!tmpfname)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  snprintf (tmpfname, strlen (idxfname) + 30, "%s-%lu" EXTSEP_S "tmp",
+            idxfname, (unsigned long)getpid ());
+
+  table = xtrycalloc (nslots, INDEX_SLOT_LEN);
+  if (!table)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  for (idx=0; idx < entries->count; idx++)
+    {
+      struct index_entry_s *e = entries->items + idx;
+      unsigned char *p;
+
+      for (slot = e->tag & mask; table[slot*INDEX_SLOT_LEN+4];
+           slot = (slot + 1) & mask)
+        ;
+      p = table + slot*INDEX_SLOT_LEN;
+      put32 (p, e->tag);
+      p[4] = e->type;
+      put_off (p+8, e->off);
+    }
+
+  memset (header, 0, sizeof header);
+  memcpy (header, "KBXi", 4);
+  header[4] = INDEX_VERSION;
+  put32 (header+8, state->generation);
+  put_off (header+12, state->size);
+  put32 (header+20, nslots);
+  put32 (header+24, entries->count);
+
+  fp = fopen (tmpfname, "wb");
+  if (!fp)
+    {
+      err = gpg_error_from_syserror ();
+      goto leave;
+    }
+  if (fwrite (header, sizeof header, 1, fp) != 1
+      || fwrite (table, INDEX_SLOT_LEN, nslots, fp) != nslots)
+    {
+      err = gpg_error_from_syserror ();
+      fclose (fp);
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+  if (fclose (fp))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+      goto leave;
+    }
+
+#ifdef HAVE_DOSISH_SYSTEM
+  gnupg_remove (idxfname);
+#endif
+  if (rename (tmpfname, idxfname))
+    {
+      err = gpg_error_from_syserror ();
+      gnupg_remove (tmpfname);
+    }
+
+ leave:
+  xfree (table);
+  xfree (tmpfname);
+  xfree (idxfname);
+  return err;
+}
+
+
+/* Open the index of the keybox FNAME and check that it belongs to the
+   keybox in STATE.  On success the file pointer is positioned at the
+   first slot and the number of slots is stored at R_NSLOTS.  */
+static FILE *
+open_index (const char *fname, const struct keybox_file_state_s *state,
+            u32 *r_nslots)
+{
+  char *idxfname;
+  FILE *fp;
+  unsigned char header[INDEX_HEADER_LEN];
+  u32 nslots;
+
+  idxfname = make_index_fname (fname);
+  if (!idxfname)
+    return NULL;
+  fp = fopen (idxfname, "rb");
+  xfree (idxfname);
+  if (!fp)
+    return NULL;
+
+  if (fread (header, sizeof header, 1, fp) != 1
+      || memcmp (header, "KBXi", 4)
+      || header[4] != INDEX_VERSION
+      || !state->valid
+      || get32 (header+8) != state->generation
+      || get_off (header+12) != state->size)
+    {
+      fclose (fp);
+      return NULL;
+    }
+  nslots = get32 (header+20);
+  if (nslots < 16 || (nslots & (nslots - 1)))
+    {
+      fclose (fp);
+      return NULL;
+    }
+
+  *r_nslots = nslots;
+  return fp;
+}
+
+
+/* Read all used slots of the index FP with NSLOTS slots into
+   ENTRIES.  */
+static gpg_error_t
+read_entries (FILE *fp, u32 nslots, struct index_entries_s *entries)
+{
+  gpg_error_t err;
+  unsigned char buffer[PROBE_CHUNK*INDEX_SLOT_LEN];
+  const unsigned char *p;
+  u32 slot, n, i;
+
+  for (slot = 0; slot < nslots; slot += n)
+    {
+      n = nslots - slot < PROBE_CHUNK? nslots - slot : PROBE_CHUNK;
+      if (fread (buffer, INDEX_SLOT_LEN, n, fp) != n)
+        return ferror (fp)? gpg_error_from_syserror ()
+                          : gpg_error (GPG_ERR_TOO_SHORT);
+      for (i=0, p = buffer; i < n; i++, p += INDEX_SLOT_LEN)
+        if (p[4])
+          {
+            err = add_entry (entries, get32 (p), p[4], get_off (p+8));
+            if (err)
+              return err;
+          }
+    }
+  return 0;
+}
+
+
+/* Create or replace the index of the keybox FNAME by scanning the
+   entire keybox.  */
+gpg_error_t
+_keybox_index_build (const char *fname)
+{
+  gpg_error_t err;
+  struct keybox_file_state_s state;
+  struct index_entries_s entries;
+  KEYBOXBLOB blob = NULL;
+  FILE *fp;
+  struct stat st;
+  unsigned char header[32];
+  int rc;
+
+#ifdef USE_ONLY_8DOT3
+  (void)fname;
+  return gpg_error (GPG_ERR_NOT_SUPPORTED);
+#endif
+
+  memset (&entries, 0, sizeof entries);
+  fp = fopen (fname, "rb");
+  if (!fp)
+    return gpg_error_from_syserror ();
+
+  /* Take the state from the very stream we are indexing.  */
+  memset (&state, 0, sizeof state);
+  if (fstat (fileno (fp), &st)
+      || fread (header, sizeof header, 1, fp) != 1
+      || header[4] != KEYBOX_BLOBTYPE_HEADER)
+    {
+      fclose (fp);
+      return gpg_error (GPG_ERR_NO_DATA);
+    }
+  state.generation = get32 (header+12);
+  state.size = st.st_size;
+  state.valid = 1;
+  rewind (fp);
+
+  err = 0;
+  for (;;)
+    {
+      rc = _keybox_read_blob (&blob, fp);
+      if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
+          && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
+        continue; /* The search skips them as well.  */
+      if (rc)
+        break;
+      err = add_blob_entries (&entries, blob,
+                              _keybox_get_blob_fileoffset (blob));
+      _keybox_release_blob (blob);
+      blob = NULL;
+      if (err)
+        break;
+    }
+  fclose (fp);
+  if (!err && rc != -1)
+    err = rc;
+  if (!err)
+    err = write_index (fname, &state, &entries);
+
+  xfree (entries.items);
+  return err;
+}
+
+
+/* Update the index of the keybox FNAME after the blob at offset OFF
+   has been replaced by BLOB.  BLOB may be NULL if the blob has been
+   deleted or OFF may be the old end of the file if BLOB has been
+   appended.  All blobs behind OFF are assumed to be moved by the
+   change of the file size.  OLDSTATE is the state of the keybox
+   before the change.  If the index does not match OLDSTATE or on any
+   error the index is removed.  */
+void
+_keybox_index_update (const char *fname,
+                      const struct keybox_file_state_s *oldstate,
+                      off_t off, KEYBOXBLOB blob)
+{
+  gpg_error_t err;
+  struct keybox_file_state_s newstate;
+  struct index_entries_s entries;
+  FILE *fp;
+  u32 nslots;
+  off_t delta;
+  size_t i, j;
+
+  memset (&entries, 0, sizeof entries);
+  fp = open_index (fname, oldstate, &nslots);
+  if (!fp)
+    {
+      /* No index or a stale one which would be useless from now on.  */
+      _keybox_index_remove (fname);
+      return;
+    }
+  err = read_entries (fp, nslots, &entries);
+  fclose (fp);
+  if (err)
+    goto leave;
+
+  _keybox_get_file_state (fname, &newstate);
+  if (!newstate.valid)
+    {
+      err = gpg_error (GPG_ERR_NO_DATA);
+      goto leave;
+    }
+  delta = newstate.size - oldstate->size;
+
+  for (i=j=0; i < entries.count; i++)
+    {
+      if (entries.items[i].off == off)
+        continue;  /* Drop the entries of the replaced blob.  */
+      entries.items[j] = entries.items[i];
+      if (entries.items[j].off > off)
+        entries.items[j].off += delta;
+      j++;
+    }
+  entries.count = j;
+
+  if (blob)
+    err = add_blob_entries (&entries, blob, off);
+  if (!err)
+    err = write_index (fname, &newstate, &entries);
+
+ leave:
+  if (err)
+    _keybox_index_remove (fname);
+  xfree (entries.items);
+}
+
+
+
+/* Open the index for the keybox of HD.  If there is no valid index
+   and the keybox is writable, an index is built.  Returns true if
+   the index can be used.  */
+static int
+open_index_for_handle (KEYBOX_HANDLE hd)
+{
+  struct keybox_file_state_s state;
+  struct stat st;
+  off_t pos;
+  unsigned char header[32];
+
+  if (hd->index.fp)
+    return 1;
+  if (hd->index.disabled || !hd->fp)
+    return 0;
+
+  /* Get the state of the keybox we are actually reading.  */
+  memset (&state, 0, sizeof state);
+  if (fstat (fileno (hd->fp), &st))
+    return 0;
+  state.size = st.st_size;
+  if (hd->map.addr)
+    {
+      if (hd->map.len < 32)
+        return 0;
+      memcpy (header, hd->map.addr, 32);
+    }
+  else
+    {
+      pos = ftello (hd->fp);
+      if (pos == (off_t)-1 || fseeko (hd->fp, 0, SEEK_SET))
+        return 0;
+      if (fread (header, sizeof header, 1, hd->fp) != 1)
+        {
+          fseeko (hd->fp, pos, SEEK_SET);
+          return 0;
+        }
+      if (fseeko (hd->fp, pos, SEEK_SET))
+        return 0;
+    }
+  if (header[4] != KEYBOX_BLOBTYPE_HEADER)
+    {
+      hd->index.disabled = 1;
+      return 0;
+    }
+  state.generation = get32 (header+12);
+  state.valid = 1;
+
+  hd->index.fp = open_index (hd->kb->fname, &state, &hd->index.nslots);
+  if (!hd->index.fp && !access (hd->kb->fname, W_OK)
+      && !_keybox_index_build (hd->kb->fname))
+    hd->index.fp = open_index (hd->kb->fname, &state, &hd->index.nslots);
+  if (!hd->index.fp)
+    {
+      /* Don't try again with this handle.  */
+      hd->index.disabled = 1;
+      return 0;
+    }
+  return 1;
+}
+
+
+/* Close the index file of HD.  */
+void
+_keybox_index_close (KEYBOX_HANDLE hd)
+{
+  if (hd->index.fp)
+    {
+      fclose (hd->index.fp);
+      hd->index.fp = NULL;
+    }
+}
+
+
+static int
+compare_offsets (const void *a, const void *b)
+{
+  off_t oa = *(const off_t *)a;
+  off_t ob = *(const off_t *)b;
+
+  return oa < ob? -1 : oa > ob? 1 : 0;
+}
+
+
+/* Look up the descriptors DESC in the index of HD.  All descriptors
+   must be of a mode supported by _keybox_index_mode_p.  On success a
+   sorted array with the offsets of all candidate blobs is stored at
+   R_OFFSETS and its length at R_NOFFSETS.  If no usable index is
+   available GPG_ERR_NOT_FOUND is returned and the caller needs to
+   fall back to a full scan.  */
+gpg_error_t
+_keybox_index_lookup (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc,
+                      size_t ndesc, off_t **r_offsets, size_t *r_noffsets)
+{
+  gpg_error_t err = 0;
+  unsigned char buffer[PROBE_CHUNK*INDEX_SLOT_LEN];
+  const unsigned char *p;
+  off_t *offsets = NULL;
+  size_t noffsets = 0, size = 0;
+  u32 mask, tag, slot, n, i, nvisited;
+  size_t dn;
+  int type, done;
+
+  *r_offsets = NULL;
+  *r_noffsets = 0;
+
+  if (!open_index_for_handle (hd))
+    return gpg_error (GPG_ERR_NOT_FOUND);
+  mask = hd->index.nslots - 1;
+
+  for (dn=0; dn < ndesc && !err; dn++)
+    {
+      switch (desc[dn].mode)
+        {
+        case KEYDB_SEARCH_MODE_FPR:
+        case KEYDB_SEARCH_MODE_FPR20:
+          tag = get32 (desc[dn].u.fpr + 16);
+          type = INDEX_TYPE_KEY;
+          break;
+        case KEYDB_SEARCH_MODE_SHORT_KID:
+        case KEYDB_SEARCH_MODE_LONG_KID:
+          tag = desc[dn].u.kid[1];
+          type = INDEX_TYPE_KEY;
+          break;
+        case KEYDB_SEARCH_MODE_KEYGRIP:
+          tag = get32 (desc[dn].u.grip);
+          type = INDEX_TYPE_GRIP;
+          break;
+        default:
+          err = gpg_error (GPG_ERR_INV_VALUE);
+          continue;
+        }
+
+      /* Walk the probe sequence until we hit an unused slot.  */
+      slot = tag & mask;
+      for (done = nvisited = 0; !done && !err; nvisited += n)
+        {
+          if (nvisited >= hd->index.nslots)
+            {
+              err = gpg_error (GPG_ERR_INV_KEYRING); /* Table is full.  */
+              break;
+            }
+          n = hd->index.nslots - slot;
+          if (n > PROBE_CHUNK)
+            n = PROBE_CHUNK;
+          if (fseeko (hd->index.fp,
+                      INDEX_HEADER_LEN + (off_t)slot * INDEX_SLOT_LEN,
+                      SEEK_SET)
+              || fread (buffer, INDEX_SLOT_LEN, n, hd->index.fp) != n)
+            {
+              err = gpg_error (GPG_ERR_INV_KEYRING);
+              break;
+            }
+          for (i=0, p = buffer; i < n; i++, p += INDEX_SLOT_LEN)
+            {
+              if (!p[4])
+                {
+                  done = 1;
+                  break;
+                }
+              if (p[4] != type || get32 (p) != tag)
+                continue;
+              if (noffsets == size)
+                {
+                  off_t *tmp;
+
+                  size = size? 2*size : 16;
+                  tmp = xtryrealloc (offsets, size * sizeof *offsets);
+                  if (!tmp)
+                    {
+                      err = gpg_error_from_syserror ();
+                      break;
+                    }
+                  offsets = tmp;
+                }
+              offsets[noffsets++] = get_off (p+8);
+            }
+          slot = (slot + n) & mask;
+        }
+    }
+
+  if (err)
+    {
+      /* Better fall back to a full scan than to miss a key.  */
+      xfree (offsets);
+      _keybox_index_close (hd);
+      hd->index.disabled = 1;
+      return gpg_error (GPG_ERR_NOT_FOUND);
+    }
+
+  if (noffsets > 1)
+    {
+      qsort (offsets, noffsets, sizeof *offsets, compare_offsets);
+      for (i=n=1; i < noffsets; i++)
+        if (offsets[i] != offsets[n-1])
+          offsets[n++] = offsets[i];
+      noffsets = n;
+    }
+
+  *r_offsets = offsets;
+  *r_noffsets = noffsets;
+  return 0;
+}
+
+
+/* Return true if a search using MODE can be answered by the index.  */
+int
+_keybox_index_mode_p (int mode)
+{
+  switch (mode)
+    {
+    case KEYDB_SEARCH_MODE_FPR:
+    case KEYDB_SEARCH_MODE_FPR20:
+    case KEYDB_SEARCH_MODE_SHORT_KID:
+    case KEYDB_SEARCH_MODE_LONG_KID:
+    case KEYDB_SEARCH_MODE_KEYGRIP:
+      return 1;
+    default:
+      return 0;
+    }
+}
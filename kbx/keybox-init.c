@@ -169,6 +169,8 @@ keybox_release (KEYBOX_HANDLE hd)
     }
   _keybox_release_blob (hd->found.blob);
   _keybox_release_blob (hd->saved_found.blob);
+  _keybox_index_close (hd);
+  _keybox_unmap_file (hd);
   if (hd->fp)
     {
       fclose (hd->fp);
@@ -217,6 +219,25 @@ keybox_get_resource_name (KEYBOX_HANDLE hd)
   return hd->kb->fname;
 }
 
+
+/* Store the generation counter of the keybox used by HD at
+   R_GENERATION.  The counter is incremented by each insert, update
+   and delete and thus allows to detect a modification by another
+   process.  Changing the flags of a blob does not touch it.  */
+gpg_error_t
+keybox_get_generation (KEYBOX_HANDLE hd, u32 *r_generation)
+{
+  struct keybox_file_state_s state;
+
+  if (!hd || !hd->kb)
+    return gpg_error (GPG_ERR_INV_HANDLE);
+  _keybox_get_file_state (hd->kb->fname, &state);
+  if (!state.valid)
+    return gpg_error (GPG_ERR_NO_DATA);
+  *r_generation = state.generation;
+  return 0;
+}
+
 int
 keybox_set_ephemeral (KEYBOX_HANDLE hd, int yes)
 {
@@ -242,6 +263,8 @@ _keybox_close_file (KEYBOX_HANDLE hd)
   for (idx=0; idx < hd->kb->handle_table_size; idx++)
     if ((roverhd = hd->kb->handle_table[idx]))
       {
+        _keybox_index_close (roverhd);
+        _keybox_unmap_file (roverhd);
         if (roverhd->fp)
           {
             fclose (roverhd->fp);
@@ -31,6 +31,13 @@
 #include <gcrypt.h>
 
 
+#if !defined(HAVE_FSEEKO) && !defined(fseeko)
+# define fseeko(a,b,c) fseek ((a), (long)(b), (c))
+#endif
+#if !defined(HAVE_FTELLO) && !defined(ftello)
+# define ftello(a) ((off_t)ftell ((a)))
+#endif
+
 #define xtoi_1(p)   (*(p) <= '9'? (*(p)- '0'): \
                      *(p) <= 'F'? (*(p)-'A'+10):(*(p)-'a'+10))
 #define xtoi_2(p)   ((xtoi_1(p) * 16) + xtoi_1((p)+1))
@@ -464,12 +471,13 @@ blob_cmp_mail (KEYBOXBLOB blob, const char *name, size_t namelen, int substr,
 
 
 #ifdef KEYBOX_WITH_X509
-/* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.
+/* Compute the keygrip of the key in the X.509 BLOB and store it at
+   GRIP which must provide space for 20 bytes.  Returns 0 on success.
    We don't have the keygrips as meta data, thus we need to parse the
    certificate. Fixme: We might want to return proper error codes
    instead of failing a search for invalid certificates etc.  */
-static int
-blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
+int
+_keybox_get_x509_keygrip (KEYBOXBLOB blob, unsigned char *grip)
 {
   int rc;
   const unsigned char *buffer;
@@ -479,21 +487,20 @@ blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
   ksba_cert_t cert = NULL;
   ksba_sexp_t p = NULL;
   gcry_sexp_t s_pkey;
-  unsigned char array[20];
   unsigned char *rcp;
   size_t n;
 
   buffer = _keybox_get_blob_image (blob, &length);
   if (length < 40)
-    return 0; /* Too short. */
+    return -1; /* Too short. */
   cert_off = get32 (buffer+8);
   cert_len = get32 (buffer+12);
   if (cert_off+cert_len > length)
-    return 0; /* Too short.  */
+    return -1; /* Too short.  */
 
   rc = ksba_reader_new (&reader);
   if (rc)
-    return 0; /* Problem with ksba. */
+    return -1; /* Problem with ksba. */
   rc = ksba_reader_set_mem (reader, buffer+cert_off, cert_len);
   if (rc)
     goto failed;
@@ -515,7 +522,7 @@ blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
       gcry_sexp_release (s_pkey);
       goto failed;
     }
-  rcp = gcry_pk_get_keygrip (s_pkey, array);
+  rcp = gcry_pk_get_keygrip (s_pkey, grip);
   gcry_sexp_release (s_pkey);
   if (!rcp)
     goto failed; /* Can't calculate keygrip. */
@@ -523,12 +530,24 @@ blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
   xfree (p);
   ksba_cert_release (cert);
   ksba_reader_release (reader);
-  return !memcmp (array, grip, 20);
+  return 0;
  failed:
   xfree (p);
   ksba_cert_release (cert);
   ksba_reader_release (reader);
-  return 0;
+  return -1;
+}
+
+
+/* Return true if the key in BLOB matches the 20 bytes keygrip GRIP.  */
+static int
+blob_x509_has_grip (KEYBOXBLOB blob, const unsigned char *grip)
+{
+  unsigned char array[20];
+
+  if (_keybox_get_x509_keygrip (blob, array))
+    return 0;
+  return !memcmp (array, grip, 20);
 }
 #endif /*KEYBOX_WITH_X509*/
 
@@ -689,6 +708,33 @@ release_sn_array (struct sn_array_s *array, size_t size)
 }
 
 
+/* Return the offset of the next blob to be read by HD.  */
+static off_t
+current_offset (KEYBOX_HANDLE hd)
+{
+  if (hd->map.addr)
+    return hd->map.pos;
+  return ftello (hd->fp);
+}
+
+
+/* Move HD to the blob at offset OFF.  */
+static gpg_error_t
+seek_to_offset (KEYBOX_HANDLE hd, off_t off)
+{
+  if (hd->map.addr)
+    {
+      if (off < 0 || (size_t)off > hd->map.len)
+        return gpg_error (GPG_ERR_INV_KEYRING);
+      hd->map.pos = off;
+      return 0;
+    }
+  if (fseeko (hd->fp, off, SEEK_SET))
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
 /*
 
   The search API
@@ -707,6 +753,8 @@ keybox_search_reset (KEYBOX_HANDLE hd)
       hd->found.blob = NULL;
     }
 
+  _keybox_index_close (hd);
+  _keybox_unmap_file (hd);
   if (hd->fp)
     {
       fclose (hd->fp);
@@ -730,10 +778,12 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
 {
   int rc;
   size_t n;
-  int need_words, any_skip;
+  int need_words, any_skip, use_index;
   KEYBOXBLOB blob = NULL;
   struct sn_array_s *sn_array = NULL;
   int pk_no, uid_no;
+  off_t *candidates = NULL;
+  size_t ncandidates = 0, candidx = 0;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -752,8 +802,11 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
 
   /* figure out what information we need */
   need_words = any_skip = 0;
+  use_index = !!ndesc;
   for (n=0; n < ndesc; n++)
     {
+      if (!_keybox_index_mode_p (desc[n].mode))
+        use_index = 0;
       switch (desc[n].mode)
         {
         case KEYDB_SEARCH_MODE_WORDS:
@@ -787,6 +840,20 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
           xfree (sn_array);
           return hd->error;
         }
+      /* Scan the file directly in memory if possible.  */
+      _keybox_map_file (hd);
+    }
+  else if (_keybox_map_is_stale (hd))
+    {
+      /* The file has been modified by another process; continue
+         with stdio at the current position.  */
+      rc = _keybox_unmap_file (hd);
+      if (rc)
+        {
+          hd->error = rc;
+          xfree (sn_array);
+          return hd->error;
+        }
     }
 
   /* Kludge: We need to convert an SN given as hexstring to its binary
@@ -850,14 +917,40 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
     }
 
 
+  /* If all descriptors can be answered by the index we only need to
+     look at the candidate blobs.  */
+  if (use_index
+      && _keybox_index_lookup (hd, desc, ndesc, &candidates, &ncandidates))
+    use_index = 0;
+
   pk_no = uid_no = 0;
   for (;;)
     {
       unsigned int blobflags;
       int blobtype;
 
-      _keybox_release_blob (blob); blob = NULL;
-      rc = _keybox_read_blob (&blob, hd->fp);
+      if (blob != hd->map.blob)
+        _keybox_release_blob (blob);
+      blob = NULL;
+      if (use_index)
+        {
+          off_t pos = current_offset (hd);
+
+          while (candidx < ncandidates && candidates[candidx] < pos)
+            candidx++;
+          if (candidx == ncandidates)
+            {
+              rc = -1; /* No more candidates.  */
+              break;
+            }
+          rc = seek_to_offset (hd, candidates[candidx++]);
+          if (rc)
+            break;
+        }
+      if (hd->map.addr)
+        rc = _keybox_read_mapped_blob (hd, &blob);
+      else
+        rc = _keybox_read_blob (&blob, hd->fp);
       if (gpg_err_code (rc) == GPG_ERR_TOO_LARGE
           && gpg_err_source (rc) == GPG_ERR_SOURCE_KEYBOX)
         {
@@ -975,7 +1068,20 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
         break; /* got it */
     }
 
-  if (!rc)
+  if (!rc && blob == hd->map.blob)
+    {
+      /* The found blob must survive the mapping, thus we need a copy
+         of it.  This is the only allocation done in mapped mode.  */
+      rc = _keybox_copy_blob (&hd->found.blob, blob);
+      if (rc)
+        hd->error = rc;
+      else
+        {
+          hd->found.pk_no = pk_no;
+          hd->found.uid_no = uid_no;
+        }
+    }
+  else if (!rc)
     {
       hd->found.blob = blob;
       hd->found.pk_no = pk_no;
@@ -983,17 +1089,20 @@ keybox_search (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, size_t ndesc,
     }
   else if (rc == -1)
     {
-      _keybox_release_blob (blob);
+      if (blob != hd->map.blob)
+        _keybox_release_blob (blob);
       hd->eof = 1;
     }
   else
     {
-      _keybox_release_blob (blob);
+      if (blob != hd->map.blob)
+        _keybox_release_blob (blob);
       hd->error = rc;
     }
 
   if (sn_array)
     release_sn_array (sn_array, ndesc);
+  xfree (candidates);
 
   return rc;
 }
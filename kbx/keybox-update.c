@@ -211,6 +211,29 @@ rename_tmp_file (const char *bakfname, const char *tmpfname,
 
 
 
+/* Increment the generation counter in the header blob of the file
+   FP which has been opened for update.  */
+static gpg_error_t
+bump_generation_in_place (FILE *fp)
+{
+  unsigned char header[32];
+
+  if (fseeko (fp, 0, SEEK_SET))
+    return gpg_error_from_syserror ();
+  if (fread (header, sizeof header, 1, fp) != 1)
+    return ferror (fp)? gpg_error_from_syserror () : 0;
+  if (header[4] != KEYBOX_BLOBTYPE_HEADER)
+    return 0;
+  _keybox_bump_generation (header, sizeof header);
+  if (fseeko (fp, 12, SEEK_SET))
+    return gpg_error_from_syserror ();
+  if (fwrite (header+12, 4, 1, fp) != 1)
+    return gpg_error_from_syserror ();
+  return 0;
+}
+
+
+
 /* Perform insert/delete/update operation.  MODE is one of
    FILECOPY_INSERT, FILECOPY_DELETE, FILECOPY_UPDATE.  FOR_OPENPGP
    indicates that this is called due to an OpenPGP keyblock change.  */
@@ -282,12 +305,14 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
          failsafe the blob type.) */
       while ( (nread = fread (buffer, 1, DIM(buffer), fp)) > 0 )
         {
-          if (first_record && for_openpgp
+          if (first_record && nread >= 32
               && buffer[4] == KEYBOX_BLOBTYPE_HEADER)
             {
-              first_record = 0;
-              buffer[7] |= 0x02; /* OpenPGP data may be available.  */
+              if (for_openpgp)
+                buffer[7] |= 0x02; /* OpenPGP data may be available.  */
+              _keybox_bump_generation (buffer, nread);
             }
+          first_record = 0;
 
           if (fwrite (buffer, nread, 1, newfp) != 1)
             {
@@ -316,6 +341,8 @@ blob_filecopy (int mode, const char *fname, KEYBOXBLOB blob,
           nread = fread (buffer, 1, nbytes, fp);
           if (!nread)
             break;
+          if (!current)
+            _keybox_bump_generation (buffer, nread);
           current += nread;
 
           if (fwrite (buffer, nread, 1, newfp) != 1)
@@ -396,6 +423,7 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen,
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
+  struct keybox_file_state_s oldstate;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -420,12 +448,12 @@ keybox_insert_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen,
   _keybox_destroy_openpgp_info (&info);
   if (!err)
     {
+      /* The new blob is appended, thus its offset is the old size.  */
+      _keybox_get_file_state (fname, &oldstate);
       err = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 1, 0);
+      if (!err)
+        _keybox_index_update (fname, &oldstate, oldstate.size, blob);
       _keybox_release_blob (blob);
-      /*    if (!rc && !hd->secret && kb_offtbl) */
-      /*      { */
-      /*        update_offset_hash_table_from_kb (kb_offtbl, kb, 0); */
-      /*      } */
     }
   return err;
 }
@@ -442,6 +470,7 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   KEYBOXBLOB blob;
   size_t nparsed;
   struct _keybox_openpgp_info info;
+  struct keybox_file_state_s oldstate;
 
   if (!hd || !image || !imagelen)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -473,7 +502,10 @@ keybox_update_keyblock (KEYBOX_HANDLE hd, const void *image, size_t imagelen)
   /* Update the keyblock.  */
   if (!err)
     {
+      _keybox_get_file_state (fname, &oldstate);
       err = blob_filecopy (FILECOPY_UPDATE, fname, blob, hd->secret, 1, off);
+      if (!err)
+        _keybox_index_update (fname, &oldstate, off, blob);
       _keybox_release_blob (blob);
     }
   return err;
@@ -489,6 +521,7 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   int rc;
   const char *fname;
   KEYBOXBLOB blob;
+  struct keybox_file_state_s oldstate;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_HANDLE);
@@ -506,12 +539,11 @@ keybox_insert_cert (KEYBOX_HANDLE hd, ksba_cert_t cert,
   rc = _keybox_create_x509_blob (&blob, cert, sha1_digest, hd->ephemeral);
   if (!rc)
     {
+      _keybox_get_file_state (fname, &oldstate);
       rc = blob_filecopy (FILECOPY_INSERT, fname, blob, hd->secret, 0, 0);
+      if (!rc)
+        _keybox_index_update (fname, &oldstate, oldstate.size, blob);
       _keybox_release_blob (blob);
-      /*    if (!rc && !hd->secret && kb_offtbl) */
-      /*      { */
-      /*        update_offset_hash_table_from_kb (kb_offtbl, kb, 0); */
-      /*      } */
     }
   return rc;
 }
@@ -617,6 +649,7 @@ keybox_delete (KEYBOX_HANDLE hd)
   const char *fname;
   FILE *fp;
   int rc;
+  struct keybox_file_state_s oldstate;
 
   if (!hd)
     return gpg_error (GPG_ERR_INV_VALUE);
@@ -631,19 +664,19 @@ keybox_delete (KEYBOX_HANDLE hd)
   off = _keybox_get_blob_fileoffset (hd->found.blob);
   if (off == (off_t)-1)
     return gpg_error (GPG_ERR_GENERAL);
-  off += 4;
 
   _keybox_close_file (hd);
+  _keybox_get_file_state (fname, &oldstate);
   fp = fopen (hd->kb->fname, "r+b");
   if (!fp)
     return gpg_error_from_syserror ();
 
-  if (fseeko (fp, off, SEEK_SET))
+  if (fseeko (fp, off + 4, SEEK_SET))
     rc = gpg_error_from_syserror ();
   else if (putc (0, fp) == EOF)
     rc = gpg_error_from_syserror ();
   else
-    rc = 0;
+    rc = bump_generation_in_place (fp);
 
   if (fclose (fp))
     {
@@ -651,6 +684,12 @@ keybox_delete (KEYBOX_HANDLE hd)
         rc = gpg_error_from_syserror ();
     }
 
+  /* The blob stays in the file but is now empty.  */
+  if (!rc)
+    _keybox_index_update (fname, &oldstate, off, NULL);
+  else
+    _keybox_index_remove (fname);
+
   return rc;
 }
 
@@ -825,7 +864,12 @@ keybox_compress (KEYBOX_HANDLE hd)
   if (rc || !any_changes)
     gnupg_remove (tmpfname);
   else
-    rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+    {
+      rc = rename_tmp_file (bakfname, tmpfname, fname, hd->secret);
+      /* All offsets have changed; thus we need a fresh index.  */
+      if (!rc && _keybox_index_build (fname))
+        _keybox_index_remove (fname);
+    }
 
   xfree(bakfname);
   xfree(tmpfname);
@@ -0,0 +1,389 @@
+/* t-keybox-index.c - Module test for keybox-index.c
+ * Copyright (C) 2015 g10 Code GmbH
+ *
+ * This file is part of GnuPG.
+ *
+ * GnuPG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * GnuPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The test edits a keybox with synthetic OpenPGP keys and compares
+   the result of each indexed lookup with the result of a linear
+   search on a second handle which does not use the index.  */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "keybox-defs.h"
+#include <gcrypt.h>
+#include "../common/sysutils.h"
+#include "../common/openpgpdefs.h"
+
+#define pass()  do { ; } while(0)
+#define fail(a)  do { fprintf (stderr, "%s:%d: test %d failed\n",\
+                               __FILE__,__LINE__, (a));          \
+                     errcount++;                                 \
+                   } while(0)
+
+#define KBXNAME  "t-keybox-index.kbx"
+#define IDXNAME  KBXNAME ".idx"
+#define MAXKEYS  200
+
+static int verbose;
+static int errcount;
+
+/* The keys we put into the keybox.  */
+static struct
+{
+  int present;   /* The key is expected in the keybox.  */
+  int nuids;     /* The number of user ids of the current version.  */
+  unsigned char fpr[20];
+  unsigned char subfpr[20];
+} keys[MAXKEYS];
+static int nkeys;
+
+static KEYBOX_HANDLE idx_hd;  /* Handle using the index.  */
+static KEYBOX_HANDLE lin_hd;  /* Handle doing linear searches.  */
+
+
+static u32
+get32 (const unsigned char *buffer)
+{
+  return (((u32)buffer[0] << 24) | ((u32)buffer[1] << 16)
+          | ((u32)buffer[2] << 8) | buffer[3]);
+}
+
+
+
+/* Append a v4 RSA key packet with packet type PKTTYPE to BUFFER at
+   *R_LEN.  The modulus is derived from SEED.  The fingerprint is
+   stored at FPR.  */
+static void
+add_key_packet (unsigned char *buffer, size_t *r_len, int pkttype,
+                unsigned int seed, unsigned char *fpr)
+{
+  unsigned char body[32];
+  unsigned char hashbuf[3 + sizeof body];
+  size_t n = 0;
+  int i;
+
+  body[n++] = 4;                       /* Version.  */
+  body[n++] = 0x55; body[n++] = 0; body[n++] = 0; body[n++] = 0;
+  body[n++] = PUBKEY_ALGO_RSA;
+  body[n++] = 0; body[n++] = 128;      /* 128 bit modulus.  */
+  for (i=0; i < 16; i++)
+    body[n++] = (seed * 2654435761u + i * 40503u) >> (i % 24);
+  body[n-16] |= 0x80;
+  body[n++] = 0; body[n++] = 17;       /* Exponent 65537.  */
+  body[n++] = 1; body[n++] = 0; body[n++] = 1;
+
+  hashbuf[0] = 0x99;
+  hashbuf[1] = 0;
+  hashbuf[2] = n;
+  memcpy (hashbuf+3, body, n);
+  gcry_md_hash_buffer (GCRY_MD_SHA1, fpr, hashbuf, 3 + n);
+
+  buffer[(*r_len)++] = 0x80 | (pkttype << 2);  /* Old CTB, 1 byte len.  */
+  buffer[(*r_len)++] = n;
+  memcpy (buffer + *r_len, body, n);
+  *r_len += n;
+}
+
+
+/* Build the keyblock for key number IDX with NUIDS user ids in
+   BUFFER and return its length.  */
+static size_t
+make_keyblock (unsigned char *buffer, int idx, int nuids)
+{
+  size_t len = 0;
+  char uid[40];
+  int i;
+
+  add_key_packet (buffer, &len, PKT_PUBLIC_KEY, 2*idx, keys[idx].fpr);
+  for (i=0; i < nuids; i++)
+    {
+      snprintf (uid, sizeof uid, "Test key %d.%d <%d@example.org>",
+                idx, i, idx);
+      buffer[len++] = 0x80 | (PKT_USER_ID << 2);
+      buffer[len++] = strlen (uid);
+      memcpy (buffer + len, uid, strlen (uid));
+      len += strlen (uid);
+    }
+  add_key_packet (buffer, &len, PKT_PUBLIC_SUBKEY, 2*idx+1, keys[idx].subfpr);
+  return len;
+}
+
+
+static void
+insert_keys (int count)
+{
+  unsigned char buffer[512];
+  size_t len;
+  gpg_error_t err;
+
+  for (; count && nkeys < MAXKEYS; count--, nkeys++)
+    {
+      keys[nkeys].nuids = 1;
+      len = make_keyblock (buffer, nkeys, keys[nkeys].nuids);
+      err = keybox_insert_keyblock (idx_hd, buffer, len, NULL);
+      if (err)
+        {
+          fprintf (stderr, "inserting key %d failed: %s\n",
+                   nkeys, gpg_strerror (err));
+          exit (1);
+        }
+      keys[nkeys].present = 1;
+    }
+}
+
+
+/* Locate key IDX by its fingerprint using the index.  */
+static int
+locate_key (int idx)
+{
+  KEYBOX_SEARCH_DESC desc;
+
+  memset (&desc, 0, sizeof desc);
+  desc.mode = KEYDB_SEARCH_MODE_FPR;
+  memcpy (desc.u.fpr, keys[idx].fpr, 20);
+  keybox_search_reset (idx_hd);
+  return !keybox_search (idx_hd, &desc, 1, KEYBOX_BLOBTYPE_PGP, NULL, NULL);
+}
+
+
+static void
+delete_keys (int every)
+{
+  int idx;
+
+  for (idx=0; idx < nkeys; idx += every)
+    {
+      if (!keys[idx].present)
+        continue;
+      if (!locate_key (idx) || keybox_delete (idx_hd))
+        fail (idx);
+      else
+        keys[idx].present = 0;
+    }
+}
+
+
+/* Add a user id to every EVERY key so that the following blobs are
+   moved.  */
+static void
+update_keys (int every)
+{
+  unsigned char buffer[512];
+  size_t len;
+  int idx;
+
+  for (idx=1; idx < nkeys; idx += every)
+    {
+      if (!keys[idx].present)
+        continue;
+      keys[idx].nuids++;
+      len = make_keyblock (buffer, idx, keys[idx].nuids);
+      if (!locate_key (idx) || keybox_update_keyblock (idx_hd, buffer, len))
+        fail (idx);
+    }
+}
+
+
+/* Search for DESC on HD and store the offset of the found blob at
+   R_OFF or -1 if nothing was found.  */
+static void
+search_one (KEYBOX_HANDLE hd, KEYBOX_SEARCH_DESC *desc, off_t *r_off)
+{
+  gpg_error_t err;
+
+  *r_off = -1;
+  keybox_search_reset (hd);
+  err = keybox_search (hd, desc, 1, KEYBOX_BLOBTYPE_PGP, NULL, NULL);
+  if (!err)
+    *r_off = _keybox_get_blob_fileoffset (hd->found.blob);
+  else if (gpg_err_code (err) != GPG_ERR_NOT_FOUND && err != -1)
+    {
+      fprintf (stderr, "search failed: %s\n", gpg_strerror (err));
+      fail (0);
+    }
+}
+
+
+/* Compare indexed and linear lookups of all keys by fingerprint,
+   keyid and subkey fingerprint.  STEP is used for diagnostics.  */
+static void
+check_lookups (int step)
+{
+  KEYBOX_SEARCH_DESC desc;
+  off_t idx_off, lin_off;
+  int idx, what;
+
+  for (idx=0; idx < nkeys; idx++)
+    for (what=0; what < 4; what++)
+      {
+        memset (&desc, 0, sizeof desc);
+        switch (what)
+          {
+          case 0:
+            desc.mode = KEYDB_SEARCH_MODE_FPR;
+            memcpy (desc.u.fpr, keys[idx].fpr, 20);
+            break;
+          case 1:
+            desc.mode = KEYDB_SEARCH_MODE_LONG_KID;
+            desc.u.kid[0] = get32 (keys[idx].fpr + 12);
+            desc.u.kid[1] = get32 (keys[idx].fpr + 16);
+            break;
+          case 2:
+            desc.mode = KEYDB_SEARCH_MODE_SHORT_KID;
+            desc.u.kid[1] = get32 (keys[idx].fpr + 16);
+            break;
+          default:
+            desc.mode = KEYDB_SEARCH_MODE_FPR;
+            memcpy (desc.u.fpr, keys[idx].subfpr, 20);
+            break;
+          }
+
+        search_one (idx_hd, &desc, &idx_off);
+        if (!idx_hd->index.fp)
+          {
+            fprintf (stderr, "step %d: index not used\n", step);
+            fail (step);
+            return;
+          }
+        search_one (lin_hd, &desc, &lin_off);
+        if (idx_off != lin_off || (idx_off != -1) != keys[idx].present)
+          {
+            fprintf (stderr, "step %d: key %d mode %d: index %ld linear %ld\n",
+                     step, idx, what, (long)idx_off, (long)lin_off);
+            fail (step);
+          }
+      }
+}
+
+
+/* Return true if the index file exists.  */
+static int
+index_exists (void)
+{
+  return !access (IDXNAME, F_OK);
+}
+
+
+/* Change byte OFF of FNAME to VALUE or with VALUE of -1 flip all
+   bits of it.  */
+static void
+patch_file (const char *fname, long off, int value)
+{
+  FILE *fp;
+  int c;
+
+  fp = fopen (fname, "r+b");
+  if (!fp || fseek (fp, off, SEEK_SET) || (c = getc (fp)) == EOF
+      || fseek (fp, off, SEEK_SET)
+      || putc (value == -1? (c ^ 0xff) : value, fp) == EOF)
+    fail (0);
+  if (fp)
+    fclose (fp);
+}
+
+
+static void
+remove_files (void)
+{
+  gnupg_remove (KBXNAME);
+  gnupg_remove (IDXNAME);
+  gnupg_remove (KBXNAME ".kb_");
+  gnupg_remove (KBXNAME ".k__");
+}
+
+
+int
+main (int argc, char **argv)
+{
+  void *token;
+  FILE *fp;
+
+  if (argc > 1 && !strcmp (argv[1], "--verbose"))
+    verbose = 1;
+
+  remove_files ();
+  fp = fopen (KBXNAME, "wb");
+  if (!fp || _keybox_write_header_blob (fp, 1) || fclose (fp))
+    {
+      fprintf (stderr, "error creating keybox\n");
+      exit (1);
+    }
+  token = keybox_register_file (KBXNAME, 0);
+  if (!token)
+    {
+      fprintf (stderr, "error registering keybox\n");
+      exit (1);
+    }
+  idx_hd = keybox_new_openpgp (token, 0);
+  lin_hd = keybox_new_openpgp (token, 0);
+  if (!idx_hd || !lin_hd)
+    {
+      fprintf (stderr, "error creating keybox handles\n");
+      exit (1);
+    }
+  lin_hd->index.disabled = 1;
+
+  /* The first indexed search builds the index.  */
+  insert_keys (60);
+  check_lookups (1);
+  if (!index_exists ())
+    fail (1);
+
+  /* Deleting, updating and inserting keys keeps the index valid.  */
+  delete_keys (5);
+  check_lookups (2);
+  update_keys (7);
+  check_lookups (3);
+  insert_keys (40);
+  check_lookups (4);
+  delete_keys (3);
+  update_keys (4);
+  check_lookups (5);
+
+  /* A stale index is detected and rebuilt.  */
+  patch_file (IDXNAME, 11, -1);
+  check_lookups (6);
+
+  /* So is a missing one.  */
+  gnupg_remove (IDXNAME);
+  check_lookups (7);
+  if (!index_exists ())
+    fail (7);
+
+  /* Compressing the keybox moves all blobs.  Clear the time of the
+     last maintenance run to make sure that it is done.  */
+  patch_file (KBXNAME, 20, 0);
+  patch_file (KBXNAME, 21, 0);
+  patch_file (KBXNAME, 22, 0);
+  patch_file (KBXNAME, 23, 0);
+  keybox_search_reset (idx_hd);
+  if (keybox_compress (idx_hd))
+    fail (8);
+  check_lookups (8);
+
+  keybox_release (idx_hd);
+  keybox_release (lin_hd);
+  remove_files ();
+
+  if (verbose)
+    fprintf (stderr, "%d keys, %d errors\n", nkeys, errcount);
+  return !!errcount;
+}